@@ -979,6 +979,9 @@ load_initrd (char *initrd)
   char *arg = initrd;
   char *name = initrd;
 
+#ifdef FSYS_INITRD
+  initrdfs_invalidate ();
+#endif
   //linux_header = (struct linux_kernel_header *) (cur_addr - LINUX_SETUP_MOVE_SIZE);
   /*
   tmp = ((linux_header->header == LINUX_MAGIC_SIGNATURE && linux_header->version >= 0x0203)
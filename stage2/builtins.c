@@ -371,13 +371,13 @@ blocklist_func (char *arg, int flags)
 
   if (!map_start_sector)
   {
-    map_start_sector = grub_zalloc(DRIVE_MAP_FRAGMENT);
-    map_num_sectors = grub_zalloc(DRIVE_MAP_FRAGMENT);
+    map_start_sector = grub_zalloc((DRIVE_MAP_FRAGMENT + 1) * sizeof (unsigned long long));
+    map_num_sectors = grub_zalloc((DRIVE_MAP_FRAGMENT + 1) * sizeof (unsigned long long));
   }
   else
   {
-    grub_memset (map_start_sector, 0, DRIVE_MAP_FRAGMENT);
-    grub_memset (map_num_sectors, 0, DRIVE_MAP_FRAGMENT);    
+    grub_memset (map_start_sector, 0, (DRIVE_MAP_FRAGMENT + 1) * sizeof (unsigned long long));
+    grub_memset (map_num_sectors, 0, (DRIVE_MAP_FRAGMENT + 1) * sizeof (unsigned long long));
   }
 #if 0
   int i;
@@ -707,6 +707,9 @@ boot_func (char *arg, int flags)
     pxe_unload();
 #endif
 
+  /* the APs run code that the kernel may overwrite */
+  smp_stop ();
+
   old_cursor = setcursor (1);
   errnum = 0;
 
@@ -4967,6 +4970,9 @@ static int grub_mod_add (struct exec_array *mod)
       unsigned long long rd_size_bak = rd_size;
       rd_base = (unsigned long long)(unsigned int)mod->data;
       rd_size = (unsigned long long)mod->len;
+#ifdef FSYS_INITRD
+      initrdfs_invalidate ();
+#endif
       buf_drive = -1;
       grub_open("(rd)+1");
       data_len += filemax;
@@ -5060,21 +5066,155 @@ static int grub_mod_del(const char *name)
    return 0;
 }
 
+/* Resident copies of external commands. Scripts tend to run the same
+ * command over and over; a hit skips the path search and the read, and
+ * only opens the known file to check that it has the same size and, if
+ * the filesystem reports one, the same modification time.
+ */
+#define CMD_CACHE_SLOTS 16
+#define CMD_CACHE_MAX 0x400000	/* total bytes of programs kept */
+struct cmd_cache
+{
+	char *name;		/* command as typed, 0 if the slot is free */
+	char *path;		/* the file command_open found for it */
+	int how;		/* and what command_open returned */
+	unsigned long drive;	/* root device at the time */
+	unsigned long partition;
+	unsigned long size;
+	unsigned long mtime;
+	unsigned long stamp;
+	char *data;
+};
+static struct cmd_cache cmd_cache[CMD_CACHE_SLOTS];
+static struct cmd_cache *cmd_hit;
+static unsigned long cmd_cache_bytes;
+static unsigned long cmd_cache_tick;
+static char cmd_open_path[512];
+
+static void command_cache_drop(struct cmd_cache *c)
+{
+    if (! c->name)
+	return;
+    cmd_cache_bytes -= c->size;
+    grub_free(c->name);
+    grub_free(c->data);
+    c->name = 0;
+}
+
+static void command_cache_flush(void)
+{
+    int i;
+    for (i = 0; i < CMD_CACHE_SLOTS; i++)
+	command_cache_drop(&cmd_cache[i]);
+}
+
+/* Look NAME up and open its file. Returns what command_open returned
+ * when the command was cached, or 0 with no file open.
+ */
+static int command_cache_open(char *name)
+{
+    struct cmd_cache *c;
+    int i;
+
+    for (i = 0, c = cmd_cache; i < CMD_CACHE_SLOTS; i++, c++)
+    {
+	if (! c->name || c->drive != saved_drive || c->partition != saved_partition
+		|| grub_strcmp(c->name, name))
+	    continue;
+	if (grub_open(c->path) && filemax == c->size && filemtime == c->mtime)
+	{
+	    c->stamp = ++cmd_cache_tick;
+	    cmd_hit = c;
+	    return c->how;
+	}
+	/* gone or changed, look for it again */
+	grub_close();
+	errnum = 0;
+	command_cache_drop(c);
+	break;
+    }
+    return 0;
+}
+
+static void command_cache_add(char *name, int how, char *program, unsigned long len)
+{
+    struct cmd_cache *c, *victim, *lru;
+    int i;
+
+    if ((how != 1 && how != 3) || ! cmd_open_path[0])
+	return;
+    if (len > CMD_CACHE_MAX / 4)
+	return;
+    /* a free slot, making room by dropping the least recently used */
+    for (;;)
+    {
+	victim = lru = 0;
+	for (i = 0, c = cmd_cache; i < CMD_CACHE_SLOTS; i++, c++)
+	{
+	    if (! c->name)
+	    {
+		if (! victim)
+		    victim = c;
+	    }
+	    else if (! lru || c->stamp < lru->stamp)
+		lru = c;
+	}
+	if (victim && cmd_cache_bytes + len <= CMD_CACHE_MAX)
+	    break;
+	command_cache_drop(lru);
+    }
+    c = victim;
+    if ((c->name = grub_malloc(grub_strlen(name) + grub_strlen(cmd_open_path) + 2)) == NULL)
+	goto fail;
+    if ((c->data = grub_malloc(len)) == NULL)
+    {
+	grub_free(c->name);
+	c->name = 0;
+	goto fail;
+    }
+    grub_strcpy(c->name, name);
+    c->path = c->name + grub_strlen(name) + 1;
+    grub_strcpy(c->path, cmd_open_path);
+    grub_memmove(c->data, program, len);
+    c->how = how;
+    c->drive = saved_drive;
+    c->partition = saved_partition;
+    c->size = len;
+    c->mtime = filemtime;
+    c->stamp = ++cmd_cache_tick;
+    cmd_cache_bytes += len;
+    return;
+fail:
+    /* running the command matters more than keeping it */
+    errnum = 0;
+}
+
 static int grub_exec_run(char *program, char *psp, int flags);
 static int test_open(char *path)
 {
     printf_debug ("CHECK: %s\n",path + command_path_len - 1);
     if (grub_open(path + command_path_len - 1))
+    {
+	grub_strcpy(cmd_open_path, path + command_path_len - 1);
 	return 1;
+    }
     printf_debug ("CHECK: %s\n",path);
     if (grub_open(path))
+    {
+	grub_strcpy(cmd_open_path, path);
 	return 3;
+    }
     return 0;
 }
 static int command_open(char *arg,int flags)
 {
    if (*arg == '(' || *arg == '/')
+   {
+      cmd_open_path[0] = 0;
+      if (grub_strlen(arg) < sizeof(cmd_open_path))
+	 grub_strcpy(cmd_open_path, arg);
       return grub_open(arg);
+   }
 
    if (skip_to(0,arg) - arg > 120)
       return 0;
@@ -5156,16 +5296,25 @@ command_func (char *arg, int flags)
 	 if (PATHEXT[0])
 	    printf("PATHEXT: %s\n",PATHEXT);
 	 #endif
+	 if (cmd_cache_bytes)
+	    printf("Cached: %d bytes\n",cmd_cache_bytes);
       }
       return 20;
    }
 
+    if (grub_memcmp(arg,"--flush",7) == 0 && arg[7] <= ' ')
+    {
+	command_cache_flush();
+	return 1;
+    }
+
     if (*(short*)arg == 0x2d2d && *(long*)(arg+2) == 0x2d746573)// -- set-
     {
 	arg += 6;
 	if (grub_memcmp(arg,"path=",5) == 0)
 	{
 	    arg += 5;
+	    command_cache_flush();
 	    if (! *arg)
 	    {
 		command_path_len = 15;
@@ -5189,7 +5338,10 @@ command_func (char *arg, int flags)
 	}
 	#ifdef PATHEXT
 	if (grub_memcmp(arg,"ext=",4) == 0)
+	{
+	    command_cache_flush();
 	    return sprintf(PATHEXT,"%.63s",arg + 4);
+	}
 	#endif
 	arg -= 6;
     }
@@ -5199,8 +5351,13 @@ command_func (char *arg, int flags)
   char file_path[512];
   unsigned long arg_len = grub_strlen(arg);/*get length for build psp */
   char *cmd_arg = skip_to(SKIP_WITH_TERMINATE,arg);/* get argument of command */
+  int how;
   p_exec = NULL;
-  switch(command_open(filename,0))
+  cmd_hit = NULL;
+  /* insmod'ed modules come first, then the cache */
+  if ((how = grub_mod_find(filename) ? 0 : command_cache_open(filename)) == 0)
+    how = command_open(filename,0);
+  switch(how)
   {
      case 2:
         sprintf(file_path,"(md)/");
@@ -5262,7 +5419,12 @@ command_func (char *arg, int flags)
 	psp = (char *)((int)(program + prog_len + 16) & ~0x0F);
 
 	unsigned long long *end_signature = (unsigned long long *)(program + (unsigned long)filemax - 8);
-	if (p_exec == NULL)
+	if (cmd_hit)
+	{
+		grub_memmove(program,cmd_hit->data,prog_len);
+		grub_close ();
+	}
+	else if (p_exec == NULL)
 	{
 		/* read file to buff and check exec signature. */
 		if ((grub_read ((unsigned long long)(int)program, -1ULL, 0xedde0d90) != filemax))
@@ -5355,6 +5517,7 @@ command_func (char *arg, int flags)
 		   grub_free(tmp);
 		   return 0;
 		}
+		command_cache_add(filename,how,program,prog_len);
 	}
 	else
 	{
@@ -5454,10 +5617,11 @@ static struct builtin builtin_command =
   "command",
   command_func,
   BUILTIN_MENU | BUILTIN_CMDLINE | BUILTIN_SCRIPT | BUILTIN_HELP_LIST | BUILTIN_BOOTING | BUILTIN_IFTITLE,
-  "command [--set-path=PATH|--set-ext=EXTENSIONS] FILE [ARGS]",
+  "command [--set-path=PATH|--set-ext=EXTENSIONS|--flush] FILE [ARGS]",
   "Run executable file FILE with arguments ARGS."
   "--set-path sets a search PATH for executable files,default is (bd)/boot/grub."
   "--set-ext sets default extensions for executable files."
+  "--flush forgets the executables kept in memory after they were run."
 };
 
 static int insmod_func(char *arg,int flags)
@@ -9320,7 +9484,7 @@ fragment_map_slot_empty(struct fragment_map_slot *q)
     if (!q->slot_len)
       return q;
     n -= q->slot_len;
-    q += q->slot_len;
+    q = (struct fragment_map_slot *)((char *)q + q->slot_len);
   }
   return 0;
 }
@@ -9336,11 +9500,293 @@ fragment_map_slot_find(struct fragment_map_slot *q, unsigned long from)
     if (q->from == (char)from)
       return q;
     n -= q->slot_len;
-    q += q->slot_len;
+    q = (struct fragment_map_slot *)((char *)q + q->slot_len);
   }
   return 0;
 }
 
+static unsigned long long map_ram_alloc (unsigned long long size);
+
+/* Bytes of the fragment table area in use, see FRAGMENT_TABLE.  */
+static unsigned long fragment_table_used;
+
+/* Return the extents of the fragment map slot Q and their number in N.  */
+static unsigned long long *
+fragment_map_slot_data (struct fragment_map_slot *q, unsigned long *n)
+{
+  if (q->slot_len == 20 && q->fragment_data[0] == 0)
+    {
+      *n = (unsigned long)(q->fragment_data[1] >> 32);
+      return (unsigned long long *)(unsigned long)q->fragment_data[1];
+    }
+  *n = (q->slot_len - 4) / 16;
+  return q->fragment_data;
+}
+
+/* Add the fragment map slot of drive FROM on drive TO, with the extents
+ * in map_start_sector[] and map_num_sectors[]. A long list goes to its
+ * table in the fragment table area.  */
+static int
+fragment_map_slot_add (unsigned long from, unsigned long to)
+{
+  struct fragment_map_slot *q;
+  char *end = (char *)&hooked_fragment_map + FRAGMENT_MAP_SLOT_SIZE;
+  unsigned long long *t, base;
+  unsigned long n, k, size, sum, *p;
+
+  for (n = 0; n < DRIVE_MAP_FRAGMENT && map_start_sector[n]; n++)
+    ;
+  q = fragment_map_slot_empty (&hooked_fragment_map);
+  if (! q || (char *)q + 20 > end)
+    return ! (errnum = ERR_MANY_FRAGMENTS);
+  q->from = from;
+  q->to = to;
+  if (n <= FRAGMENT_MAP_INLINE && (char *)q + n * 16 + 4 <= end)
+    {
+      for (k = 0; k < n; k++)
+	{
+	  q->fragment_data[k*2] = map_start_sector[k];
+	  q->fragment_data[k*2+1] = map_num_sectors[k];
+	}
+      q->slot_len = n * 16 + 4;
+      return 1;
+    }
+
+  size = ((n + 1) * 20 + 15) & ~15;
+  if (! fragment_ram_slot.sector_count)
+    {
+      base = map_ram_alloc (FRAGMENT_TABLE_AREA);
+      if (! base)
+	return ! (errnum = ERR_WONT_FIT);
+      fragment_ram_slot.from_drive = 0xFF;
+      fragment_ram_slot.to_drive = 0xFF;
+      fragment_ram_slot.start_sector = base >> SECTOR_BITS;
+      fragment_ram_slot.sector_count = FRAGMENT_TABLE_AREA >> SECTOR_BITS;
+      fragment_table_used = 0;
+    }
+  if (fragment_table_used + size > FRAGMENT_TABLE_AREA)
+    return ! (errnum = ERR_MANY_FRAGMENTS);
+  t = grub_zalloc (size);
+  if (! t)
+    return 0;
+  p = (unsigned long *)(t + (n + 1) * 2);
+  for (k = sum = 0; k < n; k++)
+    {
+      if (map_num_sectors[k] >= 0x100000000ULL - sum)
+	{
+	  grub_free (t);
+	  return ! (errnum = ERR_WONT_FIT);
+	}
+      t[k*2] = map_start_sector[k];
+      t[k*2+1] = map_num_sectors[k];
+      p[k] = sum;
+      sum += map_num_sectors[k];
+    }
+  p[n] = sum;
+  base = (fragment_ram_slot.start_sector << SECTOR_BITS) + fragment_table_used;
+  grub_memmove64 (base, (unsigned long long)(unsigned long)t, size);
+  grub_free (t);
+  fragment_table_used += size;
+  q->fragment_data[0] = 0;
+  q->fragment_data[1] = base | ((unsigned long long)n << 32);
+  q->slot_len = 20;
+  return 1;
+}
+
+/* Remove the fragment map slot Q, and its table. The tables are packed
+ * only when the int13 handler is not hooked, since a hooked one may
+ * still use them.  */
+static void
+fragment_map_slot_del (struct fragment_map_slot *q)
+{
+  struct fragment_map_slot *r;
+  char *end = (char *)&hooked_fragment_map + FRAGMENT_MAP_SLOT_SIZE;
+  unsigned long long base, area;
+  unsigned long n, size, len, tables = 0;
+
+  if (q->slot_len == 20 && q->fragment_data[0] == 0 && unset_int13_handler (1))
+    {
+      n = (unsigned long)(q->fragment_data[1] >> 32);
+      base = (unsigned long)q->fragment_data[1];
+      size = ((n + 1) * 20 + 15) & ~15;
+      area = (fragment_ram_slot.start_sector << SECTOR_BITS);
+      grub_memmove64 (base, base + size, area + fragment_table_used - base - size);
+      fragment_table_used -= size;
+      for (r = &hooked_fragment_map; (char *)r < end && r->slot_len;
+	   r = (struct fragment_map_slot *)((char *)r + r->slot_len))
+	{
+	  if (r == q || r->slot_len != 20 || r->fragment_data[0])
+	    continue;
+	  tables++;
+	  if ((unsigned long)r->fragment_data[1] > base)
+	    r->fragment_data[1] -= size;
+	}
+      if (! tables)
+	grub_memset (&fragment_ram_slot, 0, sizeof (struct drive_map_slot));
+    }
+
+  len = q->slot_len;
+  grub_memmove (q, (char *)q + len, end - (char *)q - len);
+  grub_memset (end - len, 0, len);
+}
+
+/* Forget the lazy memdrive, if it is FROM, and its fragment map slot.  */
+static void
+lazy_mem_drop (unsigned long from)
+{
+  struct fragment_map_slot *q;
+
+  if (! lazy_mem_sectors || lazy_mem_drive != (unsigned char)from)
+    return;
+  lazy_mem_sectors = 0;
+  q = fragment_map_slot_find (&hooked_fragment_map, from);
+  if (q)
+    fragment_map_slot_del (q);
+}
+
+/* Get the extents of the image file TO_DRIVE on drive TO into
+ * map_start_sector[] and map_num_sectors[], less its first SKIP
+ * sectors, for the lazy memdrive FROM. The file stays open at the
+ * same position. Return the number of sectors so backed, or 0 if the
+ * image must be loaded in whole.  */
+static unsigned long
+lazy_mem_blocklist (char *to_drive, unsigned long from, unsigned long to, int flags, unsigned long long skip)
+{
+  struct geometry geom;
+  struct fragment_map_slot *q;
+  unsigned long long pos = filepos;
+  unsigned long long total, n = 0;
+  int i, k, m;
+
+  if (to >= 0x9F || from == ram_drive || compressed_file || lazy_mem_sectors)
+    return 0;
+  /* the int13 handler reads TO through the ROM */
+  for (i = 0; i < DRIVE_MAP_SIZE && ! drive_map_slot_empty (bios_drive_map[i]); i++)
+    if (bios_drive_map[i].from_drive == to)
+      return 0;
+  if (get_diskinfo (to, &geom, 0) || geom.sector_size != SECTOR_SIZE
+      || ! (geom.flags & BIOSDISK_FLAG_LBA_EXTENSION))
+    return 0;
+
+  grub_close ();
+  query_block_entries = -1;	/* query block list only */
+  blocklist_func (to_drive, flags);
+  if (! errnum && query_block_entries > 0 && query_block_entries <= DRIVE_MAP_FRAGMENT)
+    {
+      /* an extent with a partial sector is not recorded */
+      for (k = 0; k < query_block_entries && map_start_sector[k]; k++)
+	n += map_num_sectors[k];
+      if (k < query_block_entries)
+	n = 0;
+    }
+  errnum = 0;
+  if (! grub_open (to_drive))
+    return 0;
+  filepos = pos;
+
+  total = (filemax + SECTOR_SIZE - 1) >> SECTOR_BITS;
+  if (! n || n < total || total <= skip || total - skip > 0x7FFFFFFF)
+    return 0;
+  n = total - skip;
+
+  /* drop the skipped sectors from the extents */
+  for (k = m = 0; k < query_block_entries; k++)
+    {
+      if (skip >= map_num_sectors[k])
+	{
+	  skip -= map_num_sectors[k];
+	  continue;
+	}
+      map_start_sector[m] = map_start_sector[k] + skip;
+      map_num_sectors[m++] = map_num_sectors[k] - skip;
+      skip = 0;
+    }
+  for (k = m; k < query_block_entries; k++)
+    map_start_sector[k] = map_num_sectors[k] = 0;
+
+  q = fragment_map_slot_empty (&hooked_fragment_map);
+  if (! q || (char *)q + m * 16 + 4 > (char *)&hooked_fragment_map + FRAGMENT_MAP_SLOT_SIZE)
+    return 0;
+  return n;
+}
+
+/* Set up the lazy memdrive FROM: its LAZY sectors at RAM sector START
+ * come from drive TO, at the extents lazy_mem_blocklist left, in chunks
+ * of (1 << SHIFT) sectors. The first chunk is already in RAM.  */
+static void
+lazy_mem_commit (unsigned long from, unsigned long to, unsigned long long start, unsigned long lazy, int shift)
+{
+  struct fragment_map_slot *q;
+  int k;
+
+  q = fragment_map_slot_empty (&hooked_fragment_map);
+  q->from = from;
+  q->to = to;
+  for (k = 0; k < DRIVE_MAP_FRAGMENT && map_start_sector[k]; k++)
+    {
+      q->fragment_data[k*2] = map_start_sector[k];
+      q->fragment_data[k*2+1] = map_num_sectors[k];
+    }
+  q->slot_len = k*16 + 4;
+
+  grub_memset (lazy_mem_map, 0, LAZY_MEM_MAP_SIZE);
+  lazy_mem_map[0] = 1;
+  lazy_mem_start = start;
+  lazy_mem_shift = shift;
+  lazy_mem_drive = from;
+  lazy_mem_sectors = lazy;
+}
+
+/* Load the chunks of the lazy memdrive that are still missing, so that
+ * it becomes a plain memdrive. Return 0 on a read error.  */
+static int
+lazy_mem_complete (void)
+{
+  struct fragment_map_slot *q;
+  unsigned long long *e;
+  unsigned long c, chunks, n, len, skip;
+  unsigned long long s;
+  int k, entries;
+
+  if (! lazy_mem_sectors)
+    return 1;
+  q = fragment_map_slot_find (&hooked_fragment_map, lazy_mem_drive);
+  if (! q)
+    return ! (errnum = ERR_READ);
+  e = q->fragment_data;
+  entries = (q->slot_len - 4) / 16;
+  chunks = ((lazy_mem_sectors - 1) >> lazy_mem_shift) + 1;
+  for (c = 0; c < chunks; c++)
+    {
+      if (lazy_mem_map[c >> 3] & (1 << (c & 7)))
+	continue;
+      s = (unsigned long long)c << lazy_mem_shift;
+      n = 1UL << lazy_mem_shift;
+      if (n > lazy_mem_sectors - s)
+	n = lazy_mem_sectors - s;
+      while (n)
+	{
+	  /* find the extent of sector S */
+	  skip = s;
+	  for (k = 0; k < entries && skip >= e[k*2+1]; k++)
+	    skip -= e[k*2+1];
+	  if (k == entries)
+	    return ! (errnum = ERR_READ);
+	  len = e[k*2+1] - skip;
+	  if (len > n)
+	    len = n;
+	  if (! rawread (q->to, e[k*2] + skip, 0, (unsigned long long)len << SECTOR_BITS,
+			 (lazy_mem_start + s) << SECTOR_BITS, 0xedde0d90))
+	    return 0;
+	  s += len;
+	  n -= len;
+	}
+      lazy_mem_map[c >> 3] |= 1 << (c & 7);
+    }
+  lazy_mem_drop (lazy_mem_drive);
+  return 1;
+}
+
 unsigned long analysis (char *arg, int flags);
 unsigned long
 analysis (char *arg, int flags)
@@ -9371,6 +9817,336 @@ unsigned long map_image_HPC, map_image_SPT;
 static unsigned long long map_mem_min = 0x100000;
 static unsigned long long map_mem_max = (-4096ULL);
 
+/* The RAM sectors the memdrive slot Q takes from its start sector.  */
+static unsigned long long
+memdrive_ram_sectors (struct drive_map_slot *q)
+{
+  if (comp_mem_chunks && q->from_drive == comp_mem_drive)
+    return comp_mem_store;
+  return q->sector_count;
+}
+
+/* Forget the compressed memdrive, if it is FROM.  */
+static void
+comp_mem_drop (unsigned long from)
+{
+  if (comp_mem_chunks && comp_mem_drive == (unsigned char)from)
+    comp_mem_chunks = 0;
+}
+
+#define COMP_MEM_HASH_BITS	12
+
+/* Compress the chunk SRC into DST as an LZ4 block of at most LIMIT
+ * bytes. Return its size, or 0 if it does not fit. HASH is scratch.  */
+static unsigned long
+comp_mem_lz4 (unsigned char *src, unsigned char *dst, unsigned long limit, unsigned short *hash)
+{
+  unsigned long ip = 0, anchor = 0, op = 0, ref, lit, len, v, n;
+  unsigned char *token;
+
+  grub_memset (hash, 0, sizeof (unsigned short) << COMP_MEM_HASH_BITS);
+  /* a match starts 12 bytes and ends 5 bytes before the end at least */
+  while (ip + 12 <= COMP_MEM_CHUNK_SIZE)
+    {
+      v = *(unsigned long *)(src + ip);
+      n = (v * 2654435761UL) >> (32 - COMP_MEM_HASH_BITS);
+      ref = hash[n];
+      hash[n] = ip;
+      if (ref >= ip || *(unsigned long *)(src + ref) != v)
+	{
+	  ip += 1 + ((ip - anchor) >> 6);
+	  continue;
+	}
+      for (len = 4; ip + len < COMP_MEM_CHUNK_SIZE - 5 && src[ref + len] == src[ip + len]; len++)
+	;
+      while (ip > anchor && ref && src[ip - 1] == src[ref - 1])
+	ip--, ref--, len++;
+
+      lit = ip - anchor;
+      if (op + lit + lit / 255 + len / 255 + 8 > limit)
+	return 0;
+      token = dst + op++;
+      *token = (lit < 15 ? lit : 15) << 4;
+      if (lit >= 15)
+	{
+	  for (n = lit - 15; n >= 255; n -= 255)
+	    dst[op++] = 255;
+	  dst[op++] = n;
+	}
+      grub_memmove (dst + op, src + anchor, lit);
+      op += lit;
+      dst[op++] = ip - ref;
+      dst[op++] = (ip - ref) >> 8;
+      ip += len;
+      anchor = ip;
+      len -= 4;
+      *token |= (len < 15 ? len : 15);
+      if (len >= 15)
+	{
+	  for (n = len - 15; n >= 255; n -= 255)
+	    dst[op++] = 255;
+	  dst[op++] = n;
+	}
+    }
+
+  /* the last literals */
+  lit = COMP_MEM_CHUNK_SIZE - anchor;
+  if (op + lit + lit / 255 + 2 > limit)
+    return 0;
+  dst[op++] = (lit < 15 ? lit : 15) << 4;
+  if (lit >= 15)
+    {
+      for (n = lit - 15; n >= 255; n -= 255)
+	dst[op++] = 255;
+      dst[op++] = n;
+    }
+  grub_memmove (dst + op, src + anchor, lit);
+  return op + lit;
+}
+
+/* The lowest RAM address that the compressed memdrive can take, when it
+ * ends at TOP, above memdrives and the data at LIMIT of ours.  */
+static unsigned long long
+comp_mem_floor (unsigned long long top, unsigned long long limit)
+{
+  struct AddrRangeDesc *map = (struct AddrRangeDesc *) saved_mmap_addr;
+  unsigned long end_addr = saved_mmap_addr + saved_mmap_length;
+  unsigned long long floor = 0, drvend;
+  int i;
+
+  for (; end_addr > (unsigned long) map; map = (struct AddrRangeDesc *) (((int) map) + 4 + map->size))
+    if (map->Type == MB_ARD_MEMORY && map->BaseAddr < top && map->BaseAddr + map->Length >= top)
+      floor = map->BaseAddr;
+  if (floor < map_mem_min)
+    floor = map_mem_min;
+  if (floor < limit)
+    floor = limit;
+  for (i = 0; i < DRIVE_MAP_SIZE && ! drive_map_slot_empty (bios_drive_map[i]); i++)
+    if (bios_drive_map[i].to_drive == 0xFF && !(bios_drive_map[i].to_cylinder & 0x4000))
+      {
+	drvend = (bios_drive_map[i].start_sector + memdrive_ram_sectors (&bios_drive_map[i])) << SECTOR_BITS;
+	if (drvend <= top && drvend > floor)
+	  floor = drvend;
+      }
+  return (floor + 4095) & (-4096ULL);
+}
+
+/* Read the open image, whose first sector is in mbr, as the compressed
+ * (if LZ4) or sparse memdrive FROM of SECTORS sectors, ending in RAM at
+ * TOP. The cache slots and the chunk index are at the top, the chunks
+ * go downwards below them. An all-zero chunk takes no RAM. Return the
+ * RAM address it starts at, or 0 on failure.  */
+static unsigned long long
+comp_mem_load (unsigned long from, unsigned long long top, unsigned long long sectors, int lz4)
+{
+  unsigned long chunks, c, k, len, entry;
+  unsigned long long floor, cur, cache, index, left;
+  unsigned char *buf, *src;
+  unsigned short *hash;
+
+  chunks = (sectors + 127) >> 7;	/* 128 sectors in a chunk */
+  cache = lz4 ? top - COMP_MEM_CACHE_SLOTS * COMP_MEM_CHUNK_SIZE : top;
+  index = (cache - chunks * 4) & (-4096ULL);
+  buf = grub_malloc (COMP_MEM_CHUNK_SIZE * 2 + (sizeof (unsigned short) << COMP_MEM_HASH_BITS));
+  if (! buf)
+    return 0;
+  hash = (unsigned short *)(buf + COMP_MEM_CHUNK_SIZE * 2);
+  floor = comp_mem_floor (top, (unsigned long)buf + COMP_MEM_CHUNK_SIZE * 3);
+  if (index < floor)
+    goto wont_fit;
+
+  left = filemax - filepos + SECTOR_SIZE;	/* mbr is already read */
+  cur = index;
+  for (c = 0; c < chunks; c++)
+    {
+      grub_memset (buf, 0, COMP_MEM_CHUNK_SIZE);
+      len = COMP_MEM_CHUNK_SIZE;
+      if (len > left)
+	len = left;
+      if (! c)
+	{
+	  grub_memmove (buf, mbr, SECTOR_SIZE);
+	  if (len > SECTOR_SIZE && grub_read ((unsigned long long)(unsigned int)buf + SECTOR_SIZE, len - SECTOR_SIZE, 0xedde0d90) != len - SECTOR_SIZE)
+	    goto read_error;
+	}
+      else if (len && grub_read ((unsigned long long)(unsigned int)buf, len, 0xedde0d90) != len)
+	goto read_error;
+      left -= len;
+
+      entry = 0;
+      for (k = 0; k < COMP_MEM_CHUNK_SIZE / 4 && ! ((unsigned long *)buf)[k]; k++)
+	;
+      if (k < COMP_MEM_CHUNK_SIZE / 4)
+	{
+	  src = buf;
+	  len = COMP_MEM_CHUNK_SIZE;
+	  if (lz4 && (k = comp_mem_lz4 (buf, buf + COMP_MEM_CHUNK_SIZE, COMP_MEM_CHUNK_SIZE - 1, hash)))
+	    {
+	      src = buf + COMP_MEM_CHUNK_SIZE;
+	      len = k;
+	    }
+	  if (cur - floor < len + SECTOR_SIZE)
+	    goto wont_fit;
+	  /* a chunk stored as is is moved by sectors */
+	  cur = (cur - len) & (src == buf ? -(unsigned long long)SECTOR_SIZE : -4ULL);
+	  grub_memmove64 (cur, (unsigned long long)(unsigned int)src, len);
+	  entry = cur | (src == buf);
+	}
+      grub_memmove64 (index + c * 4, (unsigned long long)(unsigned int)&entry, 4);
+    }
+  grub_free (buf);
+
+  cur &= (-4096ULL);
+  grub_memset (comp_mem_tags, 0, sizeof (unsigned long) * COMP_MEM_CACHE_SLOTS);
+  comp_mem_next = 0;
+  comp_mem_cache = cache;
+  comp_mem_index = index;
+  comp_mem_store = (top - cur) >> SECTOR_BITS;
+  comp_mem_drive = from;
+  comp_mem_chunks = chunks;
+  printf_debug ("Stored 0x%lX sectors in 0x%lX.\n", sectors, (unsigned long long)comp_mem_store);
+  return cur;
+
+wont_fit:
+  errnum = ERR_WONT_FIT;
+read_error:
+  if (errnum == ERR_NONE)
+    errnum = ERR_READ;
+  grub_free (buf);
+  return 0;
+}
+
+/* Forget the RAM overlay, if it is on FROM. Its RAM is free again.  */
+static void
+cow_drop (unsigned long from)
+{
+  if (! cow_sectors || cow_drive != (unsigned char)from)
+    return;
+  cow_sectors = 0;
+  grub_memset (&cow_ram_slot, 0, sizeof (struct drive_map_slot));
+}
+
+/* Lower HI until the RAM from LO to HI is clear of the RAM kept by the
+ * fragment tables and by the overlay, and return it.  */
+static unsigned long long
+map_ram_clamp (unsigned long long lo, unsigned long long hi)
+{
+  struct drive_map_slot *r[2] = {&fragment_ram_slot, &cow_ram_slot};
+  unsigned long long b;
+  int i, again;
+
+  do
+    {
+      again = 0;
+      for (i = 0; i < 2; i++)
+	{
+	  if (! r[i]->sector_count)
+	    continue;
+	  b = (r[i]->start_sector << SECTOR_BITS);
+	  if (hi > b && lo < b + (r[i]->sector_count << SECTOR_BITS))
+	    {
+	      hi = b;
+	      again = 1;
+	    }
+	}
+    }
+  while (again);
+  return hi;
+}
+
+/* Find SIZE bytes of free RAM below 4GB, as high as possible and clear
+ * of the memdrives. Return its base, or 0 if there is none.  */
+static unsigned long long
+map_ram_alloc (unsigned long long size)
+{
+  struct AddrRangeDesc *map = (struct AddrRangeDesc *) saved_mmap_addr;
+  unsigned long end_addr = saved_mmap_addr + saved_mmap_length;
+  unsigned long long base = 0, lo, hi, b, e;
+  int i;
+
+  if (! (mbi.flags & MB_INFO_MEM_MAP))
+    return 0;
+  for (; end_addr > (unsigned long) map; map = (struct AddrRangeDesc *) (((int) map) + 4 + map->size))
+    {
+      if (map->Type != MB_ARD_MEMORY || map->Length == 0)
+	continue;
+      lo = (map->BaseAddr > map_mem_min) ? map->BaseAddr : map_mem_min;
+      lo = ((lo + 4095) & (-4096ULL));
+      hi = map->BaseAddr + map->Length;
+      if (hi < map->BaseAddr || hi > 0x100000000ULL)
+	hi = 0x100000000ULL;
+      if (hi > map_mem_max)
+	hi = map_mem_max;
+      hi &= (-4096ULL);
+again:
+      if (hi < lo + size || hi - size <= base)
+	continue;
+      for (i = 0; i < DRIVE_MAP_SIZE; i++)
+	{
+	  if (drive_map_slot_empty (bios_drive_map[i]))
+	    break;
+	  if (bios_drive_map[i].to_drive != 0xFF || (bios_drive_map[i].to_cylinder & 0x4000))
+	    continue;
+	  b = (bios_drive_map[i].start_sector << SECTOR_BITS);
+	  e = (memdrive_ram_sectors (&bios_drive_map[i]) << SECTOR_BITS) + b;
+	  b &= (-4096ULL);
+	  e = ((e + 4095) & (-4096ULL));
+	  if (hi - size < e && b < hi)
+	    {
+	      hi = b;	/* below the memdrive, and check again */
+	      goto again;
+	    }
+	}
+      e = map_ram_clamp (hi - size, hi);
+      if (e != hi)
+	{
+	  hi = e;
+	  goto again;
+	}
+      base = hi - size;
+    }
+  return base;
+}
+
+/* Put a RAM overlay of POOL sectors on the in-place drive FROM of
+ * SECTORS sectors, so that its writes stay in RAM.  */
+static int
+cow_setup (unsigned long from, unsigned long long sectors, unsigned long long pool)
+{
+  unsigned long long base, size;
+  unsigned long chunks;
+
+  if (cow_sectors && cow_drive != (unsigned char)from)
+    return ! (errnum = ERR_BAD_ARGUMENT);	/* one overlay at a time */
+  cow_drop (from);
+  if (sectors == 0 || sectors > 0xFFFFFF80ULL)
+    return ! (errnum = ERR_BAD_ARGUMENT);
+  chunks = ((unsigned long)sectors + (COW_CHUNK_SIZE >> SECTOR_BITS) - 1) / (COW_CHUNK_SIZE >> SECTOR_BITS);
+  pool = ((pool << SECTOR_BITS) + COW_CHUNK_SIZE - 1) & (-(unsigned long long)COW_CHUNK_SIZE);
+  size = pool + ((chunks * 4ULL + 4095) & (-4096ULL));
+  base = map_ram_alloc (size);
+  if (! base)
+    return ! (errnum = ERR_WONT_FIT);
+  grub_memset64 (base + pool, 0, size - pool);
+
+  cow_map = base + pool;
+  cow_limit = base + pool;
+  cow_next = base;
+  cow_shift = 0;
+  while (((chunks - 1) >> cow_shift) >= COW_GROUPS)
+    cow_shift++;
+  grub_memset (cow_groups, 0, COW_GROUPS / 8);
+  grub_memset (&cow_ram_slot, 0, sizeof (struct drive_map_slot));
+  cow_ram_slot.from_drive = from;
+  cow_ram_slot.to_drive = 0xFF;
+  cow_ram_slot.start_sector = base >> SECTOR_BITS;
+  cow_ram_slot.sector_count = size >> SECTOR_BITS;
+  cow_drive = from;
+  cow_sectors = sectors;
+  printf_debug ("Overlay of 0x%lX sectors at 0x%lX.\n", pool >> SECTOR_BITS, base);
+  return 1;
+}
+
 /* map */
 /* Map FROM_DRIVE to TO_DRIVE.  */
 int
@@ -9414,10 +10190,19 @@ map_func (char *arg, int flags)
   int prefer_top = 0;
   unsigned long long skip_sectors = 0;
   unsigned long long max_sectors = -1ULL;
+  int lazy = 0;			/* --lazy */
+  unsigned long lazy_count = 0;	/* sectors filled on demand */
+  int lazy_shift = 3;		/* log2 of sectors per chunk */
+  int comp = 0;			/* 1 for --compress, 2 for --sparse */
+  unsigned long long comp_sectors = 0;
+  unsigned long long cow = 0;		/* pool sectors of --cow, 0=none */
   filesystem_type = -1;
   start_sector = sector_count = 0;
   map_image_HPC = 0; map_image_SPT = 0;
   blklst_num_entries = 0;
+#ifdef FSYS_INITRD
+  initrdfs_invalidate ();	/* (rd) or a memdrive may be reloaded */
+#endif
   
 #if	MAP_NUM_16
 	/* backup hooked_drive_map_1[0] onto hooked_drive_map[0] */
@@ -9633,6 +10418,9 @@ map_func (char *arg, int flags)
 	if (drive_map_slot_empty (bios_drive_map[0]))
 	    if (atapi_dev_count == 0)
 		return 1;//! (errnum = ERR_NO_DRIVE_MAPPED);
+	/* the memdrives move, so the lazy one must be in RAM as a whole */
+	if (! lazy_mem_complete ())
+		return 0;
 //	set_int13_handler (bios_drive_map);	/* backup bios_drive_map onto hooked_drive_map */
 //	unset_int13_handler (0);	/* unhook it to avoid further access of hooked_drive_map by the call to map_func */
 //	/* delete all memory mappings in hooked_drive_map */
@@ -9654,7 +10442,9 @@ map_func (char *arg, int flags)
 	    /* find the top memory mapping in bios_drive_map */
 	    for (i = 0; i < DRIVE_MAP_SIZE - 1; i++)
 	    {
-		if (bios_drive_map[i].to_drive == 0xFF && !(bios_drive_map[i].to_cylinder & 0x4000))
+		/* the compressed or sparse memdrive cannot be moved, it stays */
+		if (bios_drive_map[i].to_drive == 0xFF && !(bios_drive_map[i].to_cylinder & 0x4000)
+		    && !(comp_mem_chunks && bios_drive_map[i].from_drive == comp_mem_drive))
 		{
 			if (top_start < bios_drive_map[i].start_sector)
 			{
@@ -9797,6 +10587,9 @@ map_func (char *arg, int flags)
 //	if (tmp == 0xffffffff)
 //		return ! (errnum = ERR_INVALID_RD_BASE);
 	rd_base = tmp;
+#ifdef FSYS_INITRD
+	initrdfs_invalidate ();
+#endif
 	
 	return 1;
       }
@@ -9809,6 +10602,9 @@ map_func (char *arg, int flags)
 //	if (tmp == 0)
 //		return ! (errnum = ERR_INVALID_RD_SIZE);
 	rd_size = tmp;
+#ifdef FSYS_INITRD
+	initrdfs_invalidate ();
+#endif
 	
 	return 1;
       }
@@ -9911,6 +10707,37 @@ map_func (char *arg, int flags)
       {
 	prefer_top = 1;
       }
+    else if (grub_memcmp (arg, "--lazy", 6) == 0)
+      {
+	lazy = 1;
+	if (mem == -1ULL)
+		mem = 0;
+      }
+    else if (grub_memcmp (arg, "--compress", 10) == 0)
+      {
+	comp = 1;
+	if (mem == -1ULL)
+		mem = 0;
+      }
+    else if (grub_memcmp (arg, "--sparse", 8) == 0)
+      {
+	if (! comp)
+		comp = 2;
+	if (mem == -1ULL)
+		mem = 0;
+      }
+    else if (grub_memcmp (arg, "--cow=", 6) == 0)
+      {
+	p = arg + 6;
+	if (! safe_parse_maxint_with_suffix (&p, &cow, 9))
+		return 0;
+	if (cow == 0)
+		return !(errnum = ERR_BAD_ARGUMENT);
+      }
+    else if (grub_memcmp (arg, "--cow", 5) == 0)
+      {
+	cow = COW_DEFAULT_SECTORS;
+      }
     else if (grub_memcmp (arg, "--read-only", 11) == 0)
       {
 	if (read_Only || fake_write || unsafe_boot)
@@ -10700,21 +11527,15 @@ map_whole_drive:
       /* Perhaps the user wants to override the map.  */
       if ((bios_drive_map[i].from_drive == from))
 			{
+				lazy_mem_drop (from);
+				comp_mem_drop (from);
+				cow_drop (from);
 				if ((hooked_drive_map[i].to_cylinder & (1 << 10)) != 0)
 				{
 					q = (struct fragment_map_slot *)&hooked_fragment_map;
-//					filename = (char *)q + FRAGMENT_MAP_SLOT_SIZE;
-          unsigned int size = (unsigned int)&hooked_fragment_map + FRAGMENT_MAP_SLOT_SIZE;
 					q = fragment_map_slot_find(q, from);
-				if (q)
-				{
-//					void *start = filename - q->slot_len;
-          void *start = (char *)size - q->slot_len;
-					int len = q->slot_len;
-//					grub_memmove (q, (char *)q + q->slot_len,filename - (char *)q - q->slot_len);
-          grub_memmove (q, (char *)q + q->slot_len, (char *)size - (char *)q - q->slot_len);
-					grub_memset (start, 0, len);
-				}
+					if (q)
+						fragment_map_slot_del (q);
 				}
 	break;
 			}
@@ -10831,6 +11652,27 @@ map_whole_drive:
       unsigned long long top_end;
       
       bytes_needed = base = top_end = 0ULL;
+
+      /* the compressed or sparse memdrive is read from a disk, below 4GB */
+      if (comp && (to == 0xffff || to == ram_drive || from == ram_drive || ((long long)mem) > 0))
+      {
+	comp = 0;
+	if (debug > 0)
+	  printf_warning ("\nWarning: the image is loaded as is, in whole.\n");
+      }
+      if (comp)
+	lazy = prefer_top = 0;
+
+      if (lazy)
+      {
+	lazy_count = lazy_mem_blocklist (to_drive, from, to, flags, skip_sectors);
+	if (errnum)
+	  return 0;
+	if (! lazy_count && debug > 0)
+	  printf_warning ("\nWarning: the image cannot be loaded lazily, so it is loaded in whole.\n");
+	while (lazy_count && ((lazy_count - 1) >> lazy_shift) >= LAZY_MEM_MAP_SIZE * 8)
+	  lazy_shift++;
+      }
 //if (to == 0xff)
 //{
 //	
@@ -10874,6 +11716,21 @@ map_whole_drive:
 	bytes_needed += sectors_per_track << SECTOR_BITS;	/* build the Master Boot Track */
 
       bytes_needed = ((bytes_needed+4095)&(-4096ULL));	/* 4KB alignment */
+
+      if (comp && add_mbt)
+      {
+	/* the Master Boot Track would have to be compressed as well */
+	comp = 0;
+	if (debug > 0)
+	  printf_warning ("\nWarning: the image is loaded as is, in whole.\n");
+      }
+      if (comp)
+      {
+	/* find room for the cache, the chunk index and a chunk at least */
+	comp_sectors = bytes_needed >> SECTOR_BITS;
+	bytes_needed = (comp == 1 ? COMP_MEM_CACHE_SLOTS * COMP_MEM_CHUNK_SIZE : 0) + COMP_MEM_CHUNK_SIZE
+		+ ((((comp_sectors + 127) >> 7) * 4 + 4095) & (-4096ULL));
+      }
 //}
       if ((to == 0xffff || to == ram_drive) && sector_count == 1)
 	/* mem > 0 */
@@ -10931,6 +11788,9 @@ map_whole_drive:
 			tmpend = sum;
 		}
 	      tmpend &= (-4096ULL);	/* 4KB alignment, round down */
+	      /* the fragment tables and the RAM overlay are on top of their
+	       * regions, stay below them */
+	      tmpend = map_ram_clamp (tmpmin, tmpend);
 	      if (tmpend < bytes_needed)
 		  continue;
 	      tmpbase = tmpend - bytes_needed; // maximum possible base for this region
@@ -10956,7 +11816,7 @@ map_whole_drive:
 	            {
 		      unsigned long long drvbase, drvend;
 		      drvbase = (bios_drive_map[i].start_sector << SECTOR_BITS);
-		      drvend  = (bios_drive_map[i].sector_count << SECTOR_BITS) + drvbase;
+		      drvend  = (memdrive_ram_sectors (&bios_drive_map[i]) << SECTOR_BITS) + drvbase;
 		      drvend  = ((drvend+4095)&(-4096ULL));/* 4KB alignment, round up */
 		      drvbase &= (-4096ULL);	/* 4KB alignment, round down */
 		      //grub_printf("drv %02x: db %lx de %lx -- tb %lx te %lx\n",bios_drive_map[i].from_drive,drvbase,drvend,tmpbase,tmpend);
@@ -11042,6 +11902,8 @@ map_whole_drive:
 	  sector_count = bytes_needed >> SECTOR_BITS;
 	  // now sector_count may be > part_length, reading so many sectors could cause failure
       }
+      if (comp)
+	  sector_count = comp_sectors;
 
       bytes_needed = base;
       if (add_mbt)	/* no partition table */
@@ -11058,8 +11920,11 @@ map_whole_drive:
       if ((to != 0xffff && to != ram_drive) || ((long long)mem) <= 0)
 	{
 #endif
+	  /* the compressed or sparse memdrive is read after its MBR is set */
+	  if (comp)
+	    ;
 	  /* if image is in memory and not compressed, we can simply move it. */
-	  if ((to == 0xffff || to == ram_drive) && !compressed_file)
+	  else if ((to == 0xffff || to == ram_drive) && !compressed_file)
 	  {
 	    if (bytes_needed != start_byte)
 		grub_memmove64 (bytes_needed, start_byte, (max_sectors >= filemax) ? filemax : (sector_count << SECTOR_BITS));
@@ -11072,6 +11937,9 @@ map_whole_drive:
 	      unsigned long long read_size = ((sector_count - 1) << 9);
 	      if (read_size > filemax - ((skip_sectors + 1) << 9))
 	          read_size = filemax - ((skip_sectors + 1) << 9);
+	      /* a lazy memdrive gets only its first chunk now */
+	      if (lazy_count && read_size > (SECTOR_SIZE << lazy_shift) - SECTOR_SIZE)
+	          read_size = (SECTOR_SIZE << lazy_shift) - SECTOR_SIZE;
 	      read_result = grub_read ((bytes_needed + SECTOR_SIZE), read_size, 0xedde0d90);
 	      if (read_result != read_size)
 	      {
@@ -11095,7 +11963,8 @@ map_whole_drive:
 	      }
 	    }
 	  }
-	  grub_close ();
+	  if (! comp)
+	    grub_close ();
 #if 0
 	}
       else if (/*(to == 0xffff || to == ram_drive) && */!compressed_file)
@@ -11112,6 +11981,15 @@ map_whole_drive:
       }
 #endif
       start_sector = base >> SECTOR_BITS;
+      if (lazy_count)
+      {
+	/* the rest comes from the backing drive on demand */
+	if (add_mbt)
+	  sector_count -= sectors_per_track;
+	if (lazy_count > sector_count)
+	  lazy_count = sector_count;
+	lazy_mem_commit (from, to, bytes_needed >> SECTOR_BITS, lazy_count, lazy_shift);
+      }
       to = 0xFFFF/*GRUB_INVALID_DRIVE*/;
 
       if (add_mbt)	/* no partition table */
@@ -11197,7 +12075,17 @@ map_whole_drive:
 	  *(long *)((int)mbr + 0x1b8) = (unsigned char)from; 
 	else if ((*(long *)((int)mbr + 0x1b8) & 0xFFFFFF00) == 0)
 	  *(long *)((int)mbr + 0x1b8) |= (from << 8); 
-	grub_memmove64 (base, (unsigned long long)(unsigned int)mbr, SECTOR_SIZE);
+	if (! comp)
+	  grub_memmove64 (base, (unsigned long long)(unsigned int)mbr, SECTOR_SIZE);
+      }
+
+      if (comp)
+      {
+	base = comp_mem_load (from, top_end, sector_count, comp == 1);
+	grub_close ();
+	if (! base)
+	  return 0;
+	start_sector = base >> SECTOR_BITS;
       }
 
       /* if FROM is (rd), no mapping is established. but the image will be
@@ -11284,14 +12172,17 @@ map_whole_drive:
 			unsigned long long a = 0;																	//Sum(j_count(k))
 			unsigned long long b = map_num_sectors[0];								//Residual(To_len)
 			unsigned long long c = map_start_sector[0];								//To_statr
+			unsigned long n;
+			unsigned long long *e;
 			q = (struct fragment_map_slot *)&hooked_fragment_map;
 			q = fragment_map_slot_find(q, primeval_to);
-			for (k = 0; (k < DRIVE_MAP_FRAGMENT) && (q->fragment_data[k] != 0); k++)
+			e = fragment_map_slot_data(q, &n);
+			for (k = 0; (k < DRIVE_MAP_FRAGMENT) && (e[k] != 0); k++)
 			{
-				a += q->fragment_data[k*2+1];														//Sum(j_count(k))
+				a += e[k*2+1];														//Sum(j_count(k))
 				if (map_start_sector[0] < a)														//To_statr < Sum(j_count(k))
 				{
-					map_start_sector[0] += q->fragment_data[k*2] + q->fragment_data[k*2+1] - a;
+					map_start_sector[0] += e[k*2] + e[k*2+1] - a;
 					//To_statr = To_statr + j_start(k) +  j_count(k) - Sum(j_count(k))
 					break;																								//ok
 				}
@@ -11302,21 +12193,21 @@ map_whole_drive:
 			else 
 			{
 				map_num_sectors[0] = a - c;															//j_count(k) = Sum(j_count(k)) - To_statr
-				map_start_sector[1] = q->fragment_data[k*2+2];					//j_start(k+1)
+				map_start_sector[1] = e[k*2+2];					//j_start(k+1)
 				b -= (a - c);																						//Residual(To_len) - (Sum(j_count(k)) - To_statr)
-				for (l = 0; ((l < DRIVE_MAP_FRAGMENT - k) && (q->fragment_data[(k+l)*2+3] != 0)); l++)
+				for (l = 0; ((l < DRIVE_MAP_FRAGMENT - k) && (e[(k+l)*2+3] != 0)); l++)
 				{
 					blklst_num_entries = l + 2;
-					if (b <= q->fragment_data[(k+l)*2+3])									//Residual(To_len) <= j_count(k+1)
+					if (b <= e[(k+l)*2+3])									//Residual(To_len) <= j_count(k+1)
 					{
 						map_num_sectors[l+1] = b;									      		//Residual(To_len)
 						goto set_ok;
 					}
 					else
 					{
-						map_num_sectors[l+1] = q->fragment_data[(k+l)*2+3];	//j_count(k+1)
-						map_start_sector[l+2] = q->fragment_data[(k+l)*2+4];//j_start(k+2)
-						b -= q->fragment_data[(k+l)*2+3];										//Residual(To_len) - j_count(k+1)
+						map_num_sectors[l+1] = e[(k+l)*2+3];	//j_count(k+1)
+						map_start_sector[l+2] = e[(k+l)*2+4];//j_start(k+2)
+						b -= e[(k+l)*2+3];										//Residual(To_len) - j_count(k+1)
 					}
 				}
 			}
@@ -11329,23 +12220,21 @@ set_ok:
 			goto no_fragment;
 		}
 
-		q = (struct fragment_map_slot *)&hooked_fragment_map;
-		filename = (char *)q;
-		q = fragment_map_slot_empty(q);
-		if (((char *)q + blklst_num_entries*16 + 4 - filename) > FRAGMENT_MAP_SLOT_SIZE)
-			return ! (errnum = ERR_MANY_FRAGMENTS);
-
-		q->from = from;
-		q->to = to;
-		for (k = 0; map_start_sector[k] != 0; k++)
-		{
-			q->fragment_data[k*2] = map_start_sector[k];
-			q->fragment_data[k*2+1] = map_num_sectors[k];
-		}
-		q->slot_len = k*16 + 4;
+		if (! fragment_map_slot_add (from, to))
+			return 0;
 	}
 	
 no_fragment:
+
+  if (cow)
+  {
+	/* the overlay is for a drive in place on a hard disk */
+	if (mem != -1ULL || from >= 0x9F || to >= 0x9F || ! (to & 0x80)
+	    || tmp_geom.sector_size != 512 || ! (tmp_geom.flags & BIOSDISK_FLAG_LBA_EXTENSION))
+		return ! (errnum = ERR_BAD_ARGUMENT);
+	if (! cow_setup (from, (sector_count > 1) ? sector_count : tmp_geom.total_sectors, cow))
+		return 0;
+  }
 	
 	bios_drive_map[i].from_drive = from;
   bios_drive_map[i].to_drive = (unsigned char)to; /* to_drive = 0xFF if to == 0xffff */
@@ -11353,6 +12242,8 @@ no_fragment:
   /* if CHS disabled, let MAX_HEAD != 0 to ensure a non-empty slot */
   bios_drive_map[i].max_head = disable_chs_mode | (heads_per_cylinder - 1);
 //  bios_drive_map[i].max_sector = (disable_chs_mode ? 0 : in_situ ? 1 : sectors_per_track) | ((read_Only | fake_write) << 7) | (disable_lba_mode << 6);
+	if (comp && ! fake_write)
+		read_Only = 1;	/* the compressed or sparse memdrive is read-only */
 	bios_drive_map[i].max_sector = (disable_chs_mode ? 0 : sectors_per_track) | ((read_Only | fake_write) << 7) | (disable_lba_mode << 6);
   if (from >= 0x9F && tmp_geom.sector_size != 2048) /* FROM is cdrom and TO is not cdrom. */
 	bios_drive_map[i].max_sector |= 0x0F; /* can be any value > 1, indicating an emulation. */
@@ -11418,22 +12309,16 @@ delete_drive_map_slot:
 //    }
 
   grub_memmove ((char *) &bios_drive_map[i], (char *) &bios_drive_map[i + 1], sizeof (struct drive_map_slot) * (DRIVE_MAP_SIZE - i));
+  lazy_mem_drop (from);
+  comp_mem_drop (from);
+  cow_drop (from);
 
 	if ((hooked_drive_map[i].to_cylinder & (1 << 10)) != 0)
 	{
 		q = (struct fragment_map_slot *)&hooked_fragment_map;
-//		filename = (char *)q + FRAGMENT_MAP_SLOT_SIZE;
-    unsigned int size = (unsigned int)&hooked_fragment_map + FRAGMENT_MAP_SLOT_SIZE;
 		q = fragment_map_slot_find(q, from);
-	if (q)
-	{
-//		void *start = filename - q->slot_len;
-    void *start = (char *)size - q->slot_len;
-		int len = q->slot_len;
-//		grub_memmove (q, (char *)q + q->slot_len, filename - (char *)q - q->slot_len);
-    grub_memmove (q, (char *)q + q->slot_len, (char *)size - (char *)q - q->slot_len);
-		grub_memset (start, 0, len);
-	}
+		if (q)
+			fragment_map_slot_del (q);
 	}
 	
   if (mem != -1ULL)
@@ -11490,7 +12375,7 @@ static struct builtin builtin_map =
   "map",
   map_func,
   BUILTIN_MENU | BUILTIN_CMDLINE | BUILTIN_SCRIPT | BUILTIN_HELP_LIST | BUILTIN_IFTITLE,
-  "map [--status[-byte]] [--mem[=RESERV]] [--hook] [--unhook] [--unmap=DRIVES]\n [--rehook] [--floppies=M] [--harddrives=N] [--memdisk-raw=RAW]\n [--a20-keep-on=AKO] [--safe-mbr-hook=SMH] [--int13-scheme=SCH]\n [--ram-drive=RD] [--rd-base=ADDR] [--rd-size=SIZE] [[--read-only]\n [--fake-write] [--unsafe-boot] [--disable-chs-mode] [--disable-lba-mode]\n [--heads=H] [--sectors-per-track=S] [--swap-drivs=DRIVE1=DRIVE2] [--in-situ=FLAGS_AND_ID] TO_DRIVE FROM_DRIVE]",
+  "map [--status[-byte]] [--mem[=RESERV]] [--lazy] [--compress] [--sparse] [--cow[=SIZE]] [--hook] [--unhook] [--unmap=DRIVES]\n [--rehook] [--floppies=M] [--harddrives=N] [--memdisk-raw=RAW]\n [--a20-keep-on=AKO] [--safe-mbr-hook=SMH] [--int13-scheme=SCH]\n [--ram-drive=RD] [--rd-base=ADDR] [--rd-size=SIZE] [[--read-only]\n [--fake-write] [--unsafe-boot] [--disable-chs-mode] [--disable-lba-mode]\n [--heads=H] [--sectors-per-track=S] [--swap-drivs=DRIVE1=DRIVE2] [--in-situ=FLAGS_AND_ID] TO_DRIVE FROM_DRIVE]",
   "Map the drive FROM_DRIVE to the drive TO_DRIVE. This is necessary"
   " when you chain-load some operating systems, such as DOS, if such an"
   " OS resides at a non-first drive. TO_DRIVE can be a disk file, this"
@@ -11507,6 +12392,10 @@ static struct builtin builtin_map =
   " --ram-drive, --rd-base or --rd-size is given, then any other command-line arguments will be ignored."
   "\nThe --mem option indicates a drive in memory(0-4Gb)."
   "\nThe --mem --top option indicates a drive in memory(>4Gb)."	
+  "\nWith --lazy, the --mem image is read into memory on demand, as its sectors are accessed."
+  "\nWith --compress, the --mem image is kept compressed in memory, read-only, and decompressed as its sectors are accessed."
+  "\nWith --sparse, the --mem image is kept read-only, and its all-zero 64KB chunks take no memory. --compress does so as well."
+  "\nWith --cow, writes to a drive mapped in place go to memory, SIZE 512-byte-sectors at most(default 64MB), and the disk is not changed."
   "\nif RESERV is used and <= 0, the minimum memory occupied by the memdrive is (-RESERV) in 512-byte-sectors."
   "\nif RESERV is used and > 0,the memdrive will occupy the mem area starting at absolute physical address RESERV in 512-byte-sectors and ending at the end of this mem"
   "\nIf --swap-drivs=DRIVE1=DRIVE2 is given, swap DRIVE1 and DRIVE2 for FROM_DRIVE."
@@ -12393,6 +13282,7 @@ quit_func (char *arg, int flags)
   if (Sum)
 	return ! (errnum = ERR_DOS_BACKUP);
   
+  smp_stop ();
   chainloader_disable_A20 = 0;
   //grub_memmove((char *)0x110000, (char *)0x200000, 0xA0000);
 
@@ -13010,6 +13900,124 @@ static struct builtin builtin_write =
   "  UTF-8(or hex values) use \\xnn form, UTF-16(big endian) use \\Xnnnn form."
 };
 
+#ifndef NO_DECOMPRESSION
+/* zindex [--spacing=SIZE] [--lzma-spacing=SIZE] [--flush] [--load=FILE] [--save=FILE] */
+static int
+zindex_func (char *arg, int flags)
+{
+  unsigned long long step;
+  unsigned long points;
+  char *p;
+
+  errnum = 0;
+  for (; *arg; arg = skip_to (0, arg))
+  {
+    if (grub_memcmp (arg, "--spacing=", 10) == 0)
+    {
+      unsigned long long spacing;
+
+      p = arg + 10;
+      if (! safe_parse_maxint (&p, &spacing))
+	return 0;
+      gzip_index_spacing = spacing;
+      gunzip_index_flush ();
+    }
+    else if (grub_memcmp (arg, "--lzma-spacing=", 15) == 0)
+    {
+      unsigned long long spacing;
+
+      p = arg + 15;
+      if (! safe_parse_maxint (&p, &spacing))
+	return 0;
+      lzma_index_spacing = spacing;
+      dec_lzma_index_flush ();
+    }
+    else if (grub_memcmp (arg, "--flush", 7) == 0)
+    {
+      gunzip_index_flush ();
+      dec_lzma_index_flush ();
+    }
+    else if (grub_memcmp (arg, "--load=", 7) == 0 || grub_memcmp (arg, "--save=", 7) == 0)
+    {
+      int ret;
+
+      if (! grub_open (arg + 7))
+	return 0;
+      ret = (arg[2] == 'l') ? gunzip_index_load () : gunzip_index_save ();
+      {
+	int err = errnum;
+	grub_close ();
+	errnum = err;
+      }
+      if (! ret)
+	return 0;
+    }
+    else
+      return ! (errnum = ERR_BAD_ARGUMENT);
+  }
+
+  points = gunzip_index_points (&step);
+  printf_debug0 ("gzip seek index: %d points, %ldK apart (spacing %ldK).\n",
+		 points, step >> 10, gzip_index_spacing >> 10);
+  {
+    unsigned long n = dec_lzma_index_points (&step);
+
+    printf_debug0 ("lzma seek index: %d points, %ldK apart (spacing %ldK).\n",
+		   n, step >> 10, lzma_index_spacing >> 10);
+    points += n;
+  }
+  return points;
+}
+
+static struct builtin builtin_zindex =
+{
+  "zindex",
+  zindex_func,
+  BUILTIN_MENU | BUILTIN_CMDLINE | BUILTIN_SCRIPT | BUILTIN_HELP_LIST | BUILTIN_NO_DECOMPRESSION,
+  "zindex [--spacing=SIZE] [--lzma-spacing=SIZE] [--flush] [--load=FILE] [--save=FILE]",
+  "Control the seek index of gzip files, which lets reads resume from the\n"
+  "nearest saved point instead of the start of the data. A point (about 33K\n"
+  "of memory) is saved every SIZE bytes, 1M by default; 0 turns it off.\n"
+  "--lzma-spacing does the same for lzma files. A point there takes about\n"
+  "the dictionary size of memory, so it is off (0) by default.\n"
+  "--flush forgets the indexes. --save writes the gzip index to an existing\n"
+  "FILE that is large enough, and --load reads it back, e.g. at a later\n"
+  "boot. It is used for the next gzip file opened if the sizes, CRC and\n"
+  "time match."
+};
+
+/* zverify [on | off | status] */
+static int
+zverify_func (char *arg, int flags)
+{
+  errnum = 0;
+  if (! *arg)
+    decomp_verify = ! decomp_verify;
+  else if (grub_memcmp (arg, "on", 2) == 0)
+    decomp_verify = 1;
+  else if (grub_memcmp (arg, "off", 3) == 0)
+    decomp_verify = 0;
+  else if (grub_memcmp (arg, "status", 6) == 0)
+    printf_debug0 (" Checksum verification is now %s\n", (decomp_verify ? "on" : "off"));
+  else
+    errnum = ERR_BAD_ARGUMENT;
+  return decomp_verify;
+}
+
+static struct builtin builtin_zverify =
+{
+  "zverify",
+  zverify_func,
+  BUILTIN_MENU | BUILTIN_CMDLINE | BUILTIN_SCRIPT | BUILTIN_HELP_LIST | BUILTIN_NO_DECOMPRESSION,
+  "zverify [on | off | status]",
+  "Turn on/off or display checking of the CRC32 of gzip files, the\n"
+  "xxHash32 block and content checksums of LZ4 files, the block checks of\n"
+  "xz files and the frame checksums of zstd files, or toggle it if no\n"
+  "argument. It is on by default. A mismatch fails the read. The check of\n"
+  "the whole content is only made when the file is read from the start."
+};
+#endif /* ! NO_DECOMPRESSION */
+
 
 /* reboot */
 static int
@@ -17953,6 +18961,34 @@ static struct builtin builtin_shift =
   " not given, it is assumed to be 0."
 };
 
+/* smp [on | off | status] */
+static int
+smp_func (char *arg, int flags)
+{
+  errnum = 0;
+  if (grub_memcmp (arg, "on", 2) == 0)
+    smp_init ();
+  else if (grub_memcmp (arg, "off", 3) == 0)
+    smp_stop ();
+  else if (*arg && grub_memcmp (arg, "status", 6) != 0)
+    errnum = ERR_BAD_ARGUMENT;
+  if (! errnum)
+    printf_debug0 (" %d application processors are %s\n", smp_cpus, (smp_cpus ? "running" : "off"));
+  return smp_cpus;
+}
+
+static struct builtin builtin_smp =
+{
+  "smp",
+  smp_func,
+  BUILTIN_MENU | BUILTIN_CMDLINE | BUILTIN_SCRIPT | BUILTIN_HELP_LIST,
+  "smp [on | off | status]",
+  "Start the application processors, park them again, or show how many\n"
+  "are running. While they run, LZ4 files with independent blocks are\n"
+  "decoded on all processors. They are off by default, and parked before\n"
+  "booting."
+};
+
 static int grub_exec_run(char *program, char *psp, int flags)
 {
 	int pid;
@@ -18354,6 +19390,7 @@ struct builtin *builtin_table[] =
   &builtin_setmenu,
   &builtin_setvbe,
   &builtin_shift,
+  &builtin_smp,
 #ifdef SUPPORT_GRAPHICS
   &builtin_splashimage,
 #endif /* SUPPORT_GRAPHICS */
@@ -18373,5 +19410,9 @@ struct builtin *builtin_table[] =
   &builtin_vbeprobe,
   &builtin_vol,
   &builtin_write,
+#ifndef NO_DECOMPRESSION
+  &builtin_zindex,
+  &builtin_zverify,
+#endif
   0
 };
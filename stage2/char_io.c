@@ -1809,13 +1809,67 @@ static grub_u32_t crc32_tab[256] = {
 	0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94, 0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
 };
 
-static grub_u32_t calc_crc32(grub_u32_t crc, const void *data, grub_u32_t size)
+/* slicing-by-8 tables: crc32_tab8[k][i] is crc32_tab[i] advanced k+1 bytes */
+static grub_u32_t crc32_tab8[7][256];
+static int crc32_mode;		/* 0 not set up, 1 tables, 2 tables and PCLMULQDQ */
+
+static void
+crc32_init (void)
+{
+  grub_u32_t i, k, c;
+  unsigned int *sig = (unsigned int *)0x308000;
+
+  for (i = 0; i < 256; i++)
+    {
+      c = crc32_tab[i];
+      for (k = 0; k < 7; k++)
+	{
+	  c = crc32_tab[c & 0xFF] ^ (c >> 8);
+	  crc32_tab8[k][i] = c;
+	}
+    }
+  crc32_mode = 1;
+  /* CPUID leaf 1 was read by check_64bit_and_PAE if it reported PAE.
+   * ECX bit 1 = PCLMULQDQ, EDX bit 26 = SSE2. */
+  if ((is64bit & IS64BIT_PAE) && (sig[3] & 2) && (sig[7] & (1 << 26)))
+    crc32_mode = 2;
+}
+
+grub_u32_t
+calc_crc32 (grub_u32_t crc, const void *data, grub_u32_t size)
 {
   const grub_u8_t *p;
+  grub_u32_t a, b, n;
 
   p = data;
   crc ^= ~0U;
+  if (! crc32_mode)
+    crc32_init ();
+
+  if (crc32_mode == 2 && size >= 64)
+    {
+      n = size & ~15;
+      crc = crc32_pclmul (p, n, crc);
+      p += n;
+      size -= n;
+    }
 
+  while (size && ((grub_u32_t)p & 3))
+    {
+      crc = crc32_tab[(crc^*p++) & 0xFF]^(crc >> 8);
+      size--;
+    }
+  while (size >= 8)
+    {
+      a = *(const grub_u32_t *)p ^ crc;
+      b = *(const grub_u32_t *)(p + 4);
+      crc = crc32_tab8[6][a & 0xFF] ^ crc32_tab8[5][(a >> 8) & 0xFF]
+	  ^ crc32_tab8[4][(a >> 16) & 0xFF] ^ crc32_tab8[3][a >> 24]
+	  ^ crc32_tab8[2][b & 0xFF] ^ crc32_tab8[1][(b >> 8) & 0xFF]
+	  ^ crc32_tab8[0][(b >> 16) & 0xFF] ^ crc32_tab[b >> 24];
+      p += 8;
+      size -= 8;
+    }
   while (size--)
     crc = crc32_tab[(crc^*p++) & 0xFF]^(crc >> 8);
   return crc^~0U;
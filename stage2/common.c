@@ -131,6 +131,7 @@ char *err_list[] =
   [ERR_UNIFONT_FORMAT] = "Wrong unifont format.",
 //  [ERR_UNIFONT_RELOAD] = "Unifont already loaded.",
   [ERR_DIVISION_BY_ZERO] = "Division by zero",
+  [ERR_BAD_CHECKSUM] = "Checksum mismatch in compressed file",
 
 };
 
@@ -37,6 +37,29 @@
 #define LZ4_DICBUFSIZE   0x800000UL
 /* input buffer size 8 MB */
 #define LZ4_INPBUFSIZE   0x800000UL
+/* a forward seek past this many blocks builds the block index */
+#define LZ4_FAR_BLOCKS   16
+
+/* xxHash32, for the block and content checksums of the frame */
+#define XXH_PRIME1 2654435761U
+#define XXH_PRIME2 2246822519U
+#define XXH_PRIME3 3266489917U
+#define XXH_PRIME4 668265263U
+#define XXH_PRIME5 374761393U
+#define XXH_ROTL(x,r) (((x) << (r)) | ((x) >> (32 - (r))))
+
+struct xxh32_state {
+	grub_u32_t v[4];
+	grub_u32_t total;	/* length mod 2^32 */
+	grub_u32_t large;	/* 16 bytes or more seen */
+	grub_u32_t memsize;
+	unsigned char mem[16];
+};
+
+struct lz4_block {
+	unsigned long long cpos;	/* offset of its size field in the .lz4 file */
+	unsigned long long upos;	/* offset of its data in the uncompressed file */
+};
 
 struct {
 	unsigned char flg, bd, hc;
@@ -50,8 +73,16 @@ struct {
 	unsigned long long dicFilePos; /* uncompress file pos for data at (dic + LZ4_DICPOSSTART) */
 	unsigned long long inpFilePos;
 	unsigned long dicPos, dicSize, inpPos, inpSize;
+	unsigned long dicLow;	/* dic holds nothing below dic + dicLow */
 	unsigned char *inp;
 	unsigned char *dic;
+	/* block index of a frame with independent blocks */
+	struct lz4_block *blocks;
+	unsigned long nblocks, maxblocks;
+	unsigned long indexed;	/* lz4_index has run, or needs not */
+	unsigned long nextBlock;	/* the block nextBlockSize is of */
+	struct xxh32_state xxh;	/* of the content decoded so far */
+	unsigned long xxh_on;	/* xxh covers everything from the start */
 } lz4dec;
 /*
 typedef struct {
@@ -79,11 +110,261 @@ typedef struct {
   unsigned char hc;
 } __attribute__ ((packed)) lz4Frame;
 */
+static grub_u32_t
+xxh32_round(grub_u32_t acc, const unsigned char *p)
+{
+	acc += *(const grub_u32_t *)p * XXH_PRIME2;
+	acc = XXH_ROTL(acc, 13);
+	return acc * XXH_PRIME1;
+}
+
+static void
+xxh32_reset(struct xxh32_state *s)
+{
+	s->v[0] = XXH_PRIME1 + XXH_PRIME2;
+	s->v[1] = XXH_PRIME2;
+	s->v[2] = 0;
+	s->v[3] = 0 - XXH_PRIME1;
+	s->total = 0;
+	s->large = 0;
+	s->memsize = 0;
+}
+
+static void
+xxh32_update(struct xxh32_state *s, const unsigned char *p, unsigned long len)
+{
+	const unsigned char *end = p + len;
+	grub_u32_t v0, v1, v2, v3;
+
+	s->total += len;
+	if (len >= 16 || s->total >= 16)
+		s->large = 1;
+	if (s->memsize + len < 16) {
+		memmove(s->mem + s->memsize, p, len);
+		s->memsize += len;
+		return;
+	}
+	if (s->memsize) {
+		memmove(s->mem + s->memsize, p, 16 - s->memsize);
+		p += 16 - s->memsize;
+		s->v[0] = xxh32_round(s->v[0], s->mem);
+		s->v[1] = xxh32_round(s->v[1], s->mem + 4);
+		s->v[2] = xxh32_round(s->v[2], s->mem + 8);
+		s->v[3] = xxh32_round(s->v[3], s->mem + 12);
+		s->memsize = 0;
+	}
+	v0 = s->v[0]; v1 = s->v[1]; v2 = s->v[2]; v3 = s->v[3];
+	for (; end - p >= 16; p += 16) {
+		v0 = xxh32_round(v0, p);
+		v1 = xxh32_round(v1, p + 4);
+		v2 = xxh32_round(v2, p + 8);
+		v3 = xxh32_round(v3, p + 12);
+	}
+	s->v[0] = v0; s->v[1] = v1; s->v[2] = v2; s->v[3] = v3;
+	if (p < end) {
+		memmove(s->mem, p, end - p);
+		s->memsize = end - p;
+	}
+}
+
+static grub_u32_t
+xxh32_digest(struct xxh32_state *s)
+{
+	const unsigned char *p = s->mem, *end = s->mem + s->memsize;
+	grub_u32_t h;
+
+	if (s->large)
+		h = XXH_ROTL(s->v[0], 1) + XXH_ROTL(s->v[1], 7)
+		  + XXH_ROTL(s->v[2], 12) + XXH_ROTL(s->v[3], 18);
+	else
+		h = s->v[2] + XXH_PRIME5;	/* the seed, 0 */
+	h += s->total;
+	for (; end - p >= 4; p += 4) {
+		h += *(const grub_u32_t *)p * XXH_PRIME3;
+		h = XXH_ROTL(h, 17) * XXH_PRIME4;
+	}
+	for (; p < end; p++) {
+		h += *p * XXH_PRIME5;
+		h = XXH_ROTL(h, 11) * XXH_PRIME1;
+	}
+	h ^= h >> 15;
+	h *= XXH_PRIME2;
+	h ^= h >> 13;
+	h *= XXH_PRIME3;
+	h ^= h >> 16;
+	return h;
+}
+
+static grub_u32_t
+xxh32(const unsigned char *p, unsigned long len)
+{
+	struct xxh32_state s;
+
+	xxh32_reset(&s);
+	xxh32_update(&s, p, len);
+	return xxh32_digest(&s);
+}
+
+/* Add N decoded bytes at P to the content checksum. After the last block
+   the checksum follows the end mark at filepos (of the compressed file). */
+static void
+lz4_hash_out(const unsigned char *p, unsigned long n)
+{
+	grub_u32_t sum;
+
+	if (!lz4dec.xxh_on)
+		return;
+	if (!decomp_verify) {
+		lz4dec.xxh_on = 0;
+		return;
+	}
+	xxh32_update(&lz4dec.xxh, p, n);
+	if (lz4dec.nextBlockSize)
+		return;
+	lz4dec.xxh_on = 0;
+	if (grub_read((grub_u64_t)(int)&sum, 4, GRUB_READ) != 4 || sum != xxh32_digest(&lz4dec.xxh))
+		errnum = ERR_BAD_CHECKSUM;
+}
+
+/* The decoded size of the LZ4 block of SRC_LEN bytes at SRC, from its
+   tokens alone. Return -1 if they run past its end.  */
+static long
+lz4_block_size(const unsigned char *src, unsigned long src_len)
+{
+	const unsigned char *p = src, *end = src + src_len;
+	unsigned long size = 0;
+
+	while (p < end) {
+		unsigned char token = *(p++);
+		unsigned long litlen = token >> 4, matlen = token & 15;
+		unsigned char c;
+
+		if (litlen == 15)
+			do {
+				if (p == end)
+					return -1;
+				c = *(p++);
+				litlen += c;
+			} while (c == 255);
+		if ((unsigned long)(end - p) < litlen)
+			return -1;
+		p += litlen;
+		size += litlen;
+		if (p == end)
+			return size;
+		if (end - p < 2)
+			return -1;
+		p += 2;
+		if (matlen == 15)
+			do {
+				if (p == end)
+					return -1;
+				c = *(p++);
+				matlen += c;
+			} while (c == 255);
+		size += matlen + 4;
+	}
+	return -1;
+}
+
+/* Append block at CPOS, whose data starts at UPOS, to the index. */
+static int
+lz4_add_block(unsigned long long cpos, unsigned long long upos)
+{
+	struct lz4_block *b;
+
+	if (lz4dec.nblocks == lz4dec.maxblocks) {
+		unsigned long max = lz4dec.maxblocks ? lz4dec.maxblocks * 2 : 64;
+
+		b = grub_malloc(max * sizeof(struct lz4_block));
+		if (!b)
+			return 0;
+		if (lz4dec.blocks) {
+			memmove(b, lz4dec.blocks, lz4dec.nblocks * sizeof(struct lz4_block));
+			grub_free(lz4dec.blocks);
+		}
+		lz4dec.blocks = b;
+		lz4dec.maxblocks = max;
+	}
+	b = &lz4dec.blocks[lz4dec.nblocks++];
+	b->cpos = cpos;
+	b->upos = upos;
+	return 1;
+}
+
+/*
+ * Walk the blocks of the frame from the first block size field, reading
+ * each compressed block into inp for the decoded size its tokens give.
+ * With INDEX, note where each block starts. Return the content size, or
+ * -1 if the frame is not well-formed.
+ */
+static long long
+lz4_scan(int index)
+{
+	unsigned long long pos = lz4dec.headerSize, upos = 0;
+	grub_u32_t size;
+
+	while (1) {
+		long n;
+
+		filepos = pos;
+		if (grub_read((grub_u64_t)(int)&size, 4, GRUB_READ) != 4)
+			return -1;
+		if (!size)
+			return upos;
+		if (index && !lz4_add_block(pos, upos))
+			return -1;
+		n = size & 0x7FFFFFFF;
+		if ((unsigned long)n > lz4dec.blockMaxSize)
+			return -1;
+		if (!(size & 0x80000000)) {
+			if (grub_read((grub_u64_t)(int)lz4dec.inp, n, GRUB_READ) != (unsigned long)n)
+				return -1;
+			n = lz4_block_size(lz4dec.inp, n);
+			if (n < 0 || (unsigned long)n > lz4dec.blockMaxSize)
+				return -1;
+		}
+		upos += n;
+		pos += 4 + (size & 0x7FFFFFFF) + lz4dec.flg_bchecksum * 4;
+	}
+}
+
+/*
+ * Build the block index of a frame with independent blocks, the first
+ * time it is needed: to seek back or far ahead, or to decode on all
+ * processors. Keeps filepos. Without memory for it, go on unindexed.
+ * Return 0 if the frame is not well-formed.
+ */
+static int
+lz4_index(void)
+{
+	unsigned long long pos = filepos;
+	long long size;
+
+	if (lz4dec.indexed)
+		return 1;
+	lz4dec.indexed = 1;
+	size = lz4_scan(1);
+	filepos = pos;
+	if (size >= 0 && (unsigned long long)size == lz4dec.content_size)
+		return 1;
+	if (lz4dec.blocks) { grub_free(lz4dec.blocks); lz4dec.blocks = 0; }
+	lz4dec.nblocks = lz4dec.maxblocks = 0;
+	if (errnum == ERR_NOT_ENOUGH_MEMORY) {
+		errnum = ERR_NONE;
+		return 1;
+	}
+	errnum = ERR_BAD_GZIP_DATA;
+	return 0;
+}
+
 void
 dec_lz4_close(void)
 {
 	if (lz4dec.inp) { grub_free(lz4dec.inp); lz4dec.inp = 0; }
 	if (lz4dec.dic) { grub_free(lz4dec.dic); lz4dec.dic = 0; }
+	if (lz4dec.blocks) { grub_free(lz4dec.blocks); lz4dec.blocks = 0; }
+	lz4dec.nblocks = lz4dec.maxblocks = 0;
 }
 
 int
@@ -139,9 +420,8 @@ dec_lz4_open(void)
 		pos += 8;
 	}
 	else {
-		/* grub_printf("no content size\n"); */
+		/* found by lz4_scan below */
 		lz4dec.content_size = 0;
-		goto fail;
 	}
 	lz4dec.hc = header[pos++];
 	if (lz4dec.bd_blockmaxsize < 4) {
@@ -154,21 +434,39 @@ dec_lz4_open(void)
 	}
 	/* valid header */
 	lz4dec.headerSize = pos;
-	lz4dec.nextBlockSize = *(grub_u32_t*)(int)&header[pos];
-	pos += 4;
 	lz4dec.cfilemax = filemax;
-	lz4dec.cfilepos = pos;
-	lz4dec.ufilemax = lz4dec.content_size;
-	lz4dec.ufilepos = 0;
 	lz4dec.inp = (unsigned char *)grub_malloc(LZ4_INPBUFSIZE);
 	lz4dec.dic = (unsigned char *)grub_malloc(LZ4_DICBUFSIZE);
 	if (lz4dec.inp == 0 || lz4dec.dic == 0) {
-		if (lz4dec.inp) { grub_free(lz4dec.inp); lz4dec.inp = 0; }
-		if (lz4dec.dic) { grub_free(lz4dec.dic); lz4dec.dic = 0; }
+		dec_lz4_close();
 		errnum = ERR_NOT_ENOUGH_MEMORY;
 		filepos = 0;
 		return 0;
 	}
+	/* Without a content size, walk the blocks now to find it, and index
+	   them on the way if they are independent. Else the index is left to
+	   lz4_index, and opening the file reads only its header. */
+	lz4dec.indexed = !lz4dec.flg_bindep;
+	if (!lz4dec.flg_csize) {
+		long long size = lz4_scan(lz4dec.flg_bindep);
+
+		lz4dec.indexed = 1;
+		if (size < 0) {
+			dec_lz4_close();
+			if (errnum != ERR_NOT_ENOUGH_MEMORY)
+				errnum = ERR_BAD_GZIP_HEADER;
+			filepos = 0;
+			return 0;
+		}
+		lz4dec.content_size = size;
+	}
+	filepos = pos;
+	if (grub_read((grub_u64_t)(int)&lz4dec.nextBlockSize, 4, GRUB_READ) != 4)
+		goto fail;
+	lz4dec.nextBlock = 0;
+	lz4dec.cfilepos = filepos;
+	lz4dec.ufilemax = lz4dec.content_size;
+	lz4dec.ufilepos = 0;
 	decomp_type = DECOMP_TYPE_LZ4;
 	compressed_file = 1;
 	filemax = lz4dec.ufilemax;
@@ -178,20 +476,282 @@ dec_lz4_open(void)
 	lz4dec.inpPos = 0;
 	lz4dec.dicPos = LZ4_DICPOSSTART;
 	lz4dec.dicFilePos = 0;
+	lz4dec.dicLow = 0;
 	memset(lz4dec.dic, 0, LZ4_DICPOSSTART);
+	xxh32_reset(&lz4dec.xxh);
+	lz4dec.xxh_on = lz4dec.flg_cchecksum;
 	/* success */
 	errnum = ERR_NONE;
 	return 1;
 fail:
+	dec_lz4_close();
 	errnum = ERR_BAD_GZIP_HEADER;
 	filepos = 0;
 	return 0;
 }
 
+/* Copy 8 bytes at a time from S to D until D reaches E, which may write
+   up to 7 bytes past E. S must not be less than 8 bytes behind D.  */
+static void
+lz4_wild_copy(unsigned char *d, const unsigned char *s, const unsigned char *e)
+{
+	do {
+		((grub_u32_t *)d)[0] = ((const grub_u32_t *)s)[0];
+		((grub_u32_t *)d)[1] = ((const grub_u32_t *)s)[1];
+		d += 8;
+		s += 8;
+	} while (d < e);
+}
+
+/* Decode one LZ4 block of SRC_LEN bytes at SRC into DST, which has room
+   for DST_LEN bytes. Matches may reach back as far as LOW, which is DST
+   itself for an independent block. Return the decoded size or -1.  */
+long
+lz4_decode_block(unsigned char *dst, unsigned long dst_len, const unsigned char *src, unsigned long src_len, const unsigned char *low)
+{
+	unsigned char *q = dst;
+	const unsigned char *p = src;
+	unsigned long outRem = dst_len;
+	unsigned long inpRem = src_len;
+
+	while (1) {
+		if (!inpRem)
+			return -1;
+		/* read token */
+		unsigned char token = *(p++); --inpRem;
+		/* read more literal length */
+		unsigned long litlen = token >> 4;
+		if (litlen == 15 && inpRem) {
+			unsigned char c;
+			do {
+				c = *(p++);
+				litlen += c;
+				--inpRem;
+			} while (inpRem && c == 255);
+		}
+		/* copy literal, 8 bytes at a time with room on both sides */
+		if (inpRem < litlen || outRem < litlen)
+			return -1;
+		if (inpRem >= litlen + 8 && outRem >= litlen + 8) {
+			if (litlen)
+				lz4_wild_copy(q, p, q + litlen);
+			q += litlen;
+			p += litlen;
+		} else {
+			unsigned int counter;
+			for (counter = litlen; counter; --counter)
+				*(q++) = *(p++);
+		}
+		inpRem -= litlen;
+		outRem -= litlen;
+		if (inpRem == 0)
+			break; /* end of compressed block */
+		/* read match offset */
+		if (inpRem < 2)
+			return -1;
+		unsigned long matoff = (((unsigned long)p[0]) + ((unsigned long)p[1] << 8)); p += 2; inpRem -= 2;
+		/* read more match size */
+		unsigned long matlen = (token & 15);
+		if (matlen == 15) {
+			unsigned char c;
+			do {
+				if (!inpRem)
+					return -1;
+				c = *(p++);
+				matlen += c;
+				--inpRem;
+			} while (c == 255);
+		}
+		matlen += 4;
+		/* copy match, by bytes if it overlaps within 8 */
+		if (outRem < matlen || matoff == 0 || matoff > (unsigned long)(q - low))
+			return -1;
+		unsigned char *from = q - matoff;
+		if (matoff >= 8 && outRem >= matlen + 8) {
+			lz4_wild_copy(q, from, q + matlen);
+			q += matlen;
+		} else {
+			unsigned int counter;
+			for (counter = matlen; counter; --counter)
+				*(q++) = *(from++);
+		}
+		outRem -= matlen;
+	}
+	return q - dst;
+}
+
+/* Start decoding at block B of the index, or at the start of the frame. */
+static void
+lz4_restart(unsigned long b)
+{
+	filepos = b < lz4dec.nblocks ? lz4dec.blocks[b].cpos : lz4dec.headerSize;
+	grub_read((grub_u64_t)(int)&lz4dec.nextBlockSize, 4, GRUB_READ);
+	lz4dec.nextBlock = b;
+	lz4dec.inpSize = 0;
+	lz4dec.inpPos = 0;
+	lz4dec.dicPos = LZ4_DICPOSSTART;
+	if (!b) {
+		lz4dec.dicFilePos = 0;
+		lz4dec.dicLow = 0;
+		memset(lz4dec.dic, 0, LZ4_DICPOSSTART);
+		xxh32_reset(&lz4dec.xxh);
+		lz4dec.xxh_on = lz4dec.flg_cchecksum;
+	} else {
+		/* nothing before the block, and the content checksum is off */
+		lz4dec.dicFilePos = lz4dec.blocks[b].upos;
+		lz4dec.dicLow = LZ4_DICPOSSTART;
+		lz4dec.xxh_on = 0;
+	}
+}
+
+/* the block of the index holding uncompressed offset POS */
+static unsigned long
+lz4_find(unsigned long long pos)
+{
+	unsigned long lo = 0, hi = lz4dec.nblocks;
+
+	while (hi - lo > 1) {
+		unsigned long mid = (lo + hi) >> 1;
+
+		if (lz4dec.blocks[mid].upos <= pos)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* The last DONE bytes decoded went straight to the caller's buffer and
+   end at END. Make the 64K before END the history in dic again. */
+static void
+lz4_sync_dic(const unsigned char *end, unsigned long long done)
+{
+	unsigned long n = (done < 65536) ? (unsigned long)done : 65536;
+	unsigned long keep = 65536 - n;
+
+	memmove(lz4dec.dic, lz4dec.dic + lz4dec.dicPos - keep, keep);
+	memmove(lz4dec.dic + keep, end - n, n);
+	lz4dec.dicLow = (lz4dec.dicLow > lz4dec.dicPos - keep) ? lz4dec.dicLow - (lz4dec.dicPos - keep) : 0;
+	lz4dec.dicFilePos += lz4dec.dicPos - LZ4_DICPOSSTART + done;
+	lz4dec.dicPos = LZ4_DICPOSSTART;
+}
+
+#define LZ4_SMP_BATCH 64
+
+/* one independent block decoded by smp_run */
+struct lz4_job {
+	unsigned char *dst;
+	unsigned long dst_len;	/* its decoded size, from the index */
+	const unsigned char *src;
+	grub_u32_t size;	/* its size field */
+	long ret;		/* decoded size, -1 if bad, -2 if the checksum fails */
+};
+
+static struct lz4_job lz4_jobs[2][LZ4_SMP_BATCH];
+
+static void
+lz4_block_job(void *arg)
+{
+	struct lz4_job *j = arg;
+	unsigned long n = j->size & 0x7FFFFFFF;
+
+	if (lz4dec.flg_bchecksum && decomp_verify
+	    && xxh32(j->src, n) != *(const grub_u32_t *)(j->src + n))
+		j->ret = -2;
+	else if (j->size & 0x80000000) {
+		j->ret = (n == j->dst_len) ? (long)n : -1;
+		if (j->ret > 0)
+			memmove(j->dst, j->src, n);
+	}
+	else
+		j->ret = lz4_decode_block(j->dst, j->dst_len, j->src, n, j->dst);
+}
+
+/* Check the N jobs of a finished batch and add them to the checksum. */
+static int
+lz4_jobs_done(struct lz4_job *j, unsigned long n)
+{
+	for (; n; j++, n--) {
+		if (j->ret != (long)j->dst_len) {
+			errnum = (j->ret == -2) ? ERR_BAD_CHECKSUM : ERR_BAD_GZIP_DATA;
+			return 0;
+		}
+		lz4_hash_out(j->dst, j->dst_len);
+	}
+	return 1;
+}
+
+/*
+ * Decode the indexed blocks from nextBlock on that fit whole in the LEN
+ * bytes at Q, on all processors. The BSP reads a batch of blocks into
+ * one half of inp while the previous batch, in the other half, is being
+ * decoded. The last block of the frame is left to the caller. Return the
+ * number of bytes decoded, with filepos and nextBlockSize as after a
+ * block read by dec_lz4_read.
+ */
+static unsigned long long
+lz4_read_parallel(unsigned char *q, unsigned long long len)
+{
+	unsigned long b = lz4dec.nextBlock, e, i, half = LZ4_INPBUFSIZE / 2;
+	unsigned long long base = lz4dec.blocks[b].upos;
+	struct lz4_job *pend = 0;
+	unsigned long npend = 0;
+	int h = 0;
+
+	while (b + 1 < lz4dec.nblocks) {
+		unsigned char *p = lz4dec.inp + h * half;
+		unsigned long long cpos = lz4dec.blocks[b].cpos;
+
+		for (e = b + 1; e < lz4dec.nblocks && e - b <= LZ4_SMP_BATCH
+		     && lz4dec.blocks[e].upos - base <= len
+		     && lz4dec.blocks[e].cpos - cpos + 4 <= half; e++)
+			;
+		if (--e == b)
+			break;
+		/* blocks b...e-1, and the size field of block e */
+		filepos = cpos;
+		if (grub_read((grub_u64_t)(int)p, lz4dec.blocks[e].cpos - cpos + 4, GRUB_READ)
+		    != lz4dec.blocks[e].cpos - cpos + 4) {
+			if (!errnum)
+				errnum = ERR_BAD_GZIP_DATA;
+			break;
+		}
+		smp_wait();
+		if (npend && !lz4_jobs_done(pend, npend))
+			break;
+		pend = lz4_jobs[h];
+		for (npend = 0, i = b; i < e; i++, npend++) {
+			struct lz4_job *j = &pend[npend];
+			const unsigned char *s = p + (lz4dec.blocks[i].cpos - cpos);
+
+			j->size = *(const grub_u32_t *)s;
+			if ((j->size & 0x7FFFFFFF) + 4 + lz4dec.flg_bchecksum * 4
+			    != lz4dec.blocks[i + 1].cpos - lz4dec.blocks[i].cpos) {
+				errnum = ERR_BAD_GZIP_DATA;
+				break;
+			}
+			j->src = s + 4;
+			j->dst = q + (lz4dec.blocks[i].upos - base);
+			j->dst_len = lz4dec.blocks[i + 1].upos - lz4dec.blocks[i].upos;
+			smp_run(lz4_block_job, j);
+		}
+		lz4dec.nextBlockSize = *(grub_u32_t *)(p + (lz4dec.blocks[e].cpos - cpos));
+		lz4dec.nextBlock = b = e;
+		h ^= 1;
+		if (errnum)
+			break;
+	}
+	smp_wait();
+	if (npend && !errnum)
+		lz4_jobs_done(pend, npend);
+	return errnum ? 0 : lz4dec.blocks[b].upos - base;
+}
+
 unsigned long long
 dec_lz4_read(unsigned long long buf, unsigned long long len, unsigned long write)
 {
 	unsigned long long outTx, outSkip;
+	unsigned long long direct = 0;	/* decoded to buf, not yet in dic */
 	/* grub_printf("LZ4 read buf=%lX len=%lX dic=%X inp=%X\n",buf,len,lz4dec.dic,lz4dec.inp);
 	getkey();
 	*/
@@ -208,22 +768,31 @@ dec_lz4_read(unsigned long long buf, unsigned long long len, unsigned long write
 	* cfilemax, cfilepos are not used
 	*/
 
-	/* if reading before dic, reset decompression to beginning */
-	if (lz4dec.ufilepos + LZ4_DICPOSSTART < lz4dec.dicFilePos) {
-		filepos = lz4dec.headerSize;
-		grub_read((grub_u64_t)(int)&lz4dec.nextBlockSize, 4, GRUB_READ);
-//		unsigned char *p = lz4dec.inp;
-//		lz4dec.nextBlockSize =*(grub_u32_t*)(int)lz4dec.inp;
-		lz4dec.inpSize = 0;
-		lz4dec.inpPos = 0;
-		lz4dec.dicPos = LZ4_DICPOSSTART;
-		lz4dec.dicFilePos = 0;
-		memset(lz4dec.dic, 0, LZ4_DICPOSSTART);
+	errnum = ERR_NONE;
+
+	/* If reading before what dic holds, start over: from the block holding
+	   it when the blocks are indexed, else from the beginning. If reading
+	   past the block to decode next, skip to the one holding it. The index
+	   is built on the first such seek, backwards or LZ4_FAR_BLOCKS ahead. */
+	if (lz4dec.ufilepos + LZ4_DICPOSSTART < lz4dec.dicFilePos + lz4dec.dicLow) {
+		if (lz4_index())
+			lz4_restart(lz4dec.nblocks ? lz4_find(lz4dec.ufilepos) : 0);
+	}
+	else if (lz4dec.ufilepos + LZ4_DICPOSSTART >= lz4dec.dicFilePos + lz4dec.dicPos) {
+		unsigned long long ahead = lz4dec.ufilepos + LZ4_DICPOSSTART - lz4dec.dicFilePos - lz4dec.dicPos;
+
+		if (ahead >= LZ4_FAR_BLOCKS * lz4dec.blockMaxSize)
+			lz4_index();
+		if (!errnum && lz4dec.nextBlock < lz4dec.nblocks) {
+			unsigned long b = lz4_find(lz4dec.ufilepos);
+
+			if (b > lz4dec.nextBlock)
+				lz4_restart(b);
+		}
 	}
 
 	outTx = 0;
 	outSkip = lz4dec.ufilepos + LZ4_DICPOSSTART - lz4dec.dicFilePos;
-	errnum = ERR_NONE;
 
 	while (len && !errnum)
 	{
@@ -251,6 +820,24 @@ dec_lz4_read(unsigned long long buf, unsigned long long len, unsigned long write
 			unsigned long blockSize = lz4dec.nextBlockSize;
 			//grub_printf("blockSize %X\n",blockSize);
 			if (blockSize == 0) break;
+			/* Whole independent blocks go to all processors. */
+			if (smp_cpus && buf && len >= 2 * lz4dec.blockMaxSize && !lz4_index())
+				break;
+			if (smp_cpus && buf && outSkip == lz4dec.dicPos && lz4dec.nextBlock + 2 < lz4dec.nblocks
+			    && buf + len <= 0x100000000ULL)
+			{
+				unsigned long long n = lz4_read_parallel((unsigned char *)(unsigned long)buf, len);
+				if (errnum)
+					break;
+				if (n) {
+					buf += n;
+					direct += n;
+					outTx += n;
+					lz4dec.ufilepos += n;
+					len -= n;
+					continue;
+				}
+			}
 			int bUncompressedBlock = ((blockSize & 0x80000000) != 0);
 			blockSize &= 0x7FFFFFFF;
 			unsigned long inSizeCur = blockSize + lz4dec.flg_bchecksum * 4 + 4;
@@ -261,6 +848,48 @@ dec_lz4_read(unsigned long long buf, unsigned long long len, unsigned long write
 			lz4dec.inpPos = 0;
 //			unsigned char *pNextBlockSize = lz4dec.inp + blockSize + lz4dec.flg_bchecksum * 4;
 			lz4dec.nextBlockSize = *(grub_u32_t*)(int)(lz4dec.inp + blockSize + lz4dec.flg_bchecksum * 4);
+			lz4dec.nextBlock++;
+			if (lz4dec.flg_bchecksum && decomp_verify
+			    && xxh32(lz4dec.inp, blockSize) != *(grub_u32_t*)(int)(lz4dec.inp + blockSize)) {
+				errnum = ERR_BAD_CHECKSUM;
+				break;
+			}
+
+			/* Decode straight into the caller's buffer when it has room for
+			   a whole block and holds the 64K history the block may use. */
+			if (buf && outSkip == lz4dec.dicPos && len >= lz4dec.blockMaxSize
+			    && buf + len <= 0x100000000ULL && (lz4dec.flg_bindep || outTx >= 65536))
+			{
+				unsigned char *q = (unsigned char *)(unsigned long)buf;
+				long outLen = blockSize;
+				if (bUncompressedBlock) {
+					if (blockSize > lz4dec.blockMaxSize) {
+						errnum = ERR_BAD_GZIP_DATA;
+						break;
+					}
+					memmove(q, lz4dec.inp, blockSize);
+				}
+				else {
+					outLen = lz4_decode_block(q, lz4dec.blockMaxSize, lz4dec.inp, blockSize,
+								lz4dec.flg_bindep ? q : q - outTx);
+					if (outLen < 0) {
+						errnum = ERR_BAD_GZIP_DATA;
+						break;
+					}
+				}
+				lz4_hash_out(q, outLen);
+				buf += outLen;
+				direct += outLen;
+				outTx += outLen;
+				lz4dec.ufilepos += outLen;
+				len -= outLen;
+				continue;
+			}
+			if (direct) {
+				lz4_sync_dic((unsigned char *)(unsigned long)buf, direct);
+				outSkip = lz4dec.dicPos;
+				direct = 0;
+			}
 
 			/* If dic is full, move 64K to beginning. */
 			if (lz4dec.dicPos + lz4dec.blockMaxSize > LZ4_DICBUFSIZE)
@@ -269,91 +898,32 @@ dec_lz4_read(unsigned long long buf, unsigned long long len, unsigned long write
 				memmove(lz4dec.dic, lz4dec.dic + dicPosSrc, 65536);
 				lz4dec.dicPos = 65536;
 				lz4dec.dicFilePos += dicPosSrc;
+				lz4dec.dicLow = 0;
 				outSkip -= dicPosSrc;
 			}
 
 			/* Decode 1 block */
 			if (bUncompressedBlock) {
 				memmove(lz4dec.dic + lz4dec.dicPos, lz4dec.inp, blockSize);
+				lz4_hash_out(lz4dec.dic + lz4dec.dicPos, blockSize);
 				lz4dec.dicPos += blockSize;
 			}
 			else {
 				/* Decompress LZ4 Block format*/
-				unsigned char *q = lz4dec.dic + lz4dec.dicPos;
-				unsigned char *p = lz4dec.inp;
-				unsigned long outRem = LZ4_DICBUFSIZE - lz4dec.dicPos;
-				unsigned long inpRem = blockSize;
-				while (1) {
-					/* grub_printf("decompressing %X %X %X\n", q, p, inpRem); */
-					if (!inpRem) {
-						errnum = ERR_BAD_GZIP_DATA;
-						break;
-					}
-					/* read token */
-					unsigned char token = *(p++); --inpRem;
-					/* read more literal length */
-					unsigned long litlen = token >> 4;
-					if (litlen == 15 && inpRem) {
-						unsigned char c;
-						do {
-							c = *(p++);
-							litlen += c;
-							--inpRem;
-						} while (inpRem && c == 255);
-					}
-					/* grub_printf("litlen %X\n", litlen); */
-					/* copy literal */
-					if (inpRem < litlen || outRem < litlen) {
-						/* error */
-						/* grub_printf("inpRem %X < litlen %X\n", inpRem, litlen); */
-						errnum = ERR_BAD_GZIP_DATA;
-						break;
-					}
-					else {
-						inpRem -= litlen;
-						outRem -= litlen;
-						unsigned int counter;
-						for (counter = litlen; counter; --counter)
-							*(q++) = *(p++);
-						if (inpRem == 0) {
-							break; /* end of compressed block */
-						}
-					}
-					/* read match offset */
-					unsigned long matoff = (((unsigned long)p[0]) + ((unsigned long)p[1] << 8)); p += 2; inpRem -= 2;
-					/* read more match size */
-					unsigned long matlen = (token & 15);
-					if (matlen == 15) {
-						unsigned char c;
-						do {
-							c = *(p++);
-							matlen += c;
-							--inpRem;
-						} while (inpRem && c == 255);
-					}
-					matlen += 4;
-					/* grub_printf("matlen %X\n", matlen); */
-					/* copy match */
-					if (outRem < matlen) {
-						/* error */
-						errnum = ERR_BAD_GZIP_DATA;
-						break;
-					}
-					else {
-						outRem -= matlen;
-						unsigned char *src = q - matoff;
-						unsigned int counter;
-						for (counter = matlen; counter; --counter)
-							*(q++) = *(src++);
-					}
+				long outLen = lz4_decode_block(lz4dec.dic + lz4dec.dicPos, LZ4_DICBUFSIZE - lz4dec.dicPos,
+							lz4dec.inp, blockSize,
+							lz4dec.flg_bindep ? lz4dec.dic + lz4dec.dicPos : lz4dec.dic);
+				if (outLen < 0) {
+					errnum = ERR_BAD_GZIP_DATA;
+					break;
 				}
-				/* grub_printf("dic %X dic+dicPos %X dic+dicPos+blockSize %X q %X q-dic %X blockSize %X\n",
-				lz4dec.dic, lz4dec.dic + lz4dec.dicPos, lz4dec.dic + lz4dec.dicPos + blockSize,
-				q, q-lz4dec.dic, blockSize ); */
-				lz4dec.dicPos = q - lz4dec.dic;
+				lz4_hash_out(lz4dec.dic + lz4dec.dicPos, outLen);
+				lz4dec.dicPos += outLen;
 			}
 		}
 	}
+	if (direct)
+		lz4_sync_dic((unsigned char *)(unsigned long)buf, direct);
 	compressed_file = 1;
 
 	lz4dec.cfilemax = filemax;
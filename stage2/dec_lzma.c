@@ -27,6 +27,8 @@
 
 #include "shared.h"
 
+#include "filesys.h"
+
 /* Types.h -- Basic types
 2010-03-11 : Igor Pavlov : Public domain */
 
@@ -1158,6 +1160,305 @@ SRes LzmaDec_DecodeToDic(CLzmaDec *p, SizeT dicLimit, const Byte *src, SizeT *sr
 
 CLzmaDec lzmadec;
 
+/*
+ * Seek index: snapshots of the decoder (probabilities, range coder and
+ * the last dictionary size of output) every lzma_index_spacing bytes, so
+ * that a read before what dic holds, or well beyond it, resumes from the
+ * nearest one instead of decoding from the start of the file.  As a
+ * snapshot costs about the dictionary size of memory, it is off unless
+ * set with "zindex --lzma-spacing".
+ */
+unsigned long long lzma_index_spacing = 0;
+
+#define LZMA_INDEX_MAX	32
+
+struct lzma_point
+{
+    UInt64 out;		/* uncompressed offset, a multiple of 4K */
+    UInt64 in;		/* compressed offset of the next unread byte */
+    UInt32 range, code;
+    UInt32 processedPos, checkDicSize;
+    unsigned state;
+    UInt32 reps[4];
+    unsigned remainLen;
+    int needFlush, needInitState;
+    unsigned tempBufSize;
+    Byte tempBuf[LZMA_REQUIRED_INPUT_MAX];
+    UInt32 hist;
+    /* followed by the probabilities and HIST bytes of history */
+};
+
+/* which file the index belongs to */
+static struct
+{
+    UInt64 size;
+    unsigned long mtime;
+    Byte header[13];
+} lzma_index_id;
+
+static struct lzma_point *lzma_index[LZMA_INDEX_MAX];
+static UInt32 lzma_index_count;
+static UInt64 lzma_index_step;	/* doubles when the index fills */
+
+/* whether a point at POS is due; in 4K units to stay within 32 bits */
+#define LZMA_INDEX_DUE(pos) \
+    (((UInt32)(pos) & 0xFFF) == 0 && (UInt32)((pos) >> 12) % (UInt32)(lzma_index_step >> 12) == 0)
+
+void
+dec_lzma_index_flush (void)
+{
+    while (lzma_index_count)
+	grub_free (lzma_index[--lzma_index_count]);
+    grub_memset (&lzma_index_id, 0, sizeof (lzma_index_id));
+    lzma_index_step = (lzma_index_spacing + 0xFFF) & ~0xFFFULL;
+    if (lzma_index_step > 0x10000000000ULL)
+	lzma_index_step = 0x10000000000ULL;
+}
+
+unsigned long
+dec_lzma_index_points (unsigned long long *step)
+{
+    *step = lzma_index_step;
+    return lzma_index_count;
+}
+
+/* Keep the index if it is for the file just opened.  */
+static void
+lzma_index_attach (const Byte *header)
+{
+    if (lzma_index_id.size == filemax && lzma_index_id.mtime == filemtime
+	&& grub_memcmp ((char *) lzma_index_id.header, (char *) header, 13) == 0)
+	return;
+    dec_lzma_index_flush ();
+    lzma_index_id.size = filemax;
+    lzma_index_id.mtime = filemtime;
+    grub_memmove (lzma_index_id.header, header, 13);
+}
+
+/* Bytes from POS to the next point that is due, or 0 without an index. */
+static UInt32
+lzma_index_left (UInt64 pos)
+{
+    UInt32 step, k;
+
+    if (! lzma_index_step)
+	return 0;
+    step = (UInt32)(lzma_index_step >> 12);
+    k = step - (UInt32)(pos >> 12) % step;
+    if (k >= 0x80000)
+	return 0x80000000;
+    return (k << 12) - ((UInt32)pos & 0xFFF);
+}
+
+/* Save a point where the decoder is now, if it is due.  */
+static void
+lzma_index_add (void)
+{
+    UInt64 pos = lzmadec.dicFilePos + lzmadec.dicPos;
+    struct lzma_point *p;
+    UInt32 i, n, hist, probs;
+    Byte *h;
+
+    if (! lzma_index_step || ! pos || pos >= lzmadec.fileu.fmax
+	|| ! LZMA_INDEX_DUE (pos) || errnum)
+	return;
+    if (lzma_index_count && lzma_index[lzma_index_count - 1]->out >= pos)
+	return;
+
+    if (lzma_index_count == LZMA_INDEX_MAX)
+    {
+	/* full: keep every other point */
+	lzma_index_step <<= 1;
+	for (i = n = 0; i < lzma_index_count; i++)
+	    if (! LZMA_INDEX_DUE (lzma_index[i]->out))
+		grub_free (lzma_index[i]);
+	    else
+		lzma_index[n++] = lzma_index[i];
+	lzma_index_count = n;
+	if (! LZMA_INDEX_DUE (pos))
+	    return;
+    }
+
+    hist = (pos < lzmadec.prop.dicSize) ? (UInt32)pos : lzmadec.prop.dicSize;
+    probs = lzmadec.numProbs * sizeof (UIntLzmaProb);
+    /* the index is optional; do without it when memory is short */
+    if ((p = grub_malloc (sizeof (*p) + probs + hist)) == NULL)
+    {
+	errnum = 0;
+	return;
+    }
+    p->out = pos;
+    p->in = lzmadec.inpFilePos + lzmadec.inpPos;
+    p->range = lzmadec.range;
+    p->code = lzmadec.code;
+    p->processedPos = lzmadec.processedPos;
+    p->checkDicSize = lzmadec.checkDicSize;
+    p->state = lzmadec.state;
+    grub_memmove (p->reps, lzmadec.reps, sizeof (p->reps));
+    p->remainLen = lzmadec.remainLen;
+    p->needFlush = lzmadec.needFlush;
+    p->needInitState = lzmadec.needInitState;
+    p->tempBufSize = lzmadec.tempBufSize;
+    grub_memmove (p->tempBuf, lzmadec.tempBuf, sizeof (p->tempBuf));
+    p->hist = hist;
+    h = (Byte *)(p + 1);
+    grub_memmove (h, lzmadec.probs, probs);
+    h += probs;
+    /* the history may wrap around the end of dic */
+    n = lzmadec.dicPos;
+    if (hist > n)
+    {
+	grub_memmove (h, lzmadec.dic + lzmadec.dicBufSize - (hist - n), hist - n);
+	h += hist - n;
+	hist = n;
+    }
+    grub_memmove (h, lzmadec.dic + n - hist, hist);
+    lzma_index[lzma_index_count++] = p;
+}
+
+/* Resume from the last point at or before POS, unless dic holds POS or
+   the decoder is already past that point.  Returns 1 if it did.  */
+static int
+lzma_index_seek (UInt64 pos)
+{
+    struct lzma_point *p;
+    UInt64 cur = dFP + lzmadec.dicPos;
+    UInt32 lo, hi, mid;
+    Byte *h;
+
+    lo = 0;
+    hi = lzma_index_count;
+    while (lo < hi)
+    {
+	mid = (lo + hi) >> 1;
+	if (lzma_index[mid]->out <= pos)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    if (! lo)
+	return 0;
+    p = lzma_index[lo - 1];
+    if (p->out <= cur && (dFP ? dFP - dBS + lzmadec.dicPos : 0) <= pos)
+	return 0;
+
+    lzmadec.range = p->range;
+    lzmadec.code = p->code;
+    lzmadec.processedPos = p->processedPos;
+    lzmadec.checkDicSize = p->checkDicSize;
+    lzmadec.state = p->state;
+    grub_memmove (lzmadec.reps, p->reps, sizeof (p->reps));
+    lzmadec.remainLen = p->remainLen;
+    lzmadec.needFlush = p->needFlush;
+    lzmadec.needInitState = p->needInitState;
+    lzmadec.tempBufSize = p->tempBufSize;
+    grub_memmove (lzmadec.tempBuf, p->tempBuf, sizeof (p->tempBuf));
+    h = (Byte *)(p + 1);
+    grub_memmove (lzmadec.probs, h, lzmadec.numProbs * sizeof (UIntLzmaProb));
+    h += lzmadec.numProbs * sizeof (UIntLzmaProb);
+    /* HIST is less than dBS only for a point within the first dBS bytes */
+    grub_memmove (lzmadec.dic, h, p->hist);
+    lzmadec.dicPos = p->hist;
+    dFP = p->out - p->hist;
+    filepos = p->in;
+    lzmadec.inpPos = lzmadec.inpSize = 0;
+    return 1;
+}
+
+/*
+ * Large reads from the decoding front are decoded straight into the
+ * caller's buffer, which serves as the dictionary in place of dic.  This
+ * is only done once the read itself has put a whole dictionary span of
+ * output in the buffer, so that the decoder never looks below it and
+ * nothing outside the buffer is touched.  Afterwards dic is refilled from
+ * the end of the output.
+ */
+#define LZMA_DIRECT_MIN		0x100000
+
+/* Is OUT, holding COPIED bytes of this read with LEN more to come, fit
+   for dec_lzma_direct?  */
+static int
+lzma_direct_ok (UInt64 out, UInt64 copied, UInt64 len)
+{
+    UInt32 lo, hi;
+
+    if (len < LZMA_DIRECT_MIN || copied < dBS || out + len > 0x100000000ULL)
+	return 0;
+    lo = (UInt32)out - dBS;
+    hi = (UInt32)(out + len);
+    /* it must not overlap anything of ours */
+    if (lo < (UInt32)lzmadec.dic + dBS && hi > (UInt32)lzmadec.dic)
+	return 0;
+    if (lo < (UInt32)lzmadec.inp + lzmadec.inpBufSize && hi > (UInt32)lzmadec.inp)
+	return 0;
+    if (lo < (UInt32)lzmadec.probs + lzmadec.numProbs * sizeof(UIntLzmaProb) && hi > (UInt32)lzmadec.probs)
+	return 0;
+    return 1;
+}
+
+/* Decode up to LEN bytes to OUT, which follows the COPIED bytes of this
+   read, COPIED >= dBS.  Returns the number of bytes decoded.  */
+static UInt32
+dec_lzma_direct (UInt32 out, UInt32 copied, UInt32 len)
+{
+    Byte *ring = lzmadec.dic;
+    UInt32 size = dBS;		/* dBS is dicBufSize, which is changed below */
+    UInt32 pos = lzmadec.dicPos;
+    UInt64 base = dFP;
+    Byte *vdic = (Byte *)out - size;
+    UInt32 start = size, end = size + len;
+    UInt32 n, t;
+
+    /* vdic[] holds the last SIZE bytes of output, as dic[] does */
+    lzmadec.dic = vdic;
+    lzmadec.dicBufSize = end;
+    lzmadec.dicPos = start;
+    dFP = base + pos - size;
+
+    while (lzmadec.dicPos < end)
+    {
+	SizeT inSizeCur;
+	UInt32 dicPos = lzmadec.dicPos, limit = end, left;
+	ELzmaStatus status;
+
+	/* stop where a seek index point is due */
+	left = lzma_index_left (dFP + dicPos);
+	if (left && limit - dicPos > left)
+	    limit = dicPos + left;
+
+	if (lzmadec.inpPos == lzmadec.inpSize)
+	{
+	    UInt32 inTxCur = (filemax-filepos<lzmadec.inpBufSize)?filemax-filepos:lzmadec.inpBufSize;
+	    lzmadec.inpFilePos = filepos;
+	    lzmadec.inpPos = 0;
+	    lzmadec.inpSize = grub_read((UInt32)(lzmadec.inp), inTxCur, 0xedde0d90);
+	}
+	inSizeCur = lzmadec.inpSize - lzmadec.inpPos;
+	status = LZMA_STATUS_NOT_SPECIFIED;
+	LzmaDec_DecodeToDic (&lzmadec, limit, lzmadec.inp + lzmadec.inpPos,
+			&inSizeCur, LZMA_FINISH_ANY, &status);
+	lzmadec.inpPos += inSizeCur;
+	if (inSizeCur == 0 && lzmadec.dicPos == dicPos)
+	    break;
+	lzma_index_add ();
+	if (((lzmadec.dicPos - start) ^ (dicPos - start)) & ~0x7FFFFFUL)
+	    grub_printf("\r [%ldM/%ldM]", (UInt64)(copied + lzmadec.dicPos - start) >> 20, (UInt64)(copied + len) >> 20);
+    }
+
+    /* refill the ring from the last SIZE bytes of output */
+    end = lzmadec.dicPos;
+    n = end - start;
+    t = (pos + n) % size;
+    grub_memmove (ring, vdic + end - t, t);
+    grub_memmove (ring + t, vdic + end - size, size - t);
+
+    lzmadec.dic = ring;
+    lzmadec.dicBufSize = size;
+    lzmadec.dicPos = t;
+    dFP = base + pos + n - t;
+    return n;
+}
+
 int
 dec_lzma_open (void)
 // return 1=success or 0=failure
@@ -1218,6 +1519,7 @@ dec_lzma_open (void)
 			lzmadec.inpPos = 0;
 			lzmadec.inpSize = 0;
 			LzmaDec_Init(&lzmadec);
+			lzma_index_attach (header);
 			decomp_type = DECOMP_TYPE_LZMA;
 			compressed_file = 1;
 			cfm = filemax; filemax = ufm;
@@ -1296,10 +1598,10 @@ dec_lzma_read (unsigned long long buf, unsigned long long len, unsigned long wri
      *   uncompressed_data [dFP ... dFP+dicPos-1].
      * When dFP>0,
      *   dic[dicPos ... dBS-1] contains 
-     *   uncompressed_data [dFP-dBS+dFP ... dFP-1]
+     *   uncompressed_data [dFP-dBS+dicPos ... dFP-1]
      */
     /* do we reset decompression to the beginning of the file? */
-    if (dFP && (ufp < dFP - dBS + dFP))
+    if (! lzma_index_seek (ufp) && dFP && (ufp < dFP - dBS + lzmadec.dicPos))
     {
 	LzmaDec_Init (&lzmadec);
 	filepos = 13;
@@ -1368,6 +1670,19 @@ dec_lzma_read (unsigned long long buf, unsigned long long len, unsigned long wri
 		break;
 	}
 	/* All existing wanted data from dic have been copied. We will add more data to dic. */
+	if (buf && outSkip == lzmadec.dicPos && lzma_direct_ok (buf, outTx, len))
+	{
+	    UInt32 outTxCur = dec_lzma_direct ((UInt32)buf, (UInt32)outTx,
+				(len > 0x80000000ULL) ? 0x80000000UL : (UInt32)len);
+	    if (outTxCur == 0)
+		break;
+	    buf += outTxCur;
+	    outTx += outTxCur;
+	    ufp += outTxCur;
+	    len -= outTxCur;
+	    outSkip = ufp - dFP;
+	    continue;
+	}
 	/* Read more input if there is no unprocessed input left. */
 	if (lzmadec.inpPos == lzmadec.inpSize)
 	{
@@ -1386,6 +1701,7 @@ dec_lzma_read (unsigned long long buf, unsigned long long len, unsigned long wri
 	if (lzmadec.dicPos == dBS)
 	{
 	    lzmadec.dicPos = 0;
+	    dFP += dBS;
 	//    if (outSkip < dBS)
 	//	grub_printf ("\noutSkip(=%X) < dBS(=%X)\n", outSkip, dBS);
 	    outSkip -= dBS;
@@ -1393,6 +1709,13 @@ dec_lzma_read (unsigned long long buf, unsigned long long len, unsigned long wri
 	dicPos = lzmadec.dicPos;
 	dicLimit = (dBS < dicPos + len) ?
 		    dBS : dicPos + len;
+	/* stop where a seek index point is due */
+	{
+	    UInt32 left = lzma_index_left (dFP + dicPos);
+
+	    if (left && dicLimit - dicPos > left)
+		dicLimit = dicPos + left;
+	}
 
 	/* Do decompression. */
 	//grub_printf ("DecodeToDic dicPos=%X limit=%X inPos=%X inSize=%X ",
@@ -1405,6 +1728,7 @@ dec_lzma_read (unsigned long long buf, unsigned long long len, unsigned long wri
 	//grub_printf ("->%X\n", inSizeCur);
 	//getkey();
 	lzmadec.inpPos += inSizeCur;
+	lzma_index_add ();
 	if (inSizeCur == 0 && lzmadec.dicPos == dicPos)
 	{
 	    /* Error */
@@ -1439,4 +1763,401 @@ dec_lzma_read (unsigned long long buf, unsigned long long len, unsigned long wri
 #undef dFP
 #undef dBS
 
+/* -------------------------------------------------------------------------- */
+
+/*
+ *  Memory-to-memory decoding of whole blocks (squashfs), using a decoder
+ *  instance of its own so that an open .lzma file is not disturbed.
+ *  The output buffer is the dictionary, so no data is copied.
+ */
+
+static CLzmaDec lzmabuf;
+static UInt32 lzmabuf_probs_size;
+
+static int
+lzmabuf_set_props (Byte d)
+{
+  UInt32 numProbs;
+
+  if (d >= 9 * 5 * 5)
+    return 0;
+  lzmabuf.prop.lc = d % 9; d /= 9;
+  lzmabuf.prop.lp = d % 5;
+  lzmabuf.prop.pb = d / 5;
+  numProbs = LzmaProps_GetNumProbs (&lzmabuf.prop);
+  if (numProbs > lzmabuf_probs_size)
+    {
+      if (lzmabuf.probs)
+	grub_free (lzmabuf.probs);
+      lzmabuf.probs = (UIntLzmaProb *) grub_malloc (numProbs * sizeof (UIntLzmaProb));
+      if (! lzmabuf.probs)
+	{
+	  lzmabuf_probs_size = 0;
+	  return 0;
+	}
+      lzmabuf_probs_size = numProbs;
+    }
+  lzmabuf.numProbs = numProbs;
+  return 1;
+}
+
+static void
+lzmabuf_init (Byte *dst, SizeT dst_len, UInt32 dicSize)
+{
+  lzmabuf.dic = dst;
+  lzmabuf.dicBufSize = dst_len;
+  lzmabuf.prop.dicSize = dicSize;
+  LzmaDec_Init (&lzmabuf);
+}
+
+/* Decode an lzma-alone stream (13-byte header) at SRC into DST.
+   Return the decoded size, or 0 with errnum set.  */
+unsigned long
+lzma_decode_buffer (unsigned char *dst, unsigned long dst_len, const unsigned char *src, unsigned long src_len)
+{
+  SizeT inSize;
+  ELzmaStatus status;
+  UInt64 size;
+
+  if (src_len < 13 || ! lzmabuf_set_props (src[0]))
+    goto fail;
+  size = ReadUnalignedUInt64 (src + 5);
+  if (size < dst_len)
+    dst_len = size;
+  lzmabuf_init (dst, dst_len, ReadUnalignedUInt32 (src + 1));
+
+  inSize = src_len - 13;
+  if (LzmaDec_DecodeToDic (&lzmabuf, dst_len, src + 13, &inSize, LZMA_FINISH_ANY, &status) != SZ_OK)
+    goto fail;
+  return lzmabuf.dicPos;
+
+fail:
+  errnum = ERR_BAD_GZIP_DATA;
+  return 0;
+}
+
+/* Decode LZMA2 chunks at SRC into DST up to the end marker. DICT_PROP is
+   the dictionary size byte from the filter properties. *SRC_LEN is set
+   to the number of input bytes used. Return the decoded size, or 0 with
+   errnum set.  */
+unsigned long
+lzma2_decode_buffer (unsigned char *dst, unsigned long dst_len, const unsigned char *src, unsigned long *src_len, unsigned char dict_prop)
+{
+  const Byte *p = src, *end = src + *src_len;
+  UInt32 dicSize;
+  int need_dic = 1, need_props = 1;
+
+  if (dict_prop > 40)
+    goto fail;
+  dicSize = (dict_prop == 40) ? 0xFFFFFFFF : ((UInt32)(2 | (dict_prop & 1)) << (dict_prop / 2 + 11));
+  lzmabuf_init (dst, dst_len, dicSize);
+
+  while (p < end)
+    {
+      Byte control = *p++;
+      UInt32 unpacked, packed;
+
+      if (control == 0)
+	{
+	  *src_len = p - src;
+	  return lzmabuf.dicPos;
+	}
+
+      if (control < 0x80)
+	{
+	  /* stored chunk, 1 = with dictionary reset */
+	  if (control > 2 || end - p < 2)
+	    goto fail;
+	  if (control == 1)
+	    {
+	      lzmabuf.processedPos = 0;
+	      lzmabuf.checkDicSize = 0;
+	      need_dic = 0;
+	    }
+	  else if (need_dic)
+	    goto fail;
+	  unpacked = ((UInt32)p[0] << 8 | p[1]) + 1;
+	  p += 2;
+	  if ((UInt32)(end - p) < unpacked || dst_len - lzmabuf.dicPos < unpacked)
+	    goto fail;
+	  memcpy (dst + lzmabuf.dicPos, p, unpacked);
+	  lzmabuf.dicPos += unpacked;
+	  if (lzmabuf.checkDicSize == 0 && dicSize - lzmabuf.processedPos <= unpacked)
+	    lzmabuf.checkDicSize = dicSize;
+	  lzmabuf.processedPos += unpacked;
+	  p += unpacked;
+	  continue;
+	}
+
+      /* LZMA chunk: bits 5-6 are the reset mode */
+      if (end - p < 4)
+	goto fail;
+      unpacked = ((UInt32)(control & 0x1F) << 16 | (UInt32)p[0] << 8 | p[1]) + 1;
+      packed = ((UInt32)p[2] << 8 | p[3]) + 1;
+      p += 4;
+      switch ((control >> 5) & 3)
+	{
+	case 3:
+	  lzmabuf.processedPos = 0;
+	  lzmabuf.checkDicSize = 0;
+	  need_dic = 0;
+	  /* fall through */
+	case 2:
+	  if (p == end || ! lzmabuf_set_props (*p++)
+	      || lzmabuf.prop.lc + lzmabuf.prop.lp > 4)
+	    goto fail;
+	  need_props = 0;
+	  /* fall through */
+	case 1:
+	  lzmabuf.needInitState = 1;
+	  break;
+	}
+      if (need_dic || need_props)
+	goto fail;
+      lzmabuf.needFlush = 1;
+      lzmabuf.remainLen = 0;
+      lzmabuf.tempBufSize = 0;
+
+      if ((UInt32)(end - p) < packed || dst_len - lzmabuf.dicPos < unpacked)
+	goto fail;
+      {
+	SizeT inSize = packed;
+	UInt32 dicLimit = lzmabuf.dicPos + unpacked;
+	ELzmaStatus status;
+
+	if (LzmaDec_DecodeToDic (&lzmabuf, dicLimit, p, &inSize, LZMA_FINISH_END, &status) != SZ_OK
+	    || lzmabuf.dicPos != dicLimit || inSize != packed)
+	  goto fail;
+      }
+      p += packed;
+    }
+
+fail:
+  errnum = ERR_BAD_GZIP_DATA;
+  return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/*
+ *  LZMA2 as a stream, for dec_xz.c. Unlike lzma2_decode_buffer, input
+ *  comes in pieces that may split a chunk header, and the dictionary is a
+ *  ring buffer of the caller's that wraps like dic of dec_lzma_read.
+ *  Derived from Lzma2Dec.c of the LZMA SDK.
+ */
+
+enum
+{
+  LZMA2_CONTROL, LZMA2_UNPACK0, LZMA2_UNPACK1, LZMA2_PACK0, LZMA2_PACK1,
+  LZMA2_PROP, LZMA2_DATA, LZMA2_DATA_CONT, LZMA2_FINISHED
+};
+
+/* lc + lp is at most 4 in LZMA2 */
+#define LZMA2_PROBS_MAX ((UInt32)LZMA_BASE_SIZE + (LZMA_LIT_SIZE << 4))
+
+static CLzmaDec lzma2dec;
+static struct
+{
+  unsigned state;
+  Byte control;
+  UInt32 unpack, pack;
+  int need_dic, need_props;
+} lzma2;
+
+/* Start a new LZMA2 stream into the ring DIC of DIC_SIZE bytes, which
+   must cover the distances the stream uses. Return 0 with errnum set
+   if out of memory.  */
+int
+lzma2_stream_init (unsigned char *dic, unsigned long dic_size)
+{
+  if (! lzma2dec.probs)
+    {
+      lzma2dec.probs = (UIntLzmaProb *) grub_malloc (LZMA2_PROBS_MAX * sizeof (UIntLzmaProb));
+      if (! lzma2dec.probs)
+	return 0;
+      lzma2dec.numProbs = LZMA2_PROBS_MAX;
+    }
+  lzma2dec.dic = dic;
+  lzma2dec.dicBufSize = dic_size;
+  lzma2dec.prop.dicSize = dic_size;
+  LzmaDec_Init (&lzma2dec);
+  lzma2.state = LZMA2_CONTROL;
+  lzma2.need_dic = 1;
+  lzma2.need_props = 1;
+  return 1;
+}
+
+void
+lzma2_stream_free (void)
+{
+  if (lzma2dec.probs) { grub_free (lzma2dec.probs); lzma2dec.probs = 0; }
+}
+
+/* One byte of a chunk header. Return 0 if it is invalid.  */
+static int
+lzma2_header_byte (Byte b)
+{
+  switch (lzma2.state)
+    {
+    case LZMA2_CONTROL:
+      lzma2.control = b;
+      if (b == 0)
+	{
+	  lzma2.state = LZMA2_FINISHED;
+	  return 1;
+	}
+      if (b == 1 || b >= 0xE0)
+	{
+	  /* dictionary reset, after which new properties are due */
+	  lzma2dec.processedPos = 0;
+	  lzma2dec.checkDicSize = 0;
+	  lzma2.need_dic = 0;
+	  lzma2.need_props = 1;
+	}
+      else if (lzma2.need_dic)
+	return 0;
+      if (b < 0x80)
+	{
+	  if (b > 2)
+	    return 0;
+	  lzma2.unpack = 0;
+	}
+      else
+	{
+	  if (b < 0xC0 && lzma2.need_props)
+	    return 0;
+	  lzma2.unpack = (UInt32)(b & 0x1F) << 16;
+	}
+      lzma2.state = LZMA2_UNPACK0;
+      return 1;
+    case LZMA2_UNPACK0:
+      lzma2.unpack |= (UInt32)b << 8;
+      lzma2.state = LZMA2_UNPACK1;
+      return 1;
+    case LZMA2_UNPACK1:
+      lzma2.unpack = (lzma2.unpack | b) + 1;
+      lzma2.state = (lzma2.control < 0x80) ? LZMA2_DATA : LZMA2_PACK0;
+      return 1;
+    case LZMA2_PACK0:
+      lzma2.pack = (UInt32)b << 8;
+      lzma2.state = LZMA2_PACK1;
+      return 1;
+    case LZMA2_PACK1:
+      lzma2.pack = (lzma2.pack | b) + 1;
+      lzma2.state = (lzma2.control >= 0xC0) ? LZMA2_PROP : LZMA2_DATA;
+      return 1;
+    case LZMA2_PROP:
+      if (b >= 9 * 5 * 5)
+	return 0;
+      lzma2dec.prop.lc = b % 9; b /= 9;
+      lzma2dec.prop.lp = b % 5;
+      lzma2dec.prop.pb = b / 5;
+      if (lzma2dec.prop.lc + lzma2dec.prop.lp > 4)
+	return 0;
+      lzma2.need_props = 0;
+      lzma2.state = LZMA2_DATA;
+      return 1;
+    }
+  return 0;
+}
+
+/* Decode from SRC, *SRC_LEN bytes, to the ring at *DIC_POS, but not past
+   DIC_LIMIT, which is at most the ring size. *SRC_LEN and *DIC_POS are
+   updated with what was done. Return 1 at the end marker, 0 if more
+   input or room is needed, or -1 on bad data.  */
+int
+lzma2_stream_decode (unsigned long *dic_pos, unsigned long dic_limit, const unsigned char *src, unsigned long *src_len)
+{
+  UInt32 inSize = *src_len;
+
+  *src_len = 0;
+  lzma2dec.dicPos = *dic_pos;
+  while (lzma2.state != LZMA2_FINISHED)
+    {
+      UInt32 outCur;
+
+      if (lzma2.state < LZMA2_DATA)
+	{
+	  if (! inSize)
+	    break;
+	  if (! lzma2_header_byte (*src))
+	    return -1;
+	  src++;
+	  inSize--;
+	  (*src_len)++;
+	  continue;
+	}
+
+      if (lzma2.state == LZMA2_DATA)
+	{
+	  /* every chunk starts a new range coder */
+	  lzma2dec.needFlush = 1;
+	  lzma2dec.remainLen = 0;
+	  lzma2dec.tempBufSize = 0;
+	  if (lzma2.control >= 0xA0)
+	    lzma2dec.needInitState = 1;
+	  lzma2.state = LZMA2_DATA_CONT;
+	}
+
+      outCur = dic_limit - lzma2dec.dicPos;
+      if (outCur > lzma2.unpack)
+	outCur = lzma2.unpack;
+      if (! outCur && lzma2.unpack)
+	break;
+
+      if (lzma2.control < 0x80)
+	{
+	  /* stored chunk */
+	  if (outCur > inSize)
+	    outCur = inSize;
+	  if (! outCur)
+	    break;
+	  memcpy (lzma2dec.dic + lzma2dec.dicPos, src, outCur);
+	  if (lzma2dec.checkDicSize == 0 && lzma2dec.prop.dicSize - lzma2dec.processedPos <= outCur)
+	    lzma2dec.checkDicSize = lzma2dec.prop.dicSize;
+	  lzma2dec.processedPos += outCur;
+	  lzma2dec.dicPos += outCur;
+	  src += outCur;
+	  inSize -= outCur;
+	  (*src_len) += outCur;
+	  lzma2.unpack -= outCur;
+	  if (! lzma2.unpack)
+	    lzma2.state = LZMA2_CONTROL;
+	  continue;
+	}
+
+      {
+	SizeT inCur = (inSize < lzma2.pack) ? inSize : lzma2.pack;
+	UInt32 dicPos = lzma2dec.dicPos;
+	ELzmaStatus status;
+
+	if (LzmaDec_DecodeToDic (&lzma2dec, dicPos + outCur, src, &inCur,
+		(outCur == lzma2.unpack) ? LZMA_FINISH_END : LZMA_FINISH_ANY, &status) != SZ_OK)
+	  return -1;
+	src += inCur;
+	inSize -= inCur;
+	(*src_len) += inCur;
+	lzma2.pack -= inCur;
+	lzma2.unpack -= lzma2dec.dicPos - dicPos;
+	if (! lzma2.unpack)
+	  {
+	    /* the chunk has to end with its input */
+	    if (status != LZMA_STATUS_MAYBE_FINISHED_WITHOUT_MARK || lzma2.pack)
+	      return -1;
+	    lzma2.state = LZMA2_CONTROL;
+	  }
+	else if (status == LZMA_STATUS_NEEDS_MORE_INPUT)
+	  {
+	    if (! lzma2.pack)
+	      return -1;
+	    break;
+	  }
+	else if (inCur == 0 && lzma2dec.dicPos == dicPos)
+	  break;
+      }
+    }
+  *dic_pos = lzma2dec.dicPos;
+  return lzma2.state == LZMA2_FINISHED;
+}
+
 #endif /* ! NO_DECOMPRESSION */
@@ -0,0 +1,354 @@
+/*
+ *  GRUB4DOS  --  GRand Unified Bootloader
+ *  Copyright (C) 1999  Free Software Foundation, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ *  Based on
+ *  - The QCOW2 Image Format, docs/interop/qcow2.txt of QEMU 8.0
+ */
+
+#include "shared.h"
+
+#ifndef NO_DECOMPRESSION
+
+#define QCOW2_MAGIC		0xFB494651	/* QFI\xfb */
+
+/* incompatible features we can read */
+#define QCOW2_INCOMPAT_COMPRESSION	8
+/* dirty and corrupt say the refcounts may be wrong; we do not use them */
+#define QCOW2_INCOMPAT_DIRTY		1
+#define QCOW2_INCOMPAT_CORRUPT		2
+
+#define QCOW2_COMPRESSION_DEFLATE	0
+#define QCOW2_COMPRESSION_ZSTD		1
+
+#define QCOW2_OFLAG_COMPRESSED	(1ULL << 62)
+#define QCOW2_OFLAG_ZERO	1ULL
+#define QCOW2_OFFSET_MASK	0x00FFFFFFFFFFFE00ULL
+
+/* L2 tables kept in memory, least recently used replaced. */
+#define QCOW2_L2_SLOTS		16
+#define QCOW2_L2_CACHE_MAX	0x100000
+
+typedef struct QCOW2Header {
+	grub_u32_t magic;
+	grub_u32_t version;
+	grub_u64_t backingFileOffset;
+	grub_u32_t backingFileSize;
+	grub_u32_t clusterBits;
+	grub_u64_t size;
+	grub_u32_t cryptMethod;
+	grub_u32_t l1Size;
+	grub_u64_t l1TableOffset;
+	grub_u64_t refcountTableOffset;
+	grub_u32_t refcountTableClusters;
+	grub_u32_t nbSnapshots;
+	grub_u64_t snapshotsOffset;
+	/* version 3 */
+	grub_u64_t incompatibleFeatures;
+	grub_u64_t compatibleFeatures;
+	grub_u64_t autoclearFeatures;
+	grub_u32_t refcountOrder;
+	grub_u32_t headerLength;
+	unsigned char compressionType;
+	unsigned char padding[7];
+} QCOW2Header;
+
+struct QCOW2CacheSlot {
+	grub_u64_t offset;	/* of the L2 table in the file, 0 if unused */
+	unsigned long lastUse;
+};
+
+typedef struct QCOW2FileControl {
+	unsigned long long cFileMax;
+	unsigned long long volumeSize;
+	unsigned int  clusterBits;
+	unsigned long clusterSize;
+	unsigned int  l2Bits;		/* log2 of the entries of an L2 table */
+	unsigned long l1Size;
+	grub_u64_t *l1Table;		/* in host byte order */
+	unsigned char compressionType;
+	unsigned char *l2Cache;		/* nSlots L2 tables */
+	unsigned long nSlots;
+	struct QCOW2CacheSlot slot[QCOW2_L2_SLOTS];
+	unsigned long useCount;
+	unsigned char *cluster;		/* the last compressed cluster, inflated */
+	grub_u64_t clusterEntry;	/* its L2 entry, 0 if none */
+	unsigned char *packed;		/* its compressed data */
+} QCOW2FileControl;
+
+QCOW2FileControl *qcow2fc;
+
+grub_u32_t bswap_32(grub_u32_t *x);
+void bswap_64(grub_u64_t *x);
+
+void
+dec_qcow2_close(void)
+{
+	if (qcow2fc) {
+		if (qcow2fc->l1Table) {
+			grub_free(qcow2fc->l1Table);
+		}
+		if (qcow2fc->l2Cache) {
+			grub_free(qcow2fc->l2Cache);
+		}
+		if (qcow2fc->cluster) {
+			grub_free(qcow2fc->cluster);
+		}
+		if (qcow2fc->packed) {
+			grub_free(qcow2fc->packed);
+		}
+		grub_free(qcow2fc);
+		qcow2fc = 0;
+	}
+}
+
+int
+dec_qcow2_open(void)
+/* return 1=success or 0=failure */
+{
+	QCOW2Header header;
+	unsigned long i;
+
+	if (filemax < 512) return 0;//file is to small
+	/* Now it does not support openning more than 1 file at a time. */
+	dec_qcow2_close();
+
+	memset(&header, 0, sizeof(header));
+	if (grub_read((unsigned long)&header, sizeof(header), GRUB_READ) != sizeof(header)
+	    || header.magic != QCOW2_MAGIC)
+		goto quit;
+
+	bswap_32(&header.version);
+	bswap_64(&header.backingFileOffset);
+	bswap_32(&header.clusterBits);
+	bswap_64(&header.size);
+	bswap_32(&header.cryptMethod);
+	bswap_32(&header.l1Size);
+	bswap_64(&header.l1TableOffset);
+	if (header.version == 3) {
+		bswap_64(&header.incompatibleFeatures);
+		bswap_32(&header.headerLength);
+	} else {
+		header.incompatibleFeatures = 0;
+		header.headerLength = 72;
+	}
+	if ((header.version != 2 && header.version != 3)
+	    || header.clusterBits < 9 || header.clusterBits > 21
+	    || header.cryptMethod || !header.size
+	    || (header.incompatibleFeatures & ~(unsigned long long)(QCOW2_INCOMPAT_COMPRESSION | QCOW2_INCOMPAT_DIRTY | QCOW2_INCOMPAT_CORRUPT)))
+		/* encrypted, external data file, extended L2 entries or unknown */
+		goto quit;
+	if (header.backingFileOffset) {
+		printf_warning("\nWarning: qcow2 with a backing file is not supported.\n");
+		goto quit;
+	}
+	if (!(header.incompatibleFeatures & QCOW2_INCOMPAT_COMPRESSION) || header.headerLength <= 104)
+		header.compressionType = QCOW2_COMPRESSION_DEFLATE;
+	if (header.compressionType > QCOW2_COMPRESSION_ZSTD)
+		goto quit;
+
+	qcow2fc = grub_malloc(sizeof(QCOW2FileControl));
+	if (!qcow2fc)
+		goto quit;
+	memset(qcow2fc, 0, sizeof(QCOW2FileControl));
+	qcow2fc->volumeSize = header.size;
+	qcow2fc->clusterBits = header.clusterBits;
+	qcow2fc->clusterSize = 1UL << header.clusterBits;
+	qcow2fc->l2Bits = header.clusterBits - 3;
+	qcow2fc->compressionType = header.compressionType;
+	qcow2fc->l1Size = header.l1Size;
+	/* the L1 table must cover the disk */
+	if (((header.size - 1) >> (qcow2fc->clusterBits + qcow2fc->l2Bits)) >= header.l1Size
+	    || header.l1Size > 0x2000000)
+		goto fail;
+
+	qcow2fc->l1Table = grub_malloc(header.l1Size * 8);
+	if (!qcow2fc->l1Table)
+		goto fail;
+	filepos = header.l1TableOffset;
+	if (grub_read((unsigned long)qcow2fc->l1Table, header.l1Size * 8, GRUB_READ) != header.l1Size * 8)
+		goto fail;
+	for (i = 0; i < header.l1Size; i++)
+		bswap_64(&qcow2fc->l1Table[i]);
+
+	qcow2fc->nSlots = QCOW2_L2_CACHE_MAX >> qcow2fc->clusterBits;
+	if (qcow2fc->nSlots > QCOW2_L2_SLOTS)
+		qcow2fc->nSlots = QCOW2_L2_SLOTS;
+	if (qcow2fc->nSlots < 2)
+		qcow2fc->nSlots = 2;
+	qcow2fc->l2Cache = grub_malloc(qcow2fc->nSlots << qcow2fc->clusterBits);
+	if (!qcow2fc->l2Cache)
+		goto fail;
+
+	qcow2fc->cFileMax = filemax;
+	compressed_file = 1;
+	decomp_type = DECOMP_TYPE_QCOW2;
+	filemax = qcow2fc->volumeSize;
+	goto quit;
+fail:
+	dec_qcow2_close();
+quit:
+	filepos = 0;
+
+	errnum = ERR_NONE;
+	return compressed_file;
+}
+
+/* The L2 entry of guest cluster CLUSTER in host byte order, 0 if it is
+   not allocated. Return -1ULL if the L2 table cannot be read. */
+static grub_u64_t
+qcow2_l2_entry(unsigned long cluster)
+{
+	unsigned long l1Index = cluster >> qcow2fc->l2Bits;
+	unsigned long i, victim = 0;
+	grub_u64_t l2Offset, entry, *table;
+
+	if (l1Index >= qcow2fc->l1Size)
+		return 0;
+	l2Offset = qcow2fc->l1Table[l1Index] & QCOW2_OFFSET_MASK;
+	if (!l2Offset)
+		return 0;
+	for (i = 0; i < qcow2fc->nSlots; i++) {
+		if (qcow2fc->slot[i].offset == l2Offset)
+			break;
+		if (qcow2fc->slot[i].lastUse < qcow2fc->slot[victim].lastUse)
+			victim = i;
+	}
+	if (i == qcow2fc->nSlots) {
+		i = victim;
+		qcow2fc->slot[i].offset = 0;
+		filepos = l2Offset;
+		if (grub_read((unsigned long)(qcow2fc->l2Cache + (i << qcow2fc->clusterBits)), qcow2fc->clusterSize, GRUB_READ) != qcow2fc->clusterSize)
+			return -1ULL;
+		qcow2fc->slot[i].offset = l2Offset;
+	}
+	qcow2fc->slot[i].lastUse = ++qcow2fc->useCount;
+	table = (grub_u64_t *)(qcow2fc->l2Cache + (i << qcow2fc->clusterBits));
+	entry = table[cluster & ((1UL << qcow2fc->l2Bits) - 1)];
+	bswap_64(&entry);
+	return entry;
+}
+
+/* Inflate the compressed cluster of L2 entry ENTRY to qcow2fc->cluster,
+   unless it is there already. */
+static int
+qcow2_inflate(grub_u64_t entry)
+{
+	/* the sector count sits above the offset */
+	unsigned int x = 62 - (qcow2fc->clusterBits - 8);
+	unsigned long long offset = entry & ((1ULL << x) - 1);
+	unsigned long len = (((unsigned long)(entry >> x) & ((1UL << (qcow2fc->clusterBits - 8)) - 1)) + 1) * 512
+			    - ((unsigned long)offset & 511);
+	unsigned long n;
+
+	if (qcow2fc->clusterEntry == entry)
+		return 1;
+	qcow2fc->clusterEntry = 0;
+	if (!qcow2fc->cluster) {
+		qcow2fc->cluster = grub_malloc(qcow2fc->clusterSize);
+		/* qemu keeps a cluster that does not shrink uncompressed, but
+		   the sector count may reach one past it */
+		qcow2fc->packed = grub_malloc(qcow2fc->clusterSize + 512);
+		if (!qcow2fc->cluster || !qcow2fc->packed)
+			return 0;
+	}
+	if (len > qcow2fc->clusterSize + 512)
+		return !(errnum = ERR_BAD_GZIP_DATA);
+	if (offset + len > qcow2fc->cFileMax)
+		len = (unsigned long)(qcow2fc->cFileMax - offset);
+	filepos = offset;
+	if (grub_read((unsigned long)qcow2fc->packed, len, GRUB_READ) != len)
+		return 0;
+	if (qcow2fc->compressionType == QCOW2_COMPRESSION_ZSTD)
+		n = zstd_decode_buffer(qcow2fc->cluster, qcow2fc->clusterSize, qcow2fc->packed, len);
+	else
+		n = inflate_buffer(qcow2fc->cluster, qcow2fc->clusterSize, qcow2fc->packed, len, 0);
+	if (n != qcow2fc->clusterSize) {
+		if (!errnum)
+			errnum = ERR_BAD_GZIP_DATA;
+		return 0;
+	}
+	qcow2fc->clusterEntry = entry;
+	return 1;
+}
+
+unsigned long long
+dec_qcow2_read(unsigned long long buf, unsigned long long len, unsigned long write)
+{
+	unsigned long long ret = 0, pos = filepos, rem;
+
+	if (write == GRUB_WRITE) {
+		errnum = ERR_WRITE_GZIP_FILE;
+		return 0;
+	}
+	compressed_file = 0;
+	filemax = qcow2fc->cFileMax;
+	if (pos > qcow2fc->volumeSize)
+		pos = qcow2fc->volumeSize;
+	if (len > qcow2fc->volumeSize - pos)
+		len = qcow2fc->volumeSize - pos;
+	errnum = ERR_NONE;
+	rem = len;
+	while (rem) {
+		unsigned long cluster = (unsigned long)(pos >> qcow2fc->clusterBits);
+		unsigned long offsetInCluster = (unsigned long)pos & (qcow2fc->clusterSize - 1);
+		unsigned long long txLen = qcow2fc->clusterSize - offsetInCluster;
+		grub_u64_t entry = qcow2_l2_entry(cluster);
+
+		if (txLen > rem)
+			txLen = rem;
+		if (entry == -1ULL)
+			break;
+		if (entry & QCOW2_OFLAG_COMPRESSED) {
+			if (!qcow2_inflate(entry & (QCOW2_OFLAG_COMPRESSED - 1)))
+				break;
+			grub_memmove64(buf, (unsigned long)(qcow2fc->cluster + offsetInCluster), txLen);
+		} else if ((entry & QCOW2_OFLAG_ZERO) || !(entry & QCOW2_OFFSET_MASK)) {
+			/* unallocated or zero cluster: no I/O */
+			grub_memset64(buf, 0, txLen);
+		} else {
+			unsigned long long data = entry & QCOW2_OFFSET_MASK;
+			unsigned long nc = 1;
+
+			/* the following clusters are next in the file: one read */
+			while (txLen < rem) {
+				grub_u64_t next = qcow2_l2_entry(cluster + nc);
+
+				if (next == -1ULL || (next & (QCOW2_OFLAG_COMPRESSED | QCOW2_OFLAG_ZERO))
+				    || (next & QCOW2_OFFSET_MASK) != data + ((unsigned long long)nc << qcow2fc->clusterBits))
+					break;
+				txLen += (rem - txLen < qcow2fc->clusterSize) ? rem - txLen : qcow2fc->clusterSize;
+				nc++;
+			}
+			filepos = data + offsetInCluster;
+			if (grub_read(buf, txLen, GRUB_READ) != txLen)
+				break;
+		}
+		buf += txLen;
+		pos += txLen;
+		rem -= txLen;
+		ret += txLen;
+	}
+	filepos = pos;
+	compressed_file = 1;
+	filemax = qcow2fc->volumeSize;
+	return ret;
+}
+
+#endif /* ! NO_DECOMPRESSION */
@@ -24,6 +24,7 @@
  */
 
 #include "shared.h"
+#include "filesys.h"
 
 #ifndef NO_DECOMPRESSION
 
@@ -75,6 +76,30 @@ typedef struct VHDDynamicDiskHeader {
 
 typedef struct VHDFileControl VHDFileControl;
 
+/* Sector bitmaps of recently used blocks, least recently used replaced. */
+#define VHD_CACHE_SLOTS 16
+/* One read covers at most this many physically adjacent blocks. */
+#define VHD_SPAN_BLOCKS 4
+/* A differencing disk and its parents; the child is layer 0. */
+#define VHD_MAX_CHAIN 16
+/* Merged block map: the topmost layer holding the block, with
+   VHD_MAP_MIXED if a lower layer holds it too, or VHD_MAP_NONE. */
+#define VHD_MAP_MIXED 0x80
+#define VHD_MAP_NONE  0xFF
+#define VHD_PATH_MAX  512
+
+struct VHDCacheSlot {
+	unsigned long block;
+	unsigned long lastUse;
+};
+
+/* LEN bytes of the file at POS are at byte DISK of the drive. */
+struct VHDExtent {
+	unsigned long long pos;
+	unsigned long long disk;
+	unsigned long long len;
+};
+
 struct VHDFileControl {
 	unsigned long long cFileMax;
 	unsigned long long volumeSize;
@@ -83,16 +108,25 @@ struct VHDFileControl {
 	unsigned long blockSize;
 	unsigned int  blockSizeLog2;
 	unsigned long batEntries;
-	unsigned long blockBitmapSize;
+	unsigned long blockBitmapSize;	/* rounded up to whole sectors */
 	unsigned char *blockAllocationTable;
-	unsigned char *blockBitmapAndData;
-	unsigned char *blockData;
-	unsigned long currentBlockOffset;
+	unsigned char *spanBuffer;	/* VHD_SPAN_BLOCKS bitmaps and blocks */
+	unsigned char *bitmaps;		/* VHD_CACHE_SLOTS bitmaps */
+	struct VHDCacheSlot slot[VHD_CACHE_SLOTS];
+	unsigned long useCount;
+	/* Files of a chain are read from the drive by their extents, since
+	   only one file can be open. A single VHD is read with grub_read. */
+	struct VHDExtent *extents;
+	unsigned long nExtents, maxExtents;
+	unsigned long drive;
+	unsigned int  sectorBits;
+	unsigned char *blockLayer;	/* layer 0 only: the merged block map */
 	struct VHDFileControl *parentVHDFC;
 };
 
 extern unsigned long map_image_HPC;
 extern unsigned long map_image_SPT;
+extern int rawread_ignore_memmove_overflow;
 
 VHDFileControl *vhdfc;
 
@@ -101,7 +135,21 @@ grub_u32_t bswap_32(grub_u32_t *x);
 void bswap_64(grub_u64_t *x);
 void vhd_footer_in(VHDFooter *footer);
 void vhd_header_in(VHDDynamicDiskHeader *header);
-
+static VHDFileControl *vhd_layer(unsigned int n);
+static void vhd_list_func(unsigned long long sector, unsigned long offset, unsigned long long length);
+static int vhd_list_extents(VHDFileControl *fc);
+static int vhd_file_read(VHDFileControl *fc, unsigned long long pos, unsigned long long buf, unsigned long long len);
+static int vhd_layer_init(VHDFileControl *fc, VHDFooter *footer, VHDDynamicDiskHeader *header);
+static int vhd_open_file(const char *path);
+static int vhd_parent_path(VHDFileControl *fc, VHDDynamicDiskHeader *header, int which, const char *child, char *path);
+static int vhd_open_parents(VHDDynamicDiskHeader *header);
+static int vhd_has_block(VHDFileControl *fc, unsigned long block);
+static int vhd_build_map(void);
+static grub_u32_t vhd_bat(VHDFileControl *fc, unsigned long block);
+static unsigned char *vhd_bitmap(VHDFileControl *fc, unsigned long block, grub_u32_t lba, const unsigned char *from);
+static int vhd_copy_block(VHDFileControl *fc, unsigned long long buf, const unsigned char *map, unsigned long off, unsigned long len, const unsigned char *src, unsigned long long data);
+static int vhd_sector_layer(unsigned long block, unsigned long sector, unsigned int first);
+static int vhd_copy_mixed(unsigned long long buf, unsigned long block, unsigned int first, unsigned long off, unsigned long len);
 unsigned int log2pot32(unsigned long x) {
 	// x must be power of two
 	return ((x & 0xFFFF0000) ? 16 : 0) | ((x & 0xFF00FF00) ? 8 : 0) | ((x & 0xF0F0F0F0) ? 4 : 0) | ((x & 0xCCCCCCCC) ? 2 : 0) | ((x & 0xAAAAAAAA) ? 1 : 0);
@@ -150,22 +198,380 @@ void vhd_header_in(VHDDynamicDiskHeader *header)
 }
 
 
+
 void
 dec_vhd_close(void)
 {
 	if (vhdfc) {
+		map_image_HPC = 0;
+		map_image_SPT = 0;
+	}
+	while (vhdfc) {
+		VHDFileControl *parent = vhdfc->parentVHDFC;
+
 		if (vhdfc->blockAllocationTable) {
 			grub_free(vhdfc->blockAllocationTable);
 		}
-		if (vhdfc->blockBitmapAndData) {
-			grub_free(vhdfc->blockBitmapAndData);
+		if (vhdfc->spanBuffer) {
+			grub_free(vhdfc->spanBuffer);
+		}
+		if (vhdfc->bitmaps) {
+			grub_free(vhdfc->bitmaps);
+		}
+		if (vhdfc->extents) {
+			grub_free(vhdfc->extents);
+		}
+		if (vhdfc->blockLayer) {
+			grub_free(vhdfc->blockLayer);
 		}
 		grub_free(vhdfc);
-		map_image_HPC = 0;
-		map_image_SPT = 0;
+		vhdfc = parent;
 	}
 }
 
+/* Layer N of the chain. */
+static VHDFileControl *
+vhd_layer(unsigned int n)
+{
+	VHDFileControl *fc = vhdfc;
+
+	while (n--)
+		fc = fc->parentVHDFC;
+	return fc;
+}
+
+static VHDFileControl *vhd_listing;
+
+/* disk_read_hook while listing the extents of vhd_listing */
+static void
+vhd_list_func(unsigned long long sector, unsigned long offset, unsigned long long length)
+{
+	VHDFileControl *fc = vhd_listing;
+	unsigned long long disk = (sector << fc->sectorBits) + offset;
+	struct VHDExtent *e;
+
+	if (!fc->extents)
+		return;
+	if (fc->nExtents) {
+		e = &fc->extents[fc->nExtents - 1];
+		if (e->disk + e->len == disk) {
+			e->len += length;
+			return;
+		}
+	}
+	if (fc->nExtents == fc->maxExtents) {
+		e = grub_malloc(fc->maxExtents * 2 * sizeof(struct VHDExtent));
+		if (e)
+			memmove(e, fc->extents, fc->nExtents * sizeof(struct VHDExtent));
+		grub_free(fc->extents);
+		fc->extents = e;
+		fc->maxExtents *= 2;
+		if (!e)
+			return;
+	}
+	e = &fc->extents[fc->nExtents];
+	e->pos = fc->nExtents ? e[-1].pos + e[-1].len : 0;
+	e->disk = disk;
+	e->len = length;
+	fc->nExtents++;
+}
+
+/* Note where the file now open lies on its drive. */
+static int
+vhd_list_extents(VHDFileControl *fc)
+{
+	unsigned long long n;
+
+	fc->drive = current_drive;
+	fc->sectorBits = log2pot32(buf_geom.sector_size);
+	fc->nExtents = 0;
+	fc->maxExtents = 16;
+	fc->extents = grub_malloc(fc->maxExtents * sizeof(struct VHDExtent));
+	if (!fc->extents)
+		return 0;
+	vhd_listing = fc;
+	filepos = 0;
+	rawread_ignore_memmove_overflow = 1;
+	disk_read_hook = vhd_list_func;
+	n = grub_read(0, -1ULL, GRUB_LISTBLK);
+	disk_read_hook = 0;
+	rawread_ignore_memmove_overflow = 0;
+	return fc->extents && fc->nExtents && n >= filemax
+	       && fc->extents[fc->nExtents - 1].pos + fc->extents[fc->nExtents - 1].len >= filemax;
+}
+
+/* Read LEN bytes at POS of the file of FC to BUF. */
+static int
+vhd_file_read(VHDFileControl *fc, unsigned long long pos, unsigned long long buf, unsigned long long len)
+{
+	if (!fc->extents) {
+		filepos = pos;
+		return grub_read(buf, len, GRUB_READ) == len;
+	}
+	while (len) {
+		unsigned long lo = 0, hi = fc->nExtents;
+		unsigned long long n, disk;
+		struct VHDExtent *e;
+
+		while (hi - lo > 1) {
+			unsigned long mid = (lo + hi) >> 1;
+
+			if (fc->extents[mid].pos <= pos)
+				lo = mid;
+			else
+				hi = mid;
+		}
+		e = &fc->extents[lo];
+		if (pos < e->pos || pos >= e->pos + e->len)
+			return !(errnum = ERR_READ);
+		n = e->pos + e->len - pos;
+		if (n > len)
+			n = len;
+		disk = e->disk + (pos - e->pos);
+		if (!rawread(fc->drive, disk >> fc->sectorBits, (unsigned long)disk & ((1UL << fc->sectorBits) - 1), n, buf, GRUB_READ))
+			return 0;
+		pos += n;
+		buf += n;
+		len -= n;
+	}
+	return 1;
+}
+
+/* Set up FC for the VHD file now open, whose footer is FOOTER, reading
+   its dynamic disk header to HEADER. */
+static int
+vhd_layer_init(VHDFileControl *fc, VHDFooter *footer, VHDDynamicDiskHeader *header)
+{
+	unsigned long batSize;
+	int i;
+
+	fc->cFileMax = filemax;
+	fc->volumeSize = footer->currentSize;
+	fc->diskType = footer->diskType;
+	if (fc->diskType == VHD_DISKTYPE_FIXED)
+		return 1;
+	if (footer->dataOffset + sizeof(*header) > filemax) {
+		// grub_printf("footer dataOffset %lX\n", dataOffset);
+		return 0;
+	}
+	filepos = footer->dataOffset;
+	if (grub_read((unsigned long)header, sizeof(*header), GRUB_READ) != sizeof(*header)
+	    || *(grub_u64_t*)&header->cookie != VHD_DYNAMIC_COOKIE)
+		return 0;
+	vhd_header_in(header);
+	fc->tableOffset = header->tableOffset;
+	fc->blockSize = header->blockSize;
+	fc->blockSizeLog2 = log2pot32(fc->blockSize);
+	if (fc->blockSize < 512 || (fc->blockSize & (fc->blockSize - 1)))
+		return 0;
+	fc->batEntries = header->maxTableEntries;
+	batSize = (fc->batEntries * 4 + 511)&(-512LL);
+	fc->blockAllocationTable = grub_malloc(batSize);
+	fc->blockBitmapSize = (fc->blockSize / (512 * 8) + 511) & ~511UL;
+	fc->bitmaps = grub_malloc(VHD_CACHE_SLOTS * fc->blockBitmapSize);
+	if (!fc->blockAllocationTable || !fc->bitmaps)
+		return 0;
+	filepos = fc->tableOffset;
+	if (grub_read((grub_u64_t)(int)fc->blockAllocationTable, batSize, GRUB_READ) != batSize)
+		return 0;
+	for (i = 0; i < VHD_CACHE_SLOTS; i++)
+		fc->slot[i].block = -1UL;
+	return 1;
+}
+
+/* Open PATH on the filesystem of the file now open, without looking
+   for compression. */
+static int
+vhd_open_file(const char *path)
+{
+	char name[VHD_PATH_MAX];
+
+	grub_strcpy(name, path);
+	filepos = 0;
+	filemtime = 0;
+	fsmax = 0xFFFFFFFFFFFFFFFFULL;
+	fsys_block_map_flush();
+	print_possibilities = 0;
+	errnum = 0;
+	if ((*(fsys_table[fsys_type].dir_func)) (name))
+		return 1;
+	errnum = 0;
+	return 0;
+}
+
+/*
+ * The path of the parent named by HEADER of the differencing disk FC at
+ * CHILD: with WHICH 0 the relative locator (W2ru), 1 the absolute one
+ * (W2ku), whose drive letter is dropped, 2 parentUnicodeName. Relative
+ * names are taken from the directory of CHILD. Return 0 if there is none.
+ */
+static int
+vhd_parent_path(VHDFileControl *fc, VHDDynamicDiskHeader *header, int which, const char *child, char *path)
+{
+	static const char codes[2][5] = {"W2ru", "W2ku"};
+	unsigned short name[256];
+	unsigned char utf8[256 * 3 + 1];
+	unsigned long len, i;
+	char *p, *q;
+
+	memset(name, 0, sizeof(name));
+	if (which < 2) {
+		unsigned char *loc = 0;
+
+		for (i = 0; i < 8; i++) {
+			loc = header->parentLocaterEntry[i];
+			if (memcmp((char *)loc, codes[which], 4) == 0)
+				break;
+		}
+		if (i == 8)
+			return 0;
+		len = bswap_32((grub_u32_t *)(loc + 8));
+		if (len > sizeof(name) - 2)
+			len = sizeof(name) - 2;
+		if (!vhd_file_read(fc, (((unsigned long long)bswap_32((grub_u32_t *)(loc + 16))) << 32)
+					| bswap_32((grub_u32_t *)(loc + 20)), (unsigned long)name, len))
+			return 0;
+	} else {
+		/* big-endian */
+		for (i = 0; i < 255; i++)
+			name[i] = (header->parentUnicodeName[i * 2] << 8) | header->parentUnicodeName[i * 2 + 1];
+	}
+	if (!unicode_to_utf8(name, utf8, 256))
+		return 0;
+	p = (char *)utf8;
+	if (p[0] && p[1] == ':')
+		p += 2;
+	if (*p == '\\' || *p == '/')
+		*path = 0;
+	else {
+		grub_strcpy(path, child);
+		q = path + grub_strlen(path);
+		while (q > path && q[-1] != '/')
+			q--;
+		if (q > path)
+			q--;
+		*q = 0;
+	}
+	/* append the components, folding "." and ".." */
+	while (*p) {
+		while (*p == '\\' || *p == '/')
+			p++;
+		for (i = 0; p[i] && p[i] != '\\' && p[i] != '/'; i++)
+			;
+		if (!i)
+			break;
+		q = path + grub_strlen(path);
+		if (i == 2 && p[0] == '.' && p[1] == '.') {
+			while (q > path && *--q != '/')
+				;
+			*q = 0;
+		} else if (i != 1 || p[0] != '.') {
+			if (q + 1 + i >= path + VHD_PATH_MAX)
+				return 0;
+			*q++ = '/';
+			memmove(q, p, i);
+			q[i] = 0;
+		}
+		p += i;
+	}
+	return *path == '/';
+}
+
+/*
+ * Open the parents of the differencing disk now open, whose header is
+ * HEADER, down to a dynamic or fixed disk. The parent must carry the
+ * unique ID the child names. The child file is open again on return.
+ */
+static int
+vhd_open_parents(VHDDynamicDiskHeader *header)
+{
+	static char child[VHD_PATH_MAX], path[VHD_PATH_MAX];
+	VHDFileControl *fc = vhdfc, *parent;
+	VHDFooter footer;
+	unsigned char uid[16];
+	unsigned int depth;
+	int ok = 0, i;
+
+	grub_strcpy(child, open_filename);
+	if (!vhd_list_extents(fc))
+		return 0;
+	for (depth = 1; depth < VHD_MAX_CHAIN; depth++) {
+		memmove(uid, header->parentUniqueID, 16);
+		parent = grub_malloc(sizeof(VHDFileControl));
+		if (!parent)
+			break;
+		memset(parent, 0, sizeof(VHDFileControl));
+		fc->parentVHDFC = parent;
+		for (i = 0; i < 3; i++) {
+			if (!vhd_parent_path(fc, header, i, child, path) || !vhd_open_file(path))
+				continue;
+			filepos = filemax - 512;
+			if (filemax >= 512 && grub_read((unsigned long)&footer, 512, GRUB_READ) == 512
+			    && *(grub_u64_t*)&footer.cookie == VHD_FOOTER_COOKIE
+			    && memcmp((char *)footer.uniqueId, (char *)uid, 16) == 0)
+				break;
+		}
+		if (i == 3) {
+			printf_warning("\nWarning: the parent of VHD %s is not found.\n", child);
+			break;
+		}
+		vhd_footer_in(&footer);
+		if (!vhd_layer_init(parent, &footer, header) || !vhd_list_extents(parent))
+			break;
+		if (parent->diskType != VHD_DISKTYPE_FIXED && parent->blockSize != vhdfc->blockSize) {
+			printf_warning("\nWarning: VHD %s has another block size than its child.\n", path);
+			break;
+		}
+		if (parent->diskType != VHD_DISKTYPE_DIFFERENCE) {
+			ok = (parent->diskType == VHD_DISKTYPE_FIXED || parent->diskType == VHD_DISKTYPE_DYNAMIC);
+			break;
+		}
+		fc = parent;
+		grub_strcpy(child, path);
+	}
+	vhd_open_file(open_filename);
+	return ok;
+}
+
+static int
+vhd_has_block(VHDFileControl *fc, unsigned long block)
+{
+	if (fc->diskType == VHD_DISKTYPE_FIXED)
+		return ((unsigned long long)block << vhdfc->blockSizeLog2) < fc->volumeSize;
+	return vhd_bat(fc, block) != 0xFFFFFFFF;
+}
+
+/* Note for each block the topmost layer that holds it, so that a read
+   needs no look at the other layers unless a lower one holds it too. */
+static int
+vhd_build_map(void)
+{
+	unsigned long block;
+
+	vhdfc->blockLayer = grub_malloc(vhdfc->batEntries);
+	if (!vhdfc->blockLayer)
+		return 0;
+	for (block = 0; block < vhdfc->batEntries; block++) {
+		VHDFileControl *fc;
+		unsigned int n;
+		unsigned char layer = VHD_MAP_NONE;
+
+		for (fc = vhdfc, n = 0; fc; fc = fc->parentVHDFC, n++) {
+			if (!vhd_has_block(fc, block))
+				continue;
+			if (layer != VHD_MAP_NONE) {
+				layer |= VHD_MAP_MIXED;
+				break;
+			}
+			layer = n;
+			if (fc->diskType == VHD_DISKTYPE_FIXED)
+				break;
+		}
+		vhdfc->blockLayer[block] = layer;
+	}
+	return 1;
+}
+
 int
 dec_vhd_open(void)
 /* return 1=success or 0=failure */
@@ -195,45 +601,29 @@ dec_vhd_open(void)
 
   vhd_footer_in(&footer);
 
-	if (footer.diskType != VHD_DISKTYPE_DYNAMIC) {
-		/* Differencing disk and unknown diskType are not supported */
+	if (footer.diskType != VHD_DISKTYPE_DYNAMIC && footer.diskType != VHD_DISKTYPE_DIFFERENCE) {
+		/* unknown diskType is not supported */
 		goto quit;
 	}
 
-//	if (footer.diskType == VHD_DISKTYPE_DYNAMIC) {
-		if (footer.dataOffset + sizeof(dynaheader) > filemax) {
-			// grub_printf("footer dataOffset %lX\n", dataOffset);
-			goto quit;
-		}
-		filepos = footer.dataOffset;
-		bytesread = (int)grub_read((unsigned long)&dynaheader, sizeof(dynaheader), 0xedde0d90);
-//	}
-
 	vhdfc = (VHDFileControl*) grub_malloc(sizeof(VHDFileControl));
 	if (!vhdfc) {
 		goto quit;
 	}
 
 	memset(vhdfc, 0, sizeof(VHDFileControl));
-	vhd_header_in(&dynaheader);
+	if (!vhd_layer_init(vhdfc, &footer, &dynaheader)
+	    || (footer.diskType == VHD_DISKTYPE_DIFFERENCE && !vhd_open_parents(&dynaheader))
+	    || !vhd_build_map()) {
+		dec_vhd_close();
+		goto quit;
+	}
 	vhdfc->cFileMax = filemax;
-	vhdfc->volumeSize = footer.currentSize;
-	vhdfc->diskType = footer.diskType;
-	//if (vhdfc->diskType == VHD_DISKTYPE_FIXED) {
-	//} else if (vhdfc->diskType == VHD_DISKTYPE_DYNAMIC) {
-		vhdfc->tableOffset = dynaheader.tableOffset;
-		vhdfc->blockSize = dynaheader.blockSize;
-		vhdfc->blockSizeLog2 = log2pot32(vhdfc->blockSize);
-		vhdfc->batEntries = dynaheader.maxTableEntries;
-		unsigned long batSize = (vhdfc->batEntries * 4 + 511)&(-512LL);
-		vhdfc->blockAllocationTable = grub_malloc(batSize);
-		vhdfc->blockBitmapSize = vhdfc->blockSize / (512 * 8);
-		vhdfc->blockBitmapAndData = grub_malloc(vhdfc->blockBitmapSize + vhdfc->blockSize);
-		vhdfc->blockData = vhdfc->blockBitmapAndData + vhdfc->blockBitmapSize;
-		filepos = vhdfc->tableOffset;
-		grub_read((grub_u64_t)(int)vhdfc->blockAllocationTable, batSize, GRUB_READ);
-		vhdfc->currentBlockOffset = -1LL;
-	//}
+	vhdfc->spanBuffer = grub_malloc(VHD_SPAN_BLOCKS * (vhdfc->blockBitmapSize + vhdfc->blockSize));
+	if (!vhdfc->spanBuffer) {
+		dec_vhd_close();
+		goto quit;
+	}
 	map_image_HPC = footer.diskGeometry.heads;
 	map_image_SPT = footer.diskGeometry.sectorsPerTrack;
 	compressed_file = 1;
@@ -246,6 +636,136 @@ quit:
 	return compressed_file;
 }
 
+/* The BAT entry of BLOCK: its sector in the file, or 0xFFFFFFFF. */
+static grub_u32_t
+vhd_bat(VHDFileControl *fc, unsigned long block)
+{
+	grub_u32_t lba;
+
+	if (block >= fc->batEntries)
+		return 0xFFFFFFFF;
+	lba = *(grub_u32_t*)(fc->blockAllocationTable + block * 4);
+	return bswap_32(&lba);
+}
+
+/* The sector bitmap of BLOCK at sector LBA, from the cache, else copied
+   from FROM if not null, else read from the file. Null if the read fails. */
+static unsigned char *
+vhd_bitmap(VHDFileControl *fc, unsigned long block, grub_u32_t lba, const unsigned char *from)
+{
+	unsigned long i, victim = 0;
+	unsigned char *map;
+
+	for (i = 0; i < VHD_CACHE_SLOTS; i++) {
+		if (fc->slot[i].block == block) {
+			fc->slot[i].lastUse = ++fc->useCount;
+			return fc->bitmaps + i * fc->blockBitmapSize;
+		}
+		if (fc->slot[i].lastUse < fc->slot[victim].lastUse)
+			victim = i;
+	}
+	map = fc->bitmaps + victim * fc->blockBitmapSize;
+	fc->slot[victim].block = -1UL;
+	if (from)
+		memmove(map, from, fc->blockBitmapSize);
+	else if (!vhd_file_read(fc, (unsigned long long)lba << 9, (unsigned long)map, fc->blockBitmapSize))
+		return 0;
+	fc->slot[victim].block = block;
+	fc->slot[victim].lastUse = ++fc->useCount;
+	return map;
+}
+
+/*
+ * Copy LEN bytes at OFF of a block of FC whose sector bitmap is MAP to
+ * BUF. Sectors with their bit set come from the block data at SRC when
+ * it is not null, else from the file at DATA, in one read per run. The
+ * others read as zeros. Return 0 if a read fails.
+ */
+static int
+vhd_copy_block(VHDFileControl *fc, unsigned long long buf, const unsigned char *map, unsigned long off, unsigned long len, const unsigned char *src, unsigned long long data)
+{
+	while (len) {
+		unsigned long sector = off >> 9;
+		int present = (map[sector >> 3] >> (7 - (sector & 7))) & 1;
+		unsigned long n = 512 - (off & 511);
+
+		for (sector++; n < len && ((map[sector >> 3] >> (7 - (sector & 7))) & 1) == present; sector++)
+			n += 512;
+		if (n > len)
+			n = len;
+		if (!present)
+			grub_memset64(buf, 0, n);
+		else if (src)
+			grub_memmove64(buf, (unsigned long)(src + off), n);
+		else if (!vhd_file_read(fc, data + off, buf, n))
+			return 0;
+		buf += n;
+		off += n;
+		len -= n;
+	}
+	return 1;
+}
+
+/* The layer from FIRST down that holds SECTOR of BLOCK, -1 if none, or
+   -2 if a bitmap cannot be read. */
+static int
+vhd_sector_layer(unsigned long block, unsigned long sector, unsigned int first)
+{
+	VHDFileControl *fc;
+	unsigned int n;
+
+	for (fc = vhd_layer(first), n = first; fc; fc = fc->parentVHDFC, n++) {
+		grub_u32_t lba;
+		unsigned char *map;
+
+		if (fc->diskType == VHD_DISKTYPE_FIXED)
+			return vhd_has_block(fc, block) ? (int)n : -1;
+		lba = vhd_bat(fc, block);
+		if (lba == 0xFFFFFFFF)
+			continue;
+		map = vhd_bitmap(fc, block, lba, 0);
+		if (!map)
+			return -2;
+		if ((map[sector >> 3] >> (7 - (sector & 7))) & 1)
+			return n;
+	}
+	return -1;
+}
+
+/* Copy LEN bytes at OFF of BLOCK, held by more than one layer from FIRST
+   down, to BUF, each run of sectors from the topmost layer that has it. */
+static int
+vhd_copy_mixed(unsigned long long buf, unsigned long block, unsigned int first, unsigned long off, unsigned long len)
+{
+	while (len) {
+		unsigned long sector = off >> 9;
+		int layer = vhd_sector_layer(block, sector, first);
+		unsigned long n = 512 - (off & 511);
+
+		if (layer == -2)
+			return 0;
+		for (sector++; n < len && vhd_sector_layer(block, sector, first) == layer; sector++)
+			n += 512;
+		if (n > len)
+			n = len;
+		if (layer < 0)
+			grub_memset64(buf, 0, n);
+		else {
+			VHDFileControl *fc = vhd_layer(layer);
+			unsigned long long pos = ((unsigned long long)block << vhdfc->blockSizeLog2) + off;
+
+			if (fc->diskType != VHD_DISKTYPE_FIXED)
+				pos = ((unsigned long long)vhd_bat(fc, block) << 9) + fc->blockBitmapSize + off;
+			if (!vhd_file_read(fc, pos, buf, n))
+				return 0;
+		}
+		buf += n;
+		off += n;
+		len -= n;
+	}
+	return 1;
+}
+
 unsigned long long
 dec_vhd_read(unsigned long long buf, unsigned long long len, unsigned long write)
 {
@@ -272,23 +792,72 @@ dec_vhd_read(unsigned long long buf, unsigned long long len, unsigned long write
 			unsigned long long blockOffset = (unsigned long long)blockNumber << vhdfc->blockSizeLog2;
 			unsigned long offsetInBlock = (unsigned long)(uFilePos - blockOffset);
 			unsigned long txLen = (rem < vhdfc->blockSize - offsetInBlock) ? rem : vhdfc->blockSize - offsetInBlock;
-			grub_u32_t blockLBA = *(grub_u32_t*)(vhdfc->blockAllocationTable + blockNumber * 4);
-			bswap_32(&blockLBA);
-			// grub_printf("read bn %x of %x txlen %x lba %x\n", blockNumber, offsetInBlock, txLen, blockLBA);
-			if (blockLBA == 0xFFFFFFFF) {
+			unsigned char layer = (blockNumber < vhdfc->batEntries) ? vhdfc->blockLayer[blockNumber] : VHD_MAP_NONE;
+			// grub_printf("read bn %x of %x txlen %x layer %x\n", blockNumber, offsetInBlock, txLen, layer);
+			if (layer == VHD_MAP_NONE) {
 				// unused block on dynamic VHD. read zero
 				grub_memset64(buf, 0, txLen);
 			}
+			else if (layer & VHD_MAP_MIXED) {
+				if (!vhd_copy_mixed(buf, blockNumber, layer & ~VHD_MAP_MIXED, offsetInBlock, txLen))
+					break;
+			}
 			else {
-				if (blockOffset != vhdfc->currentBlockOffset) {
-					filepos = blockLBA * 512;
-					// grub_printf("read vhd lba %x filepos %lx\n", blockLBA, filepos);
-					unsigned long long nread = grub_read((unsigned long)vhdfc->blockBitmapAndData, vhdfc->blockBitmapSize + vhdfc->blockSize, GRUB_READ);
-					if (nread < vhdfc->blockBitmapSize + vhdfc->blockSize)
+				VHDFileControl *fc = vhd_layer(layer);
+				unsigned long span = txLen, lastLen = txLen, nb = 1, i;
+
+				if (fc->diskType == VHD_DISKTYPE_FIXED) {
+					/* the following blocks of the same layer are next in the file */
+					while (span < rem && span < 0x40000000 && blockNumber + nb < vhdfc->batEntries
+					       && vhdfc->blockLayer[blockNumber + nb] == layer) {
+						lastLen = (rem - span < vhdfc->blockSize) ? rem - span : vhdfc->blockSize;
+						span += lastLen;
+						nb++;
+					}
+					if (!vhd_file_read(fc, blockOffset + offsetInBlock, buf, span))
+						break;
+					txLen = span;
+				}
+				else {
+					grub_u32_t blockLBA = vhd_bat(fc, blockNumber);
+					unsigned long stride = fc->blockBitmapSize + fc->blockSize;
+					unsigned long long data = ((unsigned long long)blockLBA << 9) + fc->blockBitmapSize;
+					unsigned char *map;
+
+					/* Take in the blocks that follow this one in the file too. */
+					while (span < rem && nb < VHD_SPAN_BLOCKS
+					       && blockNumber + nb < vhdfc->batEntries
+					       && vhdfc->blockLayer[blockNumber + nb] == layer
+					       && vhd_bat(fc, blockNumber + nb) == blockLBA + nb * (stride >> 9)) {
+						lastLen = (rem - span < vhdfc->blockSize) ? rem - span : vhdfc->blockSize;
+						span += lastLen;
+						nb++;
+					}
+					map = vhd_bitmap(fc, blockNumber, blockLBA, 0);
+					if (!map)
 						break;
-					vhdfc->currentBlockOffset = blockOffset;
+					if (nb == 1) {
+						/* only the sectors asked for */
+						if (!vhd_copy_block(fc, buf, map, offsetInBlock, txLen, 0, data))
+							break;
+					}
+					else {
+						/* one read from the first byte to the last, bitmaps between */
+						unsigned char *src = vhdfc->spanBuffer - offsetInBlock;
+						unsigned long rawLen = (nb - 1) * stride + lastLen - offsetInBlock;
+
+						if (!vhd_file_read(fc, data + offsetInBlock, (grub_u64_t)(int)vhdfc->spanBuffer, rawLen))
+							break;
+						vhd_copy_block(fc, buf, map, offsetInBlock, txLen, src, 0);
+						for (i = 1; i < nb; i++) {
+							unsigned long n = (i + 1 < nb) ? vhdfc->blockSize : lastLen;
+
+							map = vhd_bitmap(fc, blockNumber + i, 0, src + i * stride - fc->blockBitmapSize);
+							vhd_copy_block(fc, buf + txLen, map, 0, n, src + i * stride, 0);
+							txLen += n;
+						}
+					}
 				}
-				grub_memmove64(buf, (unsigned long)(vhdfc->blockData + offsetInBlock), txLen);
 			}
 			buf += txLen;
 			uFilePos += txLen;
@@ -0,0 +1,463 @@
+/*
+ *  GRUB4DOS  --  GRand Unified Bootloader
+ *  Copyright (C) 1999  Free Software Foundation, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ *  Based on
+ *  - VHDX Format Specification v1.00 2012-08-25 Microsoft
+ */
+
+#include "shared.h"
+
+#ifndef NO_DECOMPRESSION
+
+#define VHDX_FILE_SIGNATURE	0x656C696678646876ULL	/* vhdxfile */
+#define VHDX_HEAD_SIGNATURE	0x64616568	/* head */
+#define VHDX_REGI_SIGNATURE	0x69676572	/* regi */
+#define VHDX_LOGE_SIGNATURE	0x65676F6C	/* loge */
+#define VHDX_META_SIGNATURE	0x617461646174656DULL	/* metadata */
+
+#define VHDX_HEADER1_OFFSET	0x10000
+#define VHDX_HEADER2_OFFSET	0x20000
+#define VHDX_REGION1_OFFSET	0x30000
+#define VHDX_REGION2_OFFSET	0x40000
+#define VHDX_HEADER_SIZE	0x1000
+#define VHDX_REGION_SIZE	0x10000
+#define VHDX_META_TABLE_SIZE	0x10000
+#define VHDX_LOG_SECTOR		0x1000
+
+/* BAT entry states */
+#define VHDX_BAT_STATE_MASK	7
+#define VHDX_PAYLOAD_FULLY_PRESENT	6
+#define VHDX_BAT_OFFSET_MASK	0xFFFFFFFFFFF00000ULL
+
+/* File Parameters flags */
+#define VHDX_HAS_PARENT		2
+
+typedef struct VHDXHeader {
+	grub_u32_t signature;	//string head
+	grub_u32_t checksum;
+	grub_u64_t sequenceNumber;
+	unsigned char fileWriteGuid[16];
+	unsigned char dataWriteGuid[16];
+	unsigned char logGuid[16];
+	unsigned short logVersion;
+	unsigned short version;
+	grub_u32_t logLength;
+	grub_u64_t logOffset;
+} VHDXHeader;
+
+typedef struct VHDXRegionTableHeader {
+	grub_u32_t signature;	//string regi
+	grub_u32_t checksum;
+	grub_u32_t entryCount;
+	grub_u32_t reserved;
+} VHDXRegionTableHeader;
+
+typedef struct VHDXRegionTableEntry {
+	unsigned char guid[16];
+	grub_u64_t fileOffset;
+	grub_u32_t length;
+	grub_u32_t required;
+} VHDXRegionTableEntry;
+
+typedef struct VHDXMetadataTableHeader {
+	grub_u64_t signature;	//string metadata
+	unsigned short reserved;
+	unsigned short entryCount;
+	grub_u32_t reserved2[5];
+} VHDXMetadataTableHeader;
+
+typedef struct VHDXMetadataTableEntry {
+	unsigned char itemId[16];
+	grub_u32_t offset;
+	grub_u32_t length;
+	grub_u32_t flags;	/* 1 user, 2 virtual disk, 4 required */
+	grub_u32_t reserved;
+} VHDXMetadataTableEntry;
+
+typedef struct VHDXLogEntryHeader {
+	grub_u32_t signature;	//string loge
+	grub_u32_t checksum;
+	grub_u32_t entryLength;
+	grub_u32_t tail;
+	grub_u64_t sequenceNumber;
+	grub_u32_t descriptorCount;
+	grub_u32_t reserved;
+	unsigned char logGuid[16];
+	grub_u64_t flushedFileOffset;
+	grub_u64_t lastFileOffset;
+} VHDXLogEntryHeader;
+
+/* GUIDs as stored in the file */
+static const unsigned char vhdx_guid_bat[16] =
+	{0x66,0x77,0xC2,0x2D,0x23,0xF6,0x00,0x42,0x9D,0x64,0x11,0x5E,0x9B,0xFD,0x4A,0x08};
+static const unsigned char vhdx_guid_metadata[16] =
+	{0x06,0xA2,0x7C,0x8B,0x90,0x47,0x9A,0x4B,0xB8,0xFE,0x57,0x5F,0x05,0x0F,0x88,0x6E};
+
+#define VHDX_META_FILE_PARAMETERS	0
+#define VHDX_META_DISK_SIZE		1
+#define VHDX_META_LOGICAL_SECTOR	2
+#define VHDX_META_KNOWN			5
+static const unsigned char vhdx_guid_meta[VHDX_META_KNOWN][16] = {
+	/* File Parameters */
+	{0x37,0x67,0xA1,0xCA,0x36,0xFA,0x43,0x4D,0xB3,0xB6,0x33,0xF0,0xAA,0x44,0xE7,0x6B},
+	/* Virtual Disk Size */
+	{0x24,0x42,0xA5,0x2F,0x1B,0xCD,0x76,0x48,0xB2,0x11,0x5D,0xBE,0xD8,0x3B,0xF4,0xB8},
+	/* Logical Sector Size */
+	{0x1D,0xBF,0x41,0x81,0x6F,0xA9,0x09,0x47,0xBA,0x47,0xF2,0x33,0xA8,0xFA,0xAB,0x5F},
+	/* Physical Sector Size, not needed to read */
+	{0xC7,0x48,0xA3,0xCD,0x5D,0x44,0x71,0x44,0x9C,0xC9,0xE9,0x88,0x52,0x51,0xC5,0x56},
+	/* Virtual Disk ID, not needed to read */
+	{0xAB,0x12,0xCA,0xBE,0xE6,0xB2,0x23,0x45,0x93,0xEF,0xC3,0x09,0xE0,0x00,0xC7,0x46},
+};
+
+typedef struct VHDXFileControl {
+	unsigned long long cFileMax;
+	unsigned long long volumeSize;
+	unsigned long blockSize;
+	unsigned int  blockSizeLog2;
+	unsigned long logicalSectorSize;
+	unsigned int  chunkRatioLog2;	/* payload blocks per sector bitmap block */
+	unsigned long blocks;
+	grub_u64_t *bat;	/* payload entries only, sector bitmap entries dropped */
+} VHDXFileControl;
+
+VHDXFileControl *vhdxfc;
+
+unsigned int log2pot32(unsigned long x);
+
+static grub_u32_t vhdx_crc_table[256];
+
+/* CRC-32C (Castagnoli), which all VHDX checksums use. */
+static grub_u32_t
+vhdx_crc32c(const unsigned char *p, unsigned long len)
+{
+	grub_u32_t crc = 0xFFFFFFFF;
+
+	if (!vhdx_crc_table[1]) {
+		unsigned long i, j;
+
+		for (i = 0; i < 256; i++) {
+			crc = i;
+			for (j = 0; j < 8; j++)
+				crc = (crc >> 1) ^ ((crc & 1) ? 0x82F63B78 : 0);
+			vhdx_crc_table[i] = crc;
+		}
+		crc = 0xFFFFFFFF;
+	}
+	while (len--)
+		crc = vhdx_crc_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+/* Check the checksum at offset 4 of the LEN bytes structure at P. */
+static int
+vhdx_checksum_ok(unsigned char *p, unsigned long len)
+{
+	grub_u32_t sum = *(grub_u32_t *)(p + 4);
+	int ok;
+
+	*(grub_u32_t *)(p + 4) = 0;
+	ok = (vhdx_crc32c(p, len) == sum);
+	*(grub_u32_t *)(p + 4) = sum;
+	return ok;
+}
+
+/* Read LEN bytes at POS of the file to BUF. */
+static int
+vhdx_file_read(unsigned long long pos, void *buf, unsigned long len)
+{
+	filepos = pos;
+	return grub_read((unsigned long)buf, len, GRUB_READ) == len;
+}
+
+/* The current header, the valid one with the higher sequence number,
+   to HEADER. WORK holds VHDX_HEADER_SIZE bytes. */
+static int
+vhdx_header(VHDXHeader *header, unsigned char *work)
+{
+	int i, found = 0;
+
+	for (i = 0; i < 2; i++) {
+		VHDXHeader *h = (VHDXHeader *)work;
+
+		if (!vhdx_file_read(i ? VHDX_HEADER2_OFFSET : VHDX_HEADER1_OFFSET, work, VHDX_HEADER_SIZE))
+			return 0;
+		if (h->signature != VHDX_HEAD_SIGNATURE || !vhdx_checksum_ok(work, VHDX_HEADER_SIZE))
+			continue;
+		if (!found || h->sequenceNumber > header->sequenceNumber)
+			memmove(header, h, sizeof(*header));
+		found = 1;
+	}
+	return found && header->version == 1;
+}
+
+/*
+ * A header whose log GUID is not zero says the log may hold writes not
+ * yet in place. They are applied by writing the file, which we do not
+ * do, so refuse the image if the log holds an entry of that GUID.
+ */
+static int
+vhdx_log_clean(VHDXHeader *header, unsigned char *work)
+{
+	unsigned long long pos;
+	VHDXLogEntryHeader *e = (VHDXLogEntryHeader *)work;
+	int i;
+
+	for (i = 0; i < 16 && !header->logGuid[i]; i++)
+		;
+	if (i == 16)
+		return 1;
+	for (pos = 0; pos < header->logLength; pos += VHDX_LOG_SECTOR) {
+		if (!vhdx_file_read(header->logOffset + pos, work, sizeof(*e)))
+			return 0;
+		if (e->signature == VHDX_LOGE_SIGNATURE
+		    && memcmp((char *)e->logGuid, (char *)header->logGuid, 16) == 0) {
+			printf_warning("\nWarning: VHDX log is not replayed. Attach the disk in Windows once.\n");
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Find the BAT and metadata regions in a valid region table. */
+static int
+vhdx_regions(unsigned char *work, VHDXRegionTableEntry *bat, VHDXRegionTableEntry *meta)
+{
+	VHDXRegionTableHeader *rh = (VHDXRegionTableHeader *)work;
+	VHDXRegionTableEntry *re = (VHDXRegionTableEntry *)(rh + 1);
+	unsigned long i;
+	int found = 0;
+
+	for (i = 0; i < 2; i++) {
+		if (!vhdx_file_read(i ? VHDX_REGION2_OFFSET : VHDX_REGION1_OFFSET, work, VHDX_REGION_SIZE))
+			return 0;
+		if (rh->signature == VHDX_REGI_SIGNATURE && vhdx_checksum_ok(work, VHDX_REGION_SIZE)
+		    && rh->entryCount <= 2047)
+			break;
+	}
+	if (i == 2)
+		return 0;
+	for (i = 0; i < rh->entryCount; i++, re++) {
+		if (memcmp((char *)re->guid, (char *)vhdx_guid_bat, 16) == 0) {
+			*bat = *re;
+			found |= 1;
+		} else if (memcmp((char *)re->guid, (char *)vhdx_guid_metadata, 16) == 0) {
+			*meta = *re;
+			found |= 2;
+		} else if (re->required & 1) {
+			/* a region we do not know must be understood */
+			return 0;
+		}
+	}
+	return found == 3;
+}
+
+/* Fill in VHDXFileControl from the metadata region. */
+static int
+vhdx_metadata(VHDXRegionTableEntry *meta, unsigned char *work)
+{
+	VHDXMetadataTableHeader *mh = (VHDXMetadataTableHeader *)work;
+	VHDXMetadataTableEntry *me = (VHDXMetadataTableEntry *)(mh + 1);
+	unsigned long i, j, found = 0;
+	grub_u32_t params[2];
+
+	if (meta->length < VHDX_META_TABLE_SIZE
+	    || !vhdx_file_read(meta->fileOffset, work, VHDX_META_TABLE_SIZE)
+	    || mh->signature != VHDX_META_SIGNATURE || mh->entryCount > 2047)
+		return 0;
+	for (i = 0; i < mh->entryCount; i++, me++) {
+		for (j = 0; j < VHDX_META_KNOWN; j++)
+			if (memcmp((char *)me->itemId, (char *)vhdx_guid_meta[j], 16) == 0)
+				break;
+		if (j == VHDX_META_KNOWN) {
+			if (me->flags & 4)
+				return 0;
+			continue;
+		}
+		if (j > VHDX_META_LOGICAL_SECTOR)
+			continue;
+		if (me->offset + (unsigned long long)me->length > meta->length)
+			return 0;
+		found |= 1 << j;
+		switch (j) {
+		case VHDX_META_FILE_PARAMETERS:
+			if (me->length < 8 || !vhdx_file_read(meta->fileOffset + me->offset, params, 8))
+				return 0;
+			vhdxfc->blockSize = params[0];
+			if (params[1] & VHDX_HAS_PARENT) {
+				printf_warning("\nWarning: differencing VHDX is not supported.\n");
+				return 0;
+			}
+			break;
+		case VHDX_META_DISK_SIZE:
+			if (me->length < 8 || !vhdx_file_read(meta->fileOffset + me->offset, &vhdxfc->volumeSize, 8))
+				return 0;
+			break;
+		case VHDX_META_LOGICAL_SECTOR:
+			if (me->length < 4 || !vhdx_file_read(meta->fileOffset + me->offset, params, 4))
+				return 0;
+			vhdxfc->logicalSectorSize = params[0];
+			break;
+		}
+	}
+	return found == 7
+		&& vhdxfc->blockSize >= 0x100000 && vhdxfc->blockSize <= 0x10000000
+		&& !(vhdxfc->blockSize & (vhdxfc->blockSize - 1))
+		&& (vhdxfc->logicalSectorSize == 512 || vhdxfc->logicalSectorSize == 4096)
+		&& vhdxfc->volumeSize && !(vhdxfc->volumeSize & (vhdxfc->logicalSectorSize - 1));
+}
+
+/*
+ * Read the BAT to memory, keeping only the payload block entries. In the
+ * file a sector bitmap entry follows each 2^chunkRatioLog2 of them.
+ */
+static int
+vhdx_bat(VHDXRegionTableEntry *bat)
+{
+	unsigned long entries, i;
+
+	vhdxfc->blockSizeLog2 = log2pot32(vhdxfc->blockSize);
+	/* 2^23 sectors per sector bitmap block */
+	vhdxfc->chunkRatioLog2 = 23 + log2pot32(vhdxfc->logicalSectorSize) - vhdxfc->blockSizeLog2;
+	vhdxfc->blocks = (unsigned long)((vhdxfc->volumeSize + vhdxfc->blockSize - 1) >> vhdxfc->blockSizeLog2);
+	entries = vhdxfc->blocks + ((vhdxfc->blocks - 1) >> vhdxfc->chunkRatioLog2);
+	if ((unsigned long long)entries * 8 > bat->length)
+		return 0;
+	vhdxfc->bat = grub_malloc(entries * 8);
+	if (!vhdxfc->bat || !vhdx_file_read(bat->fileOffset, vhdxfc->bat, entries * 8))
+		return 0;
+	for (i = 0; i < vhdxfc->blocks; i++)
+		vhdxfc->bat[i] = vhdxfc->bat[i + (i >> vhdxfc->chunkRatioLog2)];
+	return 1;
+}
+
+void
+dec_vhdx_close(void)
+{
+	if (vhdxfc) {
+		if (vhdxfc->bat) {
+			grub_free(vhdxfc->bat);
+		}
+		grub_free(vhdxfc);
+		vhdxfc = 0;
+	}
+}
+
+int
+dec_vhdx_open(void)
+/* return 1=success or 0=failure */
+{
+	VHDXHeader header;
+	VHDXRegionTableEntry bat, meta;
+	unsigned char *work = 0;
+	grub_u64_t signature;
+
+	if (filemax < 0x100000) return 0;//file is to small
+	/* Now it does not support openning more than 1 file at a time. */
+	dec_vhdx_close();
+
+	if (grub_read((unsigned long)&signature, 8, GRUB_READ) != 8 || signature != VHDX_FILE_SIGNATURE)
+		goto quit;
+
+	vhdxfc = grub_malloc(sizeof(VHDXFileControl));
+	work = grub_malloc(VHDX_REGION_SIZE);
+	if (!vhdxfc || !work)
+		goto fail;
+	memset(vhdxfc, 0, sizeof(VHDXFileControl));
+	memset(&header, 0, sizeof(header));
+
+	if (!vhdx_header(&header, work)
+	    || !vhdx_log_clean(&header, work)
+	    || !vhdx_regions(work, &bat, &meta)
+	    || !vhdx_metadata(&meta, work)
+	    || !vhdx_bat(&bat))
+		goto fail;
+
+	vhdxfc->cFileMax = filemax;
+	compressed_file = 1;
+	decomp_type = DECOMP_TYPE_VHDX;
+	filemax = vhdxfc->volumeSize;
+	goto quit;
+fail:
+	dec_vhdx_close();
+quit:
+	if (work)
+		grub_free(work);
+	filepos = 0;
+
+	errnum = ERR_NONE;
+	return compressed_file;
+}
+
+unsigned long long
+dec_vhdx_read(unsigned long long buf, unsigned long long len, unsigned long write)
+{
+	unsigned long long ret = 0, pos = filepos, rem;
+
+	if (write == GRUB_WRITE) {
+		errnum = ERR_WRITE_GZIP_FILE;
+		return 0;
+	}
+	compressed_file = 0;
+	filemax = vhdxfc->cFileMax;
+	if (pos > vhdxfc->volumeSize)
+		pos = vhdxfc->volumeSize;
+	if (len > vhdxfc->volumeSize - pos)
+		len = vhdxfc->volumeSize - pos;
+	errnum = ERR_NONE;
+	rem = len;
+	while (rem) {
+		unsigned long block = (unsigned long)(pos >> vhdxfc->blockSizeLog2);
+		unsigned long offsetInBlock = (unsigned long)pos & (vhdxfc->blockSize - 1);
+		unsigned long long txLen = vhdxfc->blockSize - offsetInBlock;
+		grub_u64_t entry = vhdxfc->bat[block];
+
+		if (txLen > rem)
+			txLen = rem;
+		if ((entry & VHDX_BAT_STATE_MASK) == VHDX_PAYLOAD_FULLY_PRESENT) {
+			unsigned long long data = entry & VHDX_BAT_OFFSET_MASK;
+			unsigned long nb = 1;
+
+			/* the following blocks are next in the file: one read */
+			while (txLen < rem && block + nb < vhdxfc->blocks
+			       && vhdxfc->bat[block + nb] == entry + ((unsigned long long)nb << vhdxfc->blockSizeLog2)) {
+				txLen += (rem - txLen < vhdxfc->blockSize) ? rem - txLen : vhdxfc->blockSize;
+				nb++;
+			}
+			filepos = data + offsetInBlock;
+			if (grub_read(buf, txLen, GRUB_READ) != txLen)
+				break;
+		} else {
+			/* not present, zero, unmapped or undefined: read zero.
+			   Partially present blocks only occur in differencing disks. */
+			grub_memset64(buf, 0, txLen);
+		}
+		buf += txLen;
+		pos += txLen;
+		rem -= txLen;
+		ret += txLen;
+	}
+	filepos = pos;
+	compressed_file = 1;
+	filemax = vhdxfc->volumeSize;
+	return ret;
+}
+
+#endif /* ! NO_DECOMPRESSION */
@@ -0,0 +1,648 @@
+/*
+ *  GRUB4DOS  --  GRand Unified Bootloader
+ *  Copyright (C) 1999  Free Software Foundation, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ *  Based on
+ *  - The .xz File Format version 1.0.4 2009-08-27 Lasse Collin, Igor Pavlov
+ *
+ *  Only the LZMA2 filter on its own is supported, which is what xz
+ *  writes unless asked for a BCJ or delta filter. The index at the end
+ *  of each stream gives where every block starts in both the .xz file
+ *  and the uncompressed data, so a read decodes from the start of the
+ *  block that holds it rather than from the start of the file.
+ */
+
+#include "shared.h"
+
+#ifndef NO_DECOMPRESSION
+
+#define XZ_HEADER_SIZE	12
+#define XZ_MAGIC	"\xFD" "7zXZ\0"
+#define XZ_FOOTER_MAGIC	"YZ"
+/* input buffer size 128 KB */
+#define XZ_INPBUFSIZE	0x20000UL
+
+#define XZ_CHECK_NONE	0
+#define XZ_CHECK_CRC32	1
+#define XZ_CHECK_CRC64	4
+
+#define XZ_FILTER_LZMA2	0x21
+
+#define le32(p) ((grub_u32_t)(p)[0] | ((grub_u32_t)(p)[1] << 8) | ((grub_u32_t)(p)[2] << 16) | ((grub_u32_t)(p)[3] << 24))
+
+/* size of the check field for each check type */
+static const unsigned char xz_check_size[16] = {0, 4, 4, 4, 8, 8, 8, 16, 16, 16, 32, 32, 32, 64, 64, 64};
+
+struct xz_block {
+	grub_u64_t cpos;	/* offset of the block header in the .xz file */
+	grub_u64_t unpadded;	/* header, compressed data and check */
+	grub_u64_t upos;	/* offset of its data in the uncompressed file */
+	grub_u64_t usize;
+	unsigned char check;	/* check type of its stream */
+};
+
+static struct {
+	struct xz_block *blocks;
+	unsigned long nblocks;
+	unsigned long cur;		/* block being decoded, nblocks if none */
+	int done;			/* cur has been decoded and checked */
+	unsigned long maxusize;		/* largest block, up to 4G-1 */
+	/*
+	 * dic is a ring buffer like that of dec_lzma_read: dic[0 ... dicPos-1]
+	 * holds uncompressed data [dicFilePos ...], and dic[dicPos ... dicSize-1]
+	 * what precedes it, though nothing before low.
+	 */
+	unsigned char *dic;
+	unsigned long dicSize, dicPos;
+	grub_u64_t dicFilePos;
+	grub_u64_t low;
+	/* inp[0 ... inpSize-1] holds the .xz file from inpFilePos */
+	unsigned char *inp;
+	unsigned long inpPos, inpSize;
+	grub_u64_t inpFilePos;
+	/* check of the block being decoded */
+	int check_on;
+	grub_u32_t crc32;
+	grub_u64_t crc64;
+	grub_u64_t cfilemax, cfilepos;
+	grub_u64_t ufilemax, ufilepos;
+} xzdec;
+
+/* CRC64 of the ECMA-182 polynomial, reflected, as xz uses */
+static grub_u64_t xz_crc64_table[256];
+
+static grub_u64_t
+xz_crc64(grub_u64_t crc, const unsigned char *p, unsigned long len)
+{
+	if (!xz_crc64_table[1]) {
+		unsigned long i, j;
+
+		for (i = 0; i < 256; i++) {
+			grub_u64_t c = i;
+
+			for (j = 0; j < 8; j++)
+				c = (c >> 1) ^ ((c & 1) ? 0xC96C5795D7870F42ULL : 0);
+			xz_crc64_table[i] = c;
+		}
+	}
+	crc = ~crc;
+	while (len--)
+		crc = xz_crc64_table[(unsigned char)crc ^ *p++] ^ (crc >> 8);
+	return ~crc;
+}
+
+/* Read a variable-length integer at *P, not reaching END. */
+static int
+xz_vli(const unsigned char **p, const unsigned char *end, grub_u64_t *val)
+{
+	unsigned int i;
+
+	*val = 0;
+	for (i = 0; i < 9 && *p < end; i++) {
+		unsigned char b = *(*p)++;
+
+		*val |= (grub_u64_t)(b & 0x7F) << (i * 7);
+		if (!(b & 0x80))
+			return (b || !i);	/* no superfluous zero bytes */
+	}
+	return 0;
+}
+
+/* Read N bytes at offset POS of the .xz file into BUF. */
+static int
+xz_pread(grub_u64_t pos, void *buf, unsigned long n)
+{
+	filepos = pos;
+	return grub_read((grub_u64_t)(int)buf, n, GRUB_READ) == n;
+}
+
+/*
+ * Walk the streams of the file from its end, reading the index of each.
+ * With BLOCKS null, only count the blocks; otherwise fill BLOCKS[0 ...
+ * COUNT-1] in file order. Return the number of blocks, or -1 if the file
+ * is not well-formed.
+ */
+static long
+xz_walk(struct xz_block *blocks, unsigned long count)
+{
+	grub_u64_t end = filemax;
+	unsigned long total = 0;
+	unsigned char buf[XZ_HEADER_SIZE];
+	unsigned char *index = 0;
+
+	if (end & 3)
+		return -1;
+	while (end) {
+		grub_u64_t ipos, start, cpos, val, isize;
+		unsigned long n, i;
+		const unsigned char *p, *iend;
+
+		if (end < 2 * XZ_HEADER_SIZE || !xz_pread(end - XZ_HEADER_SIZE, buf, XZ_HEADER_SIZE))
+			goto fail;
+		/* stream padding */
+		if (!le32(buf + 8)) {
+			end -= 4;
+			continue;
+		}
+		/* stream footer: CRC32, backward size, flags, magic */
+		if (memcmp((const char *)buf + 10, XZ_FOOTER_MAGIC, 2) || buf[8] || buf[9] > 15
+		    || le32(buf) != calc_crc32(0, buf + 4, 6))
+			goto fail;
+		isize = ((grub_u64_t)le32(buf + 4) + 1) << 2;
+		if (isize > end - 2 * XZ_HEADER_SIZE)
+			goto fail;
+		ipos = end - XZ_HEADER_SIZE - isize;
+
+		index = grub_malloc(isize);
+		if (!index)
+			goto fail;
+		if (!xz_pread(ipos, index, isize) || le32(index + isize - 4) != calc_crc32(0, index, isize - 4))
+			goto fail;
+		p = index;
+		iend = index + isize - 4;
+		if (*p++ || !xz_vli(&p, iend, &val) || val > (iend - p) / 2)
+			goto fail;
+		n = (unsigned long)val;
+		if (blocks && (n > count - total))
+			goto fail;
+
+		/* records: unpadded size, uncompressed size */
+		cpos = 0;
+		for (i = 0; i < n; i++) {
+			grub_u64_t unpadded, usize;
+
+			if (!xz_vli(&p, iend, &unpadded) || !xz_vli(&p, iend, &usize)
+			    || unpadded < 5 + xz_check_size[buf[9]] || unpadded > filemax)
+				goto fail;
+			if (blocks) {
+				struct xz_block *b = &blocks[count - total - n + i];
+
+				b->cpos = cpos;		/* from the stream start for now */
+				b->unpadded = unpadded;
+				b->usize = usize;
+				b->check = buf[9];
+			}
+			cpos += (unpadded + 3) & ~3ULL;
+			if (cpos > ipos)
+				goto fail;
+		}
+		while (p < iend && !*p)
+			p++;
+		if (p != iend || ((p - index) & 3))
+			goto fail;
+		grub_free(index);
+		index = 0;
+
+		/* stream header: magic, flags as in the footer, CRC32 */
+		if (ipos - cpos < XZ_HEADER_SIZE)
+			goto fail;
+		start = ipos - cpos - XZ_HEADER_SIZE;
+		{
+			unsigned char hdr[XZ_HEADER_SIZE];
+
+			if (!xz_pread(start, hdr, XZ_HEADER_SIZE) || memcmp((const char *)hdr, XZ_MAGIC, 6)
+			    || hdr[6] || hdr[7] != buf[9] || le32(hdr + 8) != calc_crc32(0, hdr + 6, 2))
+				goto fail;
+		}
+		if (blocks)
+			for (i = count - total - n; i < count - total; i++)
+				blocks[i].cpos += start + XZ_HEADER_SIZE;
+		total += n;
+		end = start;
+	}
+
+	if (blocks) {
+		grub_u64_t upos = 0;
+		unsigned long i;
+
+		for (i = 0; i < count; i++) {
+			blocks[i].upos = upos;
+			upos += blocks[i].usize;
+		}
+	}
+	return total;
+fail:
+	if (index)
+		grub_free(index);
+	return -1;
+}
+
+/* Make inp[inpPos] the byte at offset POS of the .xz file, reading from
+   there if inp does not hold N bytes of it. Return how many it holds. */
+static unsigned long
+xz_fill(grub_u64_t pos, unsigned long n)
+{
+	if (pos < xzdec.inpFilePos || pos + n > xzdec.inpFilePos + xzdec.inpSize) {
+		unsigned long len = XZ_INPBUFSIZE;
+
+		if (pos >= filemax)
+			return 0;
+		if (len > filemax - pos)
+			len = filemax - pos;
+		filepos = pos;
+		xzdec.inpFilePos = pos;
+		xzdec.inpSize = grub_read((grub_u64_t)(int)xzdec.inp, len, GRUB_READ);
+	}
+	xzdec.inpPos = pos - xzdec.inpFilePos;
+	return xzdec.inpSize - xzdec.inpPos;
+}
+
+/* the block holding uncompressed offset POS */
+static unsigned long
+xz_find(grub_u64_t pos)
+{
+	unsigned long lo = 0, hi = xzdec.nblocks;
+
+	while (hi - lo > 1) {
+		unsigned long mid = (lo + hi) >> 1;
+
+		if (xzdec.blocks[mid].upos <= pos)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Parse the header of block B and get ready to decode it. Unless KEEP,
+   what dic holds is dropped. */
+static int
+xz_block_start(unsigned long b, int keep)
+{
+	struct xz_block *blk = &xzdec.blocks[b];
+	const unsigned char *p, *hend;
+	unsigned long avail, hsize, dict;
+	grub_u64_t val;
+	unsigned char flags;
+
+	xzdec.cur = xzdec.nblocks;
+	xzdec.done = 0;
+	avail = xz_fill(blk->cpos, 1024);
+	p = xzdec.inp + xzdec.inpPos;
+	hsize = (p[0] + 1) << 2;
+	if (avail < 8 || !p[0] || hsize > avail)
+		goto fail;
+	hend = p + hsize - 4;
+	if (le32(hend) != calc_crc32(0, p, hsize - 4))
+		goto fail;
+	flags = p[1];
+	p += 2;
+	/* one filter, no reserved bits */
+	if (flags & 0x3F)
+		goto fail;
+	if ((flags & 0x40) && (!xz_vli(&p, hend, &val)
+			|| val != blk->unpadded - hsize - xz_check_size[blk->check]))
+		goto fail;
+	if ((flags & 0x80) && (!xz_vli(&p, hend, &val) || val != blk->usize))
+		goto fail;
+	if (!xz_vli(&p, hend, &val) || val != XZ_FILTER_LZMA2
+	    || !xz_vli(&p, hend, &val) || val != 1 || p >= hend || *p > 40)
+		goto fail;
+	dict = (*p == 40) ? 0xFFFFFFFFUL : (2UL | (*p & 1)) << (*p / 2 + 11);
+	for (p++; p < hend; p++)
+		if (*p)
+			goto fail;
+
+	/* the ring needs to be no bigger than a block */
+	if (dict > xzdec.maxusize)
+		dict = xzdec.maxusize;
+	if (dict < 0x1000)
+		dict = 0x1000;
+	if (dict > xzdec.dicSize) {
+		if (xzdec.dic)
+			grub_free(xzdec.dic);
+		xzdec.dicSize = 0;
+		xzdec.dic = grub_malloc(dict);
+		if (!xzdec.dic)
+			return 0;
+		xzdec.dicSize = dict;
+		keep = 0;
+	}
+	if (!keep) {
+		xzdec.dicFilePos = xzdec.low = blk->upos;
+		xzdec.dicPos = 0;
+	}
+	if (!lzma2_stream_init(xzdec.dic, xzdec.dicSize))
+		return 0;
+
+	xzdec.inpPos += hsize;
+	xzdec.check_on = decomp_verify && (blk->check == XZ_CHECK_CRC32 || blk->check == XZ_CHECK_CRC64);
+	xzdec.crc32 = 0;
+	xzdec.crc64 = 0;
+	xzdec.cur = b;
+	return 1;
+fail:
+	errnum = ERR_BAD_GZIP_DATA;
+	return 0;
+}
+
+/* Add N decoded bytes at P to the check of the block. */
+static void
+xz_check_update(const unsigned char *p, unsigned long n)
+{
+	if (!xzdec.check_on)
+		return;
+	if (!decomp_verify) {
+		xzdec.check_on = 0;
+		return;
+	}
+	if (xzdec.blocks[xzdec.cur].check == XZ_CHECK_CRC32)
+		xzdec.crc32 = calc_crc32(xzdec.crc32, p, n);
+	else
+		xzdec.crc64 = xz_crc64(xzdec.crc64, p, n);
+}
+
+/* After the end marker of the block: its sizes, padding and check. */
+static int
+xz_block_end(void)
+{
+	struct xz_block *blk = &xzdec.blocks[xzdec.cur];
+	unsigned long csize = xz_check_size[blk->check];
+	grub_u64_t pos = xzdec.inpFilePos + xzdec.inpPos;
+	unsigned long pad = (4 - ((unsigned long)pos & 3)) & 3, i;
+	const unsigned char *p;
+
+	if (xzdec.dicFilePos + xzdec.dicPos != blk->upos + blk->usize
+	    || pos - blk->cpos != blk->unpadded - csize
+	    || xz_fill(pos, pad + csize) < pad + csize)
+		goto fail;
+	p = xzdec.inp + xzdec.inpPos;
+	for (i = 0; i < pad; i++)
+		if (*p++)
+			goto fail;
+	if (xzdec.check_on) {
+		if (blk->check == XZ_CHECK_CRC32 ? le32(p) != xzdec.crc32
+		    : (le32(p) != (grub_u32_t)xzdec.crc64 || le32(p + 4) != (grub_u32_t)(xzdec.crc64 >> 32))) {
+			errnum = ERR_BAD_CHECKSUM;
+			return 0;
+		}
+	}
+	xzdec.inpPos += pad + csize;
+	xzdec.done = 1;
+	return 1;
+fail:
+	errnum = ERR_BAD_GZIP_DATA;
+	return 0;
+}
+
+int
+dec_xz_open(void)
+/* return 1=success or 0=failure */
+{
+	unsigned char header[XZ_HEADER_SIZE];
+	long n;
+	unsigned long i;
+
+	if (no_decompression) return 0;
+
+	/* Now it does not support openning more than 1 file at a time. 
+	   Make sure previously allocated memory blocks is freed. 
+	   Don't need this line if grub_close is called for every openned file before grub_open is called for next file. */
+	dec_xz_close();
+
+	filepos = 0;
+	if (filemax < 2 * XZ_HEADER_SIZE
+	    || grub_read((grub_u64_t)(int)header, XZ_HEADER_SIZE, GRUB_READ) != XZ_HEADER_SIZE
+	    || memcmp((const char *)header, XZ_MAGIC, 6)) {
+		/* file is not .xz */
+		filepos = 0;
+		return 0;
+	}
+	if (header[6] || header[7] > 15 || le32(header + 8) != calc_crc32(0, header + 6, 2))
+		goto fail;
+
+	/* count the blocks, then index them */
+	n = xz_walk(0, 0);
+	if (n < 0)
+		goto fail;
+	xzdec.blocks = grub_malloc((n ? n : 1) * sizeof(struct xz_block));
+	xzdec.inp = grub_malloc(XZ_INPBUFSIZE);
+	if (!xzdec.blocks || !xzdec.inp) {
+		dec_xz_close();
+		errnum = ERR_NOT_ENOUGH_MEMORY;
+		filepos = 0;
+		return 0;
+	}
+	if (xz_walk(xzdec.blocks, n) != n)
+		goto fail;
+	xzdec.nblocks = n;
+	xzdec.ufilemax = n ? xzdec.blocks[n - 1].upos + xzdec.blocks[n - 1].usize : 0;
+	xzdec.maxusize = 0;
+	for (i = 0; i < xzdec.nblocks; i++) {
+		grub_u64_t usize = xzdec.blocks[i].usize;
+
+		if (usize > 0xFFFFFFFFULL)
+			usize = 0xFFFFFFFFULL;
+		if (usize > xzdec.maxusize)
+			xzdec.maxusize = usize;
+	}
+	xzdec.cur = xzdec.nblocks;
+	xzdec.done = 0;
+	xzdec.dicPos = 0;
+	xzdec.dicFilePos = xzdec.low = 0;
+	xzdec.inpPos = xzdec.inpSize = 0;
+	xzdec.inpFilePos = 0;
+	xzdec.cfilemax = filemax;
+	xzdec.cfilepos = 0;
+
+	decomp_type = DECOMP_TYPE_XZ;
+	compressed_file = 1;
+	filemax = xzdec.ufilemax;
+	filepos = 0;
+	gzip_filemax = xzdec.cfilemax;
+	/* success */
+	errnum = ERR_NONE;
+	return 1;
+fail:
+	dec_xz_close();
+	errnum = ERR_BAD_GZIP_HEADER;
+	filepos = 0;
+	return 0;
+}
+
+void
+dec_xz_close(void)
+{
+	if (xzdec.blocks) { grub_free(xzdec.blocks); xzdec.blocks = 0; }
+	if (xzdec.inp) { grub_free(xzdec.inp); xzdec.inp = 0; }
+	if (xzdec.dic) { grub_free(xzdec.dic); xzdec.dic = 0; }
+	xzdec.dicSize = 0;
+	lzma2_stream_free();
+}
+
+unsigned long long
+dec_xz_read(unsigned long long buf, unsigned long long len, unsigned long write)
+{
+	unsigned long long outTx = 0;
+
+	compressed_file = 0;
+
+	xzdec.ufilemax = filemax;
+	xzdec.ufilepos = filepos;
+	filemax = xzdec.cfilemax;
+	filepos = xzdec.cfilepos;
+
+	/* Now filemax, filepos are of compressed file
+	* ufilemax, ufilepos are of uncompressed data
+	* cfilemax, cfilepos are not used
+	*/
+
+	if (xzdec.ufilepos >= xzdec.ufilemax)
+		len = 0;
+	else if (len > xzdec.ufilemax - xzdec.ufilepos)
+		len = xzdec.ufilemax - xzdec.ufilepos;
+	errnum = ERR_NONE;
+
+	while (len && !errnum) {
+		grub_u64_t ufp = xzdec.ufilepos;
+		grub_u64_t out = xzdec.dicFilePos + xzdec.dicPos;
+		grub_u64_t lo = (out > xzdec.dicSize) ? out - xzdec.dicSize : 0;
+		struct xz_block *blk;
+		unsigned long b, n, dicPos, inLen;
+		int r;
+
+		if (lo < xzdec.low)
+			lo = xzdec.low;
+		/* copy what dic holds */
+		if (ufp >= lo && ufp < out) {
+			unsigned char *p;
+
+			if (ufp >= xzdec.dicFilePos) {
+				p = xzdec.dic + (unsigned long)(ufp - xzdec.dicFilePos);
+				n = out - ufp;
+			} else {
+				n = xzdec.dicFilePos - ufp;
+				p = xzdec.dic + xzdec.dicSize - n;
+			}
+			if (n > len)
+				n = len;
+			if (buf) {
+				grub_memmove64(buf, (unsigned long)p, n);
+				buf += n;
+			}
+			xzdec.ufilepos += n;
+			outTx += n;
+			len -= n;
+			continue;
+		}
+
+		/* decode from the start of the block holding ufp, unless it is
+		   being decoded and ufp is ahead */
+		b = xz_find(ufp);
+		if ((b != xzdec.cur || ufp < lo)
+		    && !xz_block_start(b, ufp >= lo && out == xzdec.blocks[b].upos))
+			break;
+		blk = &xzdec.blocks[xzdec.cur];
+
+		if (xzdec.dicPos == xzdec.dicSize) {
+			xzdec.dicPos = 0;
+			xzdec.dicFilePos += xzdec.dicSize;
+		}
+		n = xzdec.dicSize - xzdec.dicPos;
+		if (blk->upos + blk->usize - out < n)
+			n = blk->upos + blk->usize - out;
+		if (xzdec.inpPos == xzdec.inpSize && !xz_fill(xzdec.inpFilePos + xzdec.inpSize, 1)) {
+			errnum = ERR_BAD_GZIP_DATA;
+			break;
+		}
+		dicPos = xzdec.dicPos;
+		inLen = xzdec.inpSize - xzdec.inpPos;
+		r = lzma2_stream_decode(&xzdec.dicPos, dicPos + n, xzdec.inp + xzdec.inpPos, &inLen);
+		xzdec.inpPos += inLen;
+		xz_check_update(xzdec.dic + dicPos, xzdec.dicPos - dicPos);
+		if (r < 0 || (r == 0 && !inLen && xzdec.dicPos == dicPos))
+			errnum = ERR_BAD_GZIP_DATA;
+		else if (r > 0)
+			xz_block_end();
+	}
+	if (errnum) {
+		/* start over on the next read */
+		xzdec.cur = xzdec.nblocks;
+		xzdec.low = xzdec.dicFilePos + xzdec.dicPos;
+	}
+
+	compressed_file = 1;
+	xzdec.cfilemax = filemax;
+	xzdec.cfilepos = filepos;
+	filemax = xzdec.ufilemax;
+	filepos = xzdec.ufilepos;
+
+	/* Now filemax, filepos are of uncompressed data
+	* cfilemax, cfilepos are of compressed file
+	* ufilemax, ufilepos are not used
+	*/
+
+	return outTx;
+}
+
+/* Decode an .xz stream whose blocks use the LZMA2 filter alone (as
+   written by mksquashfs without -Xbcj). Integrity checks are skipped.
+   Return the decoded size, or 0 with errnum set.  */
+unsigned long
+xz_decode_buffer(unsigned char *dst, unsigned long dst_len, const unsigned char *src, unsigned long src_len)
+{
+	const unsigned char *p = src, *end = src + src_len;
+	unsigned long out = 0;
+	unsigned int check;
+
+	if (src_len < XZ_HEADER_SIZE || memcmp((const char *)src, XZ_MAGIC, 6) || src[6] != 0 || src[7] > 15)
+		goto fail;
+	check = xz_check_size[src[7]];
+	p += XZ_HEADER_SIZE;
+
+	while (p < end && *p) {
+		const unsigned char *hdr_end = p + (*p + 1) * 4 - 4;	/* header CRC32 */
+		grub_u64_t val, id, props_size;
+		unsigned long used, n;
+		unsigned char flags;
+
+		if (hdr_end + 4 > end)
+			goto fail;
+		p++;
+		flags = *p++;
+		if (flags & 0x3F)
+			goto fail;	/* more than one filter, or reserved bits */
+		if ((flags & 0x40) && !xz_vli(&p, hdr_end, &val))
+			goto fail;
+		if ((flags & 0x80) && !xz_vli(&p, hdr_end, &val))
+			goto fail;
+		if (!xz_vli(&p, hdr_end, &id) || !xz_vli(&p, hdr_end, &props_size)
+		    || id != XZ_FILTER_LZMA2 || props_size != 1 || p >= hdr_end)
+			goto fail;
+
+		used = end - (hdr_end + 4);
+		n = lzma2_decode_buffer(dst + out, dst_len - out, hdr_end + 4, &used, *p);
+		if (!n)
+			return 0;
+		out += n;
+		p = hdr_end + 4 + used;
+		/* block padding to a multiple of four, then the check */
+		p += (4 - ((p - src) & 3)) & 3;
+		p += check;
+	}
+	if (p >= end)
+		goto fail;
+	return out;
+
+fail:
+	errnum = ERR_BAD_GZIP_DATA;
+	return 0;
+}
+
+#endif /* ! NO_DECOMPRESSION */
@@ -0,0 +1,1407 @@
+/*
+ *  GRUB4DOS  --  GRand Unified Bootloader
+ *  Copyright (C) 1999  Free Software Foundation, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ *  Based on
+ *  - RFC 8878 Zstandard Compression and the 'application/zstd' Media Type
+ *  - Zstandard Seekable Format version 0.1.0 2017-01-02 Facebook
+ *
+ *  A .zst file is a sequence of frames, each decodable on its own. Where
+ *  the frames start comes from the seek table of the seekable format if
+ *  the file ends with one, or else from a walk over the block headers at
+ *  open. A read then decodes from the start of the frame that holds it.
+ *  Frames using a dictionary are not supported.
+ */
+
+#include "shared.h"
+
+#ifndef NO_DECOMPRESSION
+
+#define ZSTD_MAGIC		0xFD2FB528UL
+#define ZSTD_SKIPPABLE		0x184D2A50UL	/* to 0x184D2A5F */
+#define ZSTD_SEEKTABLE		0x184D2A5EUL
+#define ZSTD_SEEKABLE_MAGIC	0x8F92EAB1UL
+#define ZSTD_FRAME_HEADER_MAX	18
+#define ZSTD_BLOCK_MAX		0x20000UL
+/* the largest window taken on, 1 GB */
+#define ZSTD_WINDOW_LOG_MAX	30
+/* input buffer size 256 KB, room for a block anywhere in it */
+#define ZSTD_INPBUFSIZE		0x40000UL
+
+#define le16(p) ((grub_u32_t)(p)[0] | ((grub_u32_t)(p)[1] << 8))
+#define le32(p) ((grub_u32_t)(p)[0] | ((grub_u32_t)(p)[1] << 8) | ((grub_u32_t)(p)[2] << 16) | ((grub_u32_t)(p)[3] << 24))
+
+/* FSE decoding table entry: the state after it is base + the next BITS bits */
+struct zstd_fse {
+	unsigned short base;
+	unsigned char symbol;
+	unsigned char bits;
+};
+
+/* Huffman decoding table entry, indexed by the next huf_log bits */
+struct zstd_huf {
+	unsigned char symbol;
+	unsigned char bits;
+};
+
+#define ZSTD_HUF_LOG_MAX	11
+#define ZSTD_LL_LOG_MAX		9
+#define ZSTD_ML_LOG_MAX		9
+#define ZSTD_OF_LOG_MAX		8
+#define ZSTD_LL_MAX		35
+#define ZSTD_ML_MAX		52
+#define ZSTD_OF_MAX		31
+
+#define ZSTD_HAVE_LL		1
+#define ZSTD_HAVE_OF		2
+#define ZSTD_HAVE_ML		4
+#define ZSTD_HAVE_HUF		8
+
+/* decoder state of a frame, kept from block to block */
+struct zstd_ctx {
+	unsigned char *dic;		/* output, which matches copy from */
+	unsigned long pos, size;
+	unsigned long hist;		/* the frame starts at dic[hist], or before */
+	unsigned long window;
+	unsigned char *lit;		/* ZSTD_BLOCK_MAX bytes of literals */
+	grub_u32_t rep[3];
+	unsigned int have;		/* tables from earlier blocks */
+	unsigned int huf_log;
+	unsigned char ll_log, of_log, ml_log;
+	struct zstd_huf huf[1 << ZSTD_HUF_LOG_MAX];
+	struct zstd_fse ll[1 << ZSTD_LL_LOG_MAX];
+	struct zstd_fse of[1 << ZSTD_OF_LOG_MAX];
+	struct zstd_fse ml[1 << ZSTD_ML_LOG_MAX];
+};
+
+struct zstd_frame_header {
+	grub_u64_t fcs;			/* content size, if has_fcs */
+	unsigned long window;
+	unsigned int size;
+	int has_fcs, checksum;
+};
+
+/* Literals_Length and Match_Length codes: baseline and extra bits */
+struct zstd_code {
+	grub_u32_t base;
+	unsigned char bits;
+};
+
+static const struct zstd_code zstd_ll_code[ZSTD_LL_MAX + 1] = {
+	{0, 0}, {1, 0}, {2, 0}, {3, 0}, {4, 0}, {5, 0}, {6, 0}, {7, 0},
+	{8, 0}, {9, 0}, {10, 0}, {11, 0}, {12, 0}, {13, 0}, {14, 0}, {15, 0},
+	{16, 1}, {18, 1}, {20, 1}, {22, 1}, {24, 2}, {28, 2}, {32, 3}, {40, 3},
+	{48, 4}, {64, 6}, {128, 7}, {256, 8}, {512, 9}, {1024, 10}, {2048, 11}, {4096, 12},
+	{8192, 13}, {16384, 14}, {32768, 15}, {65536, 16}
+};
+
+static const struct zstd_code zstd_ml_code[ZSTD_ML_MAX + 1] = {
+	{3, 0}, {4, 0}, {5, 0}, {6, 0}, {7, 0}, {8, 0}, {9, 0}, {10, 0},
+	{11, 0}, {12, 0}, {13, 0}, {14, 0}, {15, 0}, {16, 0}, {17, 0}, {18, 0},
+	{19, 0}, {20, 0}, {21, 0}, {22, 0}, {23, 0}, {24, 0}, {25, 0}, {26, 0},
+	{27, 0}, {28, 0}, {29, 0}, {30, 0}, {31, 0}, {32, 0}, {33, 0}, {34, 0},
+	{35, 1}, {37, 1}, {39, 1}, {41, 1}, {43, 2}, {47, 2}, {51, 3}, {59, 3},
+	{67, 4}, {83, 4}, {99, 5}, {131, 7}, {259, 8}, {515, 9}, {1027, 10}, {2051, 11},
+	{4099, 12}, {8195, 13}, {16387, 14}, {32771, 15}, {65539, 16}
+};
+
+/* the predefined distributions */
+static const short zstd_ll_default[36] = {
+	4, 3, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 1,
+	2, 2, 2, 2, 2, 2, 2, 2, 2, 3, 2, 1, 1, 1, 1, 1,
+	-1, -1, -1, -1
+};
+
+static const short zstd_ml_default[53] = {
+	1, 4, 3, 2, 2, 2, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, -1, -1,
+	-1, -1, -1, -1, -1
+};
+
+static const short zstd_of_default[29] = {
+	1, 1, 1, 1, 1, 1, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, -1, -1, -1, -1, -1
+};
+
+static unsigned int
+zstd_highbit(grub_u32_t v)
+{
+	return 31 - __builtin_clz(v);
+}
+
+/* xxHash64, for the content checksum of a frame */
+#define XXH64_PRIME1 0x9E3779B185EBCA87ULL
+#define XXH64_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define XXH64_PRIME3 0x165667B19E3779F9ULL
+#define XXH64_PRIME4 0x85EBCA77C2B2AE63ULL
+#define XXH64_PRIME5 0x27D4EB2F165667C5ULL
+#define XXH64_ROTL(x,r) (((x) << (r)) | ((x) >> (64 - (r))))
+#define le64(p) ((grub_u64_t)le32(p) | ((grub_u64_t)le32((p) + 4) << 32))
+
+struct xxh64_state {
+	grub_u64_t v[4];
+	grub_u64_t total;
+	grub_u32_t memsize;
+	unsigned char mem[32];
+};
+
+static grub_u64_t
+xxh64_round(grub_u64_t acc, grub_u64_t input)
+{
+	acc += input * XXH64_PRIME2;
+	acc = XXH64_ROTL(acc, 31);
+	return acc * XXH64_PRIME1;
+}
+
+static grub_u64_t
+xxh64_merge(grub_u64_t acc, grub_u64_t v)
+{
+	acc ^= xxh64_round(0, v);
+	return acc * XXH64_PRIME1 + XXH64_PRIME4;
+}
+
+static void
+xxh64_reset(struct xxh64_state *s)
+{
+	s->v[0] = XXH64_PRIME1 + XXH64_PRIME2;
+	s->v[1] = XXH64_PRIME2;
+	s->v[2] = 0;
+	s->v[3] = 0 - XXH64_PRIME1;
+	s->total = 0;
+	s->memsize = 0;
+}
+
+static void
+xxh64_update(struct xxh64_state *s, const unsigned char *p, unsigned long len)
+{
+	const unsigned char *end = p + len;
+	grub_u64_t v0, v1, v2, v3;
+
+	s->total += len;
+	if (s->memsize + len < 32) {
+		memmove(s->mem + s->memsize, p, len);
+		s->memsize += len;
+		return;
+	}
+	if (s->memsize) {
+		memmove(s->mem + s->memsize, p, 32 - s->memsize);
+		p += 32 - s->memsize;
+		s->v[0] = xxh64_round(s->v[0], le64(s->mem));
+		s->v[1] = xxh64_round(s->v[1], le64(s->mem + 8));
+		s->v[2] = xxh64_round(s->v[2], le64(s->mem + 16));
+		s->v[3] = xxh64_round(s->v[3], le64(s->mem + 24));
+		s->memsize = 0;
+	}
+	v0 = s->v[0]; v1 = s->v[1]; v2 = s->v[2]; v3 = s->v[3];
+	for (; end - p >= 32; p += 32) {
+		v0 = xxh64_round(v0, le64(p));
+		v1 = xxh64_round(v1, le64(p + 8));
+		v2 = xxh64_round(v2, le64(p + 16));
+		v3 = xxh64_round(v3, le64(p + 24));
+	}
+	s->v[0] = v0; s->v[1] = v1; s->v[2] = v2; s->v[3] = v3;
+	if (p < end) {
+		memmove(s->mem, p, end - p);
+		s->memsize = end - p;
+	}
+}
+
+static grub_u64_t
+xxh64_digest(struct xxh64_state *s)
+{
+	const unsigned char *p = s->mem, *end = s->mem + s->memsize;
+	grub_u64_t h;
+
+	if (s->total >= 32) {
+		h = XXH64_ROTL(s->v[0], 1) + XXH64_ROTL(s->v[1], 7)
+		  + XXH64_ROTL(s->v[2], 12) + XXH64_ROTL(s->v[3], 18);
+		h = xxh64_merge(h, s->v[0]);
+		h = xxh64_merge(h, s->v[1]);
+		h = xxh64_merge(h, s->v[2]);
+		h = xxh64_merge(h, s->v[3]);
+	} else
+		h = s->v[2] + XXH64_PRIME5;	/* the seed, 0 */
+	h += s->total;
+	for (; end - p >= 8; p += 8) {
+		h ^= xxh64_round(0, le64(p));
+		h = XXH64_ROTL(h, 27) * XXH64_PRIME1 + XXH64_PRIME4;
+	}
+	if (end - p >= 4) {
+		h ^= (grub_u64_t)le32(p) * XXH64_PRIME1;
+		h = XXH64_ROTL(h, 23) * XXH64_PRIME2 + XXH64_PRIME3;
+		p += 4;
+	}
+	for (; p < end; p++) {
+		h ^= *p * XXH64_PRIME5;
+		h = XXH64_ROTL(h, 11) * XXH64_PRIME1;
+	}
+	h ^= h >> 33;
+	h *= XXH64_PRIME2;
+	h ^= h >> 29;
+	h *= XXH64_PRIME3;
+	h ^= h >> 32;
+	return h;
+}
+
+/*
+ * Backward bit stream, as used by the Huffman and FSE coded parts: it
+ * is read from its last byte down, starting below the highest 1 bit of
+ * that byte. acc holds cnt bits still to be read, from its top bit.
+ */
+struct zstd_bits {
+	const unsigned char *start, *p;	/* start ... p-1 not yet in acc */
+	grub_u64_t acc;
+	int cnt;			/* below 0 once read past the start */
+};
+
+static void
+zstd_bits_fill(struct zstd_bits *b)
+{
+	while (b->cnt <= 56 && b->p > b->start) {
+		if (b->cnt <= 32 && b->p - b->start >= 4) {
+			b->p -= 4;
+			b->acc |= (grub_u64_t)le32(b->p) << (32 - b->cnt);
+			b->cnt += 32;
+		} else {
+			b->acc |= (grub_u64_t)*--b->p << (56 - b->cnt);
+			b->cnt += 8;
+		}
+	}
+}
+
+/* N is 32 at most; past the start, the bits read are 0 */
+static grub_u32_t
+zstd_bits_read(struct zstd_bits *b, unsigned int n)
+{
+	grub_u32_t v;
+
+	if (!n)
+		return 0;
+	if (b->cnt < (int)n)
+		zstd_bits_fill(b);
+	v = (grub_u32_t)(b->acc >> (64 - n));
+	b->acc <<= n;
+	b->cnt -= n;
+	return v;
+}
+
+static int
+zstd_bits_init(struct zstd_bits *b, const unsigned char *src, unsigned long len)
+{
+	if (!len || !src[len - 1])
+		return 0;
+	b->start = src;
+	b->p = src + len;
+	b->acc = 0;
+	b->cnt = 0;
+	zstd_bits_read(b, 8 - zstd_highbit(src[len - 1]));
+	return 1;
+}
+
+#define zstd_bits_done(b) ((b)->cnt == 0 && (b)->p == (b)->start)
+
+/*
+ * Read an FSE table description (forward bit stream) at SRC into NORM,
+ * with symbols up to MAXSYM and an accuracy log up to MAXLOG. Return the
+ * number of bytes used, or -1.
+ */
+static long
+zstd_fse_norm(const unsigned char *src, unsigned long len, short *norm,
+	      unsigned int *nsym, unsigned int *log, unsigned int maxlog, unsigned int maxsym)
+{
+	grub_u32_t bitpos = 4, total = len << 3;
+	int remaining, threshold, nbits;
+	unsigned int sym = 0, al;
+
+	if (!len)
+		return -1;
+	al = (src[0] & 15) + 5;
+	if (al > maxlog)
+		return -1;
+	remaining = (1 << al) + 1;
+	threshold = 1 << al;
+	nbits = al + 1;
+	while (remaining > 1) {
+		grub_u32_t v, i;
+		int max, count;
+
+		if (sym > maxsym || bitpos >= total)
+			return -1;
+		/* the next bits, zero past the end */
+		v = 0;
+		for (i = 0; i < 3 && (bitpos >> 3) + i < len; i++)
+			v |= (grub_u32_t)src[(bitpos >> 3) + i] << (i << 3);
+		v >>= bitpos & 7;
+		max = 2 * threshold - 1 - remaining;
+		if ((int)(v & (threshold - 1)) < max) {
+			count = v & (threshold - 1);
+			bitpos += nbits - 1;
+		} else {
+			count = v & (2 * threshold - 1);
+			if (count >= threshold)
+				count -= max;
+			bitpos += nbits;
+		}
+		count--;
+		norm[sym++] = count;
+		remaining -= (count < 0) ? -count : count;
+		if (!count) {
+			/* runs of zero probabilities, 2 bits at a time */
+			grub_u32_t r;
+
+			do {
+				if ((bitpos >> 3) >= len)
+					return -1;
+				v = src[bitpos >> 3];
+				if ((bitpos >> 3) + 1 < len)
+					v |= (grub_u32_t)src[(bitpos >> 3) + 1] << 8;
+				r = (v >> (bitpos & 7)) & 3;
+				bitpos += 2;
+				for (i = 0; i < r; i++) {
+					if (sym > maxsym)
+						return -1;
+					norm[sym++] = 0;
+				}
+			} while (r == 3);
+		}
+		while (remaining < threshold) {
+			nbits--;
+			threshold >>= 1;
+		}
+	}
+	if (remaining != 1 || bitpos > total)
+		return -1;
+	*nsym = sym;
+	*log = al;
+	return (bitpos + 7) >> 3;
+}
+
+/* Build the decoding table T of 1 << LOG states from NORM. */
+static int
+zstd_fse_build(struct zstd_fse *t, const short *norm, unsigned int nsym, unsigned int log)
+{
+	unsigned int size = 1 << log, high = size - 1, mask = size - 1;
+	unsigned int step = (size >> 1) + (size >> 3) + 3, pos = 0, s, i;
+	unsigned short next[64];
+
+	for (s = 0; s < nsym; s++) {
+		if (norm[s] == -1) {
+			t[high--].symbol = s;
+			next[s] = 1;
+		} else
+			next[s] = norm[s];
+	}
+	for (s = 0; s < nsym; s++)
+		for (i = 0; (int)i < norm[s]; i++) {
+			t[pos].symbol = s;
+			do
+				pos = (pos + step) & mask;
+			while (pos > high);
+		}
+	if (pos)
+		return 0;
+	for (i = 0; i < size; i++) {
+		unsigned int n = next[t[i].symbol]++;
+
+		t[i].bits = log - zstd_highbit(n);
+		t[i].base = (n << t[i].bits) - size;
+	}
+	return 1;
+}
+
+/* Read the Huffman tree description at SRC. Return the bytes used or -1. */
+static long
+zstd_huf_read(struct zstd_ctx *z, const unsigned char *src, unsigned long len)
+{
+	unsigned char w[258];
+	unsigned int n = 0, i, wt, log;
+	grub_u32_t total = 0, rest, pos;
+	long used;
+
+	if (!len)
+		return -1;
+	if (src[0] >= 128) {
+		/* weights as 4-bit fields */
+		n = src[0] - 127;
+		used = 1 + (n + 1) / 2;
+		if ((unsigned long)used > len)
+			return -1;
+		for (i = 0; i < n; i++)
+			w[i] = (i & 1) ? src[1 + i / 2] & 15 : src[1 + i / 2] >> 4;
+	} else {
+		/* FSE coded weights, two states taking turns */
+		struct zstd_fse t[1 << 6];
+		struct zstd_bits b;
+		short norm[16];
+		unsigned int nsym, s1, s2;
+		long hl;
+
+		used = 1 + src[0];
+		if ((unsigned long)used > len)
+			return -1;
+		hl = zstd_fse_norm(src + 1, src[0], norm, &nsym, &log, 6, 15);
+		if (hl < 0 || !zstd_fse_build(t, norm, nsym, log)
+		    || !zstd_bits_init(&b, src + 1 + hl, src[0] - hl))
+			return -1;
+		s1 = zstd_bits_read(&b, log);
+		s2 = zstd_bits_read(&b, log);
+		for (;;) {
+			if (n > 254)
+				return -1;
+			w[n++] = t[s1].symbol;
+			s1 = t[s1].base + zstd_bits_read(&b, t[s1].bits);
+			if (b.cnt < 0) {
+				w[n++] = t[s2].symbol;
+				break;
+			}
+			w[n++] = t[s2].symbol;
+			s2 = t[s2].base + zstd_bits_read(&b, t[s2].bits);
+			if (b.cnt < 0) {
+				w[n++] = t[s1].symbol;
+				break;
+			}
+		}
+	}
+
+	/* the weight of the last symbol makes the total a power of 2 */
+	if (n > 255)
+		return -1;
+	for (i = 0; i < n; i++) {
+		if (w[i] > ZSTD_HUF_LOG_MAX)
+			return -1;
+		if (w[i])
+			total += 1 << (w[i] - 1);
+	}
+	if (!total)
+		return -1;
+	log = zstd_highbit(total) + 1;
+	rest = (1 << log) - total;
+	if (log > ZSTD_HUF_LOG_MAX || (rest & (rest - 1)))
+		return -1;
+	w[n++] = zstd_highbit(rest) + 1;
+
+	/* codes go to the lower weights first */
+	pos = 0;
+	for (wt = 1; wt <= log; wt++)
+		for (i = 0; i < n; i++)
+			if (w[i] == wt) {
+				grub_u32_t k, cnt = 1 << (wt - 1);
+
+				for (k = 0; k < cnt; k++) {
+					z->huf[pos + k].symbol = i;
+					z->huf[pos + k].bits = log + 1 - wt;
+				}
+				pos += cnt;
+			}
+	z->huf_log = log;
+	z->have |= ZSTD_HAVE_HUF;
+	return used;
+}
+
+/* Decode N literals of one Huffman stream of LEN bytes at SRC. */
+static int
+zstd_huf_stream(struct zstd_ctx *z, unsigned char *dst, unsigned long n, const unsigned char *src, unsigned long len)
+{
+	struct zstd_bits b;
+	unsigned int log = z->huf_log;
+
+	if (!zstd_bits_init(&b, src, len))
+		return 0;
+	while (n--) {
+		const struct zstd_huf *e;
+
+		if (b.cnt < (int)log)
+			zstd_bits_fill(&b);
+		e = &z->huf[(grub_u32_t)(b.acc >> (64 - log))];
+		*dst++ = e->symbol;
+		b.acc <<= e->bits;
+		b.cnt -= e->bits;
+	}
+	return zstd_bits_done(&b);
+}
+
+/* The literals section at SRC into z->lit. Return the bytes used or -1. */
+static long
+zstd_literals(struct zstd_ctx *z, const unsigned char *src, unsigned long len, unsigned long *nlit)
+{
+	unsigned int type = src[0] & 3, format = (src[0] >> 2) & 3, hs;
+	grub_u32_t regen, csize;
+	const unsigned char *p;
+	long n, used;
+
+	if (type < 2) {
+		/* raw or RLE */
+		switch (format) {
+		case 1:
+			hs = 2;
+			regen = (src[0] >> 4) + ((grub_u32_t)src[1] << 4);
+			break;
+		case 3:
+			hs = 3;
+			regen = (src[0] >> 4) + ((grub_u32_t)src[1] << 4) + ((grub_u32_t)src[2] << 12);
+			break;
+		default:
+			hs = 1;
+			regen = src[0] >> 3;
+		}
+		if (len < hs + (type ? 1 : regen) || regen > ZSTD_BLOCK_MAX)
+			return -1;
+		if (type)
+			memset(z->lit, src[hs], regen);
+		else
+			memmove(z->lit, src + hs, regen);
+		*nlit = regen;
+		return hs + (type ? 1 : regen);
+	}
+
+	/* Huffman coded, with a new tree or the last one */
+	hs = (format < 2) ? 3 : format + 2;
+	if (len < hs)
+		return -1;
+	{
+		grub_u64_t h = 0;
+		unsigned int i, bits = (hs << 2) - 2;	/* 10, 14 or 18 */
+
+		for (i = 0; i < hs; i++)
+			h |= (grub_u64_t)src[i] << (i << 3);
+		regen = (grub_u32_t)(h >> 4) & ((1UL << bits) - 1);
+		csize = (grub_u32_t)(h >> (4 + bits)) & ((1UL << bits) - 1);
+	}
+	if (regen > ZSTD_BLOCK_MAX || hs + csize > len)
+		return -1;
+	used = hs + csize;
+	p = src + hs;
+	if (type == 2) {
+		n = zstd_huf_read(z, p, csize);
+		if (n < 0)
+			return -1;
+		p += n;
+		csize -= n;
+	} else if (!(z->have & ZSTD_HAVE_HUF))
+		return -1;
+
+	if (!format) {
+		if (!zstd_huf_stream(z, z->lit, regen, p, csize))
+			return -1;
+	} else {
+		/* four streams, the first three sizes in a jump table */
+		grub_u32_t s1, s2, s3, q = (regen + 3) >> 2;
+
+		if (csize < 6 || regen < 3 * q)
+			return -1;
+		s1 = le16(p);
+		s2 = le16(p + 2);
+		s3 = le16(p + 4);
+		p += 6;
+		csize -= 6;
+		if (s1 + s2 + s3 > csize
+		    || !zstd_huf_stream(z, z->lit, q, p, s1)
+		    || !zstd_huf_stream(z, z->lit + q, q, p + s1, s2)
+		    || !zstd_huf_stream(z, z->lit + 2 * q, q, p + s1 + s2, s3)
+		    || !zstd_huf_stream(z, z->lit + 3 * q, regen - 3 * q, p + s1 + s2 + s3, csize - s1 - s2 - s3))
+			return -1;
+	}
+	*nlit = regen;
+	return used;
+}
+
+/* One of the three tables for the sequences, in MODE. Return the bytes
+   used or -1.  */
+static long
+zstd_seq_table(struct zstd_ctx *z, struct zstd_fse *t, unsigned char *log, unsigned int have,
+	       unsigned int mode, const unsigned char *src, unsigned long len,
+	       const short *def, unsigned int ndef, unsigned int deflog,
+	       unsigned int maxlog, unsigned int maxsym)
+{
+	short norm[64];
+	unsigned int nsym, al;
+	long n;
+
+	switch (mode) {
+	case 0:
+		/* predefined */
+		zstd_fse_build(t, def, ndef, deflog);
+		*log = deflog;
+		n = 0;
+		break;
+	case 1:
+		/* RLE, one symbol */
+		if (!len || src[0] > maxsym)
+			return -1;
+		t[0].symbol = src[0];
+		t[0].bits = 0;
+		t[0].base = 0;
+		*log = 0;
+		n = 1;
+		break;
+	case 2:
+		n = zstd_fse_norm(src, len, norm, &nsym, &al, maxlog, maxsym);
+		if (n < 0 || !zstd_fse_build(t, norm, nsym, al))
+			return -1;
+		*log = al;
+		break;
+	default:
+		/* the table of the last block */
+		return (z->have & have) ? 0 : -1;
+	}
+	z->have |= have;
+	return n;
+}
+
+/* The sequences section at SRC, with NLIT literals in z->lit: carry
+   them out to z->dic.  */
+static int
+zstd_sequences(struct zstd_ctx *z, const unsigned char *src, unsigned long len, unsigned long nlit)
+{
+	const unsigned char *p = src, *end = src + len;
+	const unsigned char *lit = z->lit, *litend = z->lit + nlit;
+	unsigned char *out = z->dic + z->pos, *oend = z->dic + z->size;
+	unsigned char *low = z->dic + z->hist;
+	grub_u32_t nseq, i, sll, sof, sml;
+	struct zstd_bits b;
+	unsigned int modes;
+	long n;
+
+	if (p == end)
+		return 0;
+	nseq = *p++;
+	if (nseq >= 128) {
+		if (nseq < 255) {
+			if (p == end)
+				return 0;
+			nseq = ((nseq - 128) << 8) + *p++;
+		} else {
+			if (end - p < 2)
+				return 0;
+			nseq = le16(p) + 0x7F00;
+			p += 2;
+		}
+	}
+
+	if (nseq) {
+		if (p == end)
+			return 0;
+		modes = *p++;
+		if (modes & 3)
+			return 0;
+		n = zstd_seq_table(z, z->ll, &z->ll_log, ZSTD_HAVE_LL, modes >> 6, p, end - p,
+				   zstd_ll_default, 36, 6, ZSTD_LL_LOG_MAX, ZSTD_LL_MAX);
+		if (n < 0)
+			return 0;
+		p += n;
+		n = zstd_seq_table(z, z->of, &z->of_log, ZSTD_HAVE_OF, (modes >> 4) & 3, p, end - p,
+				   zstd_of_default, 29, 5, ZSTD_OF_LOG_MAX, ZSTD_OF_MAX);
+		if (n < 0)
+			return 0;
+		p += n;
+		n = zstd_seq_table(z, z->ml, &z->ml_log, ZSTD_HAVE_ML, (modes >> 2) & 3, p, end - p,
+				   zstd_ml_default, 53, 6, ZSTD_ML_LOG_MAX, ZSTD_ML_MAX);
+		if (n < 0)
+			return 0;
+		p += n;
+
+		if (!zstd_bits_init(&b, p, end - p))
+			return 0;
+		sll = zstd_bits_read(&b, z->ll_log);
+		sof = zstd_bits_read(&b, z->of_log);
+		sml = zstd_bits_read(&b, z->ml_log);
+
+		for (i = 0; i < nseq; i++) {
+			unsigned int llc = z->ll[sll].symbol, mlc = z->ml[sml].symbol, ofc = z->of[sof].symbol;
+			grub_u32_t offset, ml, ll;
+
+			/* offset, match length and literals length, in that order */
+			offset = ((grub_u32_t)1 << ofc) + zstd_bits_read(&b, ofc);
+			ml = zstd_ml_code[mlc].base + zstd_bits_read(&b, zstd_ml_code[mlc].bits);
+			ll = zstd_ll_code[llc].base + zstd_bits_read(&b, zstd_ll_code[llc].bits);
+
+			if (offset > 3) {
+				offset -= 3;
+				z->rep[2] = z->rep[1];
+				z->rep[1] = z->rep[0];
+				z->rep[0] = offset;
+			} else {
+				/* a repeat offset, shifted by one without literals */
+				unsigned int k = offset - 1 + !ll;
+
+				if (k) {
+					offset = (k == 3) ? z->rep[0] - 1 : z->rep[k];
+					if (k > 1)
+						z->rep[2] = z->rep[1];
+					z->rep[1] = z->rep[0];
+					z->rep[0] = offset;
+				} else
+					offset = z->rep[0];
+			}
+
+			if (i + 1 < nseq) {
+				sll = z->ll[sll].base + zstd_bits_read(&b, z->ll[sll].bits);
+				sml = z->ml[sml].base + zstd_bits_read(&b, z->ml[sml].bits);
+				sof = z->of[sof].base + zstd_bits_read(&b, z->of[sof].bits);
+			}
+
+			if (ll > (grub_u32_t)(litend - lit) || ll + ml > (grub_u32_t)(oend - out))
+				return 0;
+			memmove(out, lit, ll);
+			out += ll;
+			lit += ll;
+			if (!offset || offset > (grub_u32_t)(out - low))
+				return 0;
+			if (offset >= ml) {
+				memmove(out, out - offset, ml);
+				out += ml;
+			} else {
+				/* overlapping: the match repeats itself */
+				const unsigned char *m = out - offset;
+
+				while (ml--)
+					*out++ = *m++;
+			}
+		}
+		if (!zstd_bits_done(&b))
+			return 0;
+	} else if (p != end)
+		return 0;
+
+	/* the literals after the last match */
+	if ((grub_u32_t)(litend - lit) > (grub_u32_t)(oend - out))
+		return 0;
+	memmove(out, lit, litend - lit);
+	out += litend - lit;
+	z->pos = out - z->dic;
+	return 1;
+}
+
+/* Decode a block of TYPE, whose Block_Size field is SIZE, from LEN bytes
+   at SRC to z->dic + z->pos. Return 0 if it is corrupt.  */
+static int
+zstd_block(struct zstd_ctx *z, unsigned int type, const unsigned char *src, unsigned long len, unsigned long size)
+{
+	unsigned long pos = z->pos, nlit;
+	long n;
+
+	switch (type) {
+	case 0:
+		/* raw */
+		if (size > len || size > z->size - pos)
+			return 0;
+		memmove(z->dic + pos, src, size);
+		z->pos += size;
+		return 1;
+	case 1:
+		/* RLE */
+		if (!len || size > z->size - pos)
+			return 0;
+		memset(z->dic + pos, src[0], size);
+		z->pos += size;
+		return 1;
+	case 2:
+		if (!len)
+			return 0;
+		n = zstd_literals(z, src, len, &nlit);
+		if (n < 0 || !zstd_sequences(z, src + n, len - n, nlit))
+			return 0;
+		return z->pos - pos <= ZSTD_BLOCK_MAX;
+	}
+	return 0;
+}
+
+/* Parse the frame header at SRC. Return 0 if it is not one we take. */
+static int
+zstd_frame_header(const unsigned char *src, unsigned long len, struct zstd_frame_header *h)
+{
+	static const unsigned char did_size[4] = {0, 1, 2, 4};
+	unsigned int fhd, p = 5, fcs_size, single;
+
+	if (len < 6 || le32(src) != ZSTD_MAGIC)
+		return 0;
+	fhd = src[4];
+	single = (fhd >> 5) & 1;
+	/* reserved bit, or a dictionary */
+	if ((fhd & 0x08) || (fhd & 3))
+		return 0;
+	h->checksum = (fhd >> 2) & 1;
+	h->window = 0;
+	if (!single) {
+		unsigned int wlog = 10 + (src[p] >> 3);
+
+		if (wlog > ZSTD_WINDOW_LOG_MAX)
+			return 0;
+		h->window = (1UL << wlog) + ((1UL << wlog) >> 3) * (src[p] & 7);
+		p++;
+	}
+	p += did_size[fhd & 3];
+	fcs_size = (fhd >> 6) ? 1 << (fhd >> 6) : single;
+	if (p + fcs_size > len)
+		return 0;
+	switch (fcs_size) {
+	case 1:
+		h->fcs = src[p];
+		break;
+	case 2:
+		h->fcs = le16(src + p) + 256;
+		break;
+	case 4:
+		h->fcs = le32(src + p);
+		break;
+	case 8:
+		h->fcs = le64(src + p);
+		break;
+	}
+	h->has_fcs = (fcs_size != 0);
+	if (single) {
+		if (h->fcs > (1UL << ZSTD_WINDOW_LOG_MAX))
+			return 0;
+		h->window = h->fcs;
+	}
+	h->size = p + fcs_size;
+	return 1;
+}
+
+static void
+zstd_frame_init(struct zstd_ctx *z, unsigned long window)
+{
+	z->hist = z->pos;
+	z->window = window;
+	z->rep[0] = 1;
+	z->rep[1] = 4;
+	z->rep[2] = 8;
+	z->have = 0;
+}
+
+/* Slide the data of the frame down to make room for a block, keeping
+   the window that matches may copy from. */
+static void
+zstd_slide(struct zstd_ctx *z, grub_u64_t *dic_file_pos)
+{
+	unsigned long keep, shift;
+
+	if (z->size - z->pos >= ZSTD_BLOCK_MAX)
+		return;
+	keep = z->pos - z->hist;
+	if (keep > z->window)
+		keep = z->window;
+	shift = z->pos - keep;
+	if (!shift)
+		return;
+	memmove(z->dic, z->dic + shift, keep);
+	z->pos = keep;
+	z->hist = (z->hist > shift) ? z->hist - shift : 0;
+	*dic_file_pos += shift;
+}
+
+struct zstd_frame {
+	grub_u64_t cpos;	/* offset of the frame in the .zst file */
+	grub_u64_t upos;	/* offset of its data in the uncompressed file */
+	grub_u64_t usize;
+};
+
+static struct zstd_ctx zstd_file;
+
+static struct {
+	struct zstd_frame *frames;
+	unsigned long nframes, maxframes;
+	unsigned long cur;		/* frame being decoded, nframes if none */
+	int done;			/* cur has been decoded and checked */
+	grub_u64_t next;		/* offset of the next block header of cur */
+	int checksum;			/* cur ends with a content checksum */
+	int check_on;
+	struct xxh64_state xxh;
+	/*
+	 * zstd_file.dic[0 ... pos-1] holds uncompressed data [dicFilePos ...],
+	 * though nothing before low.
+	 */
+	grub_u64_t dicFilePos;
+	grub_u64_t low;
+	/* inp[0 ... inpSize-1] holds the .zst file from inpFilePos */
+	unsigned char *inp;
+	unsigned long inpPos, inpSize;
+	grub_u64_t inpFilePos;
+	grub_u64_t cfilemax, cfilepos;
+	grub_u64_t ufilemax, ufilepos;
+} zsdec;
+
+/* Read N bytes at offset POS of the .zst file into BUF. */
+static int
+zstd_pread(grub_u64_t pos, void *buf, unsigned long n)
+{
+	filepos = pos;
+	return grub_read((grub_u64_t)(int)buf, n, GRUB_READ) == n;
+}
+
+/* Append a frame at CPOS of USIZE bytes to the table. */
+static int
+zstd_add_frame(grub_u64_t cpos, grub_u64_t usize)
+{
+	struct zstd_frame *f;
+
+	if (zsdec.nframes == zsdec.maxframes) {
+		unsigned long max = zsdec.maxframes ? zsdec.maxframes * 2 : 64;
+
+		f = grub_malloc(max * sizeof(struct zstd_frame));
+		if (!f)
+			return 0;
+		if (zsdec.frames) {
+			memmove(f, zsdec.frames, zsdec.nframes * sizeof(struct zstd_frame));
+			grub_free(zsdec.frames);
+		}
+		zsdec.frames = f;
+		zsdec.maxframes = max;
+	}
+	f = &zsdec.frames[zsdec.nframes];
+	f->cpos = cpos;
+	f->upos = zsdec.nframes ? f[-1].upos + f[-1].usize : 0;
+	f->usize = usize;
+	zsdec.nframes++;
+	return 1;
+}
+
+/*
+ * Index the frames from the seek table that ends a file in the seekable
+ * format. Return 1 if it does, 0 if there is no seek table, or -1 if it
+ * is not well-formed.
+ */
+static int
+zstd_seek_table(void)
+{
+	unsigned char foot[9], *tab, *p;
+	grub_u64_t size, start, cpos = 0;
+	unsigned long n, esize, i;
+	int ret = -1;
+
+	if (filemax < 17 || !zstd_pread(filemax - 9, foot, 9) || le32(foot + 5) != ZSTD_SEEKABLE_MAGIC)
+		return 0;
+	/* reserved bits of the descriptor */
+	if (foot[4] & 0x7C)
+		return -1;
+	n = le32(foot);
+	esize = (foot[4] & 0x80) ? 12 : 8;	/* with a checksum of each frame */
+	size = (grub_u64_t)n * esize;
+	if (size + 17 > filemax || size > 0x1000000)
+		return -1;
+	start = filemax - size - 17;
+
+	/* skippable frame header, then the entries */
+	tab = grub_malloc(size + 8);
+	if (!tab)
+		return -1;
+	if (!zstd_pread(start, tab, size + 8) || le32(tab) != ZSTD_SEEKTABLE || le32(tab + 4) != size + 9)
+		goto out;
+	for (i = 0, p = tab + 8; i < n; i++, p += esize) {
+		if (!le32(p) || !zstd_add_frame(cpos, le32(p + 4)))
+			goto out;
+		cpos += le32(p);
+	}
+	if (cpos == start)
+		ret = 1;
+out:
+	grub_free(tab);
+	return ret;
+}
+
+/*
+ * Index the frames by walking the file from its start, reading the frame
+ * and block headers only. Frames must give their content size. Return 1,
+ * or -1 if the file is not well-formed.
+ */
+static int
+zstd_walk(void)
+{
+	unsigned char buf[ZSTD_FRAME_HEADER_MAX];
+	grub_u64_t pos = 0;
+
+	while (pos < filemax) {
+		struct zstd_frame_header h;
+		unsigned long len = ZSTD_FRAME_HEADER_MAX;
+
+		if (len > filemax - pos)
+			len = filemax - pos;
+		if (len < 8 || !zstd_pread(pos, buf, len))
+			return -1;
+		if ((le32(buf) & 0xFFFFFFF0) == ZSTD_SKIPPABLE) {
+			pos += 8 + (grub_u64_t)le32(buf + 4);
+			continue;
+		}
+		if (!zstd_frame_header(buf, len, &h) || !h.has_fcs || !zstd_add_frame(pos, h.fcs))
+			return -1;
+		pos += h.size;
+		for (;;) {
+			grub_u32_t bh;
+
+			if (filemax - pos < 3 || !zstd_pread(pos, buf, 3))
+				return -1;
+			bh = buf[0] | ((grub_u32_t)buf[1] << 8) | ((grub_u32_t)buf[2] << 16);
+			pos += 3 + ((((bh >> 1) & 3) == 1) ? 1 : (bh >> 3));
+			if (bh & 1)
+				break;
+		}
+		if (h.checksum)
+			pos += 4;
+	}
+	return (pos == filemax) ? 1 : -1;
+}
+
+/* Make inp[inpPos] the byte at offset POS of the .zst file, reading from
+   there if inp does not hold N bytes of it. Return how many it holds. */
+static unsigned long
+zstd_fill(grub_u64_t pos, unsigned long n)
+{
+	if (pos < zsdec.inpFilePos || pos + n > zsdec.inpFilePos + zsdec.inpSize) {
+		unsigned long len = ZSTD_INPBUFSIZE;
+
+		if (pos >= filemax)
+			return 0;
+		if (len > filemax - pos)
+			len = filemax - pos;
+		filepos = pos;
+		zsdec.inpFilePos = pos;
+		zsdec.inpSize = grub_read((grub_u64_t)(int)zsdec.inp, len, GRUB_READ);
+	}
+	zsdec.inpPos = pos - zsdec.inpFilePos;
+	return zsdec.inpSize - zsdec.inpPos;
+}
+
+/* the frame holding uncompressed offset POS */
+static unsigned long
+zstd_find(grub_u64_t pos)
+{
+	unsigned long lo = 0, hi = zsdec.nframes;
+
+	while (hi - lo > 1) {
+		unsigned long mid = (lo + hi) >> 1;
+
+		if (zsdec.frames[mid].upos <= pos)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Parse the header of frame F and get ready to decode its blocks. Unless
+   KEEP, what dic holds is dropped. */
+static int
+zstd_frame_start(unsigned long f, int keep)
+{
+	struct zstd_frame *fr = &zsdec.frames[f];
+	struct zstd_frame_header h;
+	grub_u64_t need;
+	unsigned long avail;
+
+	zsdec.cur = zsdec.nframes;
+	zsdec.done = 0;
+	avail = zstd_fill(fr->cpos, ZSTD_FRAME_HEADER_MAX);
+	if (!zstd_frame_header(zsdec.inp + zsdec.inpPos, avail, &h) || (h.has_fcs && h.fcs != fr->usize)) {
+		errnum = ERR_BAD_GZIP_DATA;
+		return 0;
+	}
+
+	/* room for the window and a block above it, but no more than the frame */
+	need = (grub_u64_t)h.window * 2 + ZSTD_BLOCK_MAX;
+	if (need > fr->usize)
+		need = fr->usize;
+	if (need < 0x1000)
+		need = 0x1000;
+	if (need > zstd_file.size) {
+		if (zstd_file.dic)
+			grub_free(zstd_file.dic);
+		zstd_file.size = 0;
+		zstd_file.dic = (need < 0x80000000ULL) ? grub_malloc(need) : 0;
+		if (!zstd_file.dic) {
+			errnum = ERR_NOT_ENOUGH_MEMORY;
+			return 0;
+		}
+		zstd_file.size = need;
+		keep = 0;
+	}
+	if (!keep) {
+		zsdec.dicFilePos = zsdec.low = fr->upos;
+		zstd_file.pos = 0;
+	}
+	zstd_frame_init(&zstd_file, h.window);
+
+	zsdec.next = fr->cpos + h.size;
+	zsdec.checksum = h.checksum;
+	zsdec.check_on = decomp_verify && h.checksum;
+	xxh64_reset(&zsdec.xxh);
+	zsdec.cur = f;
+	return 1;
+}
+
+/* Decode the next block of the current frame, checking the frame after
+   the last one. */
+static int
+zstd_next_block(void)
+{
+	struct zstd_frame *fr = &zsdec.frames[zsdec.cur];
+	const unsigned char *p;
+	unsigned long pos, csize, size;
+	unsigned int type;
+	grub_u32_t bh;
+
+	if (zstd_fill(zsdec.next, 3) < 3)
+		goto fail;
+	p = zsdec.inp + zsdec.inpPos;
+	bh = p[0] | ((grub_u32_t)p[1] << 8) | ((grub_u32_t)p[2] << 16);
+	type = (bh >> 1) & 3;
+	size = bh >> 3;
+	csize = (type == 1) ? 1 : size;
+	if (size > ZSTD_BLOCK_MAX || zstd_fill(zsdec.next, 3 + csize) < 3 + csize)
+		goto fail;
+
+	zstd_slide(&zstd_file, &zsdec.dicFilePos);
+	pos = zstd_file.pos;
+	if (!zstd_block(&zstd_file, type, zsdec.inp + zsdec.inpPos + 3, csize, size)
+	    || zsdec.dicFilePos + zstd_file.pos > fr->upos + fr->usize)
+		goto fail;
+	if (zsdec.check_on) {
+		if (decomp_verify)
+			xxh64_update(&zsdec.xxh, zstd_file.dic + pos, zstd_file.pos - pos);
+		else
+			zsdec.check_on = 0;
+	}
+	zsdec.next += 3 + csize;
+	if (!(bh & 1))
+		return 1;
+
+	/* the last block: the size and the checksum of the frame */
+	if (zsdec.dicFilePos + zstd_file.pos != fr->upos + fr->usize)
+		goto fail;
+	if (zsdec.checksum) {
+		if (zstd_fill(zsdec.next, 4) < 4)
+			goto fail;
+		if (zsdec.check_on && le32(zsdec.inp + zsdec.inpPos) != (grub_u32_t)xxh64_digest(&zsdec.xxh)) {
+			errnum = ERR_BAD_CHECKSUM;
+			return 0;
+		}
+		zsdec.next += 4;
+	}
+	zsdec.done = 1;
+	return 1;
+fail:
+	errnum = ERR_BAD_GZIP_DATA;
+	return 0;
+}
+
+int
+dec_zstd_open(void)
+/* return 1=success or 0=failure */
+{
+	unsigned char header[4];
+	int r;
+
+	if (no_decompression) return 0;
+
+	/* Now it does not support openning more than 1 file at a time. 
+	   Make sure previously allocated memory blocks is freed. 
+	   Don't need this line if grub_close is called for every openned file before grub_open is called for next file. */
+	dec_zstd_close();
+
+	filepos = 0;
+	if (filemax < 9
+	    || grub_read((grub_u64_t)(int)header, 4, GRUB_READ) != 4
+	    || le32(header) != ZSTD_MAGIC) {
+		/* file is not .zst */
+		filepos = 0;
+		return 0;
+	}
+
+	/* the seek table if there is one, else the frame headers */
+	r = zstd_seek_table();
+	if (!r)
+		r = zstd_walk();
+	if (r < 0)
+		goto fail;
+	zsdec.inp = grub_malloc(ZSTD_INPBUFSIZE);
+	zstd_file.lit = grub_malloc(ZSTD_BLOCK_MAX);
+	if (!zsdec.inp || !zstd_file.lit)
+		goto fail;
+	zsdec.ufilemax = zsdec.nframes ? zsdec.frames[zsdec.nframes - 1].upos + zsdec.frames[zsdec.nframes - 1].usize : 0;
+	zsdec.cur = zsdec.nframes;
+	zsdec.done = 0;
+	zstd_file.pos = 0;
+	zsdec.dicFilePos = zsdec.low = 0;
+	zsdec.inpPos = zsdec.inpSize = 0;
+	zsdec.inpFilePos = 0;
+	zsdec.cfilemax = filemax;
+	zsdec.cfilepos = 0;
+
+	decomp_type = DECOMP_TYPE_ZSTD;
+	compressed_file = 1;
+	filemax = zsdec.ufilemax;
+	filepos = 0;
+	gzip_filemax = zsdec.cfilemax;
+	/* success */
+	errnum = ERR_NONE;
+	return 1;
+fail:
+	dec_zstd_close();
+	if (errnum != ERR_NOT_ENOUGH_MEMORY)
+		errnum = ERR_BAD_GZIP_HEADER;
+	filepos = 0;
+	return 0;
+}
+
+void
+dec_zstd_close(void)
+{
+	if (zsdec.frames) { grub_free(zsdec.frames); zsdec.frames = 0; }
+	if (zsdec.inp) { grub_free(zsdec.inp); zsdec.inp = 0; }
+	if (zstd_file.dic) { grub_free(zstd_file.dic); zstd_file.dic = 0; }
+	if (zstd_file.lit) { grub_free(zstd_file.lit); zstd_file.lit = 0; }
+	zsdec.nframes = zsdec.maxframes = 0;
+	zstd_file.size = 0;
+}
+
+unsigned long long
+dec_zstd_read(unsigned long long buf, unsigned long long len, unsigned long write)
+{
+	unsigned long long outTx = 0;
+
+	compressed_file = 0;
+
+	zsdec.ufilemax = filemax;
+	zsdec.ufilepos = filepos;
+	filemax = zsdec.cfilemax;
+	filepos = zsdec.cfilepos;
+
+	/* Now filemax, filepos are of compressed file
+	* ufilemax, ufilepos are of uncompressed data
+	* cfilemax, cfilepos are not used
+	*/
+
+	if (zsdec.ufilepos >= zsdec.ufilemax)
+		len = 0;
+	else if (len > zsdec.ufilemax - zsdec.ufilepos)
+		len = zsdec.ufilemax - zsdec.ufilepos;
+	errnum = ERR_NONE;
+
+	while (len && !errnum) {
+		grub_u64_t ufp = zsdec.ufilepos;
+		grub_u64_t out = zsdec.dicFilePos + zstd_file.pos;
+		grub_u64_t lo = (zsdec.low > zsdec.dicFilePos) ? zsdec.low : zsdec.dicFilePos;
+		unsigned long f, n;
+
+		/* copy what dic holds */
+		if (ufp >= lo && ufp < out) {
+			n = out - ufp;
+			if (n > len)
+				n = len;
+			if (buf) {
+				grub_memmove64(buf, (unsigned long)zstd_file.dic + (unsigned long)(ufp - zsdec.dicFilePos), n);
+				buf += n;
+			}
+			zsdec.ufilepos += n;
+			outTx += n;
+			len -= n;
+			continue;
+		}
+
+		/* decode from the start of the frame holding ufp, unless it is
+		   being decoded and ufp is ahead */
+		f = zstd_find(ufp);
+		if ((f != zsdec.cur || ufp < lo)
+		    && !zstd_frame_start(f, ufp >= lo && out == zsdec.frames[f].upos))
+			break;
+		zstd_next_block();
+	}
+	if (errnum) {
+		/* start over on the next read */
+		zsdec.cur = zsdec.nframes;
+		zsdec.low = zsdec.dicFilePos + zstd_file.pos;
+	}
+
+	compressed_file = 1;
+	zsdec.cfilemax = filemax;
+	zsdec.cfilepos = filepos;
+	filemax = zsdec.ufilemax;
+	filepos = zsdec.ufilepos;
+
+	/* Now filemax, filepos are of uncompressed data
+	* cfilemax, cfilepos are of compressed file
+	* ufilemax, ufilepos are not used
+	*/
+
+	return outTx;
+}
+
+/* Decode the zstd frames at SRC into DST, as mksquashfs writes a frame
+   for each block. Decoding stops once DST is full, so padding after the
+   last frame is ignored, as qcow2 rounds compressed clusters up to whole
+   sectors. Checksums are skipped. Return the decoded size, or 0 with
+   errnum set.  */
+unsigned long
+zstd_decode_buffer(unsigned char *dst, unsigned long dst_len, const unsigned char *src, unsigned long src_len)
+{
+	static struct zstd_ctx z;
+	const unsigned char *p = src, *end = src + src_len;
+
+	z.lit = grub_malloc(ZSTD_BLOCK_MAX);
+	if (!z.lit)
+		return 0;
+	z.dic = dst;
+	z.size = dst_len;
+	z.pos = 0;
+	while (p < end && z.pos < dst_len) {
+		struct zstd_frame_header h;
+
+		if (end - p >= 8 && (le32(p) & 0xFFFFFFF0) == ZSTD_SKIPPABLE) {
+			if (le32(p + 4) > (grub_u32_t)(end - p - 8))
+				goto fail;
+			p += 8 + le32(p + 4);
+			continue;
+		}
+		if (!zstd_frame_header(p, end - p, &h))
+			goto fail;
+		zstd_frame_init(&z, h.window);
+		p += h.size;
+		for (;;) {
+			unsigned long csize, size;
+			unsigned int type;
+			grub_u32_t bh;
+
+			if (end - p < 3)
+				goto fail;
+			bh = p[0] | ((grub_u32_t)p[1] << 8) | ((grub_u32_t)p[2] << 16);
+			type = (bh >> 1) & 3;
+			size = bh >> 3;
+			csize = (type == 1) ? 1 : size;
+			p += 3;
+			if (size > ZSTD_BLOCK_MAX || csize > (unsigned long)(end - p)
+			    || !zstd_block(&z, type, p, csize, size))
+				goto fail;
+			p += csize;
+			if (bh & 1)
+				break;
+		}
+		if ((h.has_fcs && z.pos - z.hist != h.fcs) || (h.checksum && end - p < 4))
+			goto fail;
+		if (h.checksum)
+			p += 4;
+	}
+	grub_free(z.lit);
+	return z.pos;
+fail:
+	grub_free(z.lit);
+	errnum = ERR_BAD_GZIP_DATA;
+	return 0;
+}
+
+#endif /* ! NO_DECOMPRESSION */
@@ -38,7 +38,7 @@ void (*disk_read_func) (unsigned long long, unsigned long, unsigned long long) =
 static int next_bsd_partition (void);
 static int next_pc_slice (void);
 static int next_gpt_slice(void);
-static char open_filename[512];
+char open_filename[512];
 static unsigned long relative_path;
 
 int print_possibilities;
@@ -111,6 +111,7 @@ static unsigned long bsd_part_no;
 static unsigned long pc_slice_no;
 
 unsigned long long fsmax;
+unsigned long filemtime;
 struct fsys_entry fsys_table[NUM_FSYS + 1] =
 {
   /* TFTP should come first because others don't handle net device.  */
@@ -132,24 +133,27 @@ struct fsys_entry fsys_table[NUM_FSYS + 1] =
 # ifdef FSYS_NTFS
   {"ntfs", ntfs_mount, ntfs_read, ntfs_dir, 0, 0},
 # endif
-//# ifdef FSYS_MINIX
-//{"minix", minix_mount, minix_read, minix_dir, 0, 0},
-//# endif
-//# ifdef FSYS_REISERFS
-//  {"reiserfs", reiserfs_mount, reiserfs_read, reiserfs_dir, 0, reiserfs_embed},
-//# endif
-//# ifdef FSYS_VSTAFS
-//  {"vstafs", vstafs_mount, vstafs_read, vstafs_dir, 0, 0},
-// endif
-//# ifdef FSYS_JFS
-//  {"jfs", jfs_mount, jfs_read, jfs_dir, 0, jfs_embed},
-//# endif
+# ifdef FSYS_MINIX
+  {"minix", minix_mount, minix_read, minix_dir, 0, 0},
+# endif
+# ifdef FSYS_REISERFS
+  {"reiserfs", reiserfs_mount, reiserfs_read, reiserfs_dir, 0, reiserfs_embed},
+# endif
+# ifdef FSYS_VSTAFS
+  {"vstafs", vstafs_mount, vstafs_read, vstafs_dir, 0, 0},
+# endif
+# ifdef FSYS_JFS
+  {"jfs", jfs_mount, jfs_read, jfs_dir, 0, jfs_embed},
+# endif
 //# ifdef FSYS_XFS
 //  {"xfs", xfs_mount, xfs_read, xfs_dir, 0, 0},
 //# endif
-//# ifdef FSYS_UFS2
-//  {"ufs2", ufs2_mount, ufs2_read, ufs2_dir, 0, ufs2_embed},
-//# endif
+# ifdef FSYS_UFS2
+  {"ufs2", ufs2_mount, ufs2_read, ufs2_dir, 0, ufs2_embed},
+# endif
+# ifdef FSYS_SQUASHFS
+  {"squashfs", squashfs_mount, squashfs_read, squashfs_dir, 0, 0},
+# endif
 # ifdef FSYS_ISO9660
   {"iso9660", iso9660_mount, iso9660_read, iso9660_dir, 0, 0},
 # endif
@@ -507,6 +511,151 @@ devread (unsigned long long sector, unsigned long long byte_offset, unsigned lon
   return rawread (current_drive, (sector += part_start), byte_offset, byte_len, buf, rw_flag);
 }
 
+/* Memoized logical-to-physical block runs of the currently open file,
+ * shared by the block-mapped filesystems (minix, reiserfs, vstafs, jfs,
+ * ufs2). A run is a range of logical blocks that are physically
+ * contiguous on disk (or all holes), so it can be read with one devread.
+ */
+#define FSYS_BLOCK_RUNS	32
+
+struct fsys_block_run
+{
+  unsigned long long logical;	/* first logical block of the run */
+  unsigned long long sector;	/* first sector of the run, 0 for a hole */
+  unsigned long long count;	/* number of blocks in the run */
+};
+
+static struct fsys_block_run block_runs[FSYS_BLOCK_RUNS];
+static unsigned long block_run_used;
+static unsigned long block_run_next;	/* next slot to be replaced */
+static unsigned long block_run_drive;
+static unsigned long block_run_partition;
+static unsigned long block_run_file;
+static int block_run_fsys = -1;
+
+void
+fsys_block_map_flush (void)
+{
+  block_run_used = 0;
+  block_run_next = 0;
+  block_run_fsys = -1;
+}
+
+static struct fsys_block_run *
+fsys_block_run_lookup (unsigned long long logical)
+{
+  unsigned long i;
+
+  for (i = 0; i < block_run_used; i++)
+    if (logical - block_runs[i].logical < block_runs[i].count)
+      return &block_runs[i];
+  return 0;
+}
+
+/* Return the run holding LOGICAL, asking the driver to map it on a miss.
+ * A new run is grown over the following blocks (at most WANT blocks in
+ * all) for as long as they stay contiguous on disk.
+ */
+static struct fsys_block_run *
+fsys_block_run_resolve (struct fsys_block_map *map, unsigned long long logical, unsigned long long want)
+{
+  struct fsys_block_run *run;
+  unsigned long long sector, next, count;
+  unsigned long long sectors_per_block = 1 << (map->block_bits - SECTOR_BITS);
+  unsigned long more;
+
+  if ((run = fsys_block_run_lookup (logical)))
+    return run;
+
+  more = 1;
+  sector = map->map_block (logical, &more);
+  if (sector == FSYS_BLOCK_MAP_END || errnum)
+    return 0;
+  count = more ? more : 1;
+
+  while (count < want && ! fsys_block_run_lookup (logical + count))
+    {
+      more = 1;
+      next = map->map_block (logical + count, &more);
+      if (next == FSYS_BLOCK_MAP_END || errnum)
+	break;
+      if (sector ? (next != sector + count * sectors_per_block) : (next != 0))
+	break;
+      count += more ? more : 1;
+    }
+
+  run = &block_runs[block_run_next];
+  if (++block_run_next == FSYS_BLOCK_RUNS)
+    block_run_next = 0;
+  if (block_run_used < FSYS_BLOCK_RUNS)
+    block_run_used++;
+
+  run->logical = logical;
+  run->sector = sector;
+  run->count = count;
+  return run;
+}
+
+/* Read LEN bytes at FILEPOS of the file described by MAP, one devread
+ * per contiguous run. Stops early (without error) when the driver's
+ * map_block returns FSYS_BLOCK_MAP_END, e.g. at a reiserfs tail.
+ * Holes read as zeroes; writing into one fails with ERR_WRITE.
+ */
+unsigned long long
+fsys_block_map_read (struct fsys_block_map *map, unsigned long long buf, unsigned long long len, unsigned long write)
+{
+  struct fsys_block_run *run;
+  unsigned long long pos, logical, offset, size;
+  unsigned long long ret = 0;
+
+  if (block_run_fsys != fsys_type || block_run_drive != current_drive
+      || block_run_partition != current_partition || block_run_file != map->file_id)
+    {
+      fsys_block_map_flush ();
+      block_run_fsys = fsys_type;
+      block_run_drive = current_drive;
+      block_run_partition = current_partition;
+      block_run_file = map->file_id;
+    }
+
+  while (len && ! errnum)
+    {
+      pos = filepos + map->data_offset;
+      logical = pos >> map->block_bits;
+      run = fsys_block_run_resolve (map, logical,
+				    ((pos + len - 1) >> map->block_bits) - logical + 1);
+      if (! run)
+	break;
+
+      offset = pos - (run->logical << map->block_bits);
+      size = (run->count << map->block_bits) - offset;
+      if (size > len)
+	size = len;
+
+      if (run->sector)
+	{
+	  disk_read_func = disk_read_hook;
+	  devread (run->sector, offset, size, buf, write);
+	  disk_read_func = NULL;
+	}
+      else if (write == 0x900ddeed)
+	{
+	  errnum = ERR_WRITE;
+	  break;
+	}
+      else if (buf)
+	grub_memset64 (buf, 0, size);
+
+      if (buf)
+	buf += size;
+      len -= size;
+      filepos += size;
+      ret += size;
+    }
+
+  return errnum ? 0 : ret;
+}
+
 
 /* Write 1 sector at BUF onto sector number SECTOR on drive DRIVE.
  * Only a 512-byte sector should be written with this function.
@@ -1438,6 +1587,9 @@ set_device (char *device)
 	      {
 		current_drive = 0xffff;
 		md_part_base = md_part_size = 0LL;
+#ifdef FSYS_INITRD
+		initrdfs_invalidate ();	/* (md) may name any memory */
+#endif
 		if (*device == ',')
 		{
 			++device;
@@ -2039,6 +2191,8 @@ grub_open (char *filename)
   /* if any "dir" function uses/sets filepos, it must
      set it to zero before returning if opening a file! */
   filepos = 0;
+  filemtime = 0;
+  fsys_block_map_flush ();
 
   if (!(filename = setup_part (filename)))
     return 0;
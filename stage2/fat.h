@@ -114,6 +114,7 @@ struct fat_bpb {
 #define FAT_DIRENTRY_FIRST_CLUSTER(entry) \
   ((*(unsigned short *)(entry+26))+((*(unsigned short *)(entry+20)) << 16))
 #define FAT_DIRENTRY_FILELENGTH(entry)	(*(unsigned long *)(entry+28))
+#define FAT_DIRENTRY_MTIME(entry)	(*(unsigned long *)(entry+22))	/* time, date */
 
 #define FAT_LONGDIR_ID(entry)	(*(unsigned char *)(entry))
 #define FAT_LONGDIR_ALIASCHECKSUM(entry)	(*(unsigned char *)(entry+13))
@@ -34,17 +34,17 @@
 //#define FSYS_FFS_NUM 0
 //#endif
 
-//#ifdef FSYS_UFS2
-//#define FSYS_UFS2_NUM 1
-//#ifndef ASM_FILE
-//int ufs2_mount (void);
-//unsigned long long ufs2_read (unsigned long long buf, unsigned long long len, unsigned long write);
-//int ufs2_dir (char *dirname);
-//unsigned long ufs2_embed (unsigned long *start_sector, unsigned long needed_sectors);
-//#endif
-//#else
-//#define FSYS_UFS2_NUM 0
-//#endif
+#ifdef FSYS_UFS2
+#define FSYS_UFS2_NUM 1
+#ifndef ASM_FILE
+int ufs2_mount (void);
+unsigned long long ufs2_read (unsigned long long buf, unsigned long long len, unsigned long write);
+int ufs2_dir (char *dirname);
+unsigned long ufs2_embed (unsigned long *start_sector, unsigned long needed_sectors);
+#endif
+#else
+#define FSYS_UFS2_NUM 0
+#endif
 
 #ifdef FSYS_FAT
 #define FSYS_FAT_NUM 1
@@ -79,51 +79,51 @@ int ext2fs_dir (char *dirname);
 #define FSYS_EXT2FS_NUM 0
 #endif
 
-//#ifdef FSYS_MINIX
-//#define FSYS_MINIX_NUM 1
-//#ifndef ASM_FILE
-//int minix_mount (void);
-//unsigned long long minix_read (unsigned long long buf, unsigned long long len, unsigned long write);
-//int minix_dir (char *dirname);
-//#endif
-//#else
-//#define FSYS_MINIX_NUM 0
-//#endif
+#ifdef FSYS_MINIX
+#define FSYS_MINIX_NUM 1
+#ifndef ASM_FILE
+int minix_mount (void);
+unsigned long long minix_read (unsigned long long buf, unsigned long long len, unsigned long write);
+int minix_dir (char *dirname);
+#endif
+#else
+#define FSYS_MINIX_NUM 0
+#endif
 
-//#ifdef FSYS_REISERFS
-//#define FSYS_REISERFS_NUM 1
-//#ifndef ASM_FILE
-//int reiserfs_mount (void);
-//unsigned long long reiserfs_read (unsigned long long buf, unsigned long long len, unsigned long write);
-//int reiserfs_dir (char *dirname);
-//unsigned long reiserfs_embed (unsigned long *start_sector, unsigned long needed_sectors);
-//#endif
-//#else
-//#define FSYS_REISERFS_NUM 0
-//#endif
+#ifdef FSYS_REISERFS
+#define FSYS_REISERFS_NUM 1
+#ifndef ASM_FILE
+int reiserfs_mount (void);
+unsigned long long reiserfs_read (unsigned long long buf, unsigned long long len, unsigned long write);
+int reiserfs_dir (char *dirname);
+unsigned long reiserfs_embed (unsigned long *start_sector, unsigned long needed_sectors);
+#endif
+#else
+#define FSYS_REISERFS_NUM 0
+#endif
 
-//#ifdef FSYS_VSTAFS
-//#define FSYS_VSTAFS_NUM 1
-//#ifndef ASM_FILE
-//int vstafs_mount (void);
-//unsigned long long vstafs_read (unsigned long long buf, unsigned long long len, unsigned long write);
-//int vstafs_dir (char *dirname);
-//#endif
-//#else
-//#define FSYS_VSTAFS_NUM 0
-//#endif
+#ifdef FSYS_VSTAFS
+#define FSYS_VSTAFS_NUM 1
+#ifndef ASM_FILE
+int vstafs_mount (void);
+unsigned long long vstafs_read (unsigned long long buf, unsigned long long len, unsigned long write);
+int vstafs_dir (char *dirname);
+#endif
+#else
+#define FSYS_VSTAFS_NUM 0
+#endif
 
-//#ifdef FSYS_JFS
-//#define FSYS_JFS_NUM 1
-//#ifndef ASM_FILE
-//int jfs_mount (void);
-//unsigned long long jfs_read (unsigned long long buf, unsigned long long len, unsigned long write);
-//int jfs_dir (char *dirname);
-//unsigned long jfs_embed (unsigned long *start_sector, unsigned long needed_sectors);
-//#endif
-//#else
-//#define FSYS_JFS_NUM 0
-//#endif
+#ifdef FSYS_JFS
+#define FSYS_JFS_NUM 1
+#ifndef ASM_FILE
+int jfs_mount (void);
+unsigned long long jfs_read (unsigned long long buf, unsigned long long len, unsigned long write);
+int jfs_dir (char *dirname);
+unsigned long jfs_embed (unsigned long *start_sector, unsigned long needed_sectors);
+#endif
+#else
+#define FSYS_JFS_NUM 0
+#endif
 
 //#ifdef FSYS_XFS
 //#define FSYS_XFS_NUM 1
@@ -184,6 +184,17 @@ void initrdfs_close (void);
 #define FSYS_INITRD_NUM 0
 #endif
 
+#ifdef FSYS_SQUASHFS
+#define FSYS_SQUASHFS_NUM 1
+#ifndef ASM_FILE
+int squashfs_mount (void);
+unsigned long long squashfs_read (unsigned long long buf, unsigned long long len, unsigned long write);
+int squashfs_dir (char *dirname);
+#endif
+#else
+#define FSYS_SQUASHFS_NUM 0
+#endif
+
 #ifdef FSYS_FB
 #define FSYS_FB_NUM 1
 #ifndef ASM_FILE
@@ -206,8 +217,9 @@ int fb_dir (char *dirname);
 
 #ifndef NUM_FSYS
 #define NUM_FSYS	\
-  (FSYS_FAT_NUM + FSYS_NTFS_NUM + FSYS_EXT2FS_NUM	\
-   + FSYS_TFTP_NUM + FSYS_ISO9660_NUM + FSYS_PXE_NUM + FSYS_FB_NUM + FSYS_INITRD_NUM)
+  (FSYS_FAT_NUM + FSYS_NTFS_NUM + FSYS_EXT2FS_NUM + FSYS_MINIX_NUM	\
+   + FSYS_REISERFS_NUM + FSYS_VSTAFS_NUM + FSYS_JFS_NUM	\
+   + FSYS_TFTP_NUM + FSYS_ISO9660_NUM + FSYS_UFS2_NUM + FSYS_SQUASHFS_NUM + FSYS_PXE_NUM + FSYS_FB_NUM + FSYS_INITRD_NUM)
 #endif
 
 
@@ -236,8 +248,29 @@ struct fsys_entry
   unsigned long (*embed_func) (unsigned long *start_sector, unsigned long needed_sectors);
 };
 
+/* Block-mapped file reading with memoized block runs, see disk_io.c.
+   MAP_BLOCK returns the first sector of LOGICAL_BLOCK, 0 for a hole, or
+   FSYS_BLOCK_MAP_END to stop the read. It may set *COUNT to the number
+   of blocks known to follow contiguously from there.  */
+#define FSYS_BLOCK_MAP_END	0xFFFFFFFFFFFFFFFFULL
+
+struct fsys_block_map
+{
+  unsigned long file_id;	/* inode (or equivalent) of the open file */
+  unsigned long block_bits;	/* log2 of the block size, at least SECTOR_BITS */
+  unsigned long data_offset;	/* bytes in front of the file data in block 0 */
+  unsigned long long (*map_block) (unsigned long long logical_block, unsigned long *count);
+};
+
+unsigned long long fsys_block_map_read (struct fsys_block_map *map, unsigned long long buf, unsigned long long len, unsigned long write);
+void fsys_block_map_flush (void);
+
 extern int print_possibilities;
+extern char open_filename[];
 
 extern unsigned long long fsmax;
+/* modification time of the file just opened, in the filesystem's own
+   format, or 0 if the filesystem does not report one */
+extern unsigned long filemtime;
 extern struct fsys_entry fsys_table[NUM_FSYS + 1];
 #endif
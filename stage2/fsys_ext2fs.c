@@ -1093,6 +1093,7 @@ ext2fs_dir (char *dirname)
 
 //	  filemax = (INODE->i_size);
 		filemax = ((unsigned long long)INODE->i_size_high<<32) + INODE->i_size_lo;
+	  filemtime = INODE->i_mtime;
 	  return 1;
 	}
 
@@ -509,6 +509,7 @@ fat_dir (char *dirname)
   int exfat_namecount = 0;
   int exfat_nextentry =  EXFAT_ENTRY_FILE;
   unsigned long long exfat_filemax = 0;
+  unsigned long exfat_filemtime = 0;
   unsigned long exfat_file_cluster = 0;
 	int empty = 0;
   int i, j;
@@ -619,6 +620,7 @@ fat_dir (char *dirname)
 	  {
 	    case EXFAT_ENTRY_FILE:
 		    exfat_attrib = (*(unsigned short *)(dir_buf+4));
+		    exfat_filemtime = (*(unsigned long *)(dir_buf+12));
 		    exfat_secondarycount = (*(unsigned char *)(dir_buf+1));
 		    if ((exfat_secondarycount<2)||(exfat_secondarycount>18))
 			/* invalid */
@@ -805,6 +807,7 @@ valid_filename:
   {
     attrib = exfat_attrib;
     filemax = exfat_filemax;
+    filemtime = exfat_filemtime;
     FAT_SUPER->file_cluster = exfat_file_cluster;
     if (exfat_flags & EXFAT_FLAG_CONTIGUOUS) /* NoFatChain */
 	FAT_SUPER->contig_size = (filemax + ((1 << FAT_SUPER->clustsize_bits) - 1)) & ~((1 << FAT_SUPER->clustsize_bits) - 1);
@@ -815,6 +818,7 @@ valid_filename:
 
   attrib = FAT_DIRENTRY_ATTRIB (dir_buf);
   filemax = FAT_DIRENTRY_FILELENGTH (dir_buf);
+  filemtime = FAT_DIRENTRY_MTIME (dir_buf);
   FAT_SUPER->file_cluster = FAT_DIRENTRY_FIRST_CLUSTER (dir_buf);
   
   /* go back to main loop at top of function */
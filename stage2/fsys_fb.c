@@ -101,6 +101,28 @@ static uchar4 ud_ofs;
 static uchar4 ud_pri_size;
 static unsigned long ud_inited = 0;
 
+/* Hash index over a loaded fbm_file list, so that fb_dir does not have
+ * to scan the whole list for every open. Entry numbers in hash[] and
+ * chain[] are biased by one, zero ends a chain.
+ */
+struct fb_index
+{
+  uchar *list;
+  unsigned long count;
+  unsigned long mask;
+  struct fbm_file **files;
+  uchar2 *chain;
+  uchar2 *hash;
+};
+
+static struct fb_index fbm_index;	/* for fbm_buff */
+static struct fb_index ud_index;	/* for the menu at FB_MENU_ADDR */
+
+/* Primary data area files are read through this bounce buffer,
+ * FB_READ_SECTORS sectors at a time.  */
+#define FB_READ_SECTORS	(FSYS_BUFLEN >> 9)
+#define FB_READ_BUF	((uchar *)FSYS_BUF)
+
 extern unsigned long ROM_int13;
 extern unsigned long ROM_int15;
 static unsigned long is_virtual (unsigned long drive)
@@ -180,6 +202,78 @@ hook:
 	return addr;
 }
 
+/* copy the name of FILE to TMP_NAME, return its length */
+static unsigned long fb_file_name (struct fbm_file *file, char *tmp_name)
+{
+  unsigned long j, k;
+  char ch1;
+
+  for (j = 0, k = 0; j < file->size - ((ver_min==6)?12:16); j++)
+    {
+      if (! (ch1 = file->name[j+((ver_min==6)?0:4)]))
+	break;
+      tmp_name[k++] = ch1;
+    }
+  tmp_name[k] = 0;
+  return k;
+}
+
+static unsigned long fb_name_hash (const char *name)
+{
+  unsigned long h = 0;
+
+  while (*name)
+    h = h * 31 + (uchar) tolower (*name++);
+  return h;
+}
+
+static void fb_build_index (struct fb_index *idx, uchar *list)
+{
+  struct fbm_file *file;
+  unsigned long count, hash_size, i, h;
+  char tmp_name[512];
+  char *p;
+
+  if (idx->files)
+    grub_free (idx->files);
+  grub_memset (idx, 0, sizeof (*idx));
+
+  for (count = 0, file = (struct fbm_file *) list; file->size; count++)
+    file = (struct fbm_file *) ((char *) file + file->size + 2);
+  if (! count)
+    return;
+
+  for (hash_size = 64; hash_size < count; hash_size <<= 1)
+    ;
+  p = grub_malloc (count * (sizeof (struct fbm_file *) + 2) + hash_size * 2);
+  if (p == NULL)
+    {
+      errnum = 0;	/* fb_dir falls back to a linear scan */
+      return;
+    }
+  idx->files = (struct fbm_file **) p;
+  idx->chain = (uchar2 *) (idx->files + count);
+  idx->hash = idx->chain + count;
+  idx->mask = hash_size - 1;
+  grub_memset (idx->hash, 0, hash_size * 2);
+
+  for (i = 0, file = (struct fbm_file *) list; i < count; i++)
+    {
+      idx->files[i] = file;
+      file = (struct fbm_file *) ((char *) file + file->size + 2);
+    }
+  /* chain in reverse, so the first of duplicate names is found first */
+  for (i = count; i--; )
+    {
+      fb_file_name (idx->files[i], tmp_name);
+      h = fb_name_hash (tmp_name) & idx->mask;
+      idx->chain[i] = idx->hash[h];
+      idx->hash[h] = i + 1;
+    }
+  idx->count = count;
+  idx->list = list;
+}
+
 static int fb_init (void)
 {
   struct fb_mbr m;
@@ -268,6 +362,7 @@ static int fb_init (void)
 	}
 	fb_ofs = t_fb_ofs;
 	fb_pri_size = t_fb_pri_size;
+	fb_build_index ((current_drive == FB_DRIVE) ? &ud_index : &fbm_index, fb_list);
 	if (current_drive != FB_DRIVE)
 		fb_inited = fb_drive;
 	/* ret != 0, success */
@@ -369,23 +464,48 @@ fb_read (unsigned long long buf, unsigned long long len, unsigned long write)
   if (fb_drive_virtual  && fb_status && fb_drive == (unsigned char)(fb_status >> 8))
 	quick_hook (0);
 
+  /* Each sector of the primary data area holds 510 bytes of file data.
+   * Read up to FB_READ_SECTORS of them at once and pack the data.  */
   while (len)
     {
-      unsigned long n;
+      unsigned long n, count, i;
 
-      n = 510 - ofs;
-      if (n > len)
-	n = len;
+      /* No file in the primary area is longer than fb_pri_size sectors,
+       * clamp len first so that the division stays 32-bit.  */
+      n = (len > fb_pri_size * 510) ? fb_pri_size * 510 : (unsigned long) len;
+      count = (ofs + n + 509) / 510;
+      if (count > FB_READ_SECTORS)
+	count = FB_READ_SECTORS;
 
-      ret = rawread (fb_drive, sector, ofs, n, buf, write);
+      ret = rawread (fb_drive, sector, 0, count << 9,
+		     (unsigned long long)(unsigned int)FB_READ_BUF, 0xedde0d90);
 
       if (! ret)
 	break;
 
-      sector++;
-      ofs = 0;
-      buf += n;
-      len -= n;
+      for (i = 0; i < count && len; i++)
+	{
+	  n = 510 - ofs;
+	  if (n > len)
+	    n = len;
+	  if (write == 0x900ddeed)
+	    grub_memmove64 ((unsigned long long)(unsigned int)(FB_READ_BUF + (i << 9) + ofs), buf, n);
+	  else
+	    grub_memmove64 (buf, (unsigned long long)(unsigned int)(FB_READ_BUF + (i << 9) + ofs), n);
+	  ofs = 0;
+	  buf += n;
+	  len -= n;
+	}
+
+      if (write == 0x900ddeed)
+	{
+	  ret = rawread (fb_drive, sector, 0, count << 9,
+			 (unsigned long long)(unsigned int)FB_READ_BUF, write);
+	  if (! ret)
+	    break;
+	}
+
+      sector += count;
     }
 
   if (fb_drive_virtual  && fb_status && fb_drive == (unsigned char)(fb_status >> 8))
@@ -404,6 +524,7 @@ int fb_dir (char *dirname)
   unsigned long found = 0;
   unsigned long i;
   char *dirpath;
+  struct fb_index *idx;
 
   while (*dirname == '/')
     dirname++;
@@ -416,27 +537,32 @@ int fb_dir (char *dirname)
 	i++;
 
   cur_file = (struct fbm_file *)((current_drive == FB_DRIVE)?FB_MENU_ADDR:(int)fbm_buff);
+  idx = (current_drive == FB_DRIVE) ? &ud_index : &fbm_index;
 
-  while (cur_file->size)
+  if (! print_possibilities && idx->files && idx->list == (uchar *)cur_file)
     {
-      char tmp_name[512];/* max name len=255, so 512 byte buffer is needed. */
-      unsigned long j, k;
-      char ch1;
+      char tmp_name[512];
+      unsigned long j;
 
-      /* copy cur_file->name to tmp_name, and quote spaces with '\\' */
-//      for (j = 0, k = 0; j < cur_file->size - 12; j++)
-		for (j = 0, k = 0; j < cur_file->size - ((ver_min==6)?12:16); j++)
+      for (j = idx->hash[fb_name_hash (dirname) & idx->mask]; j; j = idx->chain[j - 1])
 	{
-//	  if (! (ch1 = cur_file->name[j]))
-		if (! (ch1 = cur_file->name[j+((ver_min==6)?0:4)]))
-		break;
-#if 0
-	  if (ch1 == ' ')
-		tmp_name[k++] = '\\';
-#endif
-	  tmp_name[k++] = ch1;
+	  fb_file_name (idx->files[j - 1], tmp_name);
+	  if (substring (dirname, tmp_name, 1) == 0)
+	    {
+	      cur_file = idx->files[j - 1];
+	      found = 1;
+	      filemax = (ver_min==6)?cur_file->data_size:(*(unsigned long long *)(&cur_file->data_size));
+	      break;
+	    }
 	}
-	tmp_name[k] = 0;
+      goto done;
+    }
+
+  while (cur_file->size)
+    {
+      char tmp_name[512];/* max name len=255, so 512 byte buffer is needed. */
+
+      fb_file_name (cur_file, tmp_name);
 
       if (print_possibilities)
 	{
@@ -458,6 +584,7 @@ int fb_dir (char *dirname)
       cur_file = (struct fbm_file *) ((char *) cur_file + cur_file->size + 2);
     }
 
+done:
   if (! found)
     errnum = ERR_FILE_NOT_FOUND;
 
@@ -79,29 +79,48 @@ static grub_u32_t cpio_file(struct cpio_header *hdr)
 	return cpio_image_align(hdr_sz + cur_file.size);
 }
 
-static int cpio_dir(const char* dirname)
+struct cpio_walk
+{
+	grub_u64_t cur_pos;
+	grub_u64_t tmp_pos;
+	grub_u32_t node_size;
+};
+
+/* Step to the next cpio entry and leave it in cur_file. */
+static int cpio_next(struct cpio_walk *w)
 {
 	struct cpio_header *p_cpio_hdr;
-	int found = 0;
-	grub_u64_t tmp_pos = 0;
-	grub_u64_t cur_pos = 0;
-	grub_u32_t node_size = 0;
 
-	while(cur_pos < initrdfs_size)
+	while(w->cur_pos < initrdfs_size)
 	{
-		p_cpio_hdr = (struct cpio_header *)(grub_u32_t)(initrdfs_base + cur_pos);
+		p_cpio_hdr = (struct cpio_header *)(grub_u32_t)(initrdfs_base + w->cur_pos);
 		if (*(grub_u32_t*)p_cpio_hdr->c_magic != 0x37303730 || p_cpio_hdr->c_magic[5] == 0x30)//07070
 		{
-			if (node_size)
-				cur_pos = tmp_pos + ((node_size + 0xFFF) & ~0xFFF);
+			if (w->node_size)
+				w->cur_pos = w->tmp_pos + ((w->node_size + 0xFFF) & ~0xFFF);
 			else
-				cur_pos += 4096;
-			node_size = 0;
+				w->cur_pos += 4096;
+			w->node_size = 0;
 			continue;
 		}
-		node_size = cpio_file(p_cpio_hdr);
-		if (node_size == 0 || node_size == -1)
-			break;
+		w->node_size = cpio_file(p_cpio_hdr);
+		if (w->node_size == 0 || w->node_size == -1)
+			return 0;
+		w->tmp_pos = w->cur_pos;
+		w->cur_pos += w->node_size;
+		return 1;
+	}
+
+	return 0;
+}
+
+static int cpio_dir(const char* dirname)
+{
+	struct cpio_walk w = {0, 0, 0};
+	int found = 0;
+
+	while(cpio_next(&w))
+	{
 		switch(test_file(dirname))
 		{
 			case 2:
@@ -110,8 +129,162 @@ static int cpio_dir(const char* dirname)
 				found = 1;
 				break;
 		}
-		tmp_pos = cur_pos;
-		cur_pos += node_size;
+	}
+
+	return found;
+}
+
+static struct initrdfs_index cpio_index;
+
+static grub_u32_t initrdfs_hash(const char *name)
+{
+	grub_u32_t h = 2166136261U;
+
+	while (*name)
+		h = (h ^ (unsigned char)tolower(*name++)) * 16777619U;
+	return h;
+}
+
+static int initrdfs_namecmp(const char *s1, const char *s2)
+{
+	int ch1, ch2;
+
+	do
+	{
+		ch1 = (unsigned char)tolower(*s1++);
+		ch2 = (unsigned char)tolower(*s2++);
+	} while (ch1 && ch1 == ch2);
+
+	return ch1 - ch2;
+}
+
+#define INDEX_NAME(i) ((char *)cpio_index.nodes[cpio_index.sorted[i]].name)
+
+static void cpio_index_sift(grub_u32_t root, grub_u32_t end)
+{
+	grub_u32_t child, tmp;
+
+	while ((child = root * 2 + 1) < end)
+	{
+		if (child + 1 < end && initrdfs_namecmp(INDEX_NAME(child), INDEX_NAME(child + 1)) < 0)
+			child++;
+		if (initrdfs_namecmp(INDEX_NAME(root), INDEX_NAME(child)) >= 0)
+			return;
+		tmp = cpio_index.sorted[root];
+		cpio_index.sorted[root] = cpio_index.sorted[child];
+		cpio_index.sorted[child] = tmp;
+		root = child;
+	}
+}
+
+/* Drop the cpio index.  It is called wherever the memory that
+ * initrdfs_mount() may find an archive in is set or reloaded.
+ */
+void initrdfs_invalidate (void)
+{
+	if (cpio_index.nodes)
+		grub_free(cpio_index.nodes);
+	memset(&cpio_index, 0, sizeof(cpio_index));
+}
+
+/* Parse every cpio header once, keeping sizes and offsets in a name
+ * hash table for lookups and a sorted array for directory listing.
+ * Without memory for the index, cpio_dir() scans the archive instead.
+ */
+static void cpio_build_index(void)
+{
+	struct cpio_walk w = {0, 0, 0};
+	grub_u32_t count = 0, hash_size, i, h, tmp;
+	char *p;
+
+	initrdfs_invalidate();
+
+	while(cpio_next(&w))
+		++count;
+	if (count == 0)
+		return;
+
+	for (hash_size = 64; hash_size < count; hash_size <<= 1)
+		;
+	p = grub_malloc(count * (sizeof(struct initrdfs_file) + 8) + hash_size * 4);
+	if (p == NULL)
+	{
+		errnum = 0;
+		return;
+	}
+
+	cpio_index.nodes = (struct initrdfs_file *)p;
+	cpio_index.chain = (grub_u32_t *)(cpio_index.nodes + count);
+	cpio_index.sorted = cpio_index.chain + count;
+	cpio_index.hash = cpio_index.sorted + count;
+	cpio_index.hash_mask = hash_size - 1;
+	memset(cpio_index.hash, 0, hash_size * 4);
+
+	memset(&w, 0, sizeof(w));
+	for (i = 0; i < count && cpio_next(&w); i++)
+	{
+		cpio_index.nodes[i] = cur_file;
+		cpio_index.sorted[i] = i;
+	}
+	cpio_index.count = count = i;
+
+	/* chain in reverse, so the first of duplicate names is found first */
+	while (i--)
+	{
+		h = initrdfs_hash((char *)cpio_index.nodes[i].name) & cpio_index.hash_mask;
+		cpio_index.chain[i] = cpio_index.hash[h];
+		cpio_index.hash[h] = i + 1;
+	}
+
+	/* heapsort, no recursion and no extra memory */
+	for (i = count / 2; i > 0; i--)
+		cpio_index_sift(i - 1, count);
+	for (i = count; i > 1; i--)
+	{
+		tmp = cpio_index.sorted[0];
+		cpio_index.sorted[0] = cpio_index.sorted[i - 1];
+		cpio_index.sorted[i - 1] = tmp;
+		cpio_index_sift(0, i - 1);
+	}
+
+	cpio_index.base = initrdfs_base;
+	cpio_index.size = initrdfs_size;
+}
+
+static int cpio_index_dir(const char* dirname)
+{
+	grub_u32_t i, lo, hi, mid;
+	int found = 0;
+
+	if (!print_possibilities)
+	{
+		for (i = cpio_index.hash[initrdfs_hash(dirname) & cpio_index.hash_mask]; i; i = cpio_index.chain[i - 1])
+		{
+			cur_file = cpio_index.nodes[i - 1];
+			if (test_file(dirname) == 2)
+				return 2;
+		}
+		return 0;
+	}
+
+	/* names starting with DIRNAME are adjacent in sorted order */
+	lo = 0;
+	hi = cpio_index.count;
+	while (lo < hi)
+	{
+		mid = (lo + hi) >> 1;
+		if (initrdfs_namecmp(INDEX_NAME(mid), dirname) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; lo < cpio_index.count; lo++)
+	{
+		cur_file = cpio_index.nodes[cpio_index.sorted[lo]];
+		if (!test_file(dirname))
+			break;
+		found = 1;
 	}
 
 	return found;
@@ -139,7 +312,10 @@ int initrdfs_mount (void)
 		{
 			if (hooked_drive_map[i].from_drive == (unsigned char)current_drive)
 			{
-				if (hooked_drive_map[i].to_drive == 0xFF)
+				/* a lazy or compressed memdrive is read through int13 */
+				if (hooked_drive_map[i].to_drive == 0xFF
+				    && ! (lazy_mem_sectors && lazy_mem_drive == hooked_drive_map[i].from_drive)
+				    && ! (comp_mem_chunks && comp_mem_drive == hooked_drive_map[i].from_drive))
 				{
 					initrdfs_base = (grub_u64_t)hooked_drive_map[i].start_sector << 9;
 					initrdfs_size = (grub_u64_t)hooked_drive_map[i].sector_count << 9;
@@ -158,6 +334,8 @@ int initrdfs_mount (void)
 			break;
 		case 0x37303730:
 			initrdfs_type = 2;
+			if (cpio_index.base != initrdfs_base || cpio_index.size != initrdfs_size)
+				cpio_build_index();
 			break;
 		default:
 			return 0;
@@ -201,6 +379,8 @@ int initrdfs_dir (char *dirname)
 			pos += cur_file.size + 1;
 		}
 	}
+	else if (cpio_index.nodes)
+		found = cpio_index_dir(dirname);
 	else
 		found = cpio_dir(dirname);
 
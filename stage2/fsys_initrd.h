@@ -12,4 +12,20 @@ struct initrdfs_file
 	grub_u16_t name_size;
 };
 
+/* Index over a cpio archive, built once per mounted archive.
+ * Node numbers stored in hash[] and chain[] are biased by one,
+ * so that zero ends a chain.
+ */
+struct initrdfs_index
+{
+	grub_u64_t base;	/* archive that was indexed */
+	grub_u64_t size;
+	grub_u32_t count;
+	grub_u32_t hash_mask;
+	struct initrdfs_file *nodes;
+	grub_u32_t *chain;	/* next node with the same hash */
+	grub_u32_t *sorted;	/* nodes in (case-insensitive) name order */
+	grub_u32_t *hash;	/* first node of each hash bucket */
+};
+
 #endif /* _INITRDFS_H_ */
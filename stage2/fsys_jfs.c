@@ -210,6 +210,38 @@ uni2ansi (UniChar *uni, char *ansi, int len)
 #define uni2ansi unicode_to_utf8
 #endif
 
+/* Extent cursor of jfs_map_block, reset whenever iNode is reloaded. */
+static struct xad *map_xad;
+
+static unsigned long long
+jfs_map_block (unsigned long long logical_block, unsigned long *count)
+{
+	struct xad *xad;
+	s64 offset, xadlen;
+
+	if (!map_xad || (s64)logical_block < offsetXAD (map_xad))
+		map_xad = first_extent (iNode);
+	for (xad = map_xad; xad; xad = next_extent ()) {
+		map_xad = xad;
+		offset = offsetXAD (xad);
+		xadlen = lengthXAD (xad);
+		if ((s64)logical_block < offset) {
+			/* hole in front of this extent */
+			*count = offset - logical_block;
+			return 0;
+		}
+		if (isinxt (logical_block, offset, xadlen)) {
+			*count = offset + xadlen - logical_block;
+			return (addressXAD (xad) + logical_block - offset) << jfs.bdlog;
+		}
+	}
+	/* sparse tail after the last extent */
+	*count = 0x7FFFFFFF;
+	return 0;
+}
+
+static struct fsys_block_map jfs_map = { 0, 0, 0, jfs_map_block };
+
 int
 jfs_mount (void)
 {
@@ -227,6 +259,7 @@ jfs_mount (void)
 	jfs.bsize = super.s_bsize;
 	jfs.l2bsize = super.s_l2bsize;
 	jfs.bdlog = jfs.l2bsize - SECTOR_BITS;
+	jfs_map.block_bits = jfs.l2bsize;
 
 	return 1;
 }
@@ -234,61 +267,7 @@ jfs_mount (void)
 unsigned long long
 jfs_read (unsigned long long buf, unsigned long long len, unsigned long write)
 {
-	struct xad *xad;
-	s64 endofprev, endofcur;
-	s64 offset, xadlen;
-	unsigned long toread, startpos, endpos;
-
-	startpos = filepos;
-	endpos = filepos + len;
-	endofprev = (1ULL << 62) - 1;
-	xad = first_extent (iNode);
-	do {
-		offset = offsetXAD (xad);
-		xadlen = lengthXAD (xad);
-		if (isinxt (filepos >> jfs.l2bsize, offset, xadlen)) {
-			endofcur = (offset + xadlen) << jfs.l2bsize; 
-			toread = (endofcur >= endpos)
-				  ? len : (endofcur - filepos);
-
-			disk_read_func = disk_read_hook;
-			devread (addressXAD (xad) << jfs.bdlog,
-				 filepos - (offset << jfs.l2bsize), toread, buf, write);
-			disk_read_func = NULL;
-
-			if (buf)
-				buf += toread;
-			len -= toread;		/* len always >= 0 */
-			filepos += toread;
-		} else if (offset > endofprev) {
-			toread = ((offset << jfs.l2bsize) >= endpos)
-				  ? len : ((offset - endofprev) << jfs.l2bsize);
-			filepos += toread;
-#if 0
-			{
-				unsigned long tmp_pos = toread;
-				for (; tmp_pos; tmp_pos--) {
-					if (buf)
-						*(buf++) = 0;
-				}
-			}
-#else
-			if (buf)
-			{
-				grub_memset64 (buf, 0, toread);
-				buf += toread;
-			}
-#endif
-			if (len <= toread)
-				break;
-			len -= toread;
-			continue;
-		}
-		endofprev = offset + xadlen; 
-		xad = next_extent ();
-	} while (len > 0 && xad);
-
-	return filepos - startpos;
+	return fsys_block_map_read (&jfs_map, buf, len, write);
 }
 
 int
@@ -308,6 +287,8 @@ jfs_dir (char *dirname)
 	link_count = 0;
 	for (;;) {
 		di_read (inum, iNode);
+		map_xad = NULL;
+		jfs_map.file_id = inum;
 		di_size = iNode->di_size;
 		di_mode = iNode->di_mode;
 
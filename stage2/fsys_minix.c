@@ -244,51 +244,24 @@ minix_block_map (int logical_block)
   return ((__u16 *) DATABLOCK2)[logical_block & 511];
 }
 
-/* read from INODE into BUF */
-unsigned long long
-minix_read (unsigned long long buf, unsigned long long len, unsigned long write)
+static unsigned long long
+minix_map_block (unsigned long long logical_block, unsigned long *count)
 {
-  unsigned long logical_block;
-  unsigned long offset;
-  unsigned long map;
-  unsigned long ret = 0;
-  unsigned long size = 0;
-
-  while (len > 0)
-    {
-      /* find the (logical) block component of our location */
-      logical_block = filepos >> BLOCK_SIZE_BITS;
-      offset = filepos & (BLOCK_SIZE - 1);
-      map = minix_block_map (logical_block);
-#ifdef DEBUG_MINIX
-      printf ("map=%d\n", map);
-#endif
-      if (map < 0)
-	  break;
-
-      size = BLOCK_SIZE;
-      size -= offset;
-
-      if (size > len)
-	  size = len;
+  int map = minix_block_map ((int) logical_block);
 
-      disk_read_func = disk_read_hook;
-
-      devread (map * (BLOCK_SIZE / DEV_BSIZE), offset, size, buf, write);
-
-      disk_read_func = NULL;
-
-      if (buf)
-	buf += size;
-      len -= size;	/* len always >= 0 */
-      filepos += size;
-      ret += size;
-    }
+  if (map < 0)
+    return FSYS_BLOCK_MAP_END;
+  return (unsigned long long) map * (BLOCK_SIZE / DEV_BSIZE);
+}
 
-  if (errnum)
-    ret = 0;
+static struct fsys_block_map minix_map =
+  { 0, BLOCK_SIZE_BITS, 0, minix_map_block };
 
-  return ret;
+/* read from INODE into BUF */
+unsigned long long
+minix_read (unsigned long long buf, unsigned long long len, unsigned long write)
+{
+  return fsys_block_map_read (&minix_map, buf, len, write);
 }
 
 /* preconditions: minix_mount already executed, therefore supblk in buffer
@@ -345,6 +318,7 @@ minix_dir (char *dirname)
 
       /* reset indirect blocks! */
       mapblock2 = mapblock1 = -1;
+      minix_map.file_id = current_ino;
 
       raw_inode = INODE + ((current_ino - 1) % MINIX_INODES_PER_BLOCK);
 
@@ -883,47 +883,99 @@ search_stat (__u32 dir_id, __u32 objectid)
   return 0;
 }
 
+/* Map a logical block of the open file through its indirect items.
+ * Tails packed into direct items can not be mapped; the tree is then
+ * left positioned at the direct item for reiserfs_read to copy.
+ */
+static unsigned long long
+reiserfs_map_block (unsigned long long logical_block, unsigned long *count)
+{
+  unsigned long long pos = logical_block << INFO->fullblocksize_shift;
+  unsigned long long key_offset;
+  unsigned long offset;
+  
+  if (INFO->current_ih->ih_key.k_objectid != INFO->fileinfo.k_objectid
+      || IH_KEY_OFFSET (INFO->current_ih) > pos + 1)
+    {
+      if (! search_stat (INFO->fileinfo.k_dir_id, INFO->fileinfo.k_objectid))
+	return FSYS_BLOCK_MAP_END;
+      next_key ();
+    }
+  
+  while (! errnum
+	 && INFO->current_ih->ih_key.k_objectid == INFO->fileinfo.k_objectid)
+    {
+      key_offset = IH_KEY_OFFSET (INFO->current_ih);
+      if (key_offset > pos + 1)
+	{
+	  /* hole up to the next item */
+	  *count = (key_offset - 1 - pos) >> INFO->fullblocksize_shift;
+	  return 0;
+	}
+      offset = pos - key_offset + 1;
+      
+      if (IH_KEY_ISTYPE (INFO->current_ih, TYPE_INDIRECT)
+	  && (offset >> INFO->fullblocksize_shift)
+	     < (unsigned long) (INFO->current_ih->ih_item_len >> 2))
+	return (unsigned long long) ((__u32 *) INFO->current_item)
+		 [offset >> INFO->fullblocksize_shift] << INFO->blocksize_shift;
+      
+      if (IH_KEY_ISTYPE (INFO->current_ih, TYPE_DIRECT)
+	  && offset < INFO->current_ih->ih_item_len)
+	break;
+      
+      next_key ();
+    }
+  
+  return FSYS_BLOCK_MAP_END;
+}
+
+static struct fsys_block_map reiserfs_map = { 0, 0, 0, reiserfs_map_block };
+
 unsigned long long
 reiserfs_read (unsigned long long buf, unsigned long long len, unsigned long write)
 {
-  unsigned long blocksize;
+  unsigned long long prev_filepos = filepos;
+  unsigned long long size;
   unsigned long offset;
   unsigned long to_read;
-  unsigned long prev_filepos = filepos;
   
 #ifdef REISERDEBUG
   printf ("reiserfs_read: filepos=%ld len=%ld, offset=%lx\n",
 	  (unsigned long long)filepos, (unsigned long long)len, (__u64) IH_KEY_OFFSET (INFO->current_ih) - 1);
 #endif /* REISERDEBUG */
   
-  if (INFO->current_ih->ih_key.k_objectid != INFO->fileinfo.k_objectid
-      || IH_KEY_OFFSET (INFO->current_ih) > filepos + 1)
-    {
-      search_stat (INFO->fileinfo.k_dir_id, INFO->fileinfo.k_objectid);
-      goto get_next_key;
-    }
+  reiserfs_map.file_id = INFO->fileinfo.k_objectid;
+  reiserfs_map.block_bits = INFO->fullblocksize_shift;
   
-  while (! errnum)
+  while (len && ! errnum)
     {
-      if (INFO->current_ih->ih_key.k_objectid != INFO->fileinfo.k_objectid)
+      /* Unformatted blocks, in contiguous runs.  */
+      size = fsys_block_map_read (&reiserfs_map, buf, len, write);
+      if (buf)
+	buf += size;
+      len -= size;
+      if (! len || errnum)
 	break;
       
-      offset = filepos - IH_KEY_OFFSET (INFO->current_ih) + 1;
-      blocksize = INFO->current_ih->ih_item_len;
-      
-#ifdef REISERDEBUG
-      printf ("  loop: filepos=%ld len=%ld, offset=%ld blocksize=%ld\n",
-	      (unsigned long long)filepos, (unsigned long long)len, (unsigned long long)offset, (unsigned long long)blocksize);
-#endif /* REISERDEBUG */
-      
-      if (IH_KEY_ISTYPE(INFO->current_ih, TYPE_DIRECT)
-	  && offset < blocksize)
+      /* The tail, copied out of the direct item(s) in the leaf.  */
+      size = 0;
+      while (len && ! errnum
+	     && INFO->current_ih->ih_key.k_objectid == INFO->fileinfo.k_objectid
+	     && IH_KEY_ISTYPE (INFO->current_ih, TYPE_DIRECT)
+	     && IH_KEY_OFFSET (INFO->current_ih) <= filepos + 1)
 	{
+	  offset = filepos - IH_KEY_OFFSET (INFO->current_ih) + 1;
+	  if (offset >= INFO->current_ih->ih_item_len)
+	    {
+	      next_key ();
+	      continue;
+	    }
 #ifdef REISERDEBUG
 	  printf ("direct_read: offset=%ld, blocksize=%ld\n",
-		  (unsigned long long)offset, (unsigned long long)blocksize);
+		  (unsigned long long)offset, (unsigned long long)INFO->current_ih->ih_item_len);
 #endif /* REISERDEBUG */
-	  to_read = blocksize - offset;
+	  to_read = INFO->current_ih->ih_item_len - offset;
 	  if (to_read > len)
 	    to_read = len;
 	  
@@ -938,49 +990,17 @@ reiserfs_read (unsigned long long buf, unsigned long long len, unsigned long wri
 	    }
 	  else if (buf)
 	    grub_memmove64 (buf, (unsigned long long)(unsigned int)(INFO->current_item + offset), to_read);
-	  goto update_buf_len;
-	}
-      else if (IH_KEY_ISTYPE(INFO->current_ih, TYPE_INDIRECT))
-	{
-	  blocksize = (blocksize >> 2) << INFO->fullblocksize_shift;
-#ifdef REISERDEBUG
-	  printf ("indirect_read: offset=%ld, blocksize=%ld\n",
-		  (unsigned long long)offset, (unsigned long long)blocksize);
-#endif /* REISERDEBUG */
 	  
-	  while (offset < blocksize)
-	    {
-	      __u32 blocknr = ((__u32 *) INFO->current_item)
-		[offset >> INFO->fullblocksize_shift];
-	      unsigned long blk_offset = offset & (INFO->blocksize-1);
-	      
-	      to_read = INFO->blocksize - blk_offset;
-	      if (to_read > len)
-		to_read = len;
-	      
-	      disk_read_func = disk_read_hook;
-	      
-	      /* Journal is only for meta data.  Data blocks can be read
-	       * directly without using block_read
-	       */
-	      devread (blocknr << INFO->blocksize_shift,
-		       blk_offset, to_read, buf, write);
-	      
-	      disk_read_func = NULL;
-update_buf_len:
-	      len -= to_read;
-	      if (buf)
-		buf += to_read;
-	      offset += to_read;
-	      filepos += to_read;
-	      if (len == 0)
-		goto done;
-	    }
+	  len -= to_read;
+	  if (buf)
+	    buf += to_read;
+	  filepos += to_read;
+	  size += to_read;
 	}
-get_next_key:
-      next_key ();
-    } /* while (! errnum) */
-done:
+      if (! size)
+	break;
+    }
+  
   return errnum ? 0 : filepos - prev_filepos;
 }
 
@@ -0,0 +1,707 @@
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2026  Free Software Foundation, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Read-only SquashFS 4.0 support.
+ *
+ * The image is read in place from the current partition, so a
+ * filesystem.squashfs inside another filesystem can be used after a plain
+ * "map" (no --mem) of the file to a drive. Decompressed metadata and data
+ * blocks are kept in two small LRU caches; fragment blocks shared by many
+ * small files end up in the data cache as well.
+ */
+
+#ifdef FSYS_SQUASHFS
+
+#include "shared.h"
+#include "filesys.h"
+#include "squashfs.h"
+#include "term.h"
+
+#define SQFS_PATH_MAX		1024
+#define SQFS_DIR_DEPTH		64	/* directory levels below the root */
+#define MAX_LINK_COUNT		5	/* number of symbolic links to follow */
+
+/* Cache sizes. Data slots are block_size each, up to SQFS_DATA_CACHE
+   bytes in total but never fewer than two.  */
+#define SQFS_CACHE_SLOTS	32
+#define SQFS_META_SLOTS		32
+#define SQFS_DATA_CACHE		0x400000
+
+struct sqfs_cache_slot
+{
+  unsigned long long pos;	/* image offset of the block, -1 if empty */
+  unsigned long long next;	/* image offset of the following metadata block */
+  unsigned long size;		/* bytes of decompressed data */
+  unsigned long stamp;		/* last use, for LRU replacement */
+  unsigned char *data;
+};
+
+struct sqfs_cache
+{
+  unsigned long nslots;
+  unsigned long slot_size;
+  struct sqfs_cache_slot slot[SQFS_CACHE_SLOTS];
+};
+
+static struct sqfs_cache meta_cache;
+static struct sqfs_cache data_cache;
+static unsigned long sqfs_tick;
+
+/* the mounted image */
+static struct squashfs_super_block sqfs_sb;
+static unsigned long sqfs_drive = 0xFFFFFFFF;
+static unsigned long sqfs_partition;
+static unsigned char *sqfs_inbuf;	/* compressed block, block_size bytes */
+static unsigned long sqfs_inbuf_size;
+
+/* the inode last read, and where its variable part starts */
+static union squashfs_inode sqfs_inode;
+static unsigned long long sqfs_inode_block;
+static unsigned long sqfs_inode_offset;
+
+/* the open file */
+static unsigned long long file_start;	/* image offset of the first data block */
+static unsigned long file_blocks;	/* number of data blocks */
+static unsigned long *file_sizes;	/* their on-disk sizes */
+static unsigned long file_sizes_max;
+static unsigned long long frag_start;	/* tail end fragment block, if any */
+static unsigned long frag_size;
+static unsigned long frag_offset;
+static unsigned long cursor_block;	/* file_start advanced to this block */
+static unsigned long long cursor_pos;
+
+static char sqfs_linkbuf[SQFS_PATH_MAX];
+static char sqfs_name[257];
+/* directories walked from the root, for ".." and relative links */
+static unsigned long long sqfs_dirs[SQFS_DIR_DEPTH];
+
+static int
+sqfs_decompress (unsigned char *dst, unsigned long dst_len, unsigned char *src, unsigned long src_len, unsigned long *out)
+{
+#ifndef NO_DECOMPRESSION
+  long n;
+
+  switch (sqfs_sb.compression)
+    {
+    case SQUASHFS_ZLIB:
+      *out = inflate_buffer (dst, dst_len, src, src_len, 1);
+      return *out != 0;
+    case SQUASHFS_LZMA:
+      *out = lzma_decode_buffer (dst, dst_len, src, src_len);
+      return *out != 0;
+    case SQUASHFS_XZ:
+      *out = xz_decode_buffer (dst, dst_len, src, src_len);
+      return *out != 0;
+    case SQUASHFS_ZSTD:
+      *out = zstd_decode_buffer (dst, dst_len, src, src_len);
+      return *out != 0;
+    case SQUASHFS_LZ4:
+      n = lz4_decode_block (dst, dst_len, src, src_len, dst);
+      if (n <= 0)
+	break;
+      *out = n;
+      return 1;
+    }
+#endif /* ! NO_DECOMPRESSION */
+  errnum = ERR_BAD_GZIP_DATA;
+  return 0;
+}
+
+/* Read the block of LEN bytes at image offset POS into DST, which has
+   room for DST_LEN bytes, and decompress it unless UNCOMPRESSED.  */
+static int
+sqfs_read_block (unsigned char *dst, unsigned long dst_len, unsigned long long pos,
+		 unsigned long len, int uncompressed, unsigned long *out)
+{
+  if (uncompressed)
+    {
+      if (len > dst_len)
+	goto corrupt;
+      *out = len;
+      return devread (0, pos, len, (unsigned long long)(unsigned int)dst, GRUB_READ);
+    }
+
+  if (len > sqfs_inbuf_size)
+    goto corrupt;
+  if (! devread (0, pos, len, (unsigned long long)(unsigned int)sqfs_inbuf, GRUB_READ))
+    return 0;
+  return sqfs_decompress (dst, dst_len, sqfs_inbuf, len, out);
+
+corrupt:
+  errnum = ERR_FSYS_CORRUPT;
+  return 0;
+}
+
+static void
+sqfs_cache_flush (struct sqfs_cache *c)
+{
+  unsigned long i;
+
+  for (i = 0; i < SQFS_CACHE_SLOTS; i++)
+    {
+      c->slot[i].pos = -1ULL;
+      c->slot[i].stamp = 0;
+    }
+}
+
+/* Drop the slot buffers, for a change of block size.  */
+static void
+sqfs_cache_free (struct sqfs_cache *c)
+{
+  unsigned long i;
+
+  for (i = 0; i < SQFS_CACHE_SLOTS; i++)
+    if (c->slot[i].data)
+      {
+	grub_free (c->slot[i].data);
+	c->slot[i].data = 0;
+      }
+  sqfs_cache_flush (c);
+}
+
+static struct sqfs_cache_slot *
+sqfs_cache_find (struct sqfs_cache *c, unsigned long long pos)
+{
+  struct sqfs_cache_slot *s;
+  unsigned long i;
+
+  for (i = 0, s = c->slot; i < c->nslots; i++, s++)
+    if (s->pos == pos)
+      {
+	s->stamp = ++sqfs_tick;
+	return s;
+      }
+  return 0;
+}
+
+/* Load the block of LEN bytes at DATA_POS into the least recently used
+   slot, and file it under POS.  */
+static struct sqfs_cache_slot *
+sqfs_cache_fill (struct sqfs_cache *c, unsigned long long pos, unsigned long long data_pos,
+		 unsigned long len, int uncompressed, unsigned long long next)
+{
+  struct sqfs_cache_slot *s, *victim;
+  unsigned long i;
+
+  for (i = 1, victim = c->slot, s = c->slot + 1; i < c->nslots; i++, s++)
+    if (s->stamp < victim->stamp)
+      victim = s;
+  s = victim;
+
+  if (! s->data && ! (s->data = grub_malloc (c->slot_size)))
+    return 0;
+  s->pos = -1ULL;
+  s->stamp = 0;
+  if (! sqfs_read_block (s->data, c->slot_size, data_pos, len, uncompressed, &s->size))
+    return 0;
+  s->pos = pos;
+  s->next = next;
+  s->stamp = ++sqfs_tick;
+  return s;
+}
+
+static struct sqfs_cache_slot *
+sqfs_meta_block (unsigned long long block)
+{
+  struct sqfs_cache_slot *s;
+  unsigned short hdr;
+
+  if ((s = sqfs_cache_find (&meta_cache, block)))
+    return s;
+  if (! devread (0, block, 2, (unsigned long long)(unsigned int)&hdr, GRUB_READ))
+    return 0;
+  return sqfs_cache_fill (&meta_cache, block, block + 2, SQUASHFS_METADATA_LEN (hdr),
+			  hdr & SQUASHFS_METADATA_UNCOMPRESSED,
+			  block + 2 + SQUASHFS_METADATA_LEN (hdr));
+}
+
+/* Copy LEN bytes of metadata at *BLOCK (image offset of a metadata block)
+   and *OFFSET (into its decompressed data) to BUF, advancing both.  */
+static int
+sqfs_read_meta (unsigned long long *block, unsigned long *offset, void *buf, unsigned long len)
+{
+  struct sqfs_cache_slot *s;
+  unsigned long n;
+
+  while (len)
+    {
+      if (! (s = sqfs_meta_block (*block)))
+	return 0;
+      if (*offset >= s->size)
+	{
+	  errnum = ERR_FSYS_CORRUPT;
+	  return 0;
+	}
+      n = s->size - *offset;
+      if (n > len)
+	n = len;
+      memmove (buf, s->data + *offset, n);
+      buf = (char *) buf + n;
+      len -= n;
+      *offset += n;
+      if (*offset == s->size)
+	{
+	  *block = s->next;
+	  *offset = 0;
+	}
+    }
+  return 1;
+}
+
+static int
+sqfs_read_inode (unsigned long long ref)
+{
+  unsigned long size;
+
+  sqfs_inode_block = sqfs_sb.inode_table_start + SQUASHFS_REF_BLOCK (ref);
+  sqfs_inode_offset = SQUASHFS_REF_OFFSET (ref);
+  if (! sqfs_read_meta (&sqfs_inode_block, &sqfs_inode_offset, &sqfs_inode,
+			sizeof (struct squashfs_base_inode)))
+    return 0;
+
+  switch (sqfs_inode.base.inode_type)
+    {
+    case SQUASHFS_DIR_TYPE:
+      size = sizeof (struct squashfs_dir_inode);
+      break;
+    case SQUASHFS_LDIR_TYPE:
+      size = sizeof (struct squashfs_ldir_inode);
+      break;
+    case SQUASHFS_REG_TYPE:
+      size = sizeof (struct squashfs_reg_inode);
+      break;
+    case SQUASHFS_LREG_TYPE:
+      size = sizeof (struct squashfs_lreg_inode);
+      break;
+    case SQUASHFS_SYMLINK_TYPE:
+    case SQUASHFS_LSYMLINK_TYPE:
+      size = sizeof (struct squashfs_symlink_inode);
+      break;
+    default:
+      return 1;		/* devices, fifos and sockets are never opened */
+    }
+  return sqfs_read_meta (&sqfs_inode_block, &sqfs_inode_offset,
+			 (char *) &sqfs_inode + sizeof (struct squashfs_base_inode),
+			 size - sizeof (struct squashfs_base_inode));
+}
+
+/* Set up the regular file in sqfs_inode for reading.  */
+static int
+sqfs_open_file (void)
+{
+  unsigned long long size;
+  unsigned long frag, bits = sqfs_sb.block_log;
+
+  if (sqfs_inode.base.inode_type == SQUASHFS_REG_TYPE)
+    {
+      file_start = sqfs_inode.reg.start_block;
+      size = sqfs_inode.reg.file_size;
+      frag = sqfs_inode.reg.fragment;
+      frag_offset = sqfs_inode.reg.offset;
+    }
+  else
+    {
+      file_start = sqfs_inode.lreg.start_block;
+      size = sqfs_inode.lreg.file_size;
+      frag = sqfs_inode.lreg.fragment;
+      frag_offset = sqfs_inode.lreg.offset;
+    }
+
+  if (frag == SQUASHFS_INVALID_FRAG)
+    file_blocks = (size + sqfs_sb.block_size - 1) >> bits;
+  else
+    file_blocks = size >> bits;
+
+  if (file_blocks > file_sizes_max)
+    {
+      if (file_sizes)
+	grub_free (file_sizes);
+      file_sizes_max = 0;
+      if (! (file_sizes = grub_malloc (file_blocks * 4)))
+	return 0;
+      file_sizes_max = file_blocks;
+    }
+  if (! sqfs_read_meta (&sqfs_inode_block, &sqfs_inode_offset, file_sizes, file_blocks * 4))
+    return 0;
+
+  frag_size = 0;
+  if (frag != SQUASHFS_INVALID_FRAG)
+    {
+      struct squashfs_fragment_entry entry;
+      unsigned long long block;
+      unsigned long offset;
+
+      if (frag >= sqfs_sb.fragments)
+	{
+	  errnum = ERR_FSYS_CORRUPT;
+	  return 0;
+	}
+      if (! devread (0, sqfs_sb.fragment_table_start + (frag / SQUASHFS_FRAGMENTS_PER_BLOCK) * 8,
+		     8, (unsigned long long)(unsigned int)&block, GRUB_READ))
+	return 0;
+      offset = (frag % SQUASHFS_FRAGMENTS_PER_BLOCK) * sizeof (entry);
+      if (! sqfs_read_meta (&block, &offset, &entry, sizeof (entry)))
+	return 0;
+      frag_start = entry.start_block;
+      frag_size = entry.size;
+    }
+
+  cursor_block = 0;
+  cursor_pos = file_start;
+  filemax = size;
+  filemtime = sqfs_inode.base.mtime;
+  return 1;
+}
+
+int
+squashfs_mount (void)
+{
+  struct squashfs_super_block sb;
+  unsigned long n;
+
+  if (! devread (0, 0, sizeof (sb), (unsigned long long)(unsigned int)&sb, GRUB_READ)
+      || sb.s_magic != SQUASHFS_MAGIC || sb.s_major != SQUASHFS_MAJOR
+      || sb.block_log < 12 || sb.block_log > 20
+      || sb.block_size != (1UL << sb.block_log))
+    return 0;
+
+  switch (sb.compression)
+    {
+#ifndef NO_DECOMPRESSION
+    case SQUASHFS_ZLIB:
+    case SQUASHFS_LZMA:
+    case SQUASHFS_XZ:
+    case SQUASHFS_LZ4:
+    case SQUASHFS_ZSTD:
+      break;
+#endif
+    default:
+      return 0;
+    }
+
+  if (sqfs_drive == current_drive && sqfs_partition == current_partition
+      && ! memcmp ((char *) &sb, (char *) &sqfs_sb, sizeof (sb)))
+    return 1;
+
+  /* a different image, forget what was cached */
+  if (sb.block_size != data_cache.slot_size)
+    {
+      sqfs_cache_free (&data_cache);
+      if (sqfs_inbuf)
+	grub_free (sqfs_inbuf);
+      sqfs_inbuf_size = 0;
+      /* compressed metadata blocks may exceed a small data block */
+      n = sb.block_size < SQUASHFS_METADATA_SIZE ? SQUASHFS_METADATA_SIZE : sb.block_size;
+      if (! (sqfs_inbuf = grub_malloc (n)))
+	return 0;
+      sqfs_inbuf_size = n;
+      data_cache.slot_size = sb.block_size;
+      data_cache.nslots = SQFS_DATA_CACHE / sb.block_size;
+      if (data_cache.nslots > SQFS_CACHE_SLOTS)
+	data_cache.nslots = SQFS_CACHE_SLOTS;
+      if (data_cache.nslots < 2)
+	data_cache.nslots = 2;
+    }
+  meta_cache.slot_size = SQUASHFS_METADATA_SIZE;
+  meta_cache.nslots = SQFS_META_SLOTS;
+  sqfs_cache_flush (&meta_cache);
+  sqfs_cache_flush (&data_cache);
+
+  sqfs_sb = sb;
+  sqfs_drive = current_drive;
+  sqfs_partition = current_partition;
+  return 1;
+}
+
+/* Return the image offset of data block BLK of the open file.  */
+static unsigned long long
+sqfs_block_pos (unsigned long blk)
+{
+  while (cursor_block < blk)
+    cursor_pos += SQUASHFS_BLOCK_LEN (file_sizes[cursor_block++]);
+  while (cursor_block > blk)
+    cursor_pos -= SQUASHFS_BLOCK_LEN (file_sizes[--cursor_block]);
+  return cursor_pos;
+}
+
+unsigned long long
+squashfs_read (unsigned long long buf, unsigned long long len, unsigned long write)
+{
+  unsigned long long ret = 0;
+  unsigned long bits = sqfs_sb.block_log;
+
+  if (write == GRUB_WRITE)
+    {
+      errnum = ERR_WRITE;
+      return 0;
+    }
+
+  while (len)
+    {
+      unsigned long blk = filepos >> bits;
+      unsigned long off = filepos & (sqfs_sb.block_size - 1);
+      unsigned long n = sqfs_sb.block_size - off;
+      struct sqfs_cache_slot *s;
+
+      if (n > len)
+	n = len;
+
+      if (! buf)
+	;
+      else if (blk < file_blocks)
+	{
+	  unsigned long size = file_sizes[blk];
+	  unsigned long long pos = sqfs_block_pos (blk);
+
+	  if (size == 0)
+	    /* sparse */
+	    grub_memset64 (buf, 0, n);
+	  else if (n == sqfs_sb.block_size && buf + n <= 0x100000000ULL)
+	    {
+	      /* a whole block: decompress straight into the destination */
+	      unsigned long out;
+
+	      if (! sqfs_read_block ((unsigned char *)(unsigned int)buf, n, pos,
+				     SQUASHFS_BLOCK_LEN (size), size & SQUASHFS_BLOCK_UNCOMPRESSED, &out))
+		break;
+	    }
+	  else
+	    {
+	      if (! (s = sqfs_cache_find (&data_cache, pos))
+		  && ! (s = sqfs_cache_fill (&data_cache, pos, pos, SQUASHFS_BLOCK_LEN (size),
+					     size & SQUASHFS_BLOCK_UNCOMPRESSED, 0)))
+		break;
+	      if (off + n > s->size)
+		goto corrupt;
+	      grub_memmove64 (buf, (unsigned long long)(unsigned int)(s->data + off), n);
+	    }
+	}
+      else
+	{
+	  /* the tail end is in a fragment */
+	  if (! frag_size)
+	    goto corrupt;
+	  if (! (s = sqfs_cache_find (&data_cache, frag_start))
+	      && ! (s = sqfs_cache_fill (&data_cache, frag_start, frag_start, SQUASHFS_BLOCK_LEN (frag_size),
+					 frag_size & SQUASHFS_BLOCK_UNCOMPRESSED, 0)))
+	    break;
+	  if (frag_offset + off + n > s->size)
+	    goto corrupt;
+	  grub_memmove64 (buf, (unsigned long long)(unsigned int)(s->data + frag_offset + off), n);
+	}
+
+      if (buf)
+	buf += n;
+      len -= n;
+      ret += n;
+      filepos += n;
+    }
+
+  return errnum ? 0 : ret;
+
+corrupt:
+  errnum = ERR_FSYS_CORRUPT;
+  return 0;
+}
+
+int
+squashfs_dir (char *dirname)
+{
+  unsigned long long ref = sqfs_sb.root_inode;
+  int link_count = 0, depth = 0;
+  char *rest, ch;
+
+  for (;;)
+    {
+      unsigned long type, left;
+      unsigned long long block;
+      unsigned long offset;
+      int found = 0;
+
+      if (! sqfs_read_inode (ref))
+	return 0;
+      type = sqfs_inode.base.inode_type;
+
+      /* If we've got a symbolic link, then chase it. */
+      if (type == SQUASHFS_SYMLINK_TYPE || type == SQUASHFS_LSYMLINK_TYPE)
+	{
+	  unsigned long size = sqfs_inode.symlink.symlink_size;
+	  int len;
+
+	  if (++link_count > MAX_LINK_COUNT)
+	    {
+	      errnum = ERR_SYMLINK_LOOP;
+	      return 0;
+	    }
+	  for (len = 0; dirname[len]; len++)
+	    ;
+	  if (size + len > SQFS_PATH_MAX - 2)
+	    {
+	      errnum = ERR_FILELENGTH;
+	      return 0;
+	    }
+	  /* DIRNAME and the link buffer may overlap */
+	  memmove (sqfs_linkbuf + size, dirname, len);
+	  sqfs_linkbuf[size + len] = 0;
+	  if (! sqfs_read_meta (&sqfs_inode_block, &sqfs_inode_offset, sqfs_linkbuf, size))
+	    return 0;
+	  dirname = sqfs_linkbuf;
+	  if (*dirname == '/')
+	    {
+	      ref = sqfs_sb.root_inode;
+	      depth = 0;
+	    }
+	  else if (depth)
+	    ref = sqfs_dirs[--depth];
+	  continue;
+	}
+
+      /* if we have a real file (and we're not just printing possibilities),
+         then this is where we want to exit */
+      if (! *dirname || isspace (*dirname))
+	{
+	  if (type != SQUASHFS_REG_TYPE && type != SQUASHFS_LREG_TYPE)
+	    {
+	      errnum = ERR_BAD_FILETYPE;
+	      return 0;
+	    }
+	  return sqfs_open_file ();
+	}
+
+      while (*dirname == '/')
+	dirname++;
+
+      if (type == SQUASHFS_DIR_TYPE)
+	{
+	  block = sqfs_inode.dir.start_block;
+	  offset = sqfs_inode.dir.offset;
+	  left = sqfs_inode.dir.file_size;
+	}
+      else if (type == SQUASHFS_LDIR_TYPE)
+	{
+	  block = sqfs_inode.ldir.start_block;
+	  offset = sqfs_inode.ldir.offset;
+	  left = sqfs_inode.ldir.file_size;
+	}
+      else
+	{
+	  errnum = ERR_BAD_FILETYPE;
+	  return 0;
+	}
+      block += sqfs_sb.directory_table_start;
+      /* the size counts three bytes for the implied "." and ".." */
+      left = (left > 3) ? left - 3 : 0;
+
+      for (rest = dirname; (ch = *rest) && ch != '/'; rest++)
+	;
+      *rest = 0;
+
+      /* the directory table has no "." or ".." entries */
+      if (! (print_possibilities && ch != '/') && *dirname == '.'
+	  && (! dirname[1] || (dirname[1] == '.' && ! dirname[2])))
+	{
+	  if (dirname[1] && depth)
+	    ref = sqfs_dirs[--depth];
+	  *(dirname = rest) = ch;
+	  continue;
+	}
+
+      /* loop for reading the entries in a directory */
+      while (left && ! found)
+	{
+	  struct squashfs_dir_header hdr;
+	  unsigned long count;
+
+	  if (left < sizeof (hdr)
+	      || ! sqfs_read_meta (&block, &offset, &hdr, sizeof (hdr)))
+	    goto corrupt;
+	  left -= sizeof (hdr);
+	  for (count = hdr.count + 1; count && left; count--)
+	    {
+	      struct squashfs_dir_entry entry;
+	      unsigned long len;
+
+	      if (left < sizeof (entry)
+		  || ! sqfs_read_meta (&block, &offset, &entry, sizeof (entry)))
+		goto corrupt;
+	      len = entry.size + 1;
+	      if (len > 256 || left < sizeof (entry) + len
+		  || ! sqfs_read_meta (&block, &offset, sqfs_name, len))
+		goto corrupt;
+	      left -= sizeof (entry) + len;
+	      sqfs_name[len] = 0;
+
+	      if (print_possibilities && ch != '/')
+		{
+		  if (! *dirname || substring (dirname, sqfs_name, 0) <= 0)
+		    {
+		      unsigned long long clo64 = current_color_64bit;
+		      unsigned long clo = current_color;
+
+		      if (print_possibilities > 0)
+			print_possibilities = -print_possibilities;
+		      if (entry.type == SQUASHFS_DIR_TYPE)
+			{
+			  if (current_term->setcolorstate)
+			    current_term->setcolorstate (COLOR_STATE_HIGHLIGHT);
+			  current_color_64bit = (current_color_64bit & 0xffffff) | (clo64 & 0xffffff00000000);
+			  current_color = (current_color & 0x0f) | (clo & 0xf0);
+			}
+		      print_a_completion (sqfs_name, 0);
+		      current_color_64bit = clo64;
+		      current_color = clo;
+		    }
+		}
+	      else if (substring (dirname, sqfs_name, 0) == 0)
+		{
+		  if (depth == SQFS_DIR_DEPTH)
+		    {
+		      *rest = ch;
+		      errnum = ERR_FILELENGTH;
+		      return 0;
+		    }
+		  sqfs_dirs[depth++] = ref;
+		  ref = ((unsigned long long) hdr.start_block << 16) | entry.offset;
+		  found = 1;
+		  break;
+		}
+	    }
+	}
+
+      if (! found)
+	{
+	  *rest = ch;
+	  if (print_possibilities < 0)
+	    return 1;
+	  errnum = ERR_FILE_NOT_FOUND;
+	  return 0;
+	}
+
+      /* only get here if we have a matching directory entry */
+      *(dirname = rest) = ch;
+    }
+
+corrupt:
+  *rest = ch;
+  errnum = ERR_FSYS_CORRUPT;
+  return 0;
+}
+
+#endif /* FSYS_SQUASHFS */
@@ -70,6 +70,9 @@ static int sblock_try[] = SBLOCKSEARCH;
 static ufs2_daddr_t sblockloc;
 static int type;
 
+static unsigned long long ufs2_map_block (unsigned long long logical_block, unsigned long *count);
+static struct fsys_block_map ufs2_map = { 0, 0, 0, ufs2_map_block };
+
 /* pointer to superblock */
 #define SUPERBLOCK ((struct fs *) ( FSYS_BUF + 8192 ))
 
@@ -116,6 +119,8 @@ ufs2_mount (void)
   
   mapblock = -1;
   mapblock_offset = -1;
+  if (retval)
+    ufs2_map.block_bits = SUPERBLOCK->fs_bshift;
   
   return retval;
 }
@@ -166,43 +171,20 @@ block_map (int file_block)
 				    - mapblock_offset]);
 }
 
-unsigned long long
-ufs2_read (unsigned long long buf, unsigned long long len, unsigned long write)
+static unsigned long long
+ufs2_map_block (unsigned long long logical_block, unsigned long *count)
 {
-  unsigned long logno, off, size, ret = 0;
   grub_int64_t map;
 
-  while (len && !errnum)
-    {
-      off = blkoff (SUPERBLOCK, filepos);
-      logno = lblkno (SUPERBLOCK, filepos);
-      size = blksize (SUPERBLOCK, INODE_UFS2, logno);
-
-      if ((map = block_map (logno)) < 0)
-	  break; 
-
-      size -= off;
-
-      if (size > len)
-	  size = len;
-
-      disk_read_func = disk_read_hook;
-
-      devread (fsbtodb (SUPERBLOCK, map), off, size, buf, write);
-
-      disk_read_func = NULL;
-
-      if (buf)
-	buf += size;
-      len -= size;	/* len always >= 0 */
-      filepos += size;
-      ret += size;
-    }
-
-  if (errnum)
-    ret = 0;
+  if ((map = block_map ((int) logical_block)) < 0)
+    return FSYS_BLOCK_MAP_END;
+  return fsbtodb (SUPERBLOCK, (unsigned long long) map);
+}
 
-  return ret;
+unsigned long long
+ufs2_read (unsigned long long buf, unsigned long long len, unsigned long write)
+{
+  return fsys_block_map_read (&ufs2_map, buf, len, write);
 }
 
 int
@@ -225,6 +207,7 @@ loop:
 	    ino % (SUPERBLOCK->fs_inopb) * sizeof (struct ufs2_dinode),
 	    sizeof (struct ufs2_dinode), (unsigned long long)(unsigned int)(char *) INODE_UFS2, 0xedde0d90))
 		    return 0;			/* XXX what return value? */
+  ufs2_map.file_id = ino;
 
   /* if we have a real file (and we're not just printing possibilities),
      then this is where we want to exit */
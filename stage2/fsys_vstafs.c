@@ -185,7 +185,7 @@ vstafs_dir (char *dirname)
 	    {
 	      f_sector = d->start;
 	      get_file_info (f_sector);
-	      filemax = FILE_INFO->len; 
+	      filemax = FILE_INFO->len - VSTAFS_START_DATA;
 	      break;
 	    }
 	}
@@ -210,75 +210,34 @@ vstafs_dir (char *dirname)
   return 1;
 }
 
-unsigned long long
-vstafs_read (unsigned long long buf, unsigned long long len, unsigned long write)
+/* File data starts VSTAFS_START_DATA bytes into the first sector of the
+   first extent, so logical block N is the N-th sector of the extent list. */
+static unsigned long long
+vstafs_map_block (unsigned long long logical_block, unsigned long *count)
 {
-  //struct alloc *blocks;
-  unsigned long size, ret = 0, offset, curr_len = 0;
-  //int curr_ext;
-  char extent;
-  unsigned long ext_size;
-  //char *curr_pos;
-  
+  unsigned int i;
+
   get_file_info (f_sector);
-  size = FILE_INFO->len-VSTAFS_START_DATA;
-  blocks = FILE_INFO->blocks;
-  
-  if (filepos > 0)
+  for (i = 0; i < FILE_INFO->extents && i < 32; i++)
     {
-      if (filepos < blocks[0].a_len * 512 - VSTAFS_START_DATA)
-	{
-	  offset = filepos + VSTAFS_START_DATA;
-	  extent = 0;
-	  curr_len = blocks[0].a_len * 512 - offset - filepos; 
-	}
-      else
+      if (logical_block < FILE_INFO->blocks[i].a_len)
 	{
-	  ext_size = blocks[0].a_len * 512 - VSTAFS_START_DATA;
-	  offset = filepos - ext_size;
-	  extent = 1;
-	  do
-	    {
-	      curr_len -= ext_size;
-	      offset -= ext_size;
-	      ext_size = blocks[extent+1].a_len * 512;
-	    }
-	  while (extent < FILE_INFO->extents && offset>ext_size);
+	  *count = FILE_INFO->blocks[i].a_len - logical_block;
+	  return FILE_INFO->blocks[i].a_start + logical_block;
 	}
+      logical_block -= FILE_INFO->blocks[i].a_len;
     }
-  else
-    {
-      offset = VSTAFS_START_DATA;
-      extent = 0;
-      curr_len = blocks[0].a_len * 512 - offset;
-    }
-  
-  //curr_pos = buf;
-  if (curr_len > len)
-    curr_len = len;
-  
-  curr_ext = extent;
-  while (curr_ext < FILE_INFO->extents) 
-    {
-      ret += curr_len;
-      size -= curr_len;
-      if (size < 0)
-	{
-	  ret += size;
-	  curr_len += size;
-	}
-      
-      disk_read_func = disk_read_hook;
-      devread (blocks[curr_ext].a_start, offset, curr_len, buf, write);
-      disk_read_func = NULL;
-      offset = 0;
-      curr_len = blocks[curr_ext].a_len * 512;
-      if (buf)
-	buf += curr_len;
-      curr_ext++;
-    }
-  
-  return ret;
+  return FSYS_BLOCK_MAP_END;
+}
+
+static struct fsys_block_map vstafs_map =
+  { 0, SECTOR_BITS, VSTAFS_START_DATA, vstafs_map_block };
+
+unsigned long long
+vstafs_read (unsigned long long buf, unsigned long long len, unsigned long write)
+{
+  vstafs_map.file_id = f_sector;
+  return fsys_block_map_read (&vstafs_map, buf, len, write);
 }
 
 #endif /* FSYS_VSTAFS */
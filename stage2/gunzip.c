@@ -71,10 +71,9 @@
    codes are customized to the probabilities in the current block, and so
    can code it much better than the pre-determined fixed codes.
 
-   The Huffman codes themselves are decoded using a mutli-level table
-   lookup, in order to maximize the speed of decoding plus the speed of
-   building the decoding tables.  See the comments below that precede the
-   lbits and dbits tuning parameters.
+   The Huffman codes themselves are decoded using a single table lookup
+   for all but the longest codes.  See the comments below that precede
+   the inflate engine.
  */
 
 
@@ -135,12 +134,19 @@ int compressed_file;
 /* identify active decompressor */
 int decomp_type;
 
+/* check CRCs and checksums the compressed formats carry */
+int decomp_verify = 1;
+
 struct decomp_entry decomp_table[NUM_DECOM] =
 {
 	{"gz",gunzip_test_header,gunzip_close,gunzip_read},
 	{"lzma",dec_lzma_open,dec_lzma_close,dec_lzma_read},
 	{"lz4",dec_lz4_open,dec_lz4_close,dec_lz4_read},
 	{"vhd",dec_vhd_open,dec_vhd_close,dec_vhd_read},
+	{"xz",dec_xz_open,dec_xz_close,dec_xz_read},
+	{"zstd",dec_zstd_open,dec_zstd_close,dec_zstd_read},
+	{"vhdx",dec_vhdx_open,dec_vhdx_close,dec_vhdx_read},
+	{"qcow2",dec_qcow2_open,dec_qcow2_close,dec_qcow2_read},
 };
 
 /* internal variables only */
@@ -149,35 +155,21 @@ static unsigned long long gzip_filepos;
 static unsigned long long gzip_fsmax;
 static unsigned long long saved_filepos;
 static unsigned long gzip_crc;
+static unsigned long gzip_isize;
 
-/* internal extra variables for use of inflate code */
-static unsigned long block_type;
-static unsigned long block_len;
-static unsigned long last_block;
-static unsigned long code_state;
-
+/* which file a seek index belongs to */
+struct gz_index_id
+{
+  unsigned long long size;	/* compressed */
+  unsigned long long data_offset;
+  unsigned long crc;
+  unsigned long isize;
+  unsigned long mtime;
+};
 
 /* Function prototypes */
 static void initialize_tables (void);
-
-/*
- *  Linear allocator.
- */
-
-static unsigned long linalloc_topaddr;
-
-//static void *
-//linalloc (unsigned long size)
-//{
-//  linalloc_topaddr = (linalloc_topaddr - size) & ~3;
-//  return (void *) linalloc_topaddr;
-//}
-
-static void
-reset_linalloc (void)
-{
-  linalloc_topaddr = RAW_ADDR ((saved_mem_upper << 10) + 0x100000);
-}
+static void gz_index_attach (struct gz_index_id *id);
 
 
 /* internal variable swap function */
@@ -275,15 +267,26 @@ int
 gunzip_test_header (void)
 {
   unsigned char buf[10];
+  struct gz_index_id id;
   
   /* check lz4 */
   if (dec_lz4_open ())
 	goto test_dec;
+  /* check xz */
+  if (dec_xz_open ())
+	goto test_dec;
+  /* check zstd */
+  if (dec_zstd_open ())
+	goto test_dec;
   /* check lzma */
   if (dec_lzma_open ())
 	goto test_dec;
   if (dec_vhd_open())
 	goto test_dec;
+  if (dec_vhdx_open())
+	goto test_dec;
+  if (dec_qcow2_open())
+	goto test_dec;
 
   /* "compressed_file" is already reset to zero by this point */
 
@@ -334,7 +337,14 @@ gunzip_test_header (void)
     }
 
   gzip_crc = *((unsigned long *) buf);
-  gzip_fsmax = gzip_filemax = *((unsigned long *) (buf + 4));
+  gzip_fsmax = gzip_filemax = gzip_isize = *((unsigned long *) (buf + 4));
+
+  id.size = filemax;
+  id.data_offset = gzip_data_offset;
+  id.crc = gzip_crc;
+  id.isize = gzip_filemax;
+  id.mtime = filemtime;
+  gz_index_attach (&id);
 
   initialize_tables ();
 
@@ -366,43 +376,6 @@ gunzip_close (void)
 }
 
 
-/* Huffman code lookup table entry--this entry is four bytes for machines
-   that have 16-bit pointers (e.g. PC's in the small or medium model).
-   Valid extra bits are 0..13.  e == 15 is EOB (end of block), e == 16
-   means that v is a literal, 16 < e < 32 means that v is a pointer to
-   the next table, which codes e - 16 bits, and lastly e == 99 indicates
-   an unused code.  If a code with e == 99 is looked up, this implies an
-   error in the data. */
-struct huft
-{
-  unsigned char e;		/* number of extra bits or operation */
-  unsigned char b;		/* number of bits in this code or subcode */
-  union
-    {
-      unsigned short n;		/* literal, length base, or distance base */
-      struct huft *t;		/* pointer to next level of table */
-    }
-  v;
-};
-
-
-/* The inflate algorithm uses a sliding 32K byte window on the uncompressed
-   stream to find repeated byte strings.  This is implemented here as a
-   circular buffer.  The index is updated simply by incrementing and then
-   and'ing with 0x7fff (32K-1). */
-/* It is left to other modules to supply the 32K area.  It is assumed
-   to be usable as if it were declared "uch slide[32768];" or as just
-   "uch *slide;" and then malloc'ed in the latter case.  The definition
-   must be in unzip.h, included above. */
-
-
-/* sliding window in uncompressed data */
-static unsigned char slide[WSIZE];
-
-/* current position in slide */
-static unsigned long wp;
-
-
 /* Tables for deflate from PKZIP's appnote.txt. */
 static unsigned bitorder[] =
 {				/* Order of the bit length code lengths */
@@ -427,766 +400,996 @@ static unsigned short cpdext[] =
   7, 7, 8, 8, 9, 9, 10, 10, 11, 11,
   12, 12, 13, 13};
 
-
-/*
-   Huffman code decoding is performed using a multi-level table lookup.
-   The fastest way to decode is to simply build a lookup table whose
-   size is determined by the longest code.  However, the time it takes
-   to build this table can also be a factor if the data being decoded
-   is not very long.  The most common codes are necessarily the
-   shortest codes, so those codes dominate the decoding time, and hence
-   the speed.  The idea is you can have a shorter table that decodes the
-   shorter, more probable codes, and then point to subsidiary tables for
-   the longer codes.  The time it costs to decode the longer codes is
-   then traded against the time it takes to make longer tables.
-
-   This results of this trade are in the variables lbits and dbits
-   below.  lbits is the number of bits the first level table for literal/
-   length codes can decode in one step, and dbits is the same thing for
-   the distance codes.  Subsequent tables are also less than or equal to
-   those sizes.  These values may be adjusted either when all of the
-   codes are shorter than that, in which case the longest code length in
-   bits is used, or when the shortest code is *longer* than the requested
-   table size, in which case the length of the shortest code in bits is
-   used.
-
-   There are two different values for the two tables, since they code a
-   different number of possibilities each.  The literal/length table
-   codes 286 possible values, or in a flat code, a little over eight
-   bits.  The distance table codes 30 possible values, or a little less
-   than five bits, flat.  The optimum values for speed end up being
-   about one bit more than those, so lbits is 8+1 and dbits is 5+1.
-   The optimum values may differ though from machine to machine, and
-   possibly even between compilers.  Your mileage may vary.
- */
-
-
-static unsigned long lbits = 9;	/* bits in base literal/length lookup table */
-static unsigned long dbits = 6;	/* bits in base distance lookup table */
-
-
-/* If BMAX needs to be larger than 16, then h and x[] should be ulg. */
 #define BMAX 16		/* maximum bit length of any code (16 for explode) */
 #define N_MAX 288	/* maximum number of codes in any set */
 
 
-static unsigned long hufts;	/* track memory usage */
+/*
+ *  Inflate engine.
+ *
+ *  Huffman codes are decoded with one lookup in a table indexed by the
+ *  next INFL_TABLE_BITS bits of input.  An entry says how many bits to
+ *  consume and what they stand for: a literal, two literals whose codes
+ *  fit in the index together, a length or distance base with the number
+ *  of its extra bits, or the end of the block.  The few codes longer than
+ *  the index are found by walking the canonical code.
+ *
+ *  Input is kept in a 64-bit bit buffer that is refilled up to eight
+ *  bytes at a time, so that one refill covers a literal/length code, its
+ *  extra bits, a distance code and its extra bits.  Matches are copied a
+ *  word at a time when they do not overlap within a word.
+ *
+ *  The same engine serves the gzip stream, which is inflated a window at
+ *  a time into slide[], and inflate_buffer, which works from memory to
+ *  memory.  Each has its own state.
+ */
 
+#define INFL_TABLE_BITS	10
+#define INFL_TABLE_SIZE	(1 << INFL_TABLE_BITS)
+
+/* table entry: bits 0-7 code length (of both codes for INFL_LIT2),
+   8-11 operation, 12-15 length of the first of two literals or number
+   of extra bits, 16-31 value */
+#define INFL_LIT	0	/* literal in bits 16-23 */
+#define INFL_LIT2	1	/* literals in bits 16-23 and 24-31 */
+#define INFL_BASE	2	/* length or distance base */
+#define INFL_EOB	3
+#define INFL_SLOW	4	/* longer than INFL_TABLE_BITS */
+#define INFL_BAD	5
+#define INFL_OP(e)	(((e) >> 8) & 15)
+
+/* what the symbols of a code mean */
+#define INFL_KIND_PLAIN	0	/* code length codes */
+#define INFL_KIND_LIT	1	/* literal/length codes */
+#define INFL_KIND_DIST	2	/* distance codes */
+
+struct infl_huff
+{
+  unsigned long table[INFL_TABLE_SIZE];
+  unsigned short count[BMAX];		/* codes of each length */
+  unsigned short symbol[N_MAX];		/* symbols ordered by code */
+  unsigned long kind;
+};
 
-/* Macros for inflate() bit peeking and grabbing.
-   The usage is:
+/* decoder modes */
+#define INFL_HEADER	0
+#define INFL_STORED	1
+#define INFL_CODES	2
+#define INFL_DONE	3
 
-        NEEDBITS(j)
-        x = b & mask_bits[j];
-        DUMPBITS(j)
+struct infl_state
+{
+  const unsigned char *in;
+  const unsigned char *in_end;
+  unsigned long (*more) (struct infl_state *);	/* refill in, 0 at end */
+  unsigned long long bits;
+  unsigned long nbits;
+  unsigned long pad;		/* zero bytes supplied past the end of input */
+
+  unsigned char *out;
+  unsigned char *out_start;	/* output from out_start on is history, */
+  unsigned char *out_end;
+  const unsigned char *prev_end;/* and so are prev_len bytes up to prev_end */
+  unsigned long prev_len;
+
+  unsigned long mode;
+  unsigned long last;		/* working on the final block */
+  unsigned long stored_left;
+  unsigned long copy_len;	/* of a match cut short by out_end */
+  unsigned long copy_dist;
+  struct infl_huff *lcode;
+  struct infl_huff *dcode;
+  unsigned long nlen;		/* code lengths of the dynamic block */
+  unsigned long ndist;
+  unsigned char length[286 + 30];
+  struct infl_huff lit;
+  struct infl_huff dist;
+};
 
-   where NEEDBITS makes sure that b has at least j bits in it, and
-   DUMPBITS removes the bits from b.  The macros use the variable k
-   for the number of bits in b.  Normally, b and k are register
-   variables for speed, and are initialized at the beginning of a
-   routine that uses these macros from a global bit buffer and count.
+static struct infl_huff infl_fixed_lit;
+static struct infl_huff infl_fixed_dist;
+static int infl_fixed_ready;
 
-   If we assume that EOB will be the longest code, then we will never
-   ask for bits with NEEDBITS that are beyond the end of the stream.
-   So, NEEDBITS should not read any more bytes than are needed to
-   meet the request.  Then no bytes need to be "returned" to the buffer
-   at the end of the last block.
+/* Make sure there are at least N bits in the bit buffer.  Past the end of
+   input, zero bytes are counted in PAD.  */
+static void
+infl_need (struct infl_state *s, unsigned long n)
+{
+  while (s->nbits < n)
+    {
+      if (s->in == s->in_end && (! s->more || ! s->more (s)))
+	s->pad++;
+      else
+	s->bits |= (unsigned long long) *s->in++ << s->nbits;
+      s->nbits += 8;
+    }
+}
 
-   However, this assumption is not true for fixed blocks--the EOB code
-   is 7 bits, but the other literal/length codes can be 8 or 9 bits.
-   (The EOB code is shorter than other codes because fixed blocks are
-   generally short.  So, while a block always has an EOB, many other
-   literal/length codes have a significantly lower probability of
-   showing up at all.)  However, by making the first table have a
-   lookup of seven bits, the EOB code will be found in that first
-   lookup, and so will not require that too many bits be pulled from
-   the stream.
- */
+static unsigned long
+infl_get (struct infl_state *s, unsigned long n)
+{
+  unsigned long val;
 
-static unsigned long bb;	/* bit buffer */
-static unsigned long bk;	/* bits in bit buffer */
+  infl_need (s, n);
+  val = (unsigned long) s->bits & ((1UL << n) - 1);
+  s->bits >>= n;
+  s->nbits -= n;
+  return val;
+}
 
-static unsigned short mask_bits[] =
+static unsigned long
+infl_entry (unsigned long kind, unsigned long sym, unsigned long len)
 {
-  0x0000,
-  0x0001, 0x0003, 0x0007, 0x000f, 0x001f, 0x003f, 0x007f, 0x00ff,
-  0x01ff, 0x03ff, 0x07ff, 0x0fff, 0x1fff, 0x3fff, 0x7fff, 0xffff
-};
-
-#define NEEDBITS(n) do {while(k<(n)){b|=get_byte()<<k;k+=8;}} while (0)
-#define DUMPBITS(n) do {b>>=(n);k-=(n);} while (0)
+  if (kind == INFL_KIND_DIST)
+    {
+      if (sym >= 30)
+	return (INFL_BAD << 8) | len;
+      return ((unsigned long) cpdist[sym] << 16) | (cpdext[sym] << 12) | (INFL_BASE << 8) | len;
+    }
+  if (kind == INFL_KIND_PLAIN || sym < 256)
+    return (sym << 16) | (INFL_LIT << 8) | len;
+  if (sym == 256)
+    return (INFL_EOB << 8) | len;
+  sym -= 257;
+  if (sym >= 29)
+    return (INFL_BAD << 8) | len;
+  return ((unsigned long) cplens[sym] << 16) | (cplext[sym] << 12) | (INFL_BASE << 8) | len;
+}
 
-#define INBUFSIZ  0x2000
+/* Decode a code too long for the table, from at least BMAX - 1 bits.  */
+static unsigned long
+infl_slow (const struct infl_huff *h, unsigned long long bits)
+{
+  long code = 0, first = 0, index = 0, count;
+  unsigned long len;
 
-static unsigned char inbuf[INBUFSIZ];
-static unsigned long bufloc = 0;
+  for (len = 1; len < BMAX; len++)
+    {
+      code |= (unsigned long) bits & 1;
+      bits >>= 1;
+      count = h->count[len];
+      if (code - count < first)
+	return infl_entry (h->kind, h->symbol[index + (code - first)], len);
+      index += count;
+      first += count;
+      first <<= 1;
+      code <<= 1;
+    }
+  return INFL_BAD << 8;
+}
 
-static unsigned long
-get_byte (void)
+/* Build the decoding table for N code lengths. Incomplete codes are
+   allowed (a lone distance code), oversubscribed ones are not.  */
+static int
+infl_build (struct infl_huff *h, unsigned long kind, const unsigned char *length, unsigned long n)
 {
-  if (filepos == gzip_data_offset || bufloc == INBUFSIZ)
+  unsigned short offs[BMAX];
+  unsigned long len, sym, code, idx, k, j, rev, e, e2;
+  long left;
+
+  h->kind = kind;
+  memset (h->count, 0, sizeof (h->count));
+  for (sym = 0; sym < n; sym++)
+    h->count[length[sym]]++;
+  h->count[0] = 0;
+
+  left = 1;
+  for (len = 1; len < BMAX; len++)
     {
-      bufloc = 0;
-      grub_read ((unsigned long long)(unsigned int)(char *)inbuf, INBUFSIZ, 0xedde0d90);
+      left <<= 1;
+      left -= h->count[len];
+      if (left < 0)
+	return 0;
     }
 
-  return inbuf[bufloc++];
+  offs[1] = 0;
+  for (len = 1; len < BMAX - 1; len++)
+    offs[len + 1] = offs[len] + h->count[len];
+  for (sym = 0; sym < n; sym++)
+    if (length[sym])
+      h->symbol[offs[length[sym]]++] = sym;
+
+  /* codes are stored bit-reversed, so a short code fills every entry
+     whose low bits match it */
+  for (j = 0; j < INFL_TABLE_SIZE; j++)
+    h->table[j] = INFL_SLOW << 8;
+  for (len = 1, code = 0, idx = 0; len <= INFL_TABLE_BITS; len++, code <<= 1)
+    for (k = 0; k < h->count[len]; k++, code++, idx++)
+      {
+	for (rev = 0, j = 0; j < len; j++)
+	  rev |= ((code >> j) & 1) << (len - 1 - j);
+	e = infl_entry (kind, h->symbol[idx], len);
+	for (j = rev; j < INFL_TABLE_SIZE; j += 1 << len)
+	  h->table[j] = e;
+      }
+
+  /* pair up literals whose codes fit in the index together; going down
+     means the entry for the second code has not been paired yet */
+  if (kind == INFL_KIND_LIT)
+    for (j = INFL_TABLE_SIZE; j-- > 0; )
+      {
+	e = h->table[j];
+	if (INFL_OP (e) != INFL_LIT)
+	  continue;
+	len = e & 0xff;
+	e2 = h->table[j >> len];
+	if (INFL_OP (e2) == INFL_LIT && len + (e2 & 0xff) <= INFL_TABLE_BITS)
+	  h->table[j] = (e & 0xff0000) | ((e2 & 0xff0000) << 8) | (len << 12)
+			| (INFL_LIT2 << 8) | (len + (e2 & 0xff));
+      }
+  return 1;
 }
 
-/* decompression global pointers */
-static struct huft *tl;		/* literal/length code table */
-static struct huft *td;		/* distance code table */
-static unsigned long bl;			/* lookup bits for tl */
-static unsigned long bd;			/* lookup bits for td */
+/* Decode one symbol outside the fast loop.  */
+static unsigned long
+infl_symbol (struct infl_state *s, const struct infl_huff *h)
+{
+  unsigned long e;
+
+  infl_need (s, BMAX - 1);
+  e = h->table[(unsigned long) s->bits & (INFL_TABLE_SIZE - 1)];
+  if (INFL_OP (e) == INFL_SLOW)
+    e = infl_slow (h, s->bits);
+  if (INFL_OP (e) == INFL_LIT2)
+    e = (e & 0xff0000) | (INFL_LIT << 8) | ((e >> 12) & 15);
+  s->bits >>= e & 0xff;
+  s->nbits -= e & 0xff;
+  return e;
+}
 
-static unsigned long c[BMAX + 1];	/* bit length count table */
-static struct huft *u[BMAX];		/* table stack */
-static unsigned long v[N_MAX];	/* values in order of bit length */
-static unsigned long x[BMAX + 1];	/* bit offsets, then code stack */
-static unsigned long lh[288];		/* length list for huft_build */
-static unsigned long ll[286 + 30];	/* literal/length and distance code lengths */
+static void
+infl_fixed_init (void)
+{
+  unsigned char length[288];
+  int i;
 
-/* more function prototypes */
-static unsigned long huft_build (unsigned long *, unsigned long, unsigned long, unsigned short *, unsigned short *,
-		       struct huft **, unsigned long *);
-static int inflate_codes_in_window (void);
+  if (infl_fixed_ready)
+    return;
+  for (i = 0; i < 144; i++)
+    length[i] = 8;
+  for (; i < 256; i++)
+    length[i] = 9;
+  for (; i < 280; i++)
+    length[i] = 7;
+  for (; i < 288; i++)
+    length[i] = 8;
+  infl_build (&infl_fixed_lit, INFL_KIND_LIT, length, 288);
+  for (i = 0; i < 30; i++)
+    length[i] = 5;
+  infl_build (&infl_fixed_dist, INFL_KIND_DIST, length, 30);
+  infl_fixed_ready = 1;
+}
 
+/* Read the code lengths of a dynamic block and build its tables.  */
+static int
+infl_dynamic (struct infl_state *s)
+{
+  unsigned char *length = s->length;
+  unsigned long nlen, ndist, ncode, i, rep, e, sym;
+
+  nlen = infl_get (s, 5) + 257;
+  ndist = infl_get (s, 5) + 1;
+  ncode = infl_get (s, 4) + 4;
+  if (nlen > 286 || ndist > 30)
+    return 0;
+
+  memset (length, 0, 19);
+  for (i = 0; i < ncode; i++)
+    length[bitorder[i]] = infl_get (s, 3);
+  if (! infl_build (&s->lit, INFL_KIND_PLAIN, length, 19))
+    return 0;
+
+  for (i = 0; i < nlen + ndist; )
+    {
+      e = infl_symbol (s, &s->lit);
+      if (INFL_OP (e) != INFL_LIT || s->pad > 8)
+	return 0;
+      sym = e >> 16;
+      if (sym < 16)
+	{
+	  length[i++] = sym;
+	  continue;
+	}
+      if (sym == 16)
+	{
+	  if (i == 0)
+	    return 0;
+	  sym = length[i - 1];
+	  rep = 3 + infl_get (s, 2);
+	}
+      else
+	{
+	  rep = (sym == 17) ? 3 + infl_get (s, 3) : 11 + infl_get (s, 7);
+	  sym = 0;
+	}
+      if (i + rep > nlen + ndist)
+	return 0;
+      while (rep--)
+	length[i++] = sym;
+    }
+  if (length[256] == 0)
+    return 0;
 
-/* Given a list of code lengths and a maximum table size, make a set of
-   tables to decode that set of codes.  Return zero on success, one if
-   the given code set is incomplete (the tables are still built in this
-   case), two if the input is invalid (all zero length codes or an
-   oversubscribed set of lengths), and three if not enough memory. */
+  s->nlen = nlen;
+  s->ndist = ndist;
 
-static unsigned long
-huft_build (unsigned long *b,	/* code lengths in bits (all assumed <= BMAX) */
-	    unsigned long n,	/* number of codes (assumed <= N_MAX) */
-	    unsigned long s,	/* number of simple-valued codes (0..s-1) */
-	    unsigned short * d,	/* list of base values for non-simple codes */
-	    unsigned short * e,	/* list of extra bits for non-simple codes */
-	    struct huft **t,	/* result: starting table */
-	    unsigned long *m)	/* maximum lookup bits, returns actual */
+  return infl_build (&s->lit, INFL_KIND_LIT, length, nlen)
+	 && infl_build (&s->dist, INFL_KIND_DIST, length + nlen, ndist);
+}
+
+static int
+infl_header (struct infl_state *s)
 {
-  unsigned long a;		/* counter for codes of length k */
-//unsigned long c[BMAX + 1];	/* bit length count table */
-  unsigned long f;		/* i repeats in table every f entries */
-  int g;			/* maximum code length */
-  int h;			/* table level */
-  register unsigned long i;	/* counter, current code */
-  register unsigned long j;	/* counter */
-  register int k;		/* number of bits in current code */
-  unsigned long l;		/* bits per table (returned in m) */
-  register unsigned long *p;	/* pointer into c[], b[], or v[] */
-  register struct huft *q;	/* points to current table */
-  struct huft r;		/* table entry for structure assignment */
-//struct huft *u[BMAX];		/* table stack */
-//unsigned long v[N_MAX];	/* values in order of bit length */
-  register int w;		/* bits before this table == (l * h) */
-//unsigned long x[BMAX + 1];	/* bit offsets, then code stack */
-  unsigned long *xp;		/* pointer into x */
-  int y;			/* number of dummy codes added */
-  unsigned long z;		/* number of entries in current table */
-
-  /* Generate counts for each bit length */
-  memset ((char *) c, 0, sizeof (c));
-  p = b;
-  i = n;
-  do
+  unsigned long type, len;
+
+  if (s->last)
     {
-      c[*p]++;			/* assume all entries <= BMAX */
-      p++;			/* Can't combine with above line (Solaris bug) */
+      s->mode = INFL_DONE;
+      return 1;
     }
-  while (--i);
-  if (c[0] == n)		/* null input--all zero length codes */
+  s->last = infl_get (s, 1);
+  type = infl_get (s, 2);
+  switch (type)
     {
-      *t = (struct huft *) NULL;
-      *m = 0;
-      return 0;
-    }
-
-  /* Find minimum and maximum length, bound *m by those */
-  l = *m;
-  for (j = 1; j <= BMAX; j++)
-    if (c[j])
+    case 0:
+      infl_get (s, s->nbits & 7);
+      len = infl_get (s, 16);
+      if ((len ^ 0xffff) != infl_get (s, 16))
+	return 0;
+      s->stored_left = len;
+      s->mode = INFL_STORED;
+      return 1;
+    case 1:
+      infl_fixed_init ();
+      s->lcode = &infl_fixed_lit;
+      s->dcode = &infl_fixed_dist;
       break;
-  k = j;			/* minimum code length */
-  if (l < j)
-    l = j;
-  for (i = BMAX; i; i--)
-    if (c[i])
+    case 2:
+      if (! infl_dynamic (s))
+	return 0;
+      s->lcode = &s->lit;
+      s->dcode = &s->dist;
       break;
-  g = i;			/* maximum code length */
-  if (l > i)
-    l = i;
-  *m = l;
-
-  /* Adjust last length count to fill out codes, if needed */
-  for (y = 1 << j; j < i; j++, y <<= 1)
-    if ((y -= c[j]) < 0)
-      return 2;			/* bad input: more codes than bits */
-  if ((y -= c[i]) < 0)
-    return 2;
-  c[i] += y;
-
-  /* Generate starting offsets into the value table for each length */
-  x[1] = j = 0;
-  p = c + 1;
-  xp = x + 2;
-  while (--i)
-    {				/* note that i == g from above */
-      *xp++ = (j += *p++);
+    default:
+      return 0;
     }
+  s->mode = INFL_CODES;
+  return 1;
+}
 
-  /* Make a table of values in order of bit lengths */
-  p = b;
-  i = 0;
-  do
-    {
-      if ((j = *p++) != 0)
-	v[x[j]++] = i;
-    }
-  while (++i < n);
-
-  /* Generate the Huffman codes and for each, make the table entries */
-  x[0] = i = 0;			/* first Huffman code is zero */
-  p = v;			/* grab values in bit order */
-  h = -1;			/* no tables yet--level -1 */
-  w = -l;			/* bits decoded == (l * h) */
-  u[0] = (struct huft *) NULL;	/* just to keep compilers happy */
-  q = (struct huft *) NULL;	/* ditto */
-  z = 0;			/* ditto */
-
-  /* go through the bit lengths (k already is bits in shortest code) */
-  for (; k <= g; k++)
+static int
+infl_stored (struct infl_state *s)
+{
+  unsigned long n;
+
+  while (s->stored_left && s->out < s->out_end)
     {
-      a = c[k];
-      while (a--)
+      /* bytes already in the bit buffer come first */
+      if (s->nbits)
 	{
-	  /* here i is the Huffman code of length k bits for value *p */
-	  /* make tables up to required level */
-	  while (k > w + l)
-	    {
-	      h++;
-	      w += l;		/* previous table always l bits */
-
-	      /* compute minimum size table less than or equal to l bits */
-	      z = (z = g - w) > l ? l : z;	/* upper limit on table size */
-	      if ((f = 1 << (j = k - w)) > a + 1)	/* try a k-w bit table */
-		{		/* too few codes for k-w bit table */
-		  f -= a + 1;	/* deduct codes from patterns left */
-		  xp = c + k;
-		  while (++j < z)	/* try smaller tables up to z bits */
-		    {
-		      if ((f <<= 1) <= *++xp)
-			break;	/* enough codes to use up j bits */
-		      f -= *xp;	/* else deduct codes from patterns */
-		    }
-		}
-	      z = 1 << j;	/* table entries for j-bit table */
-
-	      /* allocate and link in new table */
-	      linalloc_topaddr -= (z + 1) * sizeof (struct huft);
-	      linalloc_topaddr &= ~3;
-	      q = (struct huft *) linalloc_topaddr;
-
-	      hufts += z + 1;	/* track memory usage */
-	      *t = q + 1;	/* link to list for huft_free() */
-	      *(t = &(q->v.t)) = (struct huft *) NULL;
-	      u[h] = ++q;	/* table starts after link */
-
-	      /* connect to last table, if there is one */
-	      if (h)
-		{
-		  x[h] = i;	/* save pattern for backing up */
-		  r.b = (unsigned char) l;	/* bits to dump before this table */
-		  r.e = (unsigned char) (16 + j);	/* bits in this table */
-		  r.v.t = q;	/* pointer to this table */
-		  j = i >> (w - l);	/* (get around Turbo C bug) */
-		  u[h - 1][j] = r;	/* connect to last table */
-		}
-	    }
-
-	  /* set up table entry in r */
-	  r.b = (unsigned char) (k - w);
-	  if (p >= v + n)
-	    r.e = 99;		/* out of values--invalid code */
-	  else if (*p < s)
-	    {
-	      r.e = (unsigned char) (*p < 256 ? 16 : 15);	/* 256 is end-of-block code */
-	      r.v.n = (unsigned short) (*p);	/* simple code is just the value */
-	      p++;		/* one compiler does not like *p++ */
-	    }
-	  else
-	    {
-	      r.e = (unsigned char) e[*p - s];	/* non-simple--look up in lists */
-	      r.v.n = d[*p++ - s];
-	    }
-
-	  /* fill code-like entries with r */
-	  f = 1 << (k - w);
-	  for (j = i >> w; j < z; j += f)
-	    q[j] = r;
-
-	  /* backwards increment the k-bit code i */
-	  for (j = 1 << (k - 1); i & j; j >>= 1)
-	    i ^= j;
-	  i ^= j;
-
-	  /* backup over finished tables */
-	  while ((i & ((1 << w) - 1)) != x[h])
-	    {
-	      h--;		/* don't need to update q */
-	      w -= l;
-	    }
+	  if (s->pad >= s->nbits >> 3)
+	    return 0;
+	  *s->out++ = (unsigned char) s->bits;
+	  s->bits >>= 8;
+	  s->nbits -= 8;
+	  s->stored_left--;
+	  continue;
 	}
+      /* the buffer may hold copies of bytes still at IN */
+      s->bits = 0;
+      if (s->in == s->in_end && (! s->more || ! s->more (s)))
+	return 0;
+      n = s->in_end - s->in;
+      if (n > s->stored_left)
+	n = s->stored_left;
+      if (n > (unsigned long) (s->out_end - s->out))
+	n = s->out_end - s->out;
+      memmove (s->out, s->in, n);
+      s->in += n;
+      s->out += n;
+      s->stored_left -= n;
     }
-
-  /* Return true (1) if we were given an incomplete table */
-  return y != 0 && g != 1;
+  if (! s->stored_left)
+    s->mode = INFL_HEADER;
+  return 1;
 }
 
+/* Copy a match of LEN bytes from DIST back, leaving what does not fit
+   before out_end pending.  */
+static int
+infl_copy (struct infl_state *s, unsigned long dist, unsigned long len)
+{
+  unsigned char *out = s->out;
+  const unsigned char *from;
+  unsigned long have, n;
+
+  have = out - s->out_start;
+  if (dist > have + s->prev_len)
+    return 0;
+  s->copy_len = 0;
+  if (len > (unsigned long) (s->out_end - out))
+    {
+      s->copy_len = len - (s->out_end - out);
+      s->copy_dist = dist;
+      len = s->out_end - out;
+    }
 
-/*
- *  inflate (decompress) the codes in a deflated (compressed) block.
- *  Return an error code or zero if it all goes ok.
- */
-
-static unsigned long inflate_n, inflate_d;
+  if (dist > have)
+    {
+      /* starts in the history before out_start */
+      n = dist - have;
+      if (n > len)
+	n = len;
+      memmove (out, s->prev_end - (dist - have), n);
+      out += n;
+      len -= n;
+    }
+  from = out - dist;
+  if (dist >= sizeof (unsigned long))
+    for (; len >= sizeof (unsigned long); len -= sizeof (unsigned long))
+      {
+	*(unsigned long *) out = *(const unsigned long *) from;
+	out += sizeof (unsigned long);
+	from += sizeof (unsigned long);
+      }
+  while (len--)
+    *out++ = *from++;
+  s->out = out;
+  return 1;
+}
 
+/* Refill the local bit buffer to at least 56 bits: eight bytes in one
+   load when there are that many, the bits above NBITS then hold copies
+   of the bytes that are still at IN.  */
+#define INFL_REFILL()							\
+  do									\
+    {									\
+      if (in_end - in >= 8)						\
+	{								\
+	  bits |= *(const unsigned long long *) in << nbits;		\
+	  in += (63 - nbits) >> 3;					\
+	  nbits |= 56;							\
+	}								\
+      else								\
+	{								\
+	  s->in = in;							\
+	  s->bits = bits;						\
+	  s->nbits = nbits;						\
+	  infl_need (s, 56);						\
+	  in = s->in;							\
+	  in_end = s->in_end;						\
+	  bits = s->bits;						\
+	  nbits = s->nbits;						\
+	}								\
+    }									\
+  while (0)
+
+#define INFL_DROP(n)	do { bits >>= (n); nbits -= (n); } while (0)
+
+/* Decode a compressed block until its end or until out_end.  */
 static int
-inflate_codes_in_window (void)
+infl_codes (struct infl_state *s)
 {
-  register unsigned long e;	/* table entry flag/number of extra bits */
-  unsigned long n, d;		/* length and index for copy */
-  unsigned long w;		/* current window position */
-  struct huft *t;		/* pointer to table entry */
-  unsigned long ml, md;		/* masks for bl and bd bits */
-  register unsigned long b;	/* bit buffer */
-  register unsigned long k;	/* number of bits in bit buffer */
-
-  /* make local copies of globals */
-  d = inflate_d;
-  n = inflate_n;
-  b = bb;			/* initialize bit buffer */
-  k = bk;
-  w = wp;			/* initialize window position */
-
-  /* inflate the coded data */
-  ml = mask_bits[bl];		/* precompute masks for speed */
-  md = mask_bits[bd];
-  for (;;)			/* do until end of block */
+  const unsigned char *in = s->in;
+  const unsigned char *in_end = s->in_end;
+  unsigned long long bits = s->bits;
+  unsigned long nbits = s->nbits;
+  unsigned char *out = s->out;
+  unsigned char *out_end = s->out_end;
+  const unsigned long *ltab = s->lcode->table;
+  const unsigned long *dtab = s->dcode->table;
+  unsigned long e, n, len, dist;
+  int ret = 0;
+
+  while (out < out_end)
     {
-      if (!code_state)
+      INFL_REFILL ();
+      e = ltab[(unsigned long) bits & (INFL_TABLE_SIZE - 1)];
+      if (INFL_OP (e) == INFL_LIT2 && out_end - out >= 2)
 	{
-	  NEEDBITS (bl);
-	  if ((e = (t = tl + (b & ml))->e) > 16)
-	    do
-	      {
-		if (e == 99)
-		  {
-		    errnum = ERR_BAD_GZIP_DATA;
-		    return 0;
-		  }
-		DUMPBITS (t->b);
-		e -= 16;
-		NEEDBITS (e);
-	      }
-	    while ((e = (t = t->v.t + (b & mask_bits[e]))->e) > 16);
-	  DUMPBITS (t->b);
-
-	  if (e == 16)		/* then it's a literal */
-	    {
-	      slide[w++] = (unsigned char)(t->v.n);
-	      if (w == WSIZE)
-		break;
-	    }
-	  else
-	    /* it's an EOB or a length */
-	    {
-	      /* exit if end of block */
-	      if (e == 15)
-		{
-		  block_len = 0;
-		  break;
-		}
-
-	      /* get length of block to copy */
-	      NEEDBITS (e);
-	      n = t->v.n + (b & mask_bits[e]);
-	      DUMPBITS (e);
-
-	      /* decode distance of block to copy */
-	      NEEDBITS (bd);
-	      if ((e = (t = td + (b & md))->e) > 16)
-		do
-		  {
-		    if (e == 99)
-		      {
-			errnum = ERR_BAD_GZIP_DATA;
-			return 0;
-		      }
-		    DUMPBITS (t->b);
-		    e -= 16;
-		    NEEDBITS (e);
-		  }
-		while ((e = (t = t->v.t + (b & mask_bits[e]))->e)
-		       > 16);
-	      DUMPBITS (t->b);
-	      NEEDBITS (e);
-	      d = w - t->v.n - (b & mask_bits[e]);
-	      DUMPBITS (e);
-	      code_state++;
-	    }
+	  out[0] = e >> 16;
+	  out[1] = e >> 24;
+	  out += 2;
+	  INFL_DROP (e & 0xff);
+	  continue;
+	}
+      if (INFL_OP (e) == INFL_SLOW)
+	e = infl_slow (s->lcode, bits);
+      switch (INFL_OP (e))
+	{
+	case INFL_LIT:
+	  INFL_DROP (e & 0xff);
+	  *out++ = e >> 16;
+	  continue;
+	case INFL_LIT2:
+	  INFL_DROP ((e >> 12) & 15);
+	  *out++ = e >> 16;
+	  continue;
+	case INFL_EOB:
+	  INFL_DROP (e & 0xff);
+	  s->mode = INFL_HEADER;
+	  ret = 1;
+	  goto done;
+	case INFL_BASE:
+	  break;
+	default:
+	  goto done;
 	}
 
-      if (code_state)
+      /* a match: at most 15 + 5 + 15 + 13 bits in all */
+      INFL_DROP (e & 0xff);
+      n = (e >> 12) & 15;
+      len = (e >> 16) + ((unsigned long) bits & ((1UL << n) - 1));
+      INFL_DROP (n);
+      e = dtab[(unsigned long) bits & (INFL_TABLE_SIZE - 1)];
+      if (INFL_OP (e) == INFL_SLOW)
+	e = infl_slow (s->dcode, bits);
+      if (INFL_OP (e) != INFL_BASE)
+	goto done;
+      INFL_DROP (e & 0xff);
+      n = (e >> 12) & 15;
+      dist = (e >> 16) + ((unsigned long) bits & ((1UL << n) - 1));
+      INFL_DROP (n);
+      s->out = out;
+      if (! infl_copy (s, dist, len))
+	goto done;
+      out = s->out;
+    }
+  ret = 1;
+
+done:
+  s->in = in;
+  s->in_end = in_end;
+  s->bits = bits;
+  s->nbits = nbits;
+  s->out = out;
+  return ret;
+}
+
+/* Inflate until the output is full or the stream ends.  */
+static int
+infl_run (struct infl_state *s)
+{
+  unsigned long e;
+
+  for (;;)
+    {
+      if (s->pad > 16)
+	return 0;
+      if (s->copy_len)
+	{
+	  if (s->out == s->out_end)
+	    return 1;
+	  if (! infl_copy (s, s->copy_dist, s->copy_len))
+	    return 0;
+	  continue;
+	}
+      switch (s->mode)
 	{
-	  /* do the copy */
-	  do
+	case INFL_HEADER:
+	  if (! infl_header (s))
+	    return 0;
+	  break;
+	case INFL_STORED:
+	  if (s->stored_left && s->out == s->out_end)
+	    return 1;
+	  if (! infl_stored (s))
+	    return 0;
+	  break;
+	case INFL_CODES:
+	  if (s->out == s->out_end)
 	    {
-	      n -= (e = (e = WSIZE - ((d &= WSIZE - 1) > w ? d : w)) > n ? n
-		    : e);
-	      if (w - d >= e)
-		{
-		  memmove (slide + w, slide + d, e);
-		  w += e;
-		  d += e;
-		}
-	      else
-		/* purposefully use the overlap for extra copies here!! */
-		{
-		  while (e--)
-		    slide[w++] = slide[d++];
-		}
-	      if (w == WSIZE)
-		break;
+	      /* full; see the end of the block through if it is next */
+	      infl_need (s, BMAX - 1);
+	      e = s->lcode->table[(unsigned long) s->bits & (INFL_TABLE_SIZE - 1)];
+	      if (INFL_OP (e) == INFL_SLOW)
+		e = infl_slow (s->lcode, s->bits);
+	      if (INFL_OP (e) != INFL_EOB)
+		return 1;
+	      s->bits >>= e & 0xff;
+	      s->nbits -= e & 0xff;
+	      s->mode = INFL_HEADER;
+	      break;
 	    }
-	  while (n);
-
-	  if (!n)
-	    code_state--;
-
-	  /* did we break from the loop too soon? */
-	  if (w == WSIZE)
-	    break;
+	  if (! infl_codes (s))
+	    return 0;
+	  break;
+	default:
+	  return 1;
 	}
     }
+}
 
-  /* restore the globals from the locals */
-  inflate_d = d;
-  inflate_n = n;
-  wp = w;			/* restore global window pointer */
-  bb = b;			/* restore global bit buffer */
-  bk = k;
+/*
+ *  The gzip stream.
+ */
 
-  return !block_len;
-}
+#define INBUFSIZ  0x2000
 
+static unsigned char inbuf[INBUFSIZ];
+
+/* sliding window in uncompressed data */
+static unsigned char slide[WSIZE];
 
-/* get header for an inflated type 0 (stored) block. */
+static struct infl_state gzs;
 
-static void
-init_stored_block (void)
+static unsigned long
+gunzip_more (struct infl_state *s)
 {
-  register unsigned long b;	/* bit buffer */
-  register unsigned long k;		/* number of bits in bit buffer */
-
-  /* make local copies of globals */
-  b = bb;			/* initialize bit buffer */
-  k = bk;
-
-  /* go to byte boundary */
-  DUMPBITS (k & 7);
-
-  /* get the length and its complement */
-  NEEDBITS (16);
-  block_len = (b & 0xffff);
-  DUMPBITS (16);
-  NEEDBITS (16);
-  if (block_len != ((~b) & 0xffff))
-    errnum = ERR_BAD_GZIP_DATA;
-  DUMPBITS (16);
+  unsigned long n;
 
-  /* restore global variables */
-  bb = b;
-  bk = k;
+  n = grub_read ((unsigned long long)(unsigned int)(char *)inbuf, INBUFSIZ, 0xedde0d90);
+  s->in = inbuf;
+  s->in_end = inbuf + n;
+  return n;
 }
 
+/*
+ *  Seek index.
+ *
+ *  While the stream is inflated, the decoder state and the WSIZE bytes of
+ *  output before it are saved every gzip_index_spacing bytes, after zran.c
+ *  from zlib.  A seek then resumes from the nearest saved point at or
+ *  before it instead of from the start of the data, which is what makes
+ *  random access to a gzipped image bearable.
+ *
+ *  The index is kept when the file is closed, and is used again if the
+ *  next gzip file opened has the same size, CRC and time.  It can also be
+ *  saved to and loaded from a sidecar file (see the "zindex" command).
+ */
 
-/* get header for an inflated type 1 (fixed Huffman codes) block.  We should
-   either replace this with a custom decoder, or at least precompute the
-   Huffman tables. */
+/* 0 turns the index off */
+unsigned long long gzip_index_spacing = 0x100000;
 
-static void
-init_fixed_block ()
+#define GZ_INDEX_MAX	256
+
+struct gz_point
 {
-  unsigned long i;		/* temporary variable */
-//unsigned long lh[288];	/* length list for huft_build */
+  unsigned long long out;	/* uncompressed offset, a multiple of WSIZE */
+  unsigned long long in;	/* compressed offset of the next unread byte */
+  unsigned long long bits;
+  unsigned long nbits;
+  unsigned long mode;
+  unsigned long last;
+  unsigned long stored_left;
+  unsigned long copy_len;
+  unsigned long copy_dist;
+  unsigned long codes;		/* 0 none, 1 fixed, 2 dynamic */
+  unsigned long nlen;
+  unsigned long ndist;
+  unsigned long crc;
+  unsigned long crc_on;
+  unsigned char length[286 + 30];
+  unsigned char window[WSIZE];
+};
 
-  /* set up literal table */
-  for (i = 0; i < 144; i++)
-    lh[i] = 8;
-  for (; i < 256; i++)
-    lh[i] = 9;
-  for (; i < 280; i++)
-    lh[i] = 7;
-  for (; i < 288; i++)		/* make a complete, but wrong code set */
-    lh[i] = 8;
-  bl = 7;
-  if ((i = huft_build (lh, 288, 257, cplens, cplext, &tl, &bl)) != 0)
-    {
-      errnum = ERR_BAD_GZIP_DATA;
-      return;
-    }
+/* head of the sidecar file, followed by the points */
+struct gz_index_head
+{
+  char magic[8];
+  unsigned long point_size;
+  unsigned long count;
+  unsigned long long step;
+  struct gz_index_id id;
+};
 
-  /* set up distance table */
-  for (i = 0; i < 30; i++)	/* make an incomplete code set */
-    lh[i] = 5;
-  bd = 5;
-  if ((i = huft_build (lh, 30, 0, cpdist, cpdext, &td, &bd)) > 1)
-    {
-      errnum = ERR_BAD_GZIP_DATA;
-      return;
-    }
+#define GZ_INDEX_MAGIC	"GZINDEX1"
 
-  /* indicate we're now working on a block */
-  code_state = 0;
-  block_len++;
-}
+static struct gz_index_id gz_index_id;
+static unsigned long gzs_crc;
+static int gzs_crc_on;
+static struct gz_point *gz_index[GZ_INDEX_MAX];
+static unsigned long gz_index_count;
+static unsigned long long gz_index_step;	/* doubles when the index fills */
+
+/* whether a point at POS is due; in windows to stay within 32 bits */
+#define GZ_INDEX_DUE(pos) \
+  ((unsigned long) ((pos) / WSIZE) % (unsigned long) (gz_index_step / WSIZE) == 0)
 
+void
+gunzip_index_flush (void)
+{
+  while (gz_index_count)
+    grub_free (gz_index[--gz_index_count]);
+  grub_memset (&gz_index_id, 0, sizeof (gz_index_id));
+  gz_index_step = (gzip_index_spacing + WSIZE - 1) & ~(unsigned long long) (WSIZE - 1);
+  if (gz_index_step > 0x10000000000ULL)
+    gz_index_step = 0x10000000000ULL;
+}
 
-/* get header for an inflated type 2 (dynamic Huffman codes) block. */
+/* Keep the index if it is for the gzip file just opened.  */
+static void
+gz_index_attach (struct gz_index_id *id)
+{
+  if (grub_memcmp ((char *) id, (char *) &gz_index_id, sizeof (*id)) == 0)
+    return;
+  gunzip_index_flush ();
+  gz_index_id = *id;
+}
 
+/* Save a point at the end of the window just inflated, if it is due.  */
 static void
-init_dynamic_block (void)
+gz_index_add (void)
 {
-  unsigned long i;		/* temporary variables */
-  unsigned long j;
-  unsigned long l;		/* last length */
-  unsigned long m;		/* mask for bit lengths table */
-  unsigned long n;		/* number of lengths to get */
-  unsigned long nb;		/* number of bit length codes */
-  unsigned long na;		/* number of literal/length codes */
-  unsigned long nd;		/* number of distance codes */
-//unsigned long ll[286 + 30];	/* literal/length and distance code lengths */
-  register unsigned long b;	/* bit buffer */
-  register unsigned long k;	/* number of bits in bit buffer */
-
-  /* make local bit buffer */
-  b = bb;
-  k = bk;
-
-  /* read in table lengths */
-  NEEDBITS (5);
-  na = 257 + (b & 0x1f);	/* number of literal/length codes */
-  DUMPBITS (5);
-  NEEDBITS (5);
-  nd = 1 + (b & 0x1f);		/* number of distance codes */
-  DUMPBITS (5);
-  NEEDBITS (4);
-  nb = 4 + (b & 0xf);		/* number of bit length codes */
-  DUMPBITS (4);
-  if (na > 286 || nd > 30)
-    {
-      errnum = ERR_BAD_GZIP_DATA;
-      return;
-    }
+  struct gz_point *p;
+  unsigned long i, n;
 
-  /* read in bit-length-code lengths */
-  for (j = 0; j < nb; j++)
+  if (! gz_index_step || ! GZ_INDEX_DUE (saved_filepos)
+      || gzs.mode == INFL_DONE || gzs.pad || errnum)
+    return;
+  if (gz_index_count && gz_index[gz_index_count - 1]->out >= saved_filepos)
+    return;
+
+  if (gz_index_count == GZ_INDEX_MAX)
     {
-      NEEDBITS (3);
-      ll[bitorder[j]] = b & 7;
-      DUMPBITS (3);
+      /* full: keep every other point */
+      gz_index_step <<= 1;
+      for (i = n = 0; i < gz_index_count; i++)
+	if (! GZ_INDEX_DUE (gz_index[i]->out))
+	  grub_free (gz_index[i]);
+	else
+	  gz_index[n++] = gz_index[i];
+      gz_index_count = n;
+      if (! GZ_INDEX_DUE (saved_filepos))
+	return;
     }
-  for (; j < 19; j++)
-    ll[bitorder[j]] = 0;
 
-  /* build decoding table for trees--single level, 7 bit lookup */
-  bl = 7;
-  if ((i = huft_build (ll, 19, 19, NULL, NULL, &tl, &bl)) != 0)
+  /* the index is optional; do without it when memory is short */
+  if ((p = grub_malloc (sizeof (*p))) == NULL)
     {
-      errnum = ERR_BAD_GZIP_DATA;
+      errnum = 0;
       return;
     }
+  p->out = saved_filepos;
+  p->in = filepos - (gzs.in_end - gzs.in);
+  p->bits = gzs.bits;
+  p->nbits = gzs.nbits;
+  p->mode = gzs.mode;
+  p->last = gzs.last;
+  p->stored_left = gzs.stored_left;
+  p->copy_len = gzs.copy_len;
+  p->copy_dist = gzs.copy_dist;
+  p->codes = 0;
+  if (gzs.mode == INFL_CODES)
+    p->codes = (gzs.lcode == &gzs.lit) ? 2 : 1;
+  p->nlen = gzs.nlen;
+  p->ndist = gzs.ndist;
+  p->crc = gzs_crc;
+  p->crc_on = gzs_crc_on;
+  grub_memmove (p->length, gzs.length, sizeof (p->length));
+  grub_memmove (p->window, slide, WSIZE);
+  gz_index[gz_index_count++] = p;
+}
 
-  /* read in literal and distance code lengths */
-  n = na + nd;
-  m = mask_bits[bl];
-  i = l = 0;
-  while (i < n)
+/* Resume from the last point at or before POS, if that is closer than
+   where the stream is now.  Returns 1 if it did.  */
+static int
+gz_index_seek (unsigned long long pos)
+{
+  struct gz_point *p;
+  unsigned long lo, hi, mid;
+
+  lo = 0;
+  hi = gz_index_count;
+  while (lo < hi)
     {
-      NEEDBITS (bl);
-      j = (td = tl + (b & m))->b;
-      DUMPBITS (j);
-      j = td->v.n;
-      if (j < 16)		/* length of code in bits (0..15) */
-	ll[i++] = l = j;	/* save last length in l */
-      else if (j == 16)		/* repeat last length 3 to 6 times */
-	{
-	  NEEDBITS (2);
-	  j = 3 + (b & 3);
-	  DUMPBITS (2);
-	  if (i + j > n)
-	    {
-	      errnum = ERR_BAD_GZIP_DATA;
-	      return;
-	    }
-	  while (j--)
-	    ll[i++] = l;
-	}
-      else if (j == 17)		/* 3 to 10 zero length codes */
-	{
-	  NEEDBITS (3);
-	  j = 3 + (b & 7);
-	  DUMPBITS (3);
-	  if (i + j > n)
-	    {
-	      errnum = ERR_BAD_GZIP_DATA;
-	      return;
-	    }
-	  while (j--)
-	    ll[i++] = 0;
-	  l = 0;
-	}
+      mid = (lo + hi) >> 1;
+      if (gz_index[mid]->out <= pos + WSIZE)
+	lo = mid + 1;
       else
-	/* j == 18: 11 to 138 zero length codes */
+	hi = mid;
+    }
+  if (! lo)
+    return 0;
+  p = gz_index[lo - 1];
+  if (p->out <= saved_filepos && saved_filepos <= pos + WSIZE)
+    return 0;
+
+  gzs.in = gzs.in_end = inbuf;
+  gzs.more = gunzip_more;
+  gzs.bits = p->bits;
+  gzs.nbits = p->nbits;
+  gzs.pad = 0;
+  gzs.mode = p->mode;
+  gzs.last = p->last;
+  gzs.stored_left = p->stored_left;
+  gzs.copy_len = p->copy_len;
+  gzs.copy_dist = p->copy_dist;
+  if (p->codes == 1)
+    {
+      infl_fixed_init ();
+      gzs.lcode = &infl_fixed_lit;
+      gzs.dcode = &infl_fixed_dist;
+    }
+  else if (p->codes == 2)
+    {
+      gzs.nlen = p->nlen;
+      gzs.ndist = p->ndist;
+      grub_memmove (gzs.length, p->length, sizeof (gzs.length));
+      if (p->nlen > 286 || p->ndist > 30
+	  || ! infl_build (&gzs.lit, INFL_KIND_LIT, gzs.length, p->nlen)
+	  || ! infl_build (&gzs.dist, INFL_KIND_DIST, gzs.length + p->nlen, p->ndist))
 	{
-	  NEEDBITS (7);
-	  j = 11 + (b & 0x7f);
-	  DUMPBITS (7);
-	  if (i + j > n)
-	    {
-	      errnum = ERR_BAD_GZIP_DATA;
-	      return;
-	    }
-	  while (j--)
-	    ll[i++] = 0;
-	  l = 0;
+	  initialize_tables ();
+	  return 0;
 	}
+      gzs.lcode = &gzs.lit;
+      gzs.dcode = &gzs.dist;
     }
+  grub_memmove (slide, p->window, WSIZE);
+  gzs.prev_end = slide + WSIZE;
+  gzs.prev_len = WSIZE;
+  gzs_crc = p->crc;
+  gzs_crc_on = p->crc_on;
+  saved_filepos = p->out;
+  filepos = p->in;
+  return 1;
+}
+
+/* Write the index to the open file.  */
+int
+gunzip_index_save (void)
+{
+  struct gz_index_head head;
+  unsigned long long size;
+  unsigned long i;
+
+  size = sizeof (head) + (unsigned long long) gz_index_count * sizeof (struct gz_point);
+  if (filemax < size)
+    {
+      printf_debug0 ("The index needs %ld bytes.\n", size);
+      return ! (errnum = ERR_FILELENGTH);
+    }
+
+  grub_memmove (head.magic, GZ_INDEX_MAGIC, 8);
+  head.point_size = sizeof (struct gz_point);
+  head.count = gz_index_count;
+  head.step = gz_index_step;
+  head.id = gz_index_id;
+  filepos = 0;
+  if (grub_read ((unsigned long long)(unsigned int) &head, sizeof (head), 0x900ddeed) != sizeof (head))
+    goto fail;
+  for (i = 0; i < gz_index_count; i++)
+    if (grub_read ((unsigned long long)(unsigned int) gz_index[i], sizeof (struct gz_point), 0x900ddeed)
+	!= sizeof (struct gz_point))
+      goto fail;
+  return 1;
 
-  /* free decoding table for trees */
-  reset_linalloc ();
+fail:
+  if (! errnum)
+    errnum = ERR_WRITE;
+  return 0;
+}
 
-  /* restore the global bit buffer */
-  bb = b;
-  bk = k;
+/* Replace the index with the one in the open file.  */
+int
+gunzip_index_load (void)
+{
+  struct gz_index_head head;
+  struct gz_point *p;
+  unsigned long i;
 
-  /* build the decoding tables for literal/length and distance codes */
-  bl = lbits;
-  if ((i = huft_build (ll, na, 257, cplens, cplext, &tl, &bl)) != 0)
+  gunzip_index_flush ();
+  filepos = 0;
+  if (grub_read ((unsigned long long)(unsigned int) &head, sizeof (head), 0xedde0d90) != sizeof (head)
+      || grub_memcmp (head.magic, GZ_INDEX_MAGIC, 8)
+      || head.point_size != sizeof (struct gz_point)
+      || head.count > GZ_INDEX_MAX || ! head.step || head.step % WSIZE
+      || head.step > 0x10000000000ULL)
     {
-      errnum = ERR_BAD_GZIP_DATA;
-      return;
+      if (! errnum)
+	errnum = ERR_BAD_ARGUMENT;
+      return 0;
     }
-  bd = dbits;
-  if ((i = huft_build (ll + na, nd, 0, cpdist, cpdext, &td, &bd)) != 0)
+
+  for (i = 0; i < head.count; i++)
     {
-      errnum = ERR_BAD_GZIP_DATA;
-      return;
+      if ((p = grub_malloc (sizeof (*p))) == NULL)
+	break;
+      gz_index[gz_index_count++] = p;
+      if (grub_read ((unsigned long long)(unsigned int) p, sizeof (*p), 0xedde0d90) != sizeof (*p)
+	  || p->out % WSIZE || (i && p->out <= gz_index[i - 1]->out))
+	{
+	  if (! errnum)
+	    errnum = ERR_BAD_ARGUMENT;
+	  break;
+	}
+    }
+  if (errnum)
+    {
+      gunzip_index_flush ();
+      return 0;
     }
+  gz_index_id = head.id;
+  gz_index_step = head.step;
+  return 1;
+}
 
-  /* indicate we're now working on a block */
-  code_state = 0;
-  block_len++;
+unsigned long
+gunzip_index_points (unsigned long long *step)
+{
+  *step = gz_index_step;
+  return gz_index_count;
 }
 
 
+/* Add the N bytes just inflated at P to the running CRC, and check it
+   and the length against the trailer when the stream ends.  The CRC
+   is only kept while every byte since the start has been seen.  */
 static void
-get_new_block (void)
+gz_crc_update (const unsigned char *p, unsigned long n)
 {
-  register unsigned long b;	/* bit buffer */
-  register unsigned long k;	/* number of bits in bit buffer */
-
-  hufts = 0;
-
-  /* make local bit buffer */
-  b = bb;
-  k = bk;
-
-  /* read in last block bit */
-  NEEDBITS (1);
-  last_block = b & 1;
-  DUMPBITS (1);
-
-  /* read in block type */
-  NEEDBITS (2);
-  block_type = b & 3;
-  DUMPBITS (2);
-
-  /* restore the global bit buffer */
-  bb = b;
-  bk = k;
-
-  if (block_type == INFLATE_STORED)
-    init_stored_block ();
-  if (block_type == INFLATE_FIXED)
-    init_fixed_block ();
-  if (block_type == INFLATE_DYNAMIC)
-    init_dynamic_block ();
+  if (! gzs_crc_on)
+    return;
+  if (! decomp_verify)
+    {
+      gzs_crc_on = 0;
+      return;
+    }
+  gzs_crc = calc_crc32 (gzs_crc, p, n);
+  if (gzs.mode != INFL_DONE || errnum)
+    return;
+  gzs_crc_on = 0;
+  if (gzs_crc != gzip_crc
+      || (unsigned long) (saved_filepos + n) != gzip_isize)
+    errnum = ERR_BAD_CHECKSUM;
 }
 
-
 static void
 inflate_window (void)
 {
-  /* initialize window */
-  wp = 0;
+  gzs.out = gzs.out_start = slide;
+  gzs.out_end = slide + WSIZE;
 
-  /*
-   *  Main decompression loop.
-   */
-
-  while (wp < WSIZE && !errnum)
-    {
-      if (!block_len)
-	{
-	  if (last_block)
-	    break;
+  if (! infl_run (&gzs) && ! errnum)
+    errnum = ERR_BAD_GZIP_DATA;
 
-	  get_new_block ();
-	}
+  /* the next window overwrites this one from the start */
+  gzs.prev_end = slide + WSIZE;
+  gzs.prev_len = WSIZE;
 
-      if (block_type > INFLATE_DYNAMIC)
-	errnum = ERR_BAD_GZIP_DATA;
+  gz_crc_update (slide, gzs.out - slide);
+  saved_filepos += WSIZE;
+  gz_index_add ();
+}
 
-      if (errnum)
-	return;
+/* Inflate whole windows of LEN bytes straight into BUF, which then holds
+   the history, and leave the last window in slide[] as inflate_window
+   would have.  This saves copying large reads out of slide[].  Returns
+   the number of bytes produced.  */
+static unsigned long
+inflate_direct (unsigned char *buf, unsigned long len)
+{
+  unsigned long done, n, step, left;
 
-      /*
-       *  Expand stored block here.
-       */
-      if (block_type == INFLATE_STORED)
+  len &= ~(WSIZE - 1);
+  gzs.out = gzs.out_start = buf;
+  for (done = 0; done < len && ! errnum; done += n)
+    {
+      n = len - done;
+      /* stop where a seek index point is due */
+      if (gz_index_step)
 	{
-	  unsigned long w = wp;
-
-	  /*
-	   *  This is basically a glorified pass-through
-	   */
-
-	  while (block_len && w < WSIZE && !errnum)
-	    {
-	      slide[w++] = get_byte ();
-	      block_len--;
-	    }
-
-	  wp = w;
-
-	  continue;
+	  step = (unsigned long) (gz_index_step / WSIZE);
+	  left = step - (unsigned long) (saved_filepos / WSIZE) % step;
+	  if (n / WSIZE > left)
+	    n = left * WSIZE;
 	}
+      gzs.out = buf + done;
+      gzs.out_end = buf + done + n;
+      if (! infl_run (&gzs) && ! errnum)
+	errnum = ERR_BAD_GZIP_DATA;
 
-      /*
-       *  Expand other kind of block.
-       */
-
-      if (inflate_codes_in_window ())
-	reset_linalloc ();
+      /* slide[] is no longer history, as at least a window is in BUF */
+      grub_memmove (slide, buf + done + n - WSIZE, WSIZE);
+      gz_crc_update (buf + done, gzs.out - (buf + done));
+      saved_filepos += n;
+      gz_index_add ();
     }
 
-  saved_filepos += WSIZE;
-
-  /* XXX do CRC calculation here! */
+  gzs.prev_end = slide + WSIZE;
+  gzs.prev_len = WSIZE;
+  return done;
 }
 
 
@@ -1196,17 +1399,18 @@ initialize_tables (void)
   saved_filepos = 0;
   filepos = gzip_data_offset;
 
-  /* initialize window, bit buffer */
-  bk = 0;
-  bb = 0;
-
-  /* reset partial decompression code */
-  last_block = 0;
-  block_len = 0;
-  bufloc = 0;
-
-  /* reset memory allocation stuff */
-  reset_linalloc ();
+  gzs.in = gzs.in_end = inbuf;
+  gzs.more = gunzip_more;
+  gzs.bits = 0;
+  gzs.nbits = 0;
+  gzs.pad = 0;
+  gzs.prev_len = 0;
+  gzs.mode = INFL_HEADER;
+  gzs.last = 0;
+  gzs.stored_left = 0;
+  gzs.copy_len = 0;
+  gzs_crc = 0;
+  gzs_crc_on = 1;
 }
 
 
@@ -1222,7 +1426,7 @@ gunzip_read (unsigned long long buf, unsigned long long len, unsigned long write
    */
 
   /* do we reset decompression to the beginning of the file? */
-  if (saved_filepos > gzip_filepos + WSIZE)
+  if (! gz_index_seek (gzip_filepos) && saved_filepos > gzip_filepos + WSIZE)
     initialize_tables ();
 
   /*
@@ -1236,6 +1440,18 @@ gunzip_read (unsigned long long buf, unsigned long long len, unsigned long write
       register unsigned long long size;
       register char *srcaddr;
 
+      /* whole windows go straight to the caller */
+      if (buf && gzip_filepos == saved_filepos && len >= WSIZE
+	  && buf + len <= 0x100000000ULL)
+	{
+	  size = inflate_direct ((unsigned char *)(unsigned int) buf, len > 0x80000000UL ? 0x80000000UL : len);
+	  buf += size;
+	  len -= size;
+	  gzip_filepos += size;
+	  ret += size;
+	  continue;
+	}
+
       while (gzip_filepos >= saved_filepos)
 	inflate_window ();
 
@@ -1266,4 +1482,55 @@ gunzip_read (unsigned long long buf, unsigned long long len, unsigned long write
   return ret;
 }
 
+
+/*
+ *  Memory-to-memory inflate.
+ *
+ *  This has its own state, so it can be used while a gzip file is open
+ *  (squashfs stores each block as a zlib stream).
+ */
+
+static struct infl_state infl;
+
+/* Inflate the deflate stream of SRC_LEN bytes at SRC into DST, which
+   has room for DST_LEN bytes. If ZLIB is nonzero the stream has a zlib
+   header (as used by squashfs). Returns the number of bytes produced,
+   or 0 with errnum set.  */
+unsigned long
+inflate_buffer (unsigned char *dst, unsigned long dst_len,
+		const unsigned char *src, unsigned long src_len, int zlib)
+{
+  if (zlib)
+    {
+      if (src_len < 2 || (src[0] & 0x0f) != 8
+	  || ((src[0] << 8) | src[1]) % 31 || (src[1] & 0x20))
+	goto fail;
+      src += 2;
+      src_len -= 2;
+    }
+
+  infl.in = src;
+  infl.in_end = src + src_len;
+  infl.more = 0;
+  infl.bits = 0;
+  infl.nbits = 0;
+  infl.pad = 0;
+  infl.out = infl.out_start = dst;
+  infl.out_end = dst + dst_len;
+  infl.prev_len = 0;
+  infl.mode = INFL_HEADER;
+  infl.last = 0;
+  infl.stored_left = 0;
+  infl.copy_len = 0;
+
+  /* it must end within the input and the output */
+  if (! infl_run (&infl) || infl.mode != INFL_DONE || infl.pad * 8 > infl.nbits)
+    goto fail;
+  return infl.out - dst;
+
+fail:
+  errnum = ERR_BAD_GZIP_DATA;
+  return 0;
+}
+
 #endif /* ! NO_DECOMPRESSION */
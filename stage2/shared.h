@@ -84,6 +84,12 @@
 #define SCRATCHADDR  RAW_ADDR (0x1F000)
 #define SCRATCHSEG   RAW_SEG (0x1F00)
 
+/* The SMP trampoline is copied over the scratch area; the page number is
+   the STARTUP vector. Each application processor gets its own stack. */
+#define SMP_TRAMPOLINE_ADDR	0x1F000
+#define SMP_STACK_SIZE		0x2000
+#define SMP_MAX_CPUS		64
+
 /*
  *  This is the location of the raw device buffer.  It is 31.5K
  *  in size.
@@ -190,10 +196,32 @@
 
 /* The fragment of the drive map.  */
 //#define DRIVE_MAP_FRAGMENT		32
-#define DRIVE_MAP_FRAGMENT		0x7E
+#define DRIVE_MAP_FRAGMENT		0x2000
 
 //#define FRAGMENT_MAP_SLOT_SIZE		0x280
-#define FRAGMENT_MAP_SLOT_SIZE		0x800
+#define FRAGMENT_MAP_SLOT_SIZE		0x400
+
+/* A fragment map slot of up to FRAGMENT_MAP_INLINE extents keeps them.
+ * A longer list goes to the fragment table area of FRAGMENT_TABLE_AREA
+ * bytes in high memory, and its slot has a single extent of start 0,
+ * whose count is the address of the table and, in the high dword, the
+ * number N of extents. FRAGMENT_TABLE: the N extents, then a zero one,
+ * then N+1 dwords, the sectors of the FROM drive before each extent.  */
+#define FRAGMENT_MAP_INLINE		8
+#define FRAGMENT_TABLE_AREA		0x100000
+
+/* The chunk bitmap of the lazy memdrive, one bit per chunk.  */
+#define LAZY_MEM_MAP_SIZE		0x200
+
+/* The compressed memdrive: its chunk size and its decompressed-chunk cache.  */
+#define COMP_MEM_CHUNK_SIZE		0x10000
+#define COMP_MEM_CACHE_SLOTS		8
+
+/* The RAM overlay of an in-place drive: its chunk size, the bits of its
+ * group bitmap, and the default size of its pool in sectors.  */
+#define COW_CHUNK_SIZE		0x10000
+#define COW_GROUPS		0x400
+#define COW_DEFAULT_SECTORS	0x20000
 
 /* The size of the key map.  */
 #define KEY_MAP_SIZE		128
@@ -754,6 +782,7 @@ typedef enum
   ERR_UNIFONT_FORMAT,
 //  ERR_UNIFONT_RELOAD,
   ERR_DIVISION_BY_ZERO,
+  ERR_BAD_CHECKSUM,
 
   MAX_ERR_NUM,
 
@@ -1132,6 +1161,8 @@ extern unsigned long long md_part_base;
 extern unsigned long long md_part_size;
 extern unsigned long long rd_base;
 extern unsigned long long rd_size;
+/* forget the cpio index of initrdfs when the memory above changes */
+extern void initrdfs_invalidate (void);
 extern unsigned long long saved_mem_higher;
 extern unsigned long saved_mem_upper;
 extern unsigned long saved_mem_lower;
@@ -1227,6 +1258,27 @@ extern struct drive_map_slot hooked_drive_map[DRIVE_MAP_SIZE + 1];
 #endif
 extern struct drive_map_slot   bios_drive_map[DRIVE_MAP_SIZE + 1];
 extern struct fragment_map_slot hooked_fragment_map;
+extern unsigned long lazy_mem_sectors;
+extern unsigned long long lazy_mem_start;
+extern unsigned char lazy_mem_shift;
+extern unsigned char lazy_mem_drive;
+extern unsigned char lazy_mem_map[];
+extern unsigned long comp_mem_chunks;
+extern unsigned long comp_mem_index;
+extern unsigned long comp_mem_cache;
+extern unsigned long comp_mem_store;
+extern unsigned char comp_mem_drive;
+extern unsigned char comp_mem_next;
+extern unsigned long comp_mem_tags[];
+extern unsigned long cow_sectors;
+extern unsigned long cow_map;
+extern unsigned long cow_limit;
+extern unsigned char cow_drive;
+extern unsigned char cow_shift;
+extern struct drive_map_slot fragment_ram_slot;
+extern struct drive_map_slot cow_ram_slot;
+extern unsigned long cow_next;
+extern unsigned char cow_groups[];
 extern int drive_map_slot_empty (struct drive_map_slot item);
 
 /* Copy MAP to the drive map and set up int13_handler.  */
@@ -1444,6 +1496,18 @@ char *grub_strstr (const char *s1, const char *s2);
 char *grub_strtok (char *s, const char *delim);
 int grub_memcmp (const char *s1, const char *s2, int n);
 int grub_crc32(char *data,grub_u32_t size);
+grub_u32_t calc_crc32 (grub_u32_t crc, const void *data, grub_u32_t size);
+grub_u32_t crc32_pclmul (const void *buf, grub_u32_t len, grub_u32_t crc);
+
+/* smp.c, smp_startup and smp_udelay in asm.S */
+typedef void (*smp_job_t) (void *arg);
+extern int smp_cpus;
+int smp_startup (int sipi);
+void smp_udelay (unsigned long usec);
+int smp_init (void);
+void smp_stop (void);
+void smp_run (smp_job_t func, void *arg);
+void smp_wait (void);
 unsigned short grub_crc16(unsigned char *data, int size);
 int grub_strcmp (const char *s1, const char *s2);
 int strncmpx(const char *s1,const char *s2, unsigned long n, int case_insensitive);
@@ -1505,23 +1569,57 @@ struct decomp_entry
 #define DECOMP_TYPE_LZMA 1
 #define DECOMP_TYPE_LZ4  2
 #define DECOMP_TYPE_VHD  3
-#define NUM_DECOM 4
+#define DECOMP_TYPE_XZ   4
+#define DECOMP_TYPE_ZSTD 5
+#define DECOMP_TYPE_VHDX 6
+#define DECOMP_TYPE_QCOW2 7
+#define NUM_DECOM 8
 
 extern struct decomp_entry decomp_table[NUM_DECOM];
 extern int decomp_type;
+extern int decomp_verify;
 
 int gunzip_test_header (void);
 void gunzip_close (void);
 unsigned long long gunzip_read (unsigned long long buf, unsigned long long len, unsigned long write);
+unsigned long inflate_buffer (unsigned char *dst, unsigned long dst_len, const unsigned char *src, unsigned long src_len, int zlib);
+extern unsigned long long gzip_index_spacing;
+void gunzip_index_flush (void);
+int gunzip_index_save (void);
+int gunzip_index_load (void);
+unsigned long gunzip_index_points (unsigned long long *step);
 int dec_lzma_open (void);
 void dec_lzma_close (void);
 unsigned long long dec_lzma_read (unsigned long long buf, unsigned long long len, unsigned long write);
+extern unsigned long long lzma_index_spacing;
+void dec_lzma_index_flush (void);
+unsigned long dec_lzma_index_points (unsigned long long *step);
+unsigned long lzma_decode_buffer (unsigned char *dst, unsigned long dst_len, const unsigned char *src, unsigned long src_len);
+unsigned long lzma2_decode_buffer (unsigned char *dst, unsigned long dst_len, const unsigned char *src, unsigned long *src_len, unsigned char dict_prop);
+int lzma2_stream_init (unsigned char *dic, unsigned long dic_size);
+void lzma2_stream_free (void);
+int lzma2_stream_decode (unsigned long *dic_pos, unsigned long dic_limit, const unsigned char *src, unsigned long *src_len);
+int dec_xz_open (void);
+void dec_xz_close (void);
+unsigned long long dec_xz_read (unsigned long long buf, unsigned long long len, unsigned long write);
+unsigned long xz_decode_buffer (unsigned char *dst, unsigned long dst_len, const unsigned char *src, unsigned long src_len);
+int dec_zstd_open (void);
+void dec_zstd_close (void);
+unsigned long long dec_zstd_read (unsigned long long buf, unsigned long long len, unsigned long write);
+unsigned long zstd_decode_buffer (unsigned char *dst, unsigned long dst_len, const unsigned char *src, unsigned long src_len);
 int dec_lz4_open (void);
 void dec_lz4_close (void);
 unsigned long long dec_lz4_read (unsigned long long buf, unsigned long long len, unsigned long write);
+long lz4_decode_block (unsigned char *dst, unsigned long dst_len, const unsigned char *src, unsigned long src_len, const unsigned char *low);
 int dec_vhd_open(void);
 void dec_vhd_close(void);
 unsigned long long dec_vhd_read(unsigned long long buf, unsigned long long len, unsigned long write);
+int dec_vhdx_open(void);
+void dec_vhdx_close(void);
+unsigned long long dec_vhdx_read(unsigned long long buf, unsigned long long len, unsigned long write);
+int dec_qcow2_open(void);
+void dec_qcow2_close(void);
+unsigned long long dec_qcow2_read(unsigned long long buf, unsigned long long len, unsigned long write);
 #endif /* NO_DECOMPRESSION */
 
 int rawread (unsigned long drive, unsigned long long sector, unsigned long byte_offset, unsigned long long byte_len, unsigned long long buf, unsigned long write);
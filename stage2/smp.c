@@ -0,0 +1,252 @@
+/*
+ *  GRUB4DOS  --  GRand Unified Bootloader
+ *  Copyright (C) 1999  Free Software Foundation, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ *  Job pool on the application processors (APs).
+ *
+ *  smp_startup in asm.S wakes the APs with INIT-SIPI-SIPI. Each one
+ *  arrives in smp_ap_main in protected mode, with interrupts off, and
+ *  polls the job queue. The BSP queues jobs with smp_run and collects
+ *  them with smp_wait, which also runs queued jobs itself. A job only
+ *  touches memory reachable from its argument: it must not call the
+ *  BIOS, print, or set errnum. Without APs smp_run runs the job at once.
+ *
+ *  The APs' code and stacks are above 1MB. Each time the BSP leaves
+ *  protected mode, prot_to_real waits until every AP has finished its
+ *  job and sits in smp_ap_park, in the low 64KB, until real_to_prot.
+ */
+
+#include "shared.h"
+
+#define SMP_MAX_JOBS	128
+
+struct smp_job
+{
+  smp_job_t func;
+  void *arg;
+};
+
+/* shared with smp_ap_prot in asm.S */
+unsigned long smp_ap_next;
+unsigned long smp_ap_max;
+unsigned long smp_ap_stacks;
+
+/* in the low 64KB, see prot_to_real in asm.S */
+extern unsigned long smp_park_cpus;
+extern volatile unsigned long smp_park_flag;
+void smp_ap_park (void);
+void smp_park_timeout (void);
+
+int smp_cpus;				/* APs in the work loop, 0 if off */
+static volatile unsigned long smp_ap_count;
+static struct smp_job smp_jobs[SMP_MAX_JOBS];
+static volatile unsigned long smp_head;	/* written by the BSP only */
+static volatile unsigned long smp_tail;	/* under smp_lock */
+static volatile unsigned long smp_lock;
+static volatile unsigned long smp_busy;	/* jobs queued or running */
+static int smp_lost;			/* jobs dropped by smp_park_timeout */
+
+void smp_ap_main (unsigned long id);
+
+static inline unsigned long
+smp_xadd (volatile unsigned long *p, unsigned long v)
+{
+  asm volatile ("lock; xaddl %0, %1" : "+r" (v), "+m" (*p) : : "memory");
+  return v;
+}
+
+static inline void
+smp_pause (void)
+{
+  asm volatile ("pause" : : : "memory");
+}
+
+static void
+smp_acquire (void)
+{
+  unsigned long v;
+
+  for (;;)
+    {
+      v = 1;
+      asm volatile ("xchgl %0, %1" : "+r" (v), "+m" (smp_lock) : : "memory");
+      if (! v)
+	return;
+      while (smp_lock)
+	smp_pause ();
+    }
+}
+
+static inline void
+smp_release (void)
+{
+  asm volatile ("" : : : "memory");
+  smp_lock = 0;
+}
+
+static int
+smp_take (struct smp_job *job)
+{
+  int ret = 0;
+
+  if (smp_tail == smp_head)
+    return 0;
+  smp_acquire ();
+  if (smp_tail != smp_head)
+    {
+      *job = smp_jobs[smp_tail % SMP_MAX_JOBS];
+      smp_tail++;
+      ret = 1;
+    }
+  smp_release ();
+  return ret;
+}
+
+/* entered from smp_ap_prot in asm.S, never returns */
+void
+smp_ap_main (unsigned long id)
+{
+  struct smp_job job;
+
+  smp_xadd (&smp_ap_count, 1);
+  for (;;)
+    {
+      if (smp_park_flag)
+	{
+	  smp_ap_park ();
+	  continue;
+	}
+      if (! smp_take (&job))
+	{
+	  smp_pause ();
+	  continue;
+	}
+      job.func (job.arg);
+      smp_xadd (&smp_busy, -1);
+    }
+}
+
+/* Wake the APs. Return their number, 0 if none. */
+int
+smp_init (void)
+{
+  unsigned long n, q, t;
+
+  if (smp_cpus)
+    return smp_cpus;
+  if (! smp_ap_stacks)
+    {
+      smp_ap_stacks = (unsigned long) grub_malloc (SMP_MAX_CPUS * SMP_STACK_SIZE);
+      if (! smp_ap_stacks)
+	return 0;
+    }
+  smp_ap_max = SMP_MAX_CPUS;
+  smp_ap_next = 0;
+  smp_ap_count = 0;
+  smp_head = smp_tail = smp_busy = 0;
+  smp_lock = 0;
+
+  if (! smp_startup (1))
+    return 0;
+
+  /* wait until no AP has arrived for 100ms, 1s at most */
+  for (n = 0, q = 0, t = 0; t < 100; t++)
+    {
+      smp_udelay (10000);
+      if (smp_ap_count != n)
+	{
+	  n = smp_ap_count;
+	  q = 0;
+	}
+      else if (n && ++q >= 10)
+	break;
+    }
+
+  /* Close the slots. An AP that comes later halts in low memory, and
+   * every AP with a slot is waited for by prot_to_real.  */
+  n = smp_xadd (&smp_ap_next, SMP_MAX_CPUS);
+  smp_cpus = (n < SMP_MAX_CPUS) ? n : SMP_MAX_CPUS;
+  if (! smp_cpus)
+    smp_startup (0);
+  smp_park_cpus = smp_cpus;
+  return smp_cpus;
+}
+
+/* Called by prot_to_real, in protected mode, when the APs have not all
+ * parked in time. INIT them and drop the jobs they were running; those
+ * still queued are left to smp_wait. It must not call the BIOS.  */
+void
+smp_park_timeout (void)
+{
+  smp_park_cpus = 0;
+  smp_startup (0);
+  smp_cpus = 0;
+  smp_lock = 0;
+  smp_lost = smp_busy != smp_head - smp_tail;
+  smp_busy = smp_head - smp_tail;
+}
+
+/* Park the APs with INIT, as the firmware left them. */
+void
+smp_stop (void)
+{
+  if (! smp_cpus)
+    return;
+  smp_wait ();
+  smp_park_cpus = 0;
+  smp_startup (0);
+  smp_cpus = 0;
+}
+
+void
+smp_run (smp_job_t func, void *arg)
+{
+  struct smp_job *job;
+
+  if (! smp_cpus || smp_head - smp_tail >= SMP_MAX_JOBS)
+    {
+      func (arg);
+      return;
+    }
+  job = &smp_jobs[smp_head % SMP_MAX_JOBS];
+  job->func = func;
+  job->arg = arg;
+  smp_xadd (&smp_busy, 1);
+  asm volatile ("" : : : "memory");
+  smp_head++;
+}
+
+void
+smp_wait (void)
+{
+  struct smp_job job;
+
+  while (smp_take (&job))
+    {
+      job.func (job.arg);
+      smp_xadd (&smp_busy, -1);
+    }
+  while (smp_busy)
+    smp_pause ();
+  if (smp_lost)
+    {
+      smp_lost = 0;
+      errnum = ERR_INTERNAL_CHECK;
+    }
+}
@@ -0,0 +1,176 @@
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2026  Free Software Foundation, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* On-disk layout of SquashFS 4.0, after linux/fs/squashfs/squashfs_fs.h */
+
+#ifndef SQUASHFS_H
+#define SQUASHFS_H	1
+
+#define SQUASHFS_MAGIC			0x73717368
+#define SQUASHFS_MAJOR			4
+
+#define SQUASHFS_METADATA_SIZE		8192
+#define SQUASHFS_METADATA_LEN(h)	((h) & 0x7FFF)
+#define SQUASHFS_METADATA_UNCOMPRESSED	0x8000
+
+/* data block and fragment sizes */
+#define SQUASHFS_BLOCK_UNCOMPRESSED	(1 << 24)
+#define SQUASHFS_BLOCK_LEN(s)		((s) & ~SQUASHFS_BLOCK_UNCOMPRESSED)
+#define SQUASHFS_INVALID_FRAG		0xFFFFFFFF
+#define SQUASHFS_FRAGMENTS_PER_BLOCK	(SQUASHFS_METADATA_SIZE / sizeof (struct squashfs_fragment_entry))
+
+/* compression */
+#define SQUASHFS_ZLIB			1
+#define SQUASHFS_LZMA			2
+#define SQUASHFS_LZO			3
+#define SQUASHFS_XZ			4
+#define SQUASHFS_LZ4			5
+#define SQUASHFS_ZSTD			6
+
+/* inode types */
+#define SQUASHFS_DIR_TYPE		1
+#define SQUASHFS_REG_TYPE		2
+#define SQUASHFS_SYMLINK_TYPE		3
+#define SQUASHFS_LDIR_TYPE		8
+#define SQUASHFS_LREG_TYPE		9
+#define SQUASHFS_LSYMLINK_TYPE		10
+
+/* an inode or directory reference is (block << 16) | offset */
+#define SQUASHFS_REF_BLOCK(r)		((unsigned long long)(r) >> 16)
+#define SQUASHFS_REF_OFFSET(r)		((unsigned long)(r) & 0xFFFF)
+
+struct squashfs_super_block
+{
+  unsigned long s_magic;
+  unsigned long inodes;
+  unsigned long mkfs_time;
+  unsigned long block_size;
+  unsigned long fragments;
+  unsigned short compression;
+  unsigned short block_log;
+  unsigned short flags;
+  unsigned short no_ids;
+  unsigned short s_major;
+  unsigned short s_minor;
+  unsigned long long root_inode;
+  unsigned long long bytes_used;
+  unsigned long long id_table_start;
+  unsigned long long xattr_id_table_start;
+  unsigned long long inode_table_start;
+  unsigned long long directory_table_start;
+  unsigned long long fragment_table_start;
+  unsigned long long lookup_table_start;
+} __attribute__ ((packed));
+
+struct squashfs_base_inode
+{
+  unsigned short inode_type;
+  unsigned short mode;
+  unsigned short uid;
+  unsigned short guid;
+  unsigned long mtime;
+  unsigned long inode_number;
+} __attribute__ ((packed));
+
+struct squashfs_dir_inode
+{
+  struct squashfs_base_inode base;
+  unsigned long start_block;
+  unsigned long nlink;
+  unsigned short file_size;
+  unsigned short offset;
+  unsigned long parent_inode;
+} __attribute__ ((packed));
+
+struct squashfs_ldir_inode
+{
+  struct squashfs_base_inode base;
+  unsigned long nlink;
+  unsigned long file_size;
+  unsigned long start_block;
+  unsigned long parent_inode;
+  unsigned short i_count;
+  unsigned short offset;
+  unsigned long xattr;
+} __attribute__ ((packed));
+
+/* followed by the block size list */
+struct squashfs_reg_inode
+{
+  struct squashfs_base_inode base;
+  unsigned long start_block;
+  unsigned long fragment;
+  unsigned long offset;
+  unsigned long file_size;
+} __attribute__ ((packed));
+
+struct squashfs_lreg_inode
+{
+  struct squashfs_base_inode base;
+  unsigned long long start_block;
+  unsigned long long file_size;
+  unsigned long long sparse;
+  unsigned long nlink;
+  unsigned long fragment;
+  unsigned long offset;
+  unsigned long xattr;
+} __attribute__ ((packed));
+
+/* followed by the link target */
+struct squashfs_symlink_inode
+{
+  struct squashfs_base_inode base;
+  unsigned long nlink;
+  unsigned long symlink_size;
+} __attribute__ ((packed));
+
+union squashfs_inode
+{
+  struct squashfs_base_inode base;
+  struct squashfs_dir_inode dir;
+  struct squashfs_ldir_inode ldir;
+  struct squashfs_reg_inode reg;
+  struct squashfs_lreg_inode lreg;
+  struct squashfs_symlink_inode symlink;
+};
+
+struct squashfs_dir_header
+{
+  unsigned long count;		/* entries following, minus one */
+  unsigned long start_block;	/* inode block of these entries */
+  unsigned long inode_number;
+} __attribute__ ((packed));
+
+/* followed by size + 1 bytes of name */
+struct squashfs_dir_entry
+{
+  unsigned short offset;
+  short inode_number;
+  unsigned short type;
+  unsigned short size;
+} __attribute__ ((packed));
+
+struct squashfs_fragment_entry
+{
+  unsigned long long start_block;
+  unsigned long size;
+  unsigned long unused;
+} __attribute__ ((packed));
+
+#endif /* ! SQUASHFS_H */